@@ -0,0 +1,511 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+// Micro-benchmarks of the metadata codecs run on every read and
+// write: Dir encode/decode/match, inode table page encode/decode,
+// and external extent list encode/decode.  Each case is timed in
+// memory, as the DB calls it, across entry counts and key sizes, and
+// reports time per op and per entry, plus heap allocations per op.
+// The baseline for codec changes.
+//
+// Usage: codecbench [--option=value ...]; see usage() below.
+// "make bench-codec" builds and runs it.
+
+#include "pgdb2-config.h"
+
+#include <time.h>
+#include <stdint.h>
+#include <stdexcept>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <pgdb2.h>
+
+using namespace page;
+
+// Every heap allocation in the process, library included
+static uint64_t n_allocs;
+
+void *operator new(size_t sz)
+{
+	n_allocs++;
+	void *p = malloc(sz ? sz : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+struct CodecOptions {
+	std::string	filter;			// run cases named so
+	unsigned int	min_ms;			// per case
+	bool		json;
+
+	CodecOptions() : min_ms(200), json(false) {}
+};
+
+static CodecOptions copt;
+
+// results are summed here, so no op is optimized away
+static volatile uint64_t sink;
+
+static uint64_t nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+// One codec, on one input
+class CodecCase {
+public:
+	std::string	name;
+	size_t		ents;		// entries per op
+	size_t		key_len;	// dir: bytes, or 0 for u64 keys
+	size_t		bytes;		// encoded bytes per op
+
+	CodecCase(const std::string& name_, size_t ents_, size_t key_len_)
+		: name(name_), ents(ents_), key_len(key_len_), bytes(0) {}
+	virtual ~CodecCase() {}
+
+	virtual std::string keyDesc() const { return "-"; }
+
+	virtual void op() = 0;
+};
+
+static void report(const CodecCase& c, uint64_t ops, uint64_t ns,
+		   uint64_t allocs)
+{
+	double ns_op = (double) ns / ops;
+	double ns_ent = c.ents ? (ns_op / c.ents) : 0.0;
+	double mb_sec = ns ? ((c.bytes * ops) / (1024.0 * 1024.0)) /
+			     (ns / 1e9) : 0.0;
+	double allocs_op = (double) allocs / ops;
+
+	if (copt.json)
+		printf("{\"case\":\"%s\",\"ents\":%zu,\"key\":\"%s\","
+		       "\"bytes\":%zu,\"ops\":%llu,\"ns_per_op\":%.1f,"
+		       "\"ns_per_ent\":%.2f,\"mb_per_sec\":%.1f,"
+		       "\"allocs_per_op\":%.2f}\n",
+		       c.name.c_str(), c.ents, c.keyDesc().c_str(), c.bytes,
+		       (unsigned long long) ops, ns_op, ns_ent, mb_sec,
+		       allocs_op);
+	else
+		printf("%-15s %6zu %5s %8zu %12.1f %9.2f %9.1f %9.2f\n",
+		       c.name.c_str(), c.ents, c.keyDesc().c_str(), c.bytes,
+		       ns_op, ns_ent, mb_sec, allocs_op);
+	fflush(stdout);
+}
+
+// Double the op count until a batch takes min_ms; report that batch
+static void run(CodecCase& c)
+{
+	if (!copt.filter.empty() && (c.name != copt.filter))
+		return;
+
+	c.op();		// warm up
+
+	uint64_t min_ns = (uint64_t) copt.min_ms * 1000000ULL;
+	for (uint64_t ops = 1; ; ops *= 2) {
+		uint64_t allocs0 = n_allocs;
+		uint64_t t0 = nowNs();
+		for (uint64_t i = 0; i < ops; i++)
+			c.op();
+		uint64_t ns = nowNs() - t0;
+		uint64_t allocs = n_allocs - allocs0;
+
+		if ((ns >= min_ns) || (ops >= (1ULL << 40))) {
+			report(c, ops, ns, allocs);
+			return;
+		}
+	}
+}
+
+// Byte keys sort numerically: zero-padded decimal, key_len bytes
+static std::string mkkey(size_t i, size_t key_len)
+{
+	char num[32];
+	snprintf(num, sizeof(num), "%zu", i);
+
+	std::string key;
+	size_t len = strlen(num);
+	if (len < key_len)
+		key.append(key_len - len, '0');
+	key.append(num);
+	return key;
+}
+
+// A leaf directory: inline, packed and inode values; key_len 0 for
+// fixed-width (u64) keys
+static void mkDir(Dir& dir, size_t n_ents, size_t key_len)
+{
+	dir = Dir(key_len ? KT_BYTES : KT_U64);
+	dir.ents.resize(n_ents);
+
+	for (size_t i = 0; i < n_ents; i++) {
+		DirEntry& de = dir.ents[i];
+		if (key_len) {
+			de.key = mkkey(i * 2, key_len);
+			de.key_len = key_len;
+		} else {
+			de.ikey = i * 2;
+			de.key_len = sizeof(uint64_t);
+		}
+
+		switch (i % 4) {
+		case 0:
+		case 3:
+			de.d_type = DE_KEY_VALUE;
+			de.value.assign((i % 4) ? 8 : 32, 'v');
+			de.value_len = de.value.size();
+			break;
+		case 1:
+			de.d_type = DE_KEY_PACKED;
+			de.vh_page = 1000 + i;
+			de.vh_slot = i % 64;
+			de.value_len = 500;
+			break;
+		case 2:
+			de.d_type = DE_KEY;
+			de.ino_idx = 100 + i;
+			de.value_len = 100000;
+			break;
+		}
+	}
+}
+
+class DirCase : public CodecCase {
+protected:
+	DirCase(const std::string& name_, size_t n, size_t key_len_)
+		: CodecCase(name_, n, key_len_) {}
+
+public:
+	std::string keyDesc() const {
+		if (key_len == 0)
+			return "u64";
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%zu", key_len);
+		return buf;
+	}
+};
+
+class DirEncode : public DirCase {
+private:
+	Dir	dir;
+
+public:
+	DirEncode(size_t n, size_t key_len)
+		: DirCase("dir_encode", n, key_len) {
+		mkDir(dir, n, key_len);
+		std::vector<unsigned char> buf;
+		dir.encode(buf);
+		bytes = buf.size();
+	}
+
+	// as DB::writeDir
+	void op() {
+		std::vector<unsigned char> buf;
+		dir.encode(buf);
+		sink += buf.size();
+	}
+};
+
+class DirDecode : public DirCase {
+private:
+	std::vector<unsigned char> enc;
+	std::vector<unsigned char> scratch;
+
+public:
+	DirDecode(size_t n, size_t key_len)
+		: DirCase("dir_decode", n, key_len) {
+		Dir dir;
+		mkDir(dir, n, key_len);
+		dir.encode(enc);
+		bytes = enc.size();
+		scratch.resize(enc.size());
+	}
+
+	// as DB::loadDir; decode byte-swaps headers in place, so each
+	// op decodes a fresh copy, as if just read
+	void op() {
+		memcpy(&scratch[0], &enc[0], enc.size());
+		Dir dir;
+		dir.decode(&scratch[0], scratch.size());
+		sink += dir.ents.size();
+	}
+};
+
+// Lookups of each key in turn, and of the gaps between them
+class DirMatch : public DirCase {
+private:
+	Dir			dir;
+	std::vector<std::string> keys;
+	size_t			next;
+
+public:
+	DirMatch(size_t n, size_t key_len)
+		: DirCase("dir_match", n, key_len), next(0) {
+		mkDir(dir, n, key_len);
+		std::vector<unsigned char> buf;
+		dir.encode(buf);
+		bytes = buf.size();
+
+		if (key_len)
+			for (size_t i = 0; i < (n * 2); i++)
+				keys.push_back(mkkey(i, key_len));
+	}
+
+	void op() {
+		unsigned int idx;
+		bool found;
+		if (key_len)
+			found = dir.match(keys[next], idx);
+		else
+			found = dir.match<U64Compare>(next, idx);
+		sink += found + idx;
+
+		if (++next == (ents * 2))
+			next = 0;
+	}
+};
+
+// One full inode table page, page_size bytes
+class InodeTableCase : public CodecCase {
+protected:
+	MemBudget	mem;
+	InodeTable	inotab;
+	size_t		data_size;
+
+	InodeTableCase(const std::string& name_, size_t page_size)
+		: CodecCase(name_, 0, 0), data_size(page_size) {
+		mem.setLimit(1ULL << 40);
+		inotab.init(&mem);
+		inotab.setGeometry(data_size);
+		inotab.setSize(inotab.chunk_ents);
+
+		InodeChunk *ch = new InodeChunk;
+		for (uint32_t i = 0; i < inotab.chunk_ents; i++) {
+			Inode ino;
+			if ((i % 8) == 7) {
+				ino.unused = true;
+			} else if ((i % 16) == 5) {
+				ino.e_ref = 50000 + i;	// external list
+				ino.e_alloc = 1;
+			} else {
+				Extent e;
+				e.ext_page = 100 + (i * 4);
+				e.ext_len = 1 + (i % 4);
+				e.ext_flags = EF_MBO;
+				ino.setExtent(e);
+			}
+			ch->inodes.push_back(ino);
+		}
+		inotab.addChunk(0, ch);
+
+		ents = inotab.chunk_ents;
+		bytes = data_size;
+	}
+};
+
+class InodeTableEncode : public InodeTableCase {
+private:
+	std::vector<unsigned char> buf;
+
+public:
+	explicit InodeTableEncode(size_t page_size)
+		: InodeTableCase("inotab_encode", page_size) {}
+
+	// as DB::writeInodeTable
+	void op() {
+		buf.assign(data_size, 0);
+		inotab.encodePage(0, buf);
+		sink += buf[0];
+	}
+};
+
+class InodeTableDecode : public InodeTableCase {
+private:
+	std::vector<unsigned char> enc;
+
+public:
+	explicit InodeTableDecode(size_t page_size)
+		: InodeTableCase("inotab_decode", page_size) {
+		enc.assign(data_size, 0);
+		inotab.encodePage(0, enc);
+	}
+
+	// as DB::loadInodeChunk
+	void op() {
+		std::vector<Inode> inodes;
+		inotab.decodePage(0, &enc[0], enc.size(), inodes);
+		sink += inodes.size();
+	}
+};
+
+static void mkextlist(std::vector<Extent>& ext_list, size_t n)
+{
+	ext_list.resize(n);
+	for (size_t i = 0; i < n; i++) {
+		ext_list[i].ext_page = 100 + (i * 10);
+		ext_list[i].ext_len = 1 + (i % 8);
+		ext_list[i].ext_flags = EF_MBO;
+	}
+}
+
+// Pages, of 4096 bytes, holding a list of n
+static size_t extListBytes(size_t n)
+{
+	size_t len = (n + 1) * sizeof(Extent);
+	return ((len + 4095) / 4096) * 4096;
+}
+
+class ExtListEncode : public CodecCase {
+private:
+	std::vector<Extent> ext_list;
+
+public:
+	explicit ExtListEncode(size_t n) : CodecCase("extlist_encode", n, 0) {
+		mkextlist(ext_list, n);
+		bytes = extListBytes(n);
+	}
+
+	// as DB::writeExtList
+	void op() {
+		std::vector<unsigned char> pages(bytes);
+		encodeExtList(ext_list, pages);
+		sink += pages[0];
+	}
+};
+
+class ExtListDecode : public CodecCase {
+private:
+	std::vector<unsigned char> enc;
+	std::vector<Extent> ext_list;
+
+public:
+	explicit ExtListDecode(size_t n) : CodecCase("extlist_decode", n, 0) {
+		mkextlist(ext_list, n);
+		bytes = extListBytes(n);
+		enc.resize(bytes);
+		encodeExtList(ext_list, enc);
+	}
+
+	// as DB::readExtList, into a list reused across inodes
+	void op() {
+		decodeExtList(&enc[0], enc.size(), ext_list);
+		sink += ext_list.size();
+	}
+};
+
+static const size_t dir_ents[] = { 16, 128, 1024 };
+static const size_t key_lens[] = { 0, 8, 32, 128 };	// 0: u64 keys
+static const size_t page_sizes[] = { 4096, 16384, 65536 };
+static const size_t ext_counts[] = { 3, 32, 255 };
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static void runDir()
+{
+	for (size_t k = 0; k < ARRAY_SIZE(key_lens); k++)
+		for (size_t n = 0; n < ARRAY_SIZE(dir_ents); n++) {
+			DirEncode enc(dir_ents[n], key_lens[k]);
+			run(enc);
+			DirDecode dec(dir_ents[n], key_lens[k]);
+			run(dec);
+			DirMatch match(dir_ents[n], key_lens[k]);
+			run(match);
+		}
+}
+
+static void runInodeTable()
+{
+	for (size_t i = 0; i < ARRAY_SIZE(page_sizes); i++) {
+		InodeTableEncode enc(page_sizes[i]);
+		run(enc);
+		InodeTableDecode dec(page_sizes[i]);
+		run(dec);
+	}
+}
+
+static void runExtList()
+{
+	for (size_t i = 0; i < ARRAY_SIZE(ext_counts); i++) {
+		ExtListEncode enc(ext_counts[i]);
+		run(enc);
+		ExtListDecode dec(ext_counts[i]);
+		run(dec);
+	}
+}
+
+static void usage(const char *prog)
+{
+	CodecOptions d;
+	fprintf(stderr,
+		"usage: %s [--option=value ...]\n"
+		"  --case=NAME         run only this case, e.g. dir_decode [all]\n"
+		"  --min_ms=N          minimum time per case, ms [%u]\n"
+		"  --json=0|1          JSON lines output [0]\n",
+		prog, d.min_ms);
+}
+
+static bool parseArg(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	if ((strncmp(arg, "--", 2) != 0) || !eq)
+		return false;
+
+	std::string name(arg + 2, eq - (arg + 2));
+	const char *v = eq + 1;
+	unsigned long long n = strtoull(v, NULL, 10);
+
+	if (name == "case")
+		copt.filter = v;
+	else if (name == "min_ms")
+		copt.min_ms = n;
+	else if (name == "json")
+		copt.json = (n != 0);
+	else
+		return false;
+
+	return true;
+}
+
+int main (int argc, char *argv[])
+{
+	for (int i = 1; i < argc; i++)
+		if (!parseArg(argv[i])) {
+			usage(argv[0]);
+			return 1;
+		}
+
+	if (!copt.json)
+		printf("%-15s %6s %5s %8s %12s %9s %9s %9s\n",
+		       "case", "ents", "key", "bytes", "ns/op", "ns/ent",
+		       "MB/s", "allocs/op");
+
+	try {
+		runDir();
+		runInodeTable();
+		runExtList();
+	}
+	catch (std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
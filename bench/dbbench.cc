@@ -0,0 +1,691 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+// Standard workloads, in the style of LevelDB's db_bench: the
+// yardstick for performance changes.  Reports throughput and
+// latency percentiles per workload, as a table or as JSON lines.
+//
+// Usage: dbbench [--option=value ...]; see usage() below.
+
+#include "pgdb2-config.h"
+
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <pgdb2.h>
+#include <pgdb2-async.h>
+
+static const char *default_benchmarks =
+	"fillseq,fillrandom,overwrite,readrandom,readmissing,readseq,"
+	"multiget,mixed,fillbig,readbig";
+
+struct BenchOptions {
+	std::string	db;			// database file
+	std::string	benchmarks;		// comma separated
+	unsigned int	num;			// keys in the DB
+	unsigned int	reads;			// ops per read workload
+	unsigned int	key_size;		// bytes
+	unsigned int	value_size;		// bytes
+	unsigned int	big_num;		// fillbig, readbig keys
+	unsigned int	big_size;		// fillbig, readbig value bytes
+	unsigned int	threads;		// reader threads
+	unsigned int	batch;			// multiget keys per op
+	unsigned int	pool;			// multiget executor threads
+	unsigned int	read_pct;		// mixed: reads, in percent
+	uint64_t	cache_size;		// Options::mem_budget
+	uint32_t	page_size;
+	bool		checksum;
+	bool		json;
+
+	BenchOptions() : db("dbbench.db"), benchmarks(default_benchmarks),
+		num(100000), reads(0), key_size(16), value_size(100),
+		big_num(100), big_size(1024 * 1024), threads(1), batch(16),
+		pool(8), read_pct(90), cache_size(32 * 1024 * 1024),
+		page_size(4096), checksum(false), json(false) {}
+};
+
+static BenchOptions bopt;
+
+static uint64_t nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+// xorshift64*: cheap, and the same sequence on every run
+class Random {
+private:
+	uint64_t	s;
+
+public:
+	explicit Random(uint64_t seed) : s(seed ? seed : 1) {}
+
+	uint64_t next() {
+		s ^= s >> 12;
+		s ^= s << 25;
+		s ^= s >> 27;
+		return s * 2685821657736338717ULL;
+	}
+	uint64_t uniform(uint64_t n) { return next() % n; }
+};
+
+// Keys sort numerically: prefix, then zero-padded decimal, key_size
+// bytes in all
+static std::string mkkey(uint64_t i, const char *prefix = "")
+{
+	char num[32];
+	snprintf(num, sizeof(num), "%llu", (unsigned long long) i);
+
+	std::string key(prefix);
+	size_t len = key.size() + strlen(num);
+	if (len < bopt.key_size)
+		key.append(bopt.key_size - len, '0');
+	key.append(num);
+	return key;
+}
+
+// Half random bytes, half repeats: compresses about 2:1
+static std::string mkval(Random& rnd, size_t len)
+{
+	std::string val(len, ' ');
+	for (size_t i = 0; i < len; i++)
+		val[i] = ((i % 2) == 0) ? (char) (' ' + rnd.uniform(95)) :
+					  val[i - 1];
+	return val;
+}
+
+// Results of one workload, merged across threads
+class Stats {
+public:
+	uint64_t		ops;
+	uint64_t		bytes;		// keys and values moved
+	uint64_t		found;
+	std::vector<uint32_t>	lat_ns;		// per op, clamped
+	uint64_t		start_ns;
+	uint64_t		end_ns;
+
+	Stats() : ops(0), bytes(0), found(0), start_ns(0), end_ns(0) {}
+
+	void add(uint64_t t0, uint64_t t1, uint64_t op_bytes) {
+		uint64_t ns = t1 - t0;
+		lat_ns.push_back((ns > 0xffffffffULL) ? 0xffffffffU : ns);
+		ops++;
+		bytes += op_bytes;
+	}
+	void merge(const Stats& s) {
+		ops += s.ops;
+		bytes += s.bytes;
+		found += s.found;
+		lat_ns.insert(lat_ns.end(), s.lat_ns.begin(), s.lat_ns.end());
+	}
+	double percentileUs(double p) const {
+		if (lat_ns.empty())
+			return 0.0;
+		size_t i = (size_t) ((p / 100.0) * (lat_ns.size() - 1) + 0.5);
+		return lat_ns[i] / 1000.0;
+	}
+	void report(const std::string& name, unsigned int n_threads);
+};
+
+void Stats::report(const std::string& name, unsigned int n_threads)
+{
+	std::sort(lat_ns.begin(), lat_ns.end());
+
+	double secs = (end_ns - start_ns) / 1e9;
+	if (secs <= 0.0)
+		secs = 1e-9;
+
+	double sum = 0.0;
+	for (size_t i = 0; i < lat_ns.size(); i++)
+		sum += lat_ns[i];
+	double avg_us = lat_ns.empty() ? 0.0 : (sum / lat_ns.size()) / 1000.0;
+
+	if (bopt.json) {
+		printf("{\"benchmark\":\"%s\",\"threads\":%u,\"ops\":%llu,"
+		       "\"found\":%llu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+		       "\"mb_per_sec\":%.3f,\"avg_us\":%.3f,\"p50_us\":%.3f,"
+		       "\"p95_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,"
+		       "\"max_us\":%.3f,\"key_size\":%u,\"value_size\":%u,"
+		       "\"cache_size\":%llu,\"page_size\":%u}\n",
+		       name.c_str(), n_threads, (unsigned long long) ops,
+		       (unsigned long long) found, secs, ops / secs,
+		       (bytes / (1024.0 * 1024.0)) / secs, avg_us,
+		       percentileUs(50), percentileUs(95), percentileUs(99),
+		       percentileUs(99.9), percentileUs(100), bopt.key_size,
+		       bopt.value_size, (unsigned long long) bopt.cache_size,
+		       bopt.page_size);
+	} else {
+		printf("%-12s %3u %10llu %12.1f %9.2f %9.3f %9.3f %9.3f %9.3f %10.3f\n",
+		       name.c_str(), n_threads, (unsigned long long) ops,
+		       ops / secs, (bytes / (1024.0 * 1024.0)) / secs, avg_us,
+		       percentileUs(50), percentileUs(99), percentileUs(99.9),
+		       percentileUs(100));
+	}
+	fflush(stdout);
+}
+
+struct ThreadArg {
+	unsigned int	id;
+	Stats		stats;
+	std::string	error;
+	pthread_t	thread;
+};
+
+// Completion of one multiget batch
+class BatchDone : public page::AsyncGetDone {
+private:
+	page::Mutex	mtx;
+	page::CondVar	cv;
+	size_t		pending;
+	std::string	error;
+
+public:
+	uint64_t	found;
+	uint64_t	bytes;
+
+	BatchDone() : pending(0), found(0), bytes(0) {}
+
+	void start(size_t n) { pending = n; found = 0; bytes = 0; }
+	void done(page::AsyncGetResult& r) {
+		page::MutexGuard guard(mtx);
+		if (!r.ok())
+			error = r.error;
+		else if (r.found) {
+			found++;
+			bytes += r.value.size();
+		}
+		if (--pending == 0)
+			cv.broadcast();
+	}
+	void wait() {
+		page::MutexGuard guard(mtx);
+		while (pending > 0)
+			cv.wait(mtx);
+		if (!error.empty())
+			throw std::runtime_error(error);
+	}
+};
+
+class Bench {
+private:
+	page::DB		*db;
+	page::ThreadPool	*pool;
+	bool			filled;		// fillseq or fillrandom ran
+	bool			big_filled;
+
+	typedef void (Bench::*Workload)(ThreadArg& t);
+
+	void run(const std::string& name, Workload w, unsigned int n_threads);
+
+	void open(bool fresh);
+	void ensureFilled();
+	unsigned int readOps() const {
+		return bopt.reads ? bopt.reads : bopt.num;
+	}
+
+	void fill(ThreadArg& t, bool random);
+	void fillSeq(ThreadArg& t) { fill(t, false); }
+	void fillRandom(ThreadArg& t) { fill(t, true); }
+	void overwrite(ThreadArg& t);
+	void readRandom(ThreadArg& t);
+	void readMissing(ThreadArg& t);
+	void readSeq(ThreadArg& t);
+	void multiGet(ThreadArg& t);
+	void mixed(ThreadArg& t);
+	void fillBig(ThreadArg& t);
+	void readBig(ThreadArg& t);
+
+public:
+	Bench() : db(NULL), pool(NULL), filled(false), big_filled(false) {}
+	~Bench() {
+		delete pool;
+		delete db;
+	}
+
+	bool runOne(const std::string& name);
+};
+
+void Bench::open(bool fresh)
+{
+	delete db;
+	db = NULL;
+
+	if (fresh)
+		unlink(bopt.db.c_str());
+
+	page::Options opts;
+	opts.f_read = true;
+	opts.f_write = true;
+	opts.f_create = true;
+	opts.mem_budget = bopt.cache_size;
+	opts.page_size = bopt.page_size;
+	opts.f_checksum = bopt.checksum;
+
+	db = new page::DB(bopt.db, opts);
+
+	if (fresh)
+		filled = big_filled = false;
+}
+
+// Read workloads need data: load it, untimed
+void Bench::ensureFilled()
+{
+	if (!db)
+		open(true);
+	if (filled)
+		return;
+
+	ThreadArg t;
+	t.id = 0;
+	fill(t, false);
+	db->sync();
+	filled = true;
+}
+
+struct RunArg {
+	Bench			*bench;
+	void (Bench::*w)(ThreadArg& t);
+	ThreadArg		*t;
+};
+
+static void *runThread(void *arg)
+{
+	RunArg *ra = (RunArg *) arg;
+	try {
+		(ra->bench->*(ra->w))(*ra->t);
+	}
+	catch (std::exception& e) {
+		ra->t->error = e.what();
+	}
+	return NULL;
+}
+
+void Bench::run(const std::string& name, Workload w, unsigned int n_threads)
+{
+	std::vector<ThreadArg> args(n_threads);
+	std::vector<RunArg> ras(n_threads);
+
+	uint64_t start = nowNs();
+	for (unsigned int i = 0; i < n_threads; i++) {
+		args[i].id = i;
+		ras[i].bench = this;
+		ras[i].w = w;
+		ras[i].t = &args[i];
+		if (pthread_create(&args[i].thread, NULL, runThread, &ras[i]) != 0)
+			throw std::runtime_error("Failed thread create");
+	}
+
+	Stats total;
+	for (unsigned int i = 0; i < n_threads; i++) {
+		pthread_join(args[i].thread, NULL);
+		if (!args[i].error.empty())
+			throw std::runtime_error(name + ": " + args[i].error);
+		total.merge(args[i].stats);
+	}
+	total.start_ns = start;
+	total.end_ns = nowNs();
+
+	total.report(name, n_threads);
+}
+
+bool Bench::runOne(const std::string& name)
+{
+	if (name == "fillseq") {
+		open(true);
+		run(name, &Bench::fillSeq, 1);
+		db->sync();
+		filled = true;
+	} else if (name == "fillrandom") {
+		open(true);
+		run(name, &Bench::fillRandom, 1);
+		db->sync();
+		filled = true;
+	} else if (name == "overwrite") {
+		ensureFilled();
+		run(name, &Bench::overwrite, 1);
+		db->sync();
+	} else if (name == "readrandom") {
+		ensureFilled();
+		run(name, &Bench::readRandom, bopt.threads);
+	} else if (name == "readmissing") {
+		ensureFilled();
+		run(name, &Bench::readMissing, bopt.threads);
+	} else if (name == "readseq") {
+		ensureFilled();
+		run(name, &Bench::readSeq, 1);
+	} else if (name == "multiget") {
+		ensureFilled();
+		if (!pool)
+			pool = new page::ThreadPool(bopt.pool);
+		run(name, &Bench::multiGet, bopt.threads);
+	} else if (name == "mixed") {
+		ensureFilled();
+		run(name, &Bench::mixed, bopt.threads);
+		db->sync();
+	} else if (name == "fillbig") {
+		if (!db)
+			open(true);
+		run(name, &Bench::fillBig, 1);
+		db->sync();
+		big_filled = true;
+	} else if (name == "readbig") {
+		if (!db)
+			open(true);
+		if (!big_filled) {
+			ThreadArg t;
+			t.id = 0;
+			fillBig(t);
+			db->sync();
+			big_filled = true;
+		}
+		run(name, &Bench::readBig, bopt.threads);
+	} else
+		return false;
+
+	return true;
+}
+
+void Bench::fill(ThreadArg& t, bool random)
+{
+	Random rnd(301 + t.id);
+
+	// each key once, in key or shuffled order
+	std::vector<uint32_t> order(bopt.num);
+	for (unsigned int i = 0; i < bopt.num; i++)
+		order[i] = i;
+	if (random)
+		for (unsigned int i = bopt.num; i > 1; i--)
+			std::swap(order[i - 1], order[rnd.uniform(i)]);
+
+	for (unsigned int i = 0; i < bopt.num; i++) {
+		std::string key = mkkey(order[i]);
+		std::string val = mkval(rnd, bopt.value_size);
+
+		uint64_t t0 = nowNs();
+		db->put(key, val);
+		t.stats.add(t0, nowNs(), key.size() + val.size());
+	}
+}
+
+void Bench::overwrite(ThreadArg& t)
+{
+	Random rnd(1000 + t.id);
+
+	for (unsigned int i = 0; i < bopt.num; i++) {
+		std::string key = mkkey(rnd.uniform(bopt.num));
+		std::string val = mkval(rnd, bopt.value_size);
+
+		uint64_t t0 = nowNs();
+		db->put(key, val);
+		t.stats.add(t0, nowNs(), key.size() + val.size());
+	}
+}
+
+void Bench::readRandom(ThreadArg& t)
+{
+	Random rnd(2000 + t.id);
+	std::string val;
+
+	for (unsigned int i = 0; i < readOps(); i++) {
+		std::string key = mkkey(rnd.uniform(bopt.num));
+
+		uint64_t t0 = nowNs();
+		bool found = db->get(key, val);
+		t.stats.add(t0, nowNs(), key.size() + val.size());
+		if (found)
+			t.stats.found++;
+	}
+}
+
+// Keys sorting among the loaded ones, but never stored
+void Bench::readMissing(ThreadArg& t)
+{
+	Random rnd(3000 + t.id);
+	std::string val;
+
+	for (unsigned int i = 0; i < readOps(); i++) {
+		std::string key = mkkey(rnd.uniform(bopt.num)) + ".";
+
+		uint64_t t0 = nowNs();
+		bool found = db->get(key, val);
+		t.stats.add(t0, nowNs(), key.size());
+		if (found)
+			t.stats.found++;
+	}
+}
+
+// Every key in order: one ordered scan, timed per key visited
+class SeqVisitor : public page::ScanVisitor {
+private:
+	Stats&		stats;
+	uint64_t	last;
+
+public:
+	SeqVisitor(Stats& stats_) : stats(stats_), last(nowNs()) {}
+
+	void visit(const page::ScanItem& item) {
+		uint64_t t = nowNs();
+		stats.add(last, t, item.key.size() + item.value.size());
+		stats.found++;
+		last = t;
+	}
+};
+
+void Bench::readSeq(ThreadArg& t)
+{
+	SeqVisitor v(t.stats);
+	db->parallelScan(page::ScanRange(), v, bopt.threads, true);
+}
+
+void Bench::multiGet(ThreadArg& t)
+{
+	Random rnd(4000 + t.id);
+	BatchDone done;
+
+	unsigned int n_batches = (readOps() + bopt.batch - 1) / bopt.batch;
+	for (unsigned int b = 0; b < n_batches; b++) {
+		std::vector<std::string> keys(bopt.batch);
+		for (unsigned int i = 0; i < bopt.batch; i++)
+			keys[i] = mkkey(rnd.uniform(bopt.num));
+
+		uint64_t t0 = nowNs();
+		done.start(keys.size());
+		for (unsigned int i = 0; i < keys.size(); i++)
+			page::asyncGet(*db, *pool, keys[i], &done);
+		done.wait();
+		t.stats.add(t0, nowNs(), done.bytes);
+
+		t.stats.found += done.found;
+	}
+}
+
+void Bench::mixed(ThreadArg& t)
+{
+	Random rnd(5000 + t.id);
+	std::string val;
+
+	for (unsigned int i = 0; i < readOps(); i++) {
+		std::string key = mkkey(rnd.uniform(bopt.num));
+
+		if (rnd.uniform(100) < bopt.read_pct) {
+			uint64_t t0 = nowNs();
+			bool found = db->get(key, val);
+			t.stats.add(t0, nowNs(), key.size() + val.size());
+			if (found)
+				t.stats.found++;
+		} else {
+			std::string v = mkval(rnd, bopt.value_size);
+
+			uint64_t t0 = nowNs();
+			db->put(key, v);
+			t.stats.add(t0, nowNs(), key.size() + v.size());
+		}
+	}
+}
+
+void Bench::fillBig(ThreadArg& t)
+{
+	Random rnd(6000 + t.id);
+
+	for (unsigned int i = 0; i < bopt.big_num; i++) {
+		std::string key = mkkey(i, "big");
+		std::string val = mkval(rnd, bopt.big_size);
+
+		uint64_t t0 = nowNs();
+		db->put(key, val);
+		t.stats.add(t0, nowNs(), key.size() + val.size());
+	}
+}
+
+void Bench::readBig(ThreadArg& t)
+{
+	Random rnd(7000 + t.id);
+	std::string val;
+
+	for (unsigned int i = 0; i < bopt.big_num; i++) {
+		std::string key = mkkey(rnd.uniform(bopt.big_num), "big");
+
+		uint64_t t0 = nowNs();
+		bool found = db->get(key, val);
+		t.stats.add(t0, nowNs(), key.size() + val.size());
+		if (found)
+			t.stats.found++;
+	}
+}
+
+static void usage(const char *prog)
+{
+	BenchOptions d;
+	fprintf(stderr,
+		"usage: %s [--option=value ...]\n"
+		"  --benchmarks=LIST   comma separated, run in order [%s]\n"
+		"  --db=FILE           database file [%s]\n"
+		"  --num=N             keys loaded [%u]\n"
+		"  --reads=N           ops per read workload [num]\n"
+		"  --key_size=N        key bytes [%u]\n"
+		"  --value_size=N      value bytes [%u]\n"
+		"  --big_num=N         fillbig/readbig keys [%u]\n"
+		"  --big_size=N        fillbig/readbig value bytes [%u]\n"
+		"  --threads=N         read workload threads [%u]\n"
+		"  --batch=N           multiget keys per op [%u]\n"
+		"  --pool=N            multiget executor threads [%u]\n"
+		"  --read_pct=N        mixed: percent reads [%u]\n"
+		"  --cache_size=N      memory budget, bytes [%llu]\n"
+		"  --page_size=N       page size, bytes [%u]\n"
+		"  --checksum=0|1      page checksums [0]\n"
+		"  --json=0|1          JSON lines output [0]\n",
+		prog, d.benchmarks.c_str(), d.db.c_str(), d.num, d.key_size,
+		d.value_size, d.big_num, d.big_size, d.threads, d.batch, d.pool,
+		d.read_pct, (unsigned long long) d.cache_size, d.page_size);
+}
+
+static bool parseArg(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	if ((strncmp(arg, "--", 2) != 0) || !eq)
+		return false;
+
+	std::string name(arg + 2, eq - (arg + 2));
+	const char *v = eq + 1;
+	unsigned long long n = strtoull(v, NULL, 10);
+
+	if (name == "benchmarks")
+		bopt.benchmarks = v;
+	else if (name == "db")
+		bopt.db = v;
+	else if (name == "num")
+		bopt.num = n;
+	else if (name == "reads")
+		bopt.reads = n;
+	else if (name == "key_size")
+		bopt.key_size = n;
+	else if (name == "value_size")
+		bopt.value_size = n;
+	else if (name == "big_num")
+		bopt.big_num = n;
+	else if (name == "big_size")
+		bopt.big_size = n;
+	else if (name == "threads")
+		bopt.threads = n;
+	else if (name == "batch")
+		bopt.batch = n;
+	else if (name == "pool")
+		bopt.pool = n;
+	else if (name == "read_pct")
+		bopt.read_pct = n;
+	else if (name == "cache_size")
+		bopt.cache_size = n;
+	else if (name == "page_size")
+		bopt.page_size = n;
+	else if (name == "checksum")
+		bopt.checksum = (n != 0);
+	else if (name == "json")
+		bopt.json = (n != 0);
+	else
+		return false;
+
+	return true;
+}
+
+int main (int argc, char *argv[])
+{
+	for (int i = 1; i < argc; i++)
+		if (!parseArg(argv[i])) {
+			usage(argv[0]);
+			return 1;
+		}
+
+	if ((bopt.num == 0) || (bopt.key_size < 8) || (bopt.threads == 0) ||
+	    (bopt.batch == 0) || (bopt.read_pct > 100)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!bopt.json) {
+		printf("keys %u, key %u bytes, value %u bytes, cache %llu bytes, "
+		       "page %u bytes\n\n", bopt.num, bopt.key_size,
+		       bopt.value_size, (unsigned long long) bopt.cache_size,
+		       bopt.page_size);
+		printf("%-12s %3s %10s %12s %9s %9s %9s %9s %9s %10s\n",
+		       "benchmark", "thr", "ops", "ops/sec", "MB/s", "avg us",
+		       "p50 us", "p99 us", "p99.9 us", "max us");
+	}
+
+	Bench bench;
+	std::string list = bopt.benchmarks;
+	try {
+		size_t pos = 0;
+		while (pos <= list.size()) {
+			size_t comma = list.find(',', pos);
+			if (comma == std::string::npos)
+				comma = list.size();
+
+			std::string name = list.substr(pos, comma - pos);
+			pos = comma + 1;
+			if (name.empty())
+				continue;
+
+			if (!bench.runOne(name)) {
+				fprintf(stderr, "unknown benchmark: %s\n", name.c_str());
+				return 1;
+			}
+		}
+	}
+	catch (std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,160 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+// Compare lookup and scan costs across page sizes.
+//
+// Usage: pagesize [n_keys]
+
+#include "pgdb2-config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdexcept>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <pgdb2.h>
+
+#define BENCHFN "bench-pagesize.db"
+
+static const uint32_t page_sizes[] = { 4096, 16384, 65536 };
+static const size_t big_value_len = 16 * 1024 * 1024;
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double) tv.tv_sec + ((double) tv.tv_usec / 1000000.0);
+}
+
+static std::string mkkey(unsigned int i)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "key%08u", i);
+	return std::string(buf);
+}
+
+static std::string mkval(unsigned int i, size_t len)
+{
+	std::string val;
+	while (val.size() < len) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "{\"v\":%u},", i);
+		val.append(buf);
+	}
+	val.resize(len);
+	return val;
+}
+
+static off_t fileSize()
+{
+	struct stat st;
+	if (stat(BENCHFN, &st) < 0)
+		return 0;
+	return st.st_size;
+}
+
+static void load(uint32_t page_size, unsigned int n_keys)
+{
+	page::Options opts;
+	opts.f_read = true;
+	opts.f_write = true;
+	opts.f_create = true;
+	opts.page_size = page_size;
+
+	page::DB db(BENCHFN, opts);
+	for (unsigned int i = 0; i < n_keys; i++)
+		db.put(mkkey(i), mkval(i, 100 + (i % 200)));
+
+	db.put("big", mkval(0, big_value_len));
+	db.sync();
+}
+
+static void run(uint32_t page_size, unsigned int n_keys,
+		const std::vector<unsigned int>& order)
+{
+	unlink(BENCHFN);
+
+	double t0 = now();
+	load(page_size, n_keys);
+	double t_load = now() - t0;
+
+	page::Options opts;
+	page::DB db(BENCHFN, opts);
+	std::string val;
+
+	// point lookups, random order
+	t0 = now();
+	for (unsigned int i = 0; i < n_keys; i++)
+		if (!db.get(mkkey(order[i]), val))
+			throw std::runtime_error("lookup failed");
+	double t_random = now() - t0;
+
+	// scan: every key, in key order
+	t0 = now();
+	for (unsigned int i = 0; i < n_keys; i++)
+		if (!db.get(mkkey(i), val))
+			throw std::runtime_error("scan failed");
+	double t_scan = now() - t0;
+
+	// stream one large value
+	t0 = now();
+	page::ValueReader reader;
+	if (!db.openValue("big", reader))
+		throw std::runtime_error("big value missing");
+
+	std::vector<char> buf(64 * 1024);
+	size_t total = 0, n;
+	while ((n = reader.read(&buf[0], buf.size())) > 0)
+		total += n;
+	assert(total == big_value_len);
+	double t_stream = now() - t0;
+
+	printf("%6u  %10.2f  %10.3f  %10.3f  %10.1f  %10lu\n",
+	       page_size,
+	       (t_load * 1000000.0) / n_keys,
+	       (t_random * 1000000.0) / n_keys,
+	       (t_scan * 1000000.0) / n_keys,
+	       (big_value_len / (1024.0 * 1024.0)) / t_stream,
+	       (unsigned long) (fileSize() / 1024));
+
+	unlink(BENCHFN);
+}
+
+int main (int argc, char *argv[])
+{
+	unsigned int n_keys = 100000;
+	if (argc > 1)
+		n_keys = atoi(argv[1]);
+	if (n_keys == 0) {
+		fprintf(stderr, "usage: %s [n_keys]\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<unsigned int> order;
+	for (unsigned int i = 0; i < n_keys; i++)
+		order.push_back(i);
+
+	srand(42);
+	for (unsigned int i = n_keys - 1; i > 0; i--) {
+		unsigned int j = rand() % (i + 1);
+		std::swap(order[i], order[j]);
+	}
+
+	printf("%u keys, %lu MiB stream\n\n", n_keys,
+	       (unsigned long) (big_value_len / (1024 * 1024)));
+	printf("%6s  %10s  %10s  %10s  %10s  %10s\n",
+	       "page", "put us/op", "get us/op", "scan us/op",
+	       "stream MB/s", "file KiB");
+
+	for (unsigned int i = 0; i < 3; i++)
+		run(page_sizes[i], n_keys, order);
+
+	return 0;
+}
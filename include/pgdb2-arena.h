@@ -0,0 +1,90 @@
+#ifndef __PGDB2_ARENA_H__
+#define __PGDB2_ARENA_H__
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace page {
+
+// Bump allocator for scratch memory needed only for the duration of
+// one operation: page buffers, decompression output.  Memory is
+// released all at once, by rewinding to an earlier mark; blocks are
+// kept for reuse, so a warm arena makes no heap calls.  Not shared
+// between threads: each thread uses its own, via local().
+class ScratchArena {
+public:
+	struct Mark {
+		size_t	block;			// index of current block
+		size_t	off;			// bytes used in current block
+	};
+
+private:
+	struct Block {
+		unsigned char	*data;
+		size_t		size;
+	};
+
+	std::vector<Block>	blocks;
+	size_t			cur_block;
+	size_t			cur_off;
+	uint64_t		n_heap;		// blocks ever allocated
+
+	ScratchArena(const ScratchArena&);
+	ScratchArena& operator=(const ScratchArena&);
+
+	void newBlock(size_t pos, size_t size);
+
+public:
+	static const size_t block_size = 64 * 1024;
+	static const size_t keep_max = 1024 * 1024;	// larger: freed
+
+	ScratchArena() : cur_block(0), cur_off(0), n_heap(0) {}
+	~ScratchArena();
+
+	// calling thread's arena
+	static ScratchArena& local();
+
+	void *alloc(size_t bytes);
+	unsigned char *allocBytes(size_t bytes) {
+		return (unsigned char *) alloc(bytes);
+	}
+
+	Mark mark() const {
+		Mark m;
+		m.block = cur_block;
+		m.off = cur_off;
+		return m;
+	}
+	void rewind(const Mark& m);
+
+	uint64_t heapAllocs() const { return n_heap; }
+	size_t reserved() const;
+};
+
+// Scratch memory scope: allocations from the thread's arena made
+// within the scope are released when it exits.  Scopes nest.
+class ArenaScope {
+private:
+	ScratchArena&		a;
+	ScratchArena::Mark	m;
+
+	ArenaScope(const ArenaScope&);
+	ArenaScope& operator=(const ArenaScope&);
+
+public:
+	ArenaScope() : a(ScratchArena::local()), m(a.mark()) {}
+	~ArenaScope() { a.rewind(m); }
+
+	ScratchArena& arena() { return a; }
+};
+
+} // namespace page
+
+#endif // __PGDB2_ARENA_H__
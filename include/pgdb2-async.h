@@ -0,0 +1,227 @@
+#ifndef __PGDB2_ASYNC_H__
+#define __PGDB2_ASYNC_H__
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include "pgdb2.h"
+#include "pgdb2-lock.h"
+
+#ifdef __cpp_impl_coroutine
+#include <atomic>
+#include <coroutine>
+#include <utility>
+#endif
+
+namespace page {
+
+// Unit of work for an Executor
+class AsyncTask {
+public:
+	virtual ~AsyncTask() {}
+	virtual void run() = 0;
+};
+
+// Runs submitted tasks, which may block on storage.  Takes ownership
+// of each task, deleting it once run.
+class Executor {
+public:
+	virtual ~Executor() {}
+	virtual void submit(AsyncTask *task) = 0;
+};
+
+// Fixed set of threads running tasks in submission order.  The
+// destructor runs all tasks already submitted, then stops.
+class ThreadPool : public Executor {
+private:
+	std::vector<pthread_t>	threads;
+	std::deque<AsyncTask *>	queue;
+	Mutex			mtx;
+	CondVar			cv;
+	bool			stopping;
+
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+
+	static void *worker(void *arg);
+	void runTasks();
+
+public:
+	explicit ThreadPool(unsigned int n_threads);
+	~ThreadPool();
+
+	size_t size() const { return threads.size(); }
+	void submit(AsyncTask *task);
+};
+
+// Outcome of one lookup
+class AsyncGetResult {
+public:
+	bool		found;
+	std::string	value;
+	std::string	error;		// lookup failed: exception text
+
+	AsyncGetResult() : found(false) {}
+
+	bool ok() const { return error.empty(); }
+	void swap(AsyncGetResult& r) {
+		std::swap(found, r.found);
+		value.swap(r.value);
+		error.swap(r.error);
+	}
+};
+
+// Completion of an async lookup, called exactly once
+class AsyncGetDone {
+public:
+	virtual ~AsyncGetDone() {}
+	virtual void done(AsyncGetResult& result) = 0;
+};
+
+// Lookup without blocking the caller.  A lookup served entirely from
+// cache completes on the calling thread, before asyncGet returns;
+// otherwise it runs on the executor, and completes there.
+void asyncGet(DB& db, Executor& ex, const std::string& key,
+	      AsyncGetDone *done);
+void asyncGet(DB& db, Executor& ex, uint64_t key, AsyncGetDone *done);
+
+// Blocking lookup, run on the executor
+void submitGet(DB& db, Executor& ex, const std::string& key,
+	       AsyncGetDone *done);
+void submitGet(DB& db, Executor& ex, uint64_t key, AsyncGetDone *done);
+
+// Non-blocking lookup on the calling thread; false if it must
+// be submitted
+bool tryGet(DB& db, const std::string& key, AsyncGetResult& result);
+bool tryGet(DB& db, uint64_t key, AsyncGetResult& result);
+
+#ifdef __cpp_impl_coroutine
+
+// co_await asyncGet(db, ex, key), yielding an AsyncGetResult.  Does
+// not suspend if the lookup is served from cache; otherwise resumes
+// on the executor thread that completed it.  Lookup errors are
+// rethrown as std::runtime_error.
+template <typename K>
+class GetAwaiter : private AsyncGetDone {
+private:
+	DB&			db;
+	Executor&		ex;
+	K			key;
+	AsyncGetResult		result;
+	std::coroutine_handle<>	handle;
+
+	void done(AsyncGetResult& r) {
+		result.swap(r);
+		handle.resume();
+	}
+
+public:
+	GetAwaiter(DB& db_, Executor& ex_, const K& key_)
+		: db(db_), ex(ex_), key(key_) {}
+
+	bool await_ready() { return tryGet(db, key, result); }
+	void await_suspend(std::coroutine_handle<> h) {
+		handle = h;
+		submitGet(db, ex, key, this);
+	}
+	AsyncGetResult await_resume() {
+		if (!result.ok())
+			throw std::runtime_error(result.error);
+		return std::move(result);
+	}
+};
+
+inline GetAwaiter<std::string> asyncGet(DB& db, Executor& ex,
+					const std::string& key)
+{
+	return GetAwaiter<std::string>(db, ex, key);
+}
+
+inline GetAwaiter<uint64_t> asyncGet(DB& db, Executor& ex, uint64_t key)
+{
+	return GetAwaiter<uint64_t>(db, ex, key);
+}
+
+// co_await asyncMultiGet(db, ex, keys), yielding one AsyncGetResult
+// per key, in order.  Cached keys are looked up in place; the rest
+// run concurrently on the executor, and the last to complete
+// resumes the caller.  Errors are reported per key.
+template <typename K>
+class MultiGetAwaiter {
+private:
+	struct Slot : public AsyncGetDone {
+		MultiGetAwaiter	*owner;
+		size_t		idx;
+
+		void done(AsyncGetResult& r) {
+			owner->results[idx].swap(r);
+			owner->complete();
+		}
+	};
+
+	DB&				db;
+	Executor&			ex;
+	std::vector<K>			keys;
+	std::vector<AsyncGetResult>	results;
+	std::vector<Slot>		slots;		// pending lookups
+	std::atomic<size_t>		pending;
+	std::coroutine_handle<>		handle;
+
+	void complete() {
+		if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			handle.resume();
+	}
+
+public:
+	MultiGetAwaiter(DB& db_, Executor& ex_, const std::vector<K>& keys_)
+		: db(db_), ex(ex_), keys(keys_), results(keys_.size()),
+		  pending(0) {}
+
+	bool await_ready() {
+		for (size_t i = 0; i < keys.size(); i++) {
+			if (tryGet(db, keys[i], results[i]))
+				continue;
+
+			Slot s;
+			s.owner = this;
+			s.idx = i;
+			slots.push_back(s);
+		}
+		return slots.empty();
+	}
+	bool await_suspend(std::coroutine_handle<> h) {
+		handle = h;
+
+		// one extra count, held while submitting
+		pending.store(slots.size() + 1, std::memory_order_relaxed);
+		for (size_t i = 0; i < slots.size(); i++)
+			submitGet(db, ex, keys[slots[i].idx], &slots[i]);
+
+		// all done already: continue without suspending
+		return (pending.fetch_sub(1, std::memory_order_acq_rel) != 1);
+	}
+	std::vector<AsyncGetResult> await_resume() {
+		return std::move(results);
+	}
+};
+
+template <typename K>
+inline MultiGetAwaiter<K> asyncMultiGet(DB& db, Executor& ex,
+					const std::vector<K>& keys)
+{
+	return MultiGetAwaiter<K>(db, ex, keys);
+}
+
+#endif // __cpp_impl_coroutine
+
+} // namespace page
+
+#endif // __PGDB2_ASYNC_H__
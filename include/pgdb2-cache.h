@@ -0,0 +1,177 @@
+#ifndef __PGDB2_CACHE_H__
+#define __PGDB2_CACHE_H__
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <list>
+#include <map>
+#include "pgdb2-lock.h"
+
+namespace page {
+
+enum mem_consumer_ids {
+	MEM_PAGES	= 0,			// page cache
+	MEM_DIRS	= 1,			// decoded directory cache
+	MEM_INODES	= 2,			// resident inode table chunks
+
+	MEM__COUNT
+};
+
+struct MemStats {
+	uint64_t	used;			// bytes charged
+	uint64_t	peak;			// max bytes charged
+	uint64_t	hits;			// lookups found resident
+	uint64_t	misses;			// lookups needing I/O
+	uint64_t	evictions;		// entries evicted
+
+	MemStats() : used(0), peak(0), hits(0), misses(0), evictions(0) {}
+};
+
+// A cache whose entries may be dropped under memory pressure
+class MemConsumer {
+public:
+	virtual ~MemConsumer() {}
+
+	// evict least valuable entry; false if none can be evicted
+	virtual bool evictOne() = 0;
+};
+
+// Byte budget shared by all caches of one DB.  Each consumer is
+// entitled to a share of the limit; a consumer under its share lends
+// the remainder to the others, and is evicted from only once no
+// consumer over its share can give memory back.  The budget's mutex
+// serializes changes to the caches charged to it; cache lookups take
+// no lock.  Hit and miss counts are approximate under concurrent
+// readers.
+//
+// The limit is a soft cap.  Page frames are evicted as others are
+// added, so pages alone never hold the budget over it.  Directories
+// and inode chunks may be referenced until the operation that loaded
+// them ends: they are charged when loaded, but evicted only as each
+// operation starts, with the DB locked exclusively.  Between those
+// points, usage exceeds the limit by what the operations in progress
+// have loaded: for a get, the directories on its path and their inode
+// chunks; for a scan, every directory it visits.
+class MemBudget {
+private:
+	uint64_t	limit;
+	unsigned int	share[MEM__COUNT];	// percent of limit
+	MemConsumer	*consumers[MEM__COUNT];
+	Mutex		mtx;
+	uint64_t	retired;		// evicted, not yet freed
+
+public:
+	MemStats	stats[MEM__COUNT];
+
+	MemBudget();
+
+	uint64_t getLimit() const { return limit; }
+	void setLimit(uint64_t limit_) { limit = limit_; }
+	void attach(unsigned int id, MemConsumer *c) { consumers[id] = c; }
+
+	Mutex& mutex() { return mtx; }
+
+	uint64_t used() const;
+
+	// charged or retired bytes over the limit; no lock needed
+	bool overLimit() const;
+
+	void charge(unsigned int id, size_t bytes) {
+		MemStats& st = stats[id];
+		__atomic_store_n(&st.used, st.used + bytes, __ATOMIC_RELAXED);
+		if (st.used > st.peak)
+			st.peak = st.used;
+	}
+	void release(unsigned int id, size_t bytes) {
+		MemStats& st = stats[id];
+		__atomic_store_n(&st.used, st.used - bytes, __ATOMIC_RELAXED);
+	}
+
+	// evicted memory, freed once no reader can reference it
+	void retire(unsigned int id, size_t bytes) {
+		release(id, bytes);
+		__atomic_store_n(&retired, retired + bytes, __ATOMIC_RELAXED);
+	}
+	void unretire(size_t bytes) {
+		__atomic_store_n(&retired, retired - bytes, __ATOMIC_RELAXED);
+	}
+
+	// plain load and store, not read-modify-write: a lost count
+	// is cheaper than a contended cache line
+	void hit(unsigned int id) { bump(stats[id].hits); }
+	void miss(unsigned int id) { bump(stats[id].misses); }
+
+private:
+	static void bump(uint64_t& n) {
+		__atomic_store_n(&n, __atomic_load_n(&n, __ATOMIC_RELAXED) + 1,
+				 __ATOMIC_RELAXED);
+	}
+
+public:
+
+	// evict from consumers in mask (bit per id) until under limit
+	void reclaim(unsigned int mask);
+};
+
+// Cache of verified pages, keyed by page index.  Only small reads
+// are cached; large value reads bypass it.  Lookups take no lock:
+// frames are found through a two-level table of pointers, and are
+// never modified while readers may hold the DB lock.  Frames evicted
+// by readers are retired, and freed by quiesce(), once the caller
+// holds the DB lock exclusively.
+class PageCache : public MemConsumer {
+private:
+	struct Frame {
+		uint64_t	index;
+		uint32_t	referenced;	// CLOCK bit
+		unsigned char	*data;
+	};
+
+	static const unsigned int leaf_bits = 12;
+	static const size_t leaf_len = 1U << leaf_bits;
+
+	std::vector<Frame **>	leaves;		// by index >> leaf_bits
+	std::vector<Frame *>	resident;	// CLOCK ring
+	size_t			hand;
+	std::vector<Frame *>	retired;
+	MemBudget		*mem;
+	size_t			page_size;
+
+	PageCache(const PageCache&);
+	PageCache& operator=(const PageCache&);
+
+	size_t entBytes() const { return page_size + sizeof(Frame) + 64; }
+
+	Frame *lookup(uint64_t index) const;
+	Frame **slot(uint64_t index);
+	static void freeFrame(Frame *fr);
+
+public:
+	static const size_t max_io_pages = 8;
+
+	PageCache() : hand(0), mem(NULL), page_size(0) {}
+	~PageCache() { clear(); }
+
+	void init(MemBudget *mem_) { mem = mem_; }
+	void setPageSize(size_t sz);
+	void setCapacity(uint64_t n_pages);
+
+	bool get(uint64_t index, size_t page_count, unsigned char *out);
+	void put(uint64_t index, size_t page_count, const unsigned char *in);
+	void update(uint64_t index, size_t page_count, const unsigned char *in);
+	void quiesce();
+	void clear();
+
+	bool evictOne();
+};
+
+} // namespace page
+
+#endif // __PGDB2_CACHE_H__
@@ -0,0 +1,57 @@
+#ifndef __PGDB2_CODEC_H__
+#define __PGDB2_CODEC_H__
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "pgdb2-struct.h"
+
+namespace page {
+
+// Block compression codec.  A codec is identified on disk by its
+// id, stored in the ITF_CODEC bits of each inode table entry, so ids
+// must never be reused.  Ids below CODEC_USER are reserved for codecs
+// shipped with pgdb2.
+class Codec {
+public:
+	virtual ~Codec() {}
+
+	virtual uint32_t id() const = 0;
+	virtual const char *name() const = 0;
+
+	// append compressed form of in[0..in_len) to out
+	virtual void compress(const unsigned char *in, size_t in_len,
+			      std::vector<unsigned char>& out) const = 0;
+
+	// decompress exactly out_len bytes; throws on corrupt input
+	virtual void decompress(const unsigned char *in, size_t in_len,
+				unsigned char *out, size_t out_len) const = 0;
+};
+
+// Fast, self-contained LZ77 codec (LZ4-style block format)
+class LZCodec : public Codec {
+public:
+	uint32_t id() const { return CODEC_LZ; }
+	const char *name() const { return "lz"; }
+
+	void compress(const unsigned char *in, size_t in_len,
+		      std::vector<unsigned char>& out) const;
+	void decompress(const unsigned char *in, size_t in_len,
+			unsigned char *out, size_t out_len) const;
+};
+
+// Codec registry.  Registration is not thread safe, and should be
+// performed at startup, before any DB is opened.  The registry does
+// not take ownership.
+extern void registerCodec(const Codec *codec);
+extern const Codec *getCodec(uint32_t id);
+
+} // namespace page
+
+#endif // __PGDB2_CODEC_H__
@@ -11,11 +11,112 @@
 #include <sys/stat.h>
 #include <string>
 #include <vector>
+#include <stdexcept>
 #include <stdint.h>
 #include <fcntl.h>
+#include "pgdb2-struct.h"
+#include "pgdb2-cache.h"
+#include "pgdb2-lock.h"
+#include "pgdb2-shm.h"
+#include "pgdb2-stats.h"
 
 namespace page {
 
+// Sequential access detector for one stream of reads.  Random access
+// prefetches nothing; each sequential read keeps a prefetch window
+// ahead of the stream, doubling the window as the run continues.
+class Readahead {
+private:
+	uint64_t	next;		// position following last read
+	uint64_t	hinted;		// end of range already prefetched
+	uint64_t	window;		// current prefetch size, or 0
+	uint64_t	min_window;
+	uint64_t	max_window;	// 0: disabled
+
+public:
+	Readahead(uint64_t min_w = 0, uint64_t max_w = 0) {
+		setWindow(min_w, max_w);
+	}
+
+	void setWindow(uint64_t min_w, uint64_t max_w) {
+		min_window = min_w;
+		max_window = max_w;
+		reset();
+	}
+	void reset() {
+		next = ~0ULL;
+		hinted = 0;
+		window = 0;
+	}
+
+	// record read of [pos, pos+len); if a prefetch is due, returns
+	// true and range [ra_pos, ra_pos+ra_len) to prefetch
+	bool access(uint64_t pos, uint64_t len,
+		    uint64_t& ra_pos, uint64_t& ra_len);
+};
+
+// Thrown by File::read, within a NoBlockScope, in place of a read
+// from storage
+class WouldBlock : public std::runtime_error {
+public:
+	WouldBlock() : std::runtime_error("Read would block") {}
+};
+
+// Within this scope, the calling thread's page reads are served from
+// cache, or fail with WouldBlock.  Scopes nest.
+class NoBlockScope {
+private:
+	bool	prev;
+
+	NoBlockScope(const NoBlockScope&);
+	NoBlockScope& operator=(const NoBlockScope&);
+
+	static bool& flag();
+
+public:
+	NoBlockScope() : prev(flag()) { flag() = true; }
+	~NoBlockScope() { flag() = prev; }
+
+	static bool active() { return flag(); }
+};
+
+// Generation of the last write to each run of run_pages pages, for
+// incremental backup.  Writes are stamped with the current
+// generation.  Every write since the backup of generation base is
+// stamped; runs not written since tracking began read as 0.
+// Changed only by writers.
+class ChangeMap {
+private:
+	std::vector<uint64_t>	stamps;		// by run
+	uint64_t		gen;		// stamped on writes
+	uint64_t		base;		// oldest backup tracked from
+
+public:
+	static const unsigned int run_pages = 16;
+
+	ChangeMap() : gen(1), base(1) {}
+
+	// history unknown: track from the next backup
+	void reset(uint64_t gen_) {
+		stamps.clear();
+		gen = base = gen_;
+	}
+	uint64_t generation() const { return gen; }
+	void setGeneration(uint64_t gen_) { gen = gen_; }
+	uint64_t tracked() const { return base; }
+
+	void mark(uint64_t index, size_t page_count);
+	uint64_t stamp(uint64_t run) const {
+		return (run < stamps.size()) ? stamps[run] : 0;
+	}
+
+	bool load(const std::string& path, uint64_t db_id, uint64_t change_gen);
+	void save(const std::string& path, uint64_t db_id, uint64_t change_gen) const;
+};
+
+// Page file.  Reads use positioned I/O, and may be issued by many
+// threads at once; writes, resizes, open and close require the
+// caller to exclude all other access.
 class File {
 private:
 	int fd;			// our file descriptor, or -1 (closed/invalid)
@@ -25,10 +126,21 @@ private:
 	size_t page_size;	// page size (short term: pow 2; LT: any)
 	uint64_t n_pages;	// cache: current file size, in pages
 
-	off_t cur_fpos;		// cache: current OS file position, or -1
+
+	bool csum;		// seal/verify PageTrailer on each page
+
+	PageCache *cache;	// verified page cache, or NULL
+	SharedRegion *shm;	// cache shared by processes, or NULL
+	ChangeMap *changes;	// written pages, or NULL
+	Stats *stats;		// I/O counts, or NULL
+
+	uint64_t ra_max;	// max bytes prefetched ahead of a run
+	uint64_t ra_hints;	// prefetch hints issued
 
 public:
-	File() : fd(-1), o_flags(0), page_size(4096), n_pages(0), cur_fpos(-1) {}
+	File() : fd(-1), o_flags(0), page_size(4096), n_pages(0),
+		 csum(false), cache(NULL), shm(NULL), changes(NULL),
+		 stats(NULL), ra_max(1024 * 1024), ra_hints(0) {}
 	File(const std::string& filename_, int o_flags_ = O_RDONLY, size_t page_size = 4096);
 	~File();
 
@@ -38,13 +150,31 @@ public:
 	size_t pageSize() const { return page_size; }
 	void setPageSize(size_t sz);
 
+	bool checksum() const { return csum; }
+	void setChecksum(bool enable) { csum = enable; }
+	void setCache(PageCache *cache_);
+	void setShared(SharedRegion *shm_) { shm = shm_; }
+	void setChanges(ChangeMap *changes_) { changes = changes_; }
+	void setStats(Stats *stats_) { stats = stats_; }
+	void setReadahead(uint64_t max_bytes) { ra_max = max_bytes; }
+	uint64_t readaheadMax() const { return ra_max; }
+	uint64_t readaheadHints() const {
+		return __atomic_load_n(&ra_hints, __ATOMIC_RELAXED);
+	}
+	size_t pageDataSize() const {
+		return csum ? (page_size - sizeof(PageTrailer)) : page_size;
+	}
+
 	void open();
 	void open(std::string filename_, int o_flags_ = O_RDONLY, size_t page_size = 4096);
 	void close();
+	void refresh();
 
 	void read(void *buf, uint64_t index, size_t page_count = 1);
 	void read(std::vector<unsigned char>& buf, uint64_t index, size_t page_count = 1);
 
+	void willNeed(uint64_t index, uint64_t page_count);
+
 	void write(const void *buf, uint64_t index, size_t page_count = 1);
 	void write(const std::vector<unsigned char>& buf, uint64_t index, size_t page_count = 1);
 
@@ -55,8 +185,38 @@ public:
 private:
 	void setPageCount();
 	void stat(struct stat& st);
+	void sealPages(unsigned char *buf, uint64_t index, size_t page_count) const;
+	void verifyPages(const unsigned char *buf, uint64_t index, size_t page_count) const;
 };
 
+// Within this scope, the calling thread's reads of one file are a
+// stream: sequential runs among them are prefetched ahead.  Reads by
+// other threads, or outside any scope, neither join nor break the
+// run.  Scopes nest.
+class ReadaheadScope {
+private:
+	const File	*file;
+	Readahead	ra;		// in pages
+	ReadaheadScope	*prev;
+
+	ReadaheadScope(const ReadaheadScope&);
+	ReadaheadScope& operator=(const ReadaheadScope&);
+
+	static ReadaheadScope*& current();
+
+public:
+	ReadaheadScope(const File& f);
+	~ReadaheadScope() { current() = prev; }
+
+	// this thread's stream of reads of f, or NULL
+	static Readahead *stream(const File *f) {
+		ReadaheadScope *s = current();
+		return (s && (s->file == f)) ? &s->ra : NULL;
+	}
+};
+
+extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
 static inline void bufSizeAlign(std::vector<unsigned char>& buf, size_t page_size) {
 	size_t rem = buf.size() % page_size;
 	if (rem || (buf.size() == 0))
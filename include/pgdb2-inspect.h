@@ -0,0 +1,99 @@
+#ifndef __PGDB2_INSPECT_H__
+#define __PGDB2_INSPECT_H__
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "pgdb2.h"
+
+namespace page {
+
+// Directories at one depth of the tree; the root is depth 1
+class InspectLevel {
+public:
+	uint64_t	dirs;
+	uint64_t	entries;
+	uint64_t	pages;			// allocated
+	uint64_t	bytes;			// encoded directory data
+
+	InspectLevel() : dirs(0), entries(0), pages(0), bytes(0) {}
+};
+
+// A leaf directory, and the cost of a cold lookup of its keys:
+// every directory page from the root down, then the value
+class InspectPath {
+public:
+	uint32_t	ino;
+	uint32_t	depth;
+	uint64_t	dir_pages;		// along the path
+	uint64_t	keys;			// in the leaf
+	uint64_t	max_value_pages;	// largest value in the leaf
+	std::string	first, last;		// byte keys: leaf key range
+	uint64_t	ifirst, ilast;		// fixed-width keys
+
+	InspectPath() : ino(0), depth(0), dir_pages(0), keys(0),
+			max_value_pages(0), ifirst(0), ilast(0) {}
+
+	uint64_t pages() const { return dir_pages + max_value_pages; }
+};
+
+// Layout of one DB file, see DB::inspect
+class InspectReport {
+public:
+	static const unsigned int max_ext_bucket = 16;	// "16 or more"
+
+	enum key_types	key_type;
+	uint32_t	page_size;
+	bool		checksum;
+	uint64_t	file_pages;
+	uint64_t	alloc_end;		// pages ever allocated
+
+	uint64_t	free_extents;		// free list
+	uint64_t	free_pages;
+
+	uint64_t	inodes;			// inode table length
+	uint64_t	inodes_unused;
+	uint64_t	table_pages;		// inode table storage
+	uint64_t	extlist_pages;		// external extent lists
+	uint64_t	fragmented;		// inodes of 2+ extents
+	uint64_t	max_extents;
+	std::vector<uint64_t> extent_counts;	// inodes, by extent count
+
+	std::vector<InspectLevel> levels;	// by depth - 1
+	uint64_t	max_dir_entries;
+	std::vector<uint64_t> dir_fill;		// dirs, by tenth of pages
+						// filled, 0-10%..90-100%
+
+	uint64_t	keys;
+	uint64_t	key_bytes;
+	uint64_t	value_bytes;
+	uint64_t	values_inline;		// in directory entries
+	uint64_t	values_packed;		// in value heap pages
+	uint64_t	values_inode;		// in their own inode
+	uint64_t	heap_pages;
+	uint64_t	value_inode_pages;
+
+	std::vector<InspectPath> paths;		// costliest first
+
+	InspectReport();
+
+	uint32_t depth() const { return levels.size(); }
+	uint64_t dirs() const;
+	uint64_t dirPages() const;
+
+	// file bytes per byte of keys and values
+	double spaceAmp() const;
+
+	std::string toText() const;
+	std::string toJSON() const;
+};
+
+} // namespace page
+
+#endif // __PGDB2_INSPECT_H__
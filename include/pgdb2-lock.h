@@ -0,0 +1,169 @@
+#ifndef __PGDB2_LOCK_H__
+#define __PGDB2_LOCK_H__
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+
+namespace page {
+
+// Recursive mutex: a cache may re-enter its own lock while
+// evicting entries on behalf of the memory budget
+class Mutex {
+private:
+	friend class CondVar;
+
+	pthread_mutex_t	mtx;
+
+	Mutex(const Mutex&);
+	Mutex& operator=(const Mutex&);
+
+public:
+	Mutex() {
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&mtx, &attr);
+		pthread_mutexattr_destroy(&attr);
+	}
+	~Mutex() { pthread_mutex_destroy(&mtx); }
+
+	void lock() { pthread_mutex_lock(&mtx); }
+	void unlock() { pthread_mutex_unlock(&mtx); }
+};
+
+class MutexGuard {
+private:
+	Mutex&	m;
+
+	MutexGuard(const MutexGuard&);
+	MutexGuard& operator=(const MutexGuard&);
+
+public:
+	explicit MutexGuard(Mutex& m_) : m(m_) { m.lock(); }
+	~MutexGuard() { m.unlock(); }
+};
+
+// Condition variable, waited on with a Mutex held exactly once
+class CondVar {
+private:
+	pthread_cond_t	cv;
+
+	CondVar(const CondVar&);
+	CondVar& operator=(const CondVar&);
+
+public:
+	CondVar() { pthread_cond_init(&cv, NULL); }
+	~CondVar() { pthread_cond_destroy(&cv); }
+
+	void wait(Mutex& m) { pthread_cond_wait(&cv, &m.mtx); }
+	void signal() { pthread_cond_signal(&cv); }
+	void broadcast() { pthread_cond_broadcast(&cv); }
+};
+
+// Reader-writer lock, for read-mostly use.  A reader writes only its
+// thread's slot: readers on different cores share no cache line, and
+// take no atomic read-modify-write.  A writer announces itself, then
+// waits for readers in flight to leave; readers arriving meanwhile
+// wait for the writer.  Threads beyond max_slots share a counter.
+// A thread with a slot may take the read lock recursively; no other
+// recursion is allowed.
+class RWLock {
+public:
+	static const unsigned int max_slots = 256;
+
+private:
+	struct Slot {
+		uint32_t	active;		// read depth, by owner only
+		unsigned char	pad[64 - sizeof(uint32_t)];
+	} __attribute__((aligned(64)));
+
+	Slot		slots[max_slots];
+	uint32_t	overflow;	// readers without a slot
+	uint32_t	writer;		// writer waiting or holding
+	bool		writing;	// writer holding, see unlock()
+	pthread_t	owner;
+	Mutex		writer_mtx;	// one writer at a time
+	Mutex		wait_mtx;	// readers waiting on a writer
+	CondVar		wait_cv;
+
+	RWLock(const RWLock&);
+	RWLock& operator=(const RWLock&);
+
+	static int slotId();
+	bool enter(bool wait);
+	void leave();
+
+public:
+	RWLock();
+
+	void readLock() { enter(true); }
+	bool tryReadLock() { return enter(false); }
+	void writeLock();
+	void unlock();
+};
+
+class ReadGuard {
+private:
+	RWLock&	l;
+
+	ReadGuard(const ReadGuard&);
+	ReadGuard& operator=(const ReadGuard&);
+
+public:
+	explicit ReadGuard(RWLock& l_) : l(l_) { l.readLock(); }
+	~ReadGuard() { l.unlock(); }
+};
+
+class WriteGuard {
+private:
+	RWLock&	l;
+
+	WriteGuard(const WriteGuard&);
+	WriteGuard& operator=(const WriteGuard&);
+
+public:
+	explicit WriteGuard(RWLock& l_) : l(l_) { l.writeLock(); }
+	~WriteGuard() { l.unlock(); }
+};
+
+// Advisory fcntl(2) lock on one byte of a file, coordinating
+// processes.  fcntl locks belong to a process, not a thread: shared
+// holds by several threads are counted, and the lock is dropped when
+// the last lets go.  Closing any descriptor of the file releases it.
+class FileLock {
+private:
+	int		fd;
+	off_t		off;
+	Mutex		mtx;
+	unsigned int	n_shared;
+
+	FileLock(const FileLock&);
+	FileLock& operator=(const FileLock&);
+
+	bool setLock(short type, bool wait);
+
+public:
+	FileLock() : fd(-1), off(0), n_shared(0) {}
+
+	void init(int fd_, off_t off_) { fd = fd_; off = off_; n_shared = 0; }
+
+	bool tryExclusive() { return setLock(F_WRLCK, false); }
+	void lockExclusive() { setLock(F_WRLCK, true); }
+	void unlockExclusive() { setLock(F_UNLCK, false); }
+
+	bool tryShared();
+	void lockShared();
+	void unlockShared();
+};
+
+} // namespace page
+
+#endif // __PGDB2_LOCK_H__
@@ -0,0 +1,55 @@
+#ifndef __PGDB2_PROBES_H__
+#define __PGDB2_PROBES_H__
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+// Static tracepoints (USDT), provider "pgdb2", for bpftrace, perf or
+// SystemTap, e.g.
+//
+//	bpftrace -e 'usdt:./libpgdb2.so:pgdb2:get__done { @[arg1] = count(); }'
+//
+// A probe site is a single nop until a tracer attaches.  Built only
+// if configure finds <sys/sdt.h> (--disable-probes: never); otherwise
+// probes compile to nothing.
+//
+//	file__read__start	index, page_count
+//	file__read__done	index, page_count, source (0 page cache,
+//				1 shared cache, 2 storage)
+//	file__write__start	index, page_count
+//	file__write__done	index, page_count
+//	file__sync__start
+//	file__sync__done
+//	get__start		key, key_len (byte keys), ikey
+//	get__done		found, depth (directories walked),
+//				value_len
+//	dir__load__start	ino
+//	dir__load__done		ino, data_len, n_ents
+//	extlist__load		ref (page), len (pages), n_extents
+
+#include "pgdb2-config.h"
+
+#if defined(ENABLE_PROBES) && defined(HAVE_SYS_SDT_H)
+
+#include <sys/sdt.h>
+
+#define PGDB2_PROBE0(name) \
+	DTRACE_PROBE(pgdb2, name)
+#define PGDB2_PROBE1(name, a1) \
+	DTRACE_PROBE1(pgdb2, name, a1)
+#define PGDB2_PROBE2(name, a1, a2) \
+	DTRACE_PROBE2(pgdb2, name, a1, a2)
+#define PGDB2_PROBE3(name, a1, a2, a3) \
+	DTRACE_PROBE3(pgdb2, name, a1, a2, a3)
+
+#else
+
+#define PGDB2_PROBE0(name)			do {} while (0)
+#define PGDB2_PROBE1(name, a1)			do {} while (0)
+#define PGDB2_PROBE2(name, a1, a2)		do {} while (0)
+#define PGDB2_PROBE3(name, a1, a2, a3)		do {} while (0)
+
+#endif
+
+#endif // __PGDB2_PROBES_H__
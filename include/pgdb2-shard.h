@@ -0,0 +1,112 @@
+#ifndef __PGDB2_SHARD_H__
+#define __PGDB2_SHARD_H__
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "pgdb2.h"
+#include "pgdb2-async.h"
+
+namespace page {
+
+enum shard_schemes {
+	SHARD_HASH,			// by key hash
+	SHARD_RANGE,			// by key range, at split points
+};
+
+class ShardOptions {
+public:
+	enum shard_schemes scheme;
+
+	// SHARD_RANGE: one split point less than shards, ascending.
+	// Shard i holds keys below split i, and not below split i - 1.
+	// Byte keys use splits; fixed-width keys, isplits.
+	std::vector<std::string> splits;
+	std::vector<uint64_t>	isplits;
+
+	ShardOptions() : scheme(SHARD_HASH) {}
+};
+
+// One logical database partitioned across several DB files, which
+// may live on different devices.  Single-key operations go to the
+// key's shard; batch operations, sync and scans run on all shards
+// at once, one thread per shard.  The partitioning is not recorded
+// in the files: every open must name the same files, in the same
+// order, with the same ShardOptions.  Thread safety is as for DB.
+class ShardedDB {
+private:
+	std::vector<DB *>	shards;
+	ShardOptions		sopts;
+	ThreadPool		*pool;		// NULL with one shard
+
+	ShardedDB(const ShardedDB&);
+	ShardedDB& operator=(const ShardedDB&);
+
+	void close();
+
+	template <typename K>
+	void multiGetKeys(const std::vector<K>& keys,
+			  std::vector<std::string>& values,
+			  std::vector<bool>& found);
+	template <typename K>
+	void multiPutKeys(const std::vector<K>& keys,
+			  const std::vector<std::string>& values);
+
+	bool overlaps(size_t shard, const ScanRange& range) const;
+
+public:
+	ShardedDB(const std::vector<std::string>& filenames,
+		  const Options& opts, const ShardOptions& sopts_);
+	~ShardedDB();
+
+	size_t size() const { return shards.size(); }
+	DB& shard(size_t i) { return *shards[i]; }
+	enum key_types keyType() const { return shards[0]->keyType(); }
+
+	size_t shardOf(const std::string& key) const;
+	size_t shardOf(uint64_t key) const;
+
+	bool get(const std::string& key, std::string& valueOut);
+	bool get(uint64_t key, std::string& valueOut);
+
+	void put(const std::string& key, const std::string& value);
+	void put(uint64_t key, const std::string& value);
+
+	// Look up keys[i] into values[i], setting found[i]
+	void multiGet(const std::vector<std::string>& keys,
+		      std::vector<std::string>& values,
+		      std::vector<bool>& found);
+	void multiGet(const std::vector<uint64_t>& keys,
+		      std::vector<std::string>& values,
+		      std::vector<bool>& found);
+
+	// Store values[i] at keys[i].  Each shard applies its keys in
+	// order; shards are independent, and one failing does not
+	// undo the others.
+	void multiPut(const std::vector<std::string>& keys,
+		      const std::vector<std::string>& values);
+	void multiPut(const std::vector<uint64_t>& keys,
+		      const std::vector<std::string>& values);
+
+	void sync();
+
+	// As DB::parallelScan, over shards whose keys may fall in range.
+	// Unordered, shards are scanned at once, sharing n_threads.
+	// Ordered scans need SHARD_RANGE: shards are scanned in turn,
+	// each with n_threads.
+	void parallelScan(const ScanRange& range, ScanVisitor& visitor,
+			  unsigned int n_threads, bool ordered = false);
+
+	// Statistics of all shards, summed; see DB::getStats
+	void getStats(DBStats& out) const;
+};
+
+} // namespace page
+
+#endif // __PGDB2_SHARD_H__
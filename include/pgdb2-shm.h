@@ -0,0 +1,67 @@
+#ifndef __PGDB2_SHM_H__
+#define __PGDB2_SHM_H__
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "pgdb2-struct.h"
+
+namespace page {
+
+// Region shared by all processes using one DB in multi-process mode,
+// mapped from a sidecar file next to the DB.  Holds the DB commit
+// generation, and a direct-mapped cache of verified pages that any
+// process may fill.  Slots are read lock-free, seqlock style; the
+// writer process keeps pages it writes current.
+class SharedRegion {
+private:
+	int		fd;
+	unsigned char	*map;
+	size_t		map_len;
+	size_t		page_size;
+	size_t		slot_size;
+	ShmHdr		*hdr;
+
+	uint64_t	n_hits;		// this process only
+	uint64_t	n_misses;
+
+	SharedRegion(const SharedRegion&);
+	SharedRegion& operator=(const SharedRegion&);
+
+	ShmSlot *slot(uint64_t index) const {
+		return (ShmSlot *) (map + sizeof(ShmHdr) +
+				    ((index % hdr->n_slots) * slot_size));
+	}
+
+public:
+	SharedRegion() : fd(-1), map(NULL), map_len(0), page_size(0),
+			 slot_size(0), hdr(NULL), n_hits(0), n_misses(0) {}
+	~SharedRegion() { close(); }
+
+	bool isOpen() const { return (map != NULL); }
+	void open(const std::string& path, int db_fd, size_t page_size_,
+		  uint64_t cache_bytes);
+	void close();
+	void reset();
+
+	uint64_t generation() const;
+	void bumpGeneration();
+
+	bool getPages(uint64_t index, size_t page_count, unsigned char *out);
+	void putPages(uint64_t index, size_t page_count, const unsigned char *in,
+		      bool force = false);
+
+	uint64_t slots() const { return hdr ? hdr->n_slots : 0; }
+	uint64_t hits() const;
+	uint64_t misses() const;
+};
+
+} // namespace page
+
+#endif // __PGDB2_SHM_H__
@@ -0,0 +1,232 @@
+#ifndef __PGDB2_STATS_H__
+#define __PGDB2_STATS_H__
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include "pgdb2-cache.h"
+
+namespace page {
+
+// What a page holds, for I/O accounting
+enum page_kinds {
+	PK_OTHER	= 0,		// unattributed
+	PK_SUPER	= 1,		// superblock
+	PK_INOTAB	= 2,		// inode table
+	PK_EXTLIST	= 3,		// external extent lists
+	PK_FREELIST	= 4,		// free extent list
+	PK_DIR		= 5,		// directories
+	PK_VALUE	= 6,		// values in their own inode
+	PK_VHEAP	= 7,		// shared value heap
+
+	PK__COUNT
+};
+
+enum page_io {
+	IO_CACHED	= 0,		// read, served by a page cache
+	IO_READ		= 1,		// read from storage
+	IO_WRITTEN	= 2,
+
+	IO__COUNT
+};
+
+enum stat_counters {
+	ST_READ_CALLS	= 0,		// pread(2)
+	ST_WRITE_CALLS	= 1,		// pwrite(2)
+	ST_FSYNCS	= 2,
+	ST_PREFETCHES	= 3,		// readahead hints
+	ST_DIR_LEVELS	= 4,		// directories walked by lookups
+	ST_DIRS_DECODED	= 5,
+	ST_BYTES_DECODED = 6,		// directory bytes decoded, and
+					// value bytes decompressed
+	ST_ENTRIES_SCANNED = 7,		// keys visited by scans
+	ST_WOULD_BLOCK	= 8,		// tryGet calls declined
+
+	ST__COUNT
+};
+
+enum stat_ops {
+	OP_GET		= 0,		// get, getRange, openValue, tryGet
+	OP_PUT		= 1,
+	OP_SYNC		= 2,
+	OP_SCAN		= 3,
+	OP_BACKUP	= 4,
+
+	OP__COUNT
+};
+
+extern const char *pageKindName(unsigned int kind);
+extern const char *statCounterName(unsigned int ctr);
+extern const char *statOpName(unsigned int op);
+
+// Latencies in nanoseconds, HDR style: each power of two is split
+// into 2^sub_bits linear buckets, so a bucket spans at most 1/8 of
+// its values.  Values past 2^max_bits land in the last bucket.
+class LatencyHistogram {
+public:
+	static const unsigned int sub_bits = 3;
+	static const unsigned int max_bits = 40;	// ~18 minutes
+	static const unsigned int n_buckets =
+		(max_bits - sub_bits + 2) << sub_bits;
+
+	uint64_t	counts[n_buckets];
+	uint64_t	total;			// sum of values
+
+	LatencyHistogram() { clear(); }
+
+	void clear();
+	void add(uint64_t v) { counts[bucketOf(v)]++; total += v; }
+	void merge(const LatencyHistogram& h);
+
+	uint64_t count() const;
+	uint64_t mean() const;
+	uint64_t max() const;
+
+	// least value at or above fraction p of all values, as the
+	// highest value of its bucket
+	uint64_t percentile(double p) const;
+
+	static unsigned int bucketOf(uint64_t v) {
+		if (v < (1ULL << sub_bits))
+			return v;
+
+		unsigned int msb = 63 - __builtin_clzll(v);
+		if (msb > max_bits)
+			return n_buckets - 1;
+
+		unsigned int shift = msb - sub_bits;
+		return ((shift + 1) << sub_bits) +
+		       ((v >> shift) & ((1U << sub_bits) - 1));
+	}
+	static uint64_t bucketLow(unsigned int b);
+	static uint64_t bucketHigh(unsigned int b);
+};
+
+// Point-in-time copy of one DB's statistics, see DB::getStats
+class DBStats {
+public:
+	uint64_t	pages[IO__COUNT][PK__COUNT];
+	uint64_t	counters[ST__COUNT];
+	MemStats	mem[MEM__COUNT];	// caches, by consumer
+	uint64_t	shm_hits;		// f_shared: this process
+	uint64_t	shm_misses;
+	LatencyHistogram latency[OP__COUNT];
+
+	DBStats();
+
+	uint64_t pagesTotal(unsigned int io) const;
+	void merge(const DBStats& st);
+
+	std::string toText() const;
+	std::string toJSON() const;
+};
+
+// Counters of one DB, updated by many threads at once.  Each thread
+// adds into one of n_shards cache-line aligned shards, picked when
+// the thread first counts: a thread's adds are uncontended unless
+// more than n_shards threads count at once, and never lost.  Readers
+// sum the shards.
+class Stats {
+public:
+	static const unsigned int n_shards = 16;
+
+private:
+	struct Shard {
+		uint64_t	pages[IO__COUNT][PK__COUNT];
+		uint64_t	counters[ST__COUNT];
+		uint64_t	lat_total[OP__COUNT];
+		uint64_t	lat[OP__COUNT][LatencyHistogram::n_buckets];
+	} __attribute__((aligned(64)));
+
+	Shard		*shards;
+	bool		enabled;
+
+	Stats(const Stats&);
+	Stats& operator=(const Stats&);
+
+	static unsigned int shardId();
+	static void add(uint64_t& n, uint64_t v) {
+		__atomic_fetch_add(&n, v, __ATOMIC_RELAXED);
+	}
+
+public:
+	Stats();
+	~Stats();
+
+	bool isEnabled() const { return enabled; }
+	void setEnabled(bool enabled_) { enabled = enabled_; }
+
+	void count(unsigned int ctr, uint64_t n = 1) {
+		if (enabled)
+			add(shards[shardId()].counters[ctr], n);
+	}
+	void pages(unsigned int io, unsigned int kind, uint64_t n) {
+		if (enabled)
+			add(shards[shardId()].pages[io][kind], n);
+	}
+	void latency(unsigned int op, uint64_t ns) {
+		if (!enabled)
+			return;
+		Shard& s = shards[shardId()];
+		add(s.lat[op][LatencyHistogram::bucketOf(ns)], 1);
+		add(s.lat_total[op], ns);
+	}
+
+	void snapshot(DBStats& out) const;
+	void reset();
+
+	static uint64_t now() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+	}
+};
+
+// Times one operation, from construction to destruction
+class StatTimer {
+private:
+	Stats&		st;
+	unsigned int	op;
+	uint64_t	start;
+
+	StatTimer(const StatTimer&);
+	StatTimer& operator=(const StatTimer&);
+
+public:
+	StatTimer(Stats& st_, unsigned int op_)
+		: st(st_), op(op_), start(st_.isEnabled() ? Stats::now() : 0) {}
+	~StatTimer() {
+		if (st.isEnabled() && start)
+			st.latency(op, Stats::now() - start);
+	}
+};
+
+// Within this scope, the calling thread's page I/O is counted as
+// kind.  Scopes nest.
+class PageKindScope {
+private:
+	unsigned int	prev;
+
+	PageKindScope(const PageKindScope&);
+	PageKindScope& operator=(const PageKindScope&);
+
+	static unsigned int& current();
+
+public:
+	explicit PageKindScope(unsigned int kind) : prev(current()) {
+		current() = kind;
+	}
+	~PageKindScope() { current() = prev; }
+
+	static unsigned int kind() { return current(); }
+};
+
+} // namespace page
+
+#endif // __PGDB2_STATS_H__
@@ -8,6 +8,7 @@
 #include "pgdb2-config.h"
 
 #include <stdint.h>
+#include <string.h>
 #include <string>
 #include "endian_compat.h"
 
@@ -26,50 +27,122 @@ enum inode_constants {
 #define INOTABENT_MAGIC "PGIE0000"
 #define DIR_MAGIC "PGDR0000"
 #define DIRENT_MAGIC "PGDE0000"
+#define VHEAP_MAGIC "PGVH0000"
+#define SHM_MAGIC "PGSH0000"
+#define CHANGES_MAGIC "PGCM0000"
+#define TRACE_MAGIC "PGTR0000"
 
 enum sb_features {
 	SBF_MBO		= (1ULL << 63),		// must be one
 	SBF_MBZ		= (1ULL << 62),		// must be zero
+	SBF_KEY_U32	= (1ULL << 0),		// fixed-width u32 keys
+	SBF_KEY_U64	= (1ULL << 1),		// fixed-width u64 keys
+	SBF_CSUM	= (1ULL << 2),		// page trailer checksums
+};
+
+enum key_types {
+	KT_BYTES	= 0,			// variable length byte strings
+	KT_U32		= 1,			// fixed-width uint32_t
+	KT_U64		= 2,			// fixed-width uint64_t
 };
 
 enum various_constants {
+	SB_VERSION	= 2,			// current db format version
 	INT_KEY_MAX	= 511,			// max key size before spill
+	DIR_MAX_DEPTH	= 32,			// max directory tree depth
+
+	PAGE_SIZE_MIN	= 1024,			// superblock + page trailer
+	PAGE_SIZE_MAX	= 65536,
 };
 
+static inline bool validPageSize(uint64_t sz) {
+	return (sz >= PAGE_SIZE_MIN) && (sz <= PAGE_SIZE_MAX) &&
+	       ((sz & (sz - 1)) == 0);
+}
+
 struct Superblock {
 	unsigned char	magic[8];		// file format unique id
 	uint32_t	version;		// db version
 	uint32_t	page_size;		// page size, in bytes
 	uint64_t	features;		// feature bitmask
 	uint64_t	inode_table_ref;	// page w/ list of ino tab pages
-	uint64_t	reserved[64 - 4];
+	uint64_t	inode_table_len;	// ino tab page list, in pages
+	uint64_t	alloc_end;		// first never-allocated page
+	uint64_t	vh_page;		// value heap page being filled
+	uint64_t	ino_free;		// lowest maybe-unused inode
+	uint64_t	ino_unused;		// count of unused inodes
+	uint64_t	ino_count;		// inode table length
+	uint64_t	db_id;			// random, set at creation
+	uint64_t	change_gen;		// generation of last backup
+	uint64_t	reserved[64 - 13];
 
 	void swap_n2h() {
 		version = le32toh(version);
 		page_size = le32toh(page_size);
 		features = le64toh(features);
 		inode_table_ref = le64toh(inode_table_ref);
+		inode_table_len = le64toh(inode_table_len);
+		alloc_end = le64toh(alloc_end);
+		vh_page = le64toh(vh_page);
+		ino_free = le64toh(ino_free);
+		ino_unused = le64toh(ino_unused);
+		ino_count = le64toh(ino_count);
+		db_id = le64toh(db_id);
+		change_gen = le64toh(change_gen);
 	}
 	void swap_h2n() {
 		version = htole32(version);
 		page_size = htole32(page_size);
 		features = htole64(features);
 		inode_table_ref = htole64(inode_table_ref);
+		inode_table_len = htole64(inode_table_len);
+		alloc_end = htole64(alloc_end);
+		vh_page = htole64(vh_page);
+		ino_free = htole64(ino_free);
+		ino_unused = htole64(ino_unused);
+		ino_count = htole64(ino_count);
+		db_id = htole64(db_id);
+		change_gen = htole64(change_gen);
+	}
+	enum key_types keyType() const {
+		if (features & SBF_KEY_U32)
+			return KT_U32;
+		if (features & SBF_KEY_U64)
+			return KT_U64;
+		return KT_BYTES;
 	}
 	bool valid() const {
-		if ((version < 1) ||
-		    (page_size < 512) || (page_size > 65536) ||
+		if ((version != SB_VERSION) ||
+		    !validPageSize(page_size) ||
 		    ((!(features & SBF_MBO)) || (features & SBF_MBZ)) ||
-		    (inode_table_ref < 1))
+		    (inode_table_ref < 1) || (inode_table_len < 1))
+			return false;
+		if ((features & SBF_KEY_U32) && (features & SBF_KEY_U64))
 			return false;
 
-		if (std::string((const char *)magic, sizeof(magic)) != SB_MAGIC)
+		if (memcmp(magic, SB_MAGIC, sizeof(magic)))
 			return false;
 
 		return true;
 	}
 };
 
+// Stored in the last bytes of every page, if SBF_CSUM.  The
+// checksum covers all preceding bytes of the page.
+struct PageTrailer {
+	uint32_t	pt_crc;			// CRC32C of page data
+	uint32_t	pt_page;		// page index, low 32 bits
+
+	void swap_n2h() {
+		pt_crc = le32toh(pt_crc);
+		pt_page = le32toh(pt_page);
+	}
+	void swap_h2n() {
+		pt_crc = htole32(pt_crc);
+		pt_page = htole32(pt_page);
+	}
+};
+
 enum ext_flags {
 	EF_MBO		= (1U << 31),		// must be one
 	EF_MBZ		= (1U << 30),		// must be zero
@@ -108,14 +181,40 @@ struct Extent {
 enum inodetable_flags {
 	ITF_MBO		= (1U << 31),		// must be one
 	ITF_MBZ		= (1U << 30),		// must be zero
-	ITF_HDR		= (1U << 29),		// hdr rec
+	ITF_HDR		= (1U << 29),		// hdr rec, per table page
 	ITF_EXT_INT	= (1U << 28),		// ext list in inode table
 	ITF_UNUSED	= (1U << 27),		// unused slot in inode tbl
+	ITF_CODEC	= 0xff,			// ent: compression codec id
+};
+
+enum codec_ids {
+	CODEC_NONE	= 0,			// uncompressed
+	CODEC_LZ	= 1,			// built-in LZ77
+
+	CODEC_USER	= 128,			// first user-defined codec id
+	CODEC__LAST	= 255
+};
+
+// Prefix of compressed inode data; the uncompressed length is
+// stored in the inode table entry it_len field.
+struct CompressedHdr {
+	uint32_t	z_len;			// compressed data len
+	uint32_t	z_codec;		// compression codec id
+
+	void swap_n2h() {
+		z_len = le32toh(z_len);
+		z_codec = le32toh(z_codec);
+	}
+	void swap_h2n() {
+		z_len = htole32(z_len);
+		z_codec = htole32(z_codec);
+	}
 };
 
 struct InodeTableHdr {
 	unsigned char	magic[8];		// record unique id
-	uint32_t	it_len;			// number of entries in table
+	uint32_t	it_len;			// hdr: entries in table page;
+						// ent: uncompressed data len
 	uint32_t	it_flags;		// flags bitmask
 
 	void swap_n2h() {
@@ -133,10 +232,10 @@ struct InodeTableHdr {
 			return false;
 
 		if (it_flags & ITF_HDR) {
-			if (std::string((const char *)magic, sizeof(magic)) != INOTAB_MAGIC)
+			if (memcmp(magic, INOTAB_MAGIC, sizeof(magic)))
 				return false;
 		} else {
-			if (std::string((const char *)magic, sizeof(magic)) != INOTABENT_MAGIC)
+			if (memcmp(magic, INOTABENT_MAGIC, sizeof(magic)))
 				return false;
 		}
 
@@ -149,8 +248,9 @@ enum directory_ent_type {
 	DE_DIR		= 1,			// dirent key range, dir inode
 	DE_KEY		= 2,			// dirent key, value inode
 	DE_KEY_VALUE	= 3,			// in-dirent key + value
+	DE_KEY_PACKED	= 4,			// dirent key, value heap slot
 
-	DE__LAST	= DE_KEY_VALUE
+	DE__LAST	= DE_KEY_PACKED
 };
 
 enum directory_ent_masks {
@@ -160,7 +260,8 @@ enum directory_ent_masks {
 enum directory_flags {
 	DF_MBO		= (1U << 31),		// must be one
 	DF_MBZ		= (1U << 30),		// must be zero
-
+	DF_KEY_U32	= (1U << 0),		// hdr: fixed-width u32 keys
+	DF_KEY_U64	= (1U << 1),		// hdr: fixed-width u64 keys
 };
 
 struct DirectoryHdr {
@@ -176,12 +277,20 @@ struct DirectoryHdr {
 		d_len = htole32(d_len);
 		d_flags = htole32(d_flags);
 	}
+	enum key_types keyType() const {
+		if (d_flags & DF_KEY_U32)
+			return KT_U32;
+		if (d_flags & DF_KEY_U64)
+			return KT_U64;
+		return KT_BYTES;
+	}
 	bool valid() const {
 		if ((!(d_flags & DF_MBO)) ||
-		    (d_flags & DF_MBZ))
+		    (d_flags & DF_MBZ) ||
+		    ((d_flags & DF_KEY_U32) && (d_flags & DF_KEY_U64)))
 			return false;
 
-		if (std::string((const char *)magic, sizeof(magic)) != DIR_MAGIC)
+		if (memcmp(magic, DIR_MAGIC, sizeof(magic)))
 			return false;
 
 		return true;
@@ -216,13 +325,236 @@ struct DirectoryEnt {
 		    (dType() > DE__LAST))
 			return false;
 
-		if (std::string((const char *)magic, sizeof(magic)) != DIRENT_MAGIC)
+		if (memcmp(magic, DIRENT_MAGIC, sizeof(magic)))
+			return false;
+
+		return true;
+	}
+};
+
+// Compact directory entry, used in directories with fixed-width
+// keys (DF_KEY_U32, DF_KEY_U64).  Followed by the key in a
+// little endian, fixed-width slot; DE_DIR entries add a second slot
+// for the range end, DE_KEY_VALUE entries add de_val_len value bytes,
+// DE_KEY_PACKED entries add a le64 value heap page.
+struct DirectoryEntFixed {
+	uint32_t	de_flags;		// flags bitmask
+	uint32_t	de_val_len;		// value len
+	uint32_t	de_ino;			// dir or value inode
+
+	void swap_n2h() {
+		de_flags = le32toh(de_flags);
+		de_val_len = le32toh(de_val_len);
+		de_ino = le32toh(de_ino);
+	}
+	void swap_h2n() {
+		de_flags = htole32(de_flags);
+		de_val_len = htole32(de_val_len);
+		de_ino = htole32(de_ino);
+	}
+	enum directory_ent_type dType() const {
+		return (enum directory_ent_type) (de_flags & DE_ENT_TYPE);
+	}
+	bool valid() const {
+		if ((!(de_flags & DF_MBO)) ||
+		    (de_flags & DF_MBZ) ||
+		    (dType() > DE__LAST))
+			return false;
+
+		return true;
+	}
+};
+
+enum value_heap_flags {
+	VHF_MBO		= (1U << 31),		// must be one
+	VHF_MBZ		= (1U << 30),		// must be zero
+};
+
+// Value heap page: shared by several medium-sized values, each
+// addressed by (page, slot).  The slot array grows up from the header,
+// value data grows down from the end of the page data area.
+struct ValueHeapHdr {
+	unsigned char	magic[8];		// record unique id
+	uint32_t	vh_slots;		// number of slots
+	uint32_t	vh_flags;		// flags bitmask
+
+	void swap_n2h() {
+		vh_slots = le32toh(vh_slots);
+		vh_flags = le32toh(vh_flags);
+	}
+	void swap_h2n() {
+		vh_slots = htole32(vh_slots);
+		vh_flags = htole32(vh_flags);
+	}
+	bool valid() const {
+		if ((!(vh_flags & VHF_MBO)) ||
+		    (vh_flags & VHF_MBZ))
+			return false;
+
+		if (memcmp(magic, VHEAP_MAGIC, sizeof(magic)))
 			return false;
 
 		return true;
 	}
 };
 
+struct ValueHeapSlot {
+	uint32_t	vs_off;			// value offset, or 0 if free
+	uint32_t	vs_len;			// value len
+
+	void swap_n2h() {
+		vs_off = le32toh(vs_off);
+		vs_len = le32toh(vs_len);
+	}
+	void swap_h2n() {
+		vs_off = htole32(vs_off);
+		vs_len = htole32(vs_len);
+	}
+};
+
+// Shared region, mapped by all processes using a DB in multi-process
+// mode: a header, then a direct-mapped page cache of n_slots slots.
+// Host byte order; never leaves the host.
+struct ShmHdr {
+	unsigned char	magic[8];		// region unique id
+	uint32_t	version;		// region format version
+	uint32_t	page_size;		// DB page size
+	uint64_t	n_slots;		// page cache slots
+	uint64_t	generation;		// DB commit count
+	uint64_t	db_dev;			// DB file identity
+	uint64_t	db_ino;
+	uint64_t	reserved[8 - 6];
+
+	bool valid() const {
+		return (memcmp(magic, SHM_MAGIC, sizeof(magic)) == 0) &&
+		       (version == 1);
+	}
+};
+
+// Shared page cache slot, followed by page data.  seq is even when
+// the slot is stable, odd while it is being filled.
+struct ShmSlot {
+	uint64_t	seq;
+	uint64_t	page;			// page index + 1, or 0 if empty
+};
+
+// Change map sidecar file, <db>-changes: a header, then n_runs le64
+// generations.  Written when a writable DB closes; removed while one
+// is open, so that a crash leaves none.
+struct ChangeMapHdr {
+	unsigned char	magic[8];		// file unique id
+	uint32_t	version;		// file format version
+	uint32_t	run_pages;		// pages per run
+	uint64_t	db_id;			// DB identity, see Superblock
+	uint64_t	change_gen;		// DB change_gen when written
+	uint64_t	base;			// oldest backup tracked from
+	uint64_t	n_runs;			// generations following
+
+	void swap_n2h() {
+		version = le32toh(version);
+		run_pages = le32toh(run_pages);
+		db_id = le64toh(db_id);
+		change_gen = le64toh(change_gen);
+		base = le64toh(base);
+		n_runs = le64toh(n_runs);
+	}
+	void swap_h2n() {
+		version = htole32(version);
+		run_pages = htole32(run_pages);
+		db_id = htole64(db_id);
+		change_gen = htole64(change_gen);
+		base = htole64(base);
+		n_runs = htole64(n_runs);
+	}
+	bool valid() const {
+		return (memcmp(magic, CHANGES_MAGIC, sizeof(magic)) == 0) &&
+		       (version == 1);
+	}
+};
+
+enum trace_ops {
+	TR_GET		= 0,			// get, tryGet
+	TR_GET_RANGE	= 1,
+	TR_OPEN		= 2,			// openValue
+	TR_PUT		= 3,
+	TR_SYNC		= 4,
+	TR_SCAN		= 5,			// parallelScan
+
+	TR__COUNT
+};
+
+enum trace_flags {
+	TRF_FOUND	= (1U << 0),		// key present
+	TRF_FAILED	= (1U << 1),		// op threw
+};
+
+// Workload trace file, see DB::startTrace: a header, then records.
+// Each thread's records are in time order; threads' records are
+// interleaved in batches.
+struct TraceHdr {
+	unsigned char	magic[8];		// file unique id
+	uint32_t	version;		// file format version
+	uint32_t	key_type;		// DB key type
+	uint64_t	start_time;		// ns since the epoch
+	uint64_t	reserved;
+
+	void swap_n2h() {
+		version = le32toh(version);
+		key_type = le32toh(key_type);
+		start_time = le64toh(start_time);
+	}
+	void swap_h2n() {
+		version = htole32(version);
+		key_type = htole32(key_type);
+		start_time = htole64(start_time);
+	}
+	bool valid() const {
+		return (memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0) &&
+		       (version == 1);
+	}
+};
+
+// One traced operation
+struct TraceRecord {
+	uint64_t	t_ns;			// op start, since start_time
+	uint64_t	key;			// byte keys: hash; else the key
+	uint64_t	arg;			// get_range: offset; scan: threads
+	uint32_t	value_len;		// bytes read or written
+	uint32_t	lat_ns;			// op latency, clamped
+	uint16_t	thread;			// recording thread
+	uint16_t	key_len;
+	uint8_t		op;			// enum trace_ops
+	uint8_t		flags;			// TRF_*
+	uint16_t	reserved;
+
+	void swap_n2h() {
+		t_ns = le64toh(t_ns);
+		key = le64toh(key);
+		arg = le64toh(arg);
+		value_len = le32toh(value_len);
+		lat_ns = le32toh(lat_ns);
+		thread = le16toh(thread);
+		key_len = le16toh(key_len);
+	}
+	void swap_h2n() {
+		t_ns = htole64(t_ns);
+		key = htole64(key);
+		arg = htole64(arg);
+		value_len = htole32(value_len);
+		lat_ns = htole32(lat_ns);
+		thread = htole16(thread);
+		key_len = htole16(key_len);
+	}
+};
+
+static inline size_t keyTypeWidth(enum key_types kt) {
+	switch (kt) {
+	case KT_U32:	return sizeof(uint32_t);
+	case KT_U64:	return sizeof(uint64_t);
+	default:	return 0;
+	}
+}
+
 } // namespace page
 
 #endif // __PGDB2_STRUCT_H__
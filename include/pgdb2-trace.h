@@ -0,0 +1,160 @@
+#ifndef __PGDB2_TRACE_H__
+#define __PGDB2_TRACE_H__
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "pgdb2-struct.h"
+#include "pgdb2-lock.h"
+#include "pgdb2-stats.h"
+
+namespace page {
+
+extern const char *traceOpName(unsigned int op);
+
+// Appends traced operations to a trace file.  Each thread records
+// into one of n_shards buffers, as for Stats, each written out with
+// one append when full.  A failed write stops recording; close()
+// reports it.
+class TraceRecorder {
+public:
+	static const unsigned int n_shards = 16;
+	static const unsigned int shard_records = 1024;
+
+private:
+	struct Shard {
+		Mutex		mtx;
+		unsigned int	n;
+		TraceRecord	recs[shard_records];
+	} __attribute__((aligned(64)));
+
+	int		fd;
+	std::string	path;
+	Mutex		write_mtx;		// one batch at a time
+	Shard		*shards;
+	uint64_t	start_ns;		// Stats::now() at open
+	size_t		key_width;		// fixed-width keys, or 0
+	bool		failed;
+	uint64_t	dropped;		// records lost to failure
+
+	TraceRecorder(const TraceRecorder&);
+	TraceRecorder& operator=(const TraceRecorder&);
+
+	void flush(Shard& s);
+
+public:
+	TraceRecorder();
+	~TraceRecorder();
+
+	void open(const std::string& path_, enum key_types kt);
+	void close();
+
+	// r.t_ns is a Stats::now() time, made relative here
+	void record(TraceRecord& r);
+
+	size_t keyWidth() const { return key_width; }
+
+	static uint64_t keyHash(const std::string& key);
+	static unsigned int threadId();
+};
+
+// Traces one operation, from construction to destruction, if rec is
+// not NULL.  done() records the outcome; an op ending without it
+// threw, and is marked TRF_FAILED.
+class TraceScope {
+private:
+	TraceRecorder	*rec;
+	TraceRecord	r;
+	bool		completed;
+
+	TraceScope(const TraceScope&);
+	TraceScope& operator=(const TraceScope&);
+
+	void init(unsigned int op, uint64_t key, size_t key_len) {
+		memset(&r, 0, sizeof(r));
+		r.op = op;
+		r.key = key;
+		r.key_len = key_len;
+		r.t_ns = Stats::now();
+	}
+
+public:
+	TraceScope(TraceRecorder *rec_, unsigned int op)
+		: rec(rec_), completed(false) {
+		if (rec)
+			init(op, 0, 0);
+	}
+	TraceScope(TraceRecorder *rec_, unsigned int op,
+		   const std::string& key)
+		: rec(rec_), completed(false) {
+		if (rec)
+			init(op, TraceRecorder::keyHash(key), key.size());
+	}
+	TraceScope(TraceRecorder *rec_, unsigned int op, uint64_t key)
+		: rec(rec_), completed(false) {
+		if (rec)
+			init(op, key, rec->keyWidth());
+	}
+	~TraceScope() {
+		if (!rec)
+			return;
+		if (!completed)
+			r.flags |= TRF_FAILED;
+		uint64_t lat = Stats::now() - r.t_ns;
+		r.lat_ns = (lat > UINT32_MAX) ? UINT32_MAX : lat;
+		rec->record(r);
+	}
+
+	void setArg(uint64_t arg) {
+		if (rec)
+			r.arg = arg;
+	}
+	void done(uint64_t value_len = 0, bool found = true) {
+		if (!rec)
+			return;
+		r.value_len = (value_len > UINT32_MAX) ? UINT32_MAX : value_len;
+		if (found)
+			r.flags |= TRF_FOUND;
+		completed = true;
+	}
+
+	// not an operation after all: record nothing
+	void cancel() { rec = NULL; }
+};
+
+// Reads a trace file written by TraceRecorder
+class TraceReader {
+private:
+	int		fd;
+	TraceHdr	hdr;
+	std::vector<TraceRecord> buf;		// read ahead
+	size_t		pos;
+
+	TraceReader(const TraceReader&);
+	TraceReader& operator=(const TraceReader&);
+
+public:
+	TraceReader() : fd(-1), pos(0) {}
+	~TraceReader() { close(); }
+
+	void open(const std::string& path);
+	void close();
+
+	enum key_types keyType() const {
+		return (enum key_types) hdr.key_type;
+	}
+	uint64_t startTime() const { return hdr.start_time; }
+
+	// false at end of trace
+	bool next(TraceRecord& r);
+};
+
+} // namespace page
+
+#endif // __PGDB2_TRACE_H__
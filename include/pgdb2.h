@@ -12,10 +12,16 @@
 #include <string>
 #include <stdexcept>
 #include <vector>
+#include <list>
+#include <map>
 #include <stdint.h>
 #include <fcntl.h>
 #include "pgdb2-file.h"
 #include "pgdb2-struct.h"
+#include "pgdb2-codec.h"
+#include "pgdb2-cache.h"
+#include "pgdb2-arena.h"
+#include "pgdb2-stats.h"
 
 namespace page {
 
@@ -27,11 +33,19 @@ public:
 	std::string		value;
 	uint32_t		ino_idx;
 
+	uint64_t		ikey;		// fixed-width key
+	uint64_t		ikey_end;	// fixed-width key range end
+
+	uint64_t		vh_page;	// value heap page
+	uint32_t		vh_slot;	// value heap slot
+
 	uint32_t		key_len;
 	uint32_t		key_end_len;
 	uint32_t		value_len;
 
-	DirEntry() : d_type(DE_NONE), ino_idx(0) {}
+	DirEntry() : d_type(DE_NONE), ino_idx(0), ikey(0), ikey_end(0),
+		     vh_page(0), vh_slot(0),
+		     key_len(0), key_end_len(0), value_len(0) {}
 
 	void clear() {
 		d_type = DE_NONE;
@@ -39,65 +53,314 @@ public:
 		key_end.clear();
 		value.clear();
 		ino_idx = 0;
+		ikey = 0;
+		ikey_end = 0;
+		vh_page = 0;
+		vh_slot = 0;
 		key_len = 0;
 		key_end_len = 0;
 		value_len = 0;
 	}
 };
 
+// Key comparison policies for directory search.  Each policy
+// three-way compares a search key against the key, or key range end,
+// of a decoded directory entry.
+struct BytewiseCompare {
+	typedef std::string key_type;
+	static const enum key_types type = KT_BYTES;
+
+	static int key(const std::string& k, const DirEntry& ent) {
+		return k.compare(ent.key);
+	}
+	static int keyEnd(const std::string& k, const DirEntry& ent) {
+		return k.compare(ent.key_end);
+	}
+
+	static void setKey(DirEntry& ent, const std::string& k) {
+		ent.key = k;
+		ent.key_len = k.size();
+	}
+	static void setKeyEnd(DirEntry& ent, const std::string& k) {
+		ent.key_end = k;
+		ent.key_end_len = k.size();
+	}
+};
+
+template <typename T, enum key_types KT>
+struct FixedCompare {
+	typedef T key_type;
+	static const enum key_types type = KT;
+
+	static int cmp(T a, T b) { return (a > b) - (a < b); }
+
+	static int key(T k, const DirEntry& ent) {
+		return cmp(k, (T) ent.ikey);
+	}
+	static int keyEnd(T k, const DirEntry& ent) {
+		return cmp(k, (T) ent.ikey_end);
+	}
+
+	static void setKey(DirEntry& ent, T k) {
+		ent.ikey = k;
+		ent.key_len = sizeof(T);
+	}
+	static void setKeyEnd(DirEntry& ent, T k) {
+		ent.ikey_end = k;
+		ent.key_end_len = sizeof(T);
+	}
+};
+
+typedef FixedCompare<uint32_t, KT_U32> U32Compare;
+typedef FixedCompare<uint64_t, KT_U64> U64Compare;
+
 class Dir {
 public:
+	enum key_types		key_type;
 	std::vector<DirEntry>	ents;
 
+	Dir() : key_type(KT_BYTES) {}
+	explicit Dir(enum key_types kt) : key_type(kt) {}
+
 	void clear() {
 		ents.clear();
 	}
 	void eraseIdx(size_t idx) { ents.erase(ents.begin() + idx); }
 	void decode(const std::vector<unsigned char>& buf);
+	void decode(const unsigned char *p, size_t len);
 	void encode(std::vector<unsigned char>& buf) const;
 
-	bool match(const std::string& key, unsigned int& idx) const;
+	template <class Cmp>
+	bool match(const typename Cmp::key_type& key, unsigned int& idx) const {
+		for (idx = 0; idx < ents.size(); idx++) {
+			const DirEntry& ent = ents[idx];
+
+			int key_cmp = Cmp::key(key, ent);
+			if (key_cmp < 0)
+				return false;
+			if (key_cmp == 0)
+				return true;
+
+			if ((ent.d_type == DE_DIR) &&
+			    (Cmp::keyEnd(key, ent) <= 0))
+				return true;
+		}
+
+		return false;
+	}
+	bool match(const std::string& key, unsigned int& idx) const {
+		return match<BytewiseCompare>(key, idx);
+	}
+
+private:
+	void decodeFixed(const unsigned char *p, uint32_t bytes, uint32_t n_ents);
+	void encodeFixed(std::vector<unsigned char>& buf) const;
 };
 
+// Cache of decoded directories, keyed by directory inode.  Lookups
+// take no lock, and return references into the cache, valid until
+// the next erase or eviction; both happen only while the DB is
+// locked exclusively.  Eviction is second chance, in insertion order.
+class DirCache : public MemConsumer {
+private:
+	struct Ent {
+		Dir		dir;
+		size_t		bytes;		// charged to budget
+		uint32_t	referenced;	// since last passed over
+		std::list<uint32_t>::iterator lru_it;
+	};
+
+	std::vector<Ent *>	dirs;		// by inode, or NULL
+	std::list<uint32_t>	lru;		// newest first
+	MemBudget		*mem;
+
+	DirCache(const DirCache&);
+	DirCache& operator=(const DirCache&);
+
+	static size_t dirBytes(const Dir& d);
+
+public:
+	DirCache() : mem(NULL) {}
+	~DirCache() { clear(); }
+
+	void init(MemBudget *mem_) { mem = mem_; }
+	void resize(size_t n);
+
+	const Dir *find(uint32_t ino_idx);
+	const Dir& insert(uint32_t ino_idx, Dir& d);	// unless present
+	const Dir& put(uint32_t ino_idx, Dir& d);	// takes d's entries
+	void erase(uint32_t ino_idx);
+	void clear();
+
+	bool evictOne();
+};
+
+// Directory on the path from root to leaf, during a write
+class DirPathEnt {
+public:
+	Dir		dir;
+	uint32_t	ino_idx;		// directory inode
+	unsigned int	parent_idx;		// entry index in parent dir
+	bool		dirty;
+
+	DirPathEnt() : ino_idx(0), parent_idx(0), dirty(false) {}
+};
+
+// View of a value heap page's data area, in a buffer owned by the
+// caller: usually scratch memory from the thread's arena
+class ValueHeapPage {
+public:
+	unsigned char	*buf;			// page data area
+	size_t		len;
+
+	ValueHeapPage() : buf(NULL), len(0) {}
+
+	void init(unsigned char *buf_, size_t data_size);
+	void attach(unsigned char *buf_, size_t data_size);
+	void validate() const;
+
+	uint32_t slots() const;
+	uint32_t liveSlots() const;
+	size_t freeSpace() const;
+
+	bool get(uint32_t slot, std::string& valueOut) const;
+	bool insert(const std::string& value, uint32_t& slot);
+	void erase(uint32_t slot);
+
+	static size_t maxValue(size_t data_size);
+
+private:
+	ValueHeapSlot getSlot(uint32_t slot) const;
+	void setSlot(uint32_t slot, const ValueHeapSlot& vs);
+	void setSlotCount(uint32_t n);
+	uint32_t dataStart() const;
+	void compact();
+};
+
+// Inode metadata.  A single extent, the common case, is stored
+// inline; longer extent lists live in a flat arena shared by all
+// inodes of a table chunk, as (e_off, e_count).
 class Inode {
 public:
 	bool		unused;			// unused slot in inode table
 
 	uint64_t	e_ref;			// extent list page
 	uint32_t	e_alloc;		// extent list alloc'd len
-	std::vector<Extent> ext;		// extent list
 
-	uint32_t size() const {
-		uint32_t total = 0;
-		for (std::vector<Extent>::const_iterator it = ext.begin();
-		     it != ext.end(); it++)
-			total += (*it).ext_len;
+	uint32_t	e_count;		// number of extents
+	uint32_t	e_off;			// e_count > 1: arena index
+	uint32_t	n_pages;		// total extent pages
+	Extent		e_one;			// e_count == 1: the extent
+
+	uint32_t	codec;			// compression codec id
+	uint32_t	raw_len;		// uncompressed data len
+
+	Inode() : unused(false), e_ref(0), e_alloc(0),
+		  e_count(0), e_off(0), n_pages(0),
+		  codec(CODEC_NONE), raw_len(0) {
+		e_one.ext_page = 0;
+		e_one.ext_len = 0;
+		e_one.ext_flags = EF_MBO;
+	}
+
+	uint32_t size() const { return n_pages; }
 
-		return total;
+	// valid until the arena next grows
+	const Extent *extents(const std::vector<Extent>& arena) const {
+		return (e_count > 1) ? &arena[e_off] : &e_one;
 	}
 
-	void read(File& f, std::vector<unsigned char>& pagebuf) const;
-	void write(File& f, const std::vector<unsigned char>& pagebuf) const;
+	void setExtent(const Extent& e) {
+		e_one = e;
+		e_count = 1;
+		e_off = 0;
+		n_pages = e.ext_len;
+	}
+	void setExtents(std::vector<Extent>& arena,
+			const std::vector<Extent>& ext_list);
+
+	void read(File& f, std::vector<unsigned char>& pagebuf,
+		  const Extent *ext) const;
+	void read(File& f, unsigned char *p, const Extent *ext) const;
+	void write(File& f, const std::vector<unsigned char>& pagebuf,
+		   const Extent *ext) const;
+
+	void decode(const unsigned char *p);	// one inode table entry
+	void encode(unsigned char *p) const;
 };
 
-class InodeTable {
+// External extent list: a header extent, then the list.  encode
+// requires buf sized for the list.
+void decodeExtList(const unsigned char *buf, size_t len,
+		   std::vector<Extent>& ext_list);
+void encodeExtList(const std::vector<Extent>& ext_list,
+		   std::vector<unsigned char>& buf);
+
+// Decoded, resident range of inode table entries
+class InodeChunk {
 public:
-	std::vector<Inode> inodes;
+	std::vector<Inode>	inodes;		// entries, from first idx
+	std::vector<Extent>	arena;		// multi-extent lists; replaced
+						// lists freed on eviction
+	bool			dirty;		// needs write-back
+	bool			referenced;	// since eviction passed over
+	size_t			bytes;		// charged to memory budget
+	std::list<uint32_t>::iterator lru_it;	// position in LRU list
+
+	InodeChunk() : dirty(false), referenced(false), bytes(0) {}
+};
 
-	size_t size() const { return inodes.size(); }
+// Inode table, loaded lazily.  The table is stored as fixed-size
+// pages of chunk_ents entries each; table page N holds inodes
+// [N * chunk_ents, (N + 1) * chunk_ents).  Pages are decoded into
+// chunks on first access, and written back individually when
+// modified.  Resident chunks are charged to the DB memory budget;
+// under pressure, clean chunks are evicted, second chance, while the
+// DB is locked exclusively.  Lookups take no lock.  Chunk 0, holding
+// the special inodes, always stays resident.
+class InodeTable : public MemConsumer {
+private:
+	size_t			n_inodes;	// table length, incl. unloaded
+	std::vector<InodeChunk *> chunks;	// by chunk number, or NULL
+	std::list<uint32_t>	lru;		// resident chunks, newest first
+	MemBudget		*mem;
 
-	const Inode& getIdx(uint32_t idx) {
-		if (idx >= inodes.size())
-			throw std::runtime_error("InodeTable idx out of range");
-		return inodes[idx];
-	}
+	InodeTable(const InodeTable&);
+	InodeTable& operator=(const InodeTable&);
+
+public:
+	Inode		table_ino;		// DBINO_TABLE: table pages
+	std::vector<Extent> table_arena;	// table_ino extents
+	bool		ext_dirty;		// table_ino ext list modified
+	uint32_t	chunk_ents;		// inodes per chunk, per page
+
+	static const size_t ent_size = sizeof(InodeTableHdr) + sizeof(Extent);
+
+	InodeTable() : n_inodes(0), mem(NULL), ext_dirty(false),
+		       chunk_ents(1) {}
+	~InodeTable() { clear(); }
+
+	void init(MemBudget *mem_) { mem = mem_; }
+	void setGeometry(size_t data_size);
+
+	size_t size() const { return n_inodes; }
+	void setSize(size_t n);
+	size_t pageCount() const { return chunks.size(); }
+
+	uint32_t chunkOf(uint32_t idx) const { return idx / chunk_ents; }
+	size_t chunkLen(uint32_t chunk) const;
+	InodeChunk *getChunk(uint32_t chunk);
+	InodeChunk *peekChunk(uint32_t chunk) const { return chunks[chunk]; }
+	InodeChunk *addChunk(uint32_t chunk, InodeChunk *ch);
+	void charge(InodeChunk *ch, size_t bytes);
+	const std::list<uint32_t>& resident() const { return lru; }
+	void clear();
 
-	void clear() { inodes.clear(); }
-	void reserve(size_t n) { inodes.reserve(n); }
-	void push_back(const Inode& ino) { inodes.push_back(ino); }
+	bool evictOne();
 
-	void decode(std::vector<unsigned char>& buf);
-	void encode(std::vector<unsigned char>& inotab_buf) const;
+	void decodePage(uint32_t chunk, const unsigned char *p, size_t len,
+			std::vector<Inode>& inodes) const;
+	void encodePage(uint32_t chunk, std::vector<unsigned char>& buf) const;
 };
 
 class Options {
@@ -105,33 +368,341 @@ public:
 	bool		f_read;
 	bool		f_write;
 	bool		f_create;
+	bool		f_checksum;	// create: page checksums; open: from sb
+
+	enum key_types	key_type;	// create: key type; open: from sb
+	uint32_t	page_size;	// create: page size; open: from sb
+	uint32_t	codec;		// codec for new inode data, or none
+
+	// value storage: in directory entry, up to inline_max bytes;
+	// packed in shared value heap pages, up to packed_max bytes;
+	// otherwise, in a dedicated inode
+	uint32_t	inline_max;
+	uint32_t	packed_max;
+
+	uint32_t	dir_max_pages;	// split directories larger than this
+
+	uint64_t	mem_budget;	// bytes, shared by all caches; a
+					// soft cap, see MemBudget
+	uint64_t	readahead_max;	// bytes prefetched ahead of
+					// sequential reads; 0: disabled
+	uint64_t	scan_buffer_max; // ordered scans: bytes read ahead
+					// of the visitor
+
+	bool		f_shared;	// multi-process: one writer, many
+					// reader processes; see DB
+	uint64_t	shm_cache;	// f_shared: bytes of shared page cache
+
+	bool		f_stats;	// count I/O and time operations,
+					// see DB::getStats
+	bool		f_track_changes; // f_write: record pages written
+					// in <db>-changes, for incremental
+					// backups; see DB::backup
+
+	Options() : f_read(true), f_write(false), f_create(false),
+		    f_checksum(false), key_type(KT_BYTES), page_size(4096),
+		    codec(CODEC_NONE),
+		    inline_max(128), packed_max(2048), dir_max_pages(1),
+		    mem_budget(32 * 1024 * 1024),
+		    readahead_max(1024 * 1024),
+		    scan_buffer_max(4 * 1024 * 1024),
+		    f_shared(false), shm_cache(16 * 1024 * 1024),
+		    f_stats(true), f_track_changes(false) {}
+};
+
+class DB;
+class InspectReport;
+class TraceRecorder;
+
+// Key range of a scan, inclusive.  Byte keys use first and last;
+// fixed-width keys, ifirst and ilast.  By default, every key.
+class ScanRange {
+public:
+	std::string	first;
+	std::string	last;
+	bool		has_last;	// byte keys: else no upper bound
+	uint64_t	ifirst;
+	uint64_t	ilast;
+
+	ScanRange() : has_last(false), ifirst(0), ilast(UINT64_MAX) {}
+};
+
+// One key visited by a scan; key for byte keys, else ikey
+class ScanItem {
+public:
+	std::string	key;
+	uint64_t	ikey;
+	std::string	value;
 
-	Options() : f_read(true), f_write(false), f_create(false) {}
+	ScanItem() : ikey(0) {}
 };
 
+// Outcome of one DB::backup
+class BackupStats {
+public:
+	bool		incremental;	// else a full copy
+	bool		cloned;		// full copy shares storage (FICLONE)
+	uint64_t	pages;		// DB size
+	uint64_t	pages_copied;
+
+	BackupStats() : incremental(false), cloned(false), pages(0),
+			pages_copied(0) {}
+};
+
+class ScanVisitor {
+public:
+	virtual ~ScanVisitor() {}
+
+	// Called once per key in range.  Unless the scan is ordered,
+	// called from several threads at once, in no particular order.
+	virtual void visit(const ScanItem& item) = 0;
+};
+
+// Streaming reader over one stored value.  Only the pages covering
+// each requested byte range are read, in bounded-size chunks; values
+// in value heap pages or compressed inodes are read whole, once.
+// Valid until the key is next written.  A reader is used by one
+// thread at a time.
+class ValueReader {
+private:
+	friend class DB;
+
+	DB		*db;
+	DirEntry	ent;
+	uint64_t	pos;		// stream position
+	std::string	cache;		// whole value, if not page-addressable
+	bool		cached;
+	Readahead	ra;		// sequential reads, in bytes
+
+	void open(DB *db_, const DirEntry& ent_);
+
+public:
+	ValueReader() : db(NULL), pos(0), cached(false) {}
+
+	bool isOpen() const { return (db != NULL); }
+	uint64_t size() const { return ent.value_len; }
+	uint64_t tell() const { return pos; }
+	void seek(uint64_t pos_) { pos = pos_; }
+
+	size_t read(void *buf, size_t len);
+	size_t pread(void *buf, size_t len, uint64_t offset);
+};
+
+// Database handle.
+//
+// Concurrency: one DB may be shared by any number of threads.  Reads
+// (get, getRange, openValue, ValueReader reads) hold the DB lock
+// shared and run in parallel; writes (put, sync) hold it exclusively.
+// Readers look up the page, directory and inode caches without
+// locking, and fill them under the memory budget's mutex.  Readers
+// evict only pages, retiring them until no reader can hold them:
+// decoded directories and inodes are referenced for a whole
+// operation.  A reader that finds the budget exceeded takes the DB
+// lock exclusively, briefly, to evict and free retired pages.
+// Scratch memory is per thread (ScratchArena); file reads use
+// positioned I/O.
+//
+// Multi-process (Options::f_shared): one writer process and any
+// number of reader processes open the same file.  They coordinate
+// with fcntl(2) locks on the DB file: the writer holds the writer
+// lock for as long as the DB is open, and the commit lock exclusively
+// for each put or sync; reader processes hold the commit lock shared
+// for each read.  A region mapped from the sidecar file <db>-shm
+// carries the commit generation and a cache of verified pages filled
+// by every process.  A reader seeing a newer generation drops its
+// decoded metadata and rebuilds it, mostly from shared pages.  All
+// processes using the file must open it f_shared, each only once:
+// closing any descriptor of the file drops the process's locks.
 class DB {
 private:
+	friend class ValueReader;
+	friend class ScanJob;
+	friend class InspectJob;
+
+	// Read side of the DB lock, for one read operation.  Unless
+	// wait, gives up rather than wait for the lock; see locked().
+	class ReadScope {
+	private:
+		DB&		db;
+		bool		held;
+		ArenaScope	scope;
+
+		ReadScope(const ReadScope&);
+		ReadScope& operator=(const ReadScope&);
+
+	public:
+		explicit ReadScope(DB& db_, bool wait = true)
+			: db(db_), held(db_.beginRead(wait)) {}
+		~ReadScope() {
+			if (held)
+				db.endRead();
+		}
+
+		bool locked() const { return held; }
+	};
+
+	// Write side, for one put or sync
+	class CommitScope {
+	private:
+		DB&		db;
+		WriteGuard	guard;
+
+		CommitScope(const CommitScope&);
+		CommitScope& operator=(const CommitScope&);
+
+	public:
+		explicit CommitScope(DB& db_) : db(db_), guard(db_.rwlock) {
+			db.beginCommit();
+		}
+		~CommitScope() { db.endCommit(); }
+	};
+
+	RWLock		rwlock;
+
 	bool		running;
 
 	std::string	filename;
 	Options		options;
 
+	MemBudget	mem;
+	PageCache	pagecache;
+	DirCache	dircache;
+	Stats		stats;
+	TraceRecorder	*trace;			// tracing: see startTrace
+
+	ChangeMap	changes;		// f_track_changes: pages written
+	SharedRegion	shm;			// f_shared: see above
+	FileLock	writer_lock;
+	FileLock	commit_lock;
+	uint64_t	generation;		// shm generation last seen
+
 	File		f;
 	Superblock	sb;
 	InodeTable	inotab;
+	std::vector<Extent> freelist;		// free extents, sorted
+
+	bool		sb_dirty;
+	bool		inotab_dirty;
+	bool		freelist_dirty;
 
 public:
 	DB(std::string filename_, const Options& opt_);
 	~DB();
 
+	enum key_types keyType() const { return sb.keyType(); }
+	const MemBudget& memory() const { return mem; }
+	const File& file() const { return f; }
+	const SharedRegion& shared() const { return shm; }
+
 	bool get(const std::string& key, std::string& valueOut);
+	bool get(uint64_t key, std::string& valueOut);
+
+	// Non-blocking get: returns false, having done nothing, if the
+	// lookup would wait for a lock or read from storage; otherwise
+	// sets found and valueOut as get() would
+	bool tryGet(const std::string& key, bool& found, std::string& valueOut);
+	bool tryGet(uint64_t key, bool& found, std::string& valueOut);
+
+	bool getRange(const std::string& key, uint64_t offset, size_t len,
+		      std::string& valueOut);
+	bool getRange(uint64_t key, uint64_t offset, size_t len,
+		      std::string& valueOut);
+	bool openValue(const std::string& key, ValueReader& reader);
+	bool openValue(uint64_t key, ValueReader& reader);
+
+	void put(const std::string& key, const std::string& value);
+	void put(uint64_t key, const std::string& value);
+
+	void sync();
+
+	// Visit every key in range, and its value, using n_threads
+	// threads.  If ordered, visits happen on the calling thread,
+	// in key order; workers read up to Options::scan_buffer_max
+	// bytes ahead, plus the directory being visited.  The scan sees
+	// the DB as of its start: puts wait until it ends.  The visitor
+	// must not call into the DB.
+	void parallelScan(const ScanRange& range, ScanVisitor& visitor,
+			  unsigned int n_threads, bool ordered = false);
+
+	// Copy a consistent version of the DB to path.  If path holds
+	// an earlier backup of this DB, copies only pages written since,
+	// when known; otherwise, all.  Reads proceed meanwhile; puts
+	// wait, though those racing the start may be included.  Pages
+	// written are known only to handles opened with
+	// Options::f_track_changes; the record persists across clean
+	// closes, in <db>-changes, and is dropped by any writable
+	// handle without it.
+	void backup(const std::string& path, BackupStats *stats = NULL);
+
+	// Counters and latency histograms since open or resetStats(),
+	// and cache statistics.  Cheap enough to poll; may be called
+	// during other operations.
+	void getStats(DBStats& out) const;
+	void resetStats() { stats.reset(); }
+
+	// Survey the file's layout: directory tree, inode table and
+	// free list; see pgdb2-inspect.h.  Directories are read by
+	// n_threads threads, bypassing the directory cache.  Keeps the
+	// top_paths leaf directories costliest to read.  Reads proceed
+	// meanwhile; puts wait.
+	void inspect(InspectReport& report, unsigned int n_threads = 1,
+		     size_t top_paths = 10);
+
+	// Record every get, getRange, openValue, put, sync and scan to
+	// a trace file at path, for pgdb2-replay: its start time,
+	// latency and outcome, a hash of the key (fixed-width keys: the
+	// key), and sizes.  Keys and values themselves are not stored.
+	// stopTrace writes out buffered records, and throws if any were
+	// lost.
+	void startTrace(const std::string& path);
+	void stopTrace();
 
 private:
 	void open();
 
+	template <class Cmp>
+	const DirEntry *findKey(const typename Cmp::key_type& key,
+				unsigned int *depth = NULL);
+	const DirEntry *lookup(const std::string& key, unsigned int *depth = NULL);
+	const DirEntry *lookup(uint64_t key, unsigned int *depth = NULL);
+	template <typename K>
+	bool getKey(const K& key, std::string& valueOut);
+	template <typename K>
+	bool tryGetKey(const K& key, bool& found, std::string& valueOut);
+	template <typename K>
+	bool openValueKey(const K& key, ValueReader& reader);
+	template <typename K>
+	bool getRangeKey(const K& key, uint64_t offset, size_t len,
+			 std::string& valueOut);
+	template <class Cmp>
+	void putKey(const typename Cmp::key_type& key, const std::string& value);
+	void splitDir(std::vector<DirPathEnt>& path, size_t level);
+
+	void readValue(const DirEntry& ent, std::string& valueOut);
+	void readInodeRange(uint32_t ino_idx, uint64_t offset, size_t len,
+			    unsigned char *out);
+	void readValueRange(ValueReader& reader, uint64_t offset, size_t len,
+			    unsigned char *out);
+	void readerRange(ValueReader& reader, uint64_t offset, size_t len,
+			 std::string& valueOut);
+	void prefetchInode(uint32_t ino_idx, uint64_t offset, uint64_t len);
+	void writeValue(DirEntry& ent, const std::string& value);
+	void freeValue(const DirEntry& ent);
+
 	void readSuperblock();
 	void readInodeTable();
+	const Inode& getInode(uint32_t ino_idx);
+	Inode& getMutInode(uint32_t ino_idx);
+	const Extent *inodeExt(uint32_t ino_idx);
+	InodeChunk *loadInodeChunk(uint32_t chunk);
+	uint64_t tablePage(uint64_t lpage) const;
+	void growInodeTable();
 	void readInodeData(uint32_t ino_idx, std::vector<unsigned char>& buf);
+	size_t readInodeData(uint32_t ino_idx, ScratchArena& arena,
+			     const unsigned char *& data);
+	void writeInodeData(uint32_t ino_idx, std::vector<unsigned char>& buf);
+	const Dir& getDir(uint32_t ino_idx);
+	void loadDir(uint32_t ino_idx, Dir& d);
 	void readDir(uint32_t ino_idx, Dir& d);
 	void readExtList(std::vector<Extent> &ext_list, uint64_t ref, uint32_t len = 1);
 
@@ -140,6 +711,43 @@ private:
 	void writeDir(uint32_t ino_idx, const Dir& d);
 	void writeExtList(const std::vector<Extent>& ext_list, uint64_t ref, uint32_t max_len = 1);
 
+	void bufToPages(std::vector<unsigned char>& buf);
+	void pagesToBuf(std::vector<unsigned char>& buf);
+	size_t pagesToBuf(unsigned char *buf, size_t n_pages);
+
+	void readHeapPage(uint64_t pgno, ScratchArena& arena,
+			  ValueHeapPage& vhp);
+	void writeHeapPage(uint64_t pgno, const ValueHeapPage& vhp);
+	void heapPut(const std::string& value, uint64_t& pgno, uint32_t& slot);
+	void heapErase(uint64_t pgno, uint32_t slot);
+	size_t packedMax() const;
+
+	Extent allocPages(uint32_t n_pages, bool from_freelist = true);
+	void freeExtent(const Extent& ext);
+	void freePages(uint64_t pgno, uint32_t n_pages);
+	uint32_t allocInode();
+	void freeInode(uint32_t ino_idx);
+	void resizeInode(uint32_t ino_idx, uint32_t n_pages);
+	void readFreeList();
+	void writeFreeList();
+	void flush();
+	void reclaim();
+	bool readerReclaim(bool wait = true);
+
+	bool sharedReader() const {
+		return options.f_shared && !options.f_write;
+	}
+	void openChanges();
+	void closeChanges();
+	void markBackup();
+	void copyTo(int dest_fd, BackupStats& stats);
+	void openShared();
+	void refresh();
+	bool beginRead(bool wait);
+	void endRead();
+	void beginCommit();
+	void endCommit();
+
 	void clear();
 
 };
@@ -0,0 +1,198 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdint.h>
+#include <cassert>
+#include <vector>
+#include <pgdb2.h>
+
+namespace page {
+
+Extent DB::allocPages(uint32_t n_pages, bool from_freelist)
+{
+	assert(n_pages > 0);
+
+	Extent e;
+	e.ext_len = n_pages;
+	e.ext_flags = EF_MBO;
+
+	// first fit, from free list
+	if (from_freelist) {
+		for (std::vector<Extent>::iterator it = freelist.begin();
+		     it != freelist.end(); it++) {
+			Extent& fe = (*it);
+			if (fe.ext_len < n_pages)
+				continue;
+
+			e.ext_page = fe.ext_page;
+			fe.ext_page += n_pages;
+			fe.ext_len -= n_pages;
+			if (fe.ext_len == 0)
+				freelist.erase(it);
+
+			freelist_dirty = true;
+			return e;
+		}
+	}
+
+	// otherwise, from end of file
+	e.ext_page = sb.alloc_end;
+	sb.alloc_end += n_pages;
+	sb_dirty = true;
+
+	return e;
+}
+
+void DB::freeExtent(const Extent& ext)
+{
+	assert(ext.ext_page > 0);
+	assert((ext.ext_page + ext.ext_len) <= sb.alloc_end);
+
+	// insert into sorted free list
+	std::vector<Extent>::iterator it = freelist.begin();
+	while ((it != freelist.end()) && ((*it).ext_page < ext.ext_page))
+		it++;
+
+	it = freelist.insert(it, ext);
+	(*it).ext_flags = EF_MBO;
+
+	// merge with following extent
+	std::vector<Extent>::iterator next = it + 1;
+	if ((next != freelist.end()) &&
+	    (((*it).ext_page + (*it).ext_len) == (*next).ext_page)) {
+		(*it).ext_len += (*next).ext_len;
+		freelist.erase(next);
+	}
+
+	// merge with preceding extent
+	if (it != freelist.begin()) {
+		std::vector<Extent>::iterator prev = it - 1;
+		if (((*prev).ext_page + (*prev).ext_len) == (*it).ext_page) {
+			(*prev).ext_len += (*it).ext_len;
+			it = freelist.erase(it) - 1;
+		}
+	}
+
+	// give back space at end of file
+	if (((*it).ext_page + (*it).ext_len) == sb.alloc_end) {
+		sb.alloc_end = (*it).ext_page;
+		freelist.erase(it);
+		sb_dirty = true;
+	}
+
+	freelist_dirty = true;
+}
+
+void DB::freePages(uint64_t pgno, uint32_t n_pages)
+{
+	Extent e;
+	e.ext_page = pgno;
+	e.ext_len = n_pages;
+	e.ext_flags = EF_MBO;
+
+	freeExtent(e);
+}
+
+uint32_t DB::allocInode()
+{
+	// reuse unused inode table slot, if any are known
+	if (sb.ino_unused > 0) {
+		if (sb.ino_free <= DBINO__LAST)
+			sb.ino_free = DBINO__LAST + 1;
+
+		for (uint64_t idx = sb.ino_free; idx < inotab.size(); idx++) {
+			if (!getInode(idx).unused)
+				continue;
+
+			getMutInode(idx) = Inode();
+			sb.ino_free = idx + 1;
+			sb.ino_unused--;
+			sb_dirty = true;
+			return idx;
+		}
+
+		sb.ino_unused = 0;	// stale count
+	}
+
+	// otherwise, append to inode table; the last table page
+	// must be resident, as it is written back in full
+	uint32_t idx = inotab.size();
+	uint32_t chunk = inotab.chunkOf(idx);
+
+	InodeChunk *ch = NULL;
+	if (idx % inotab.chunk_ents) {
+		ch = inotab.getChunk(chunk);
+		if (!ch)
+			ch = loadInodeChunk(chunk);
+	} else if (chunk >= inotab.table_ino.size())
+		growInodeTable();
+
+	inotab.setSize(idx + 1);
+	dircache.resize(inotab.size());
+	if (!ch) {
+		ch = new InodeChunk;
+		inotab.addChunk(chunk, ch);
+	}
+
+	ch->inodes.push_back(Inode());
+	ch->dirty = true;
+	inotab_dirty = true;
+
+	sb.ino_count = inotab.size();
+	sb.ino_free = inotab.size();
+	sb_dirty = true;
+
+	return idx;
+}
+
+void DB::freeInode(uint32_t ino_idx)
+{
+	assert(ino_idx > DBINO__LAST);
+
+	Inode& ino = getMutInode(ino_idx);
+
+	const Extent *ext = inodeExt(ino_idx);
+	for (uint32_t i = 0; i < ino.e_count; i++)
+		freeExtent(ext[i]);
+	if (ino.e_ref && ino.e_alloc)
+		freePages(ino.e_ref, ino.e_alloc);
+
+	ino = Inode();
+	ino.unused = true;
+	dircache.erase(ino_idx);
+
+	sb.ino_unused++;
+	if (ino_idx < sb.ino_free)
+		sb.ino_free = ino_idx;
+	sb_dirty = true;
+}
+
+void DB::resizeInode(uint32_t ino_idx, uint32_t n_pages)
+{
+	assert(ino_idx != DBINO_TABLE);
+
+	Inode& ino = getMutInode(ino_idx);
+
+	// replace storage with a single new extent; the caller
+	// rewrites the inode's contents in full
+	const Extent *ext = inodeExt(ino_idx);
+	std::vector<Extent> old_ext(ext, ext + ino.e_count);
+	uint64_t old_ref = ino.e_ref;
+	uint32_t old_alloc = ino.e_alloc;
+
+	ino.setExtent(allocPages(n_pages));
+	ino.e_ref = 0;
+	ino.e_alloc = 0;
+
+	for (std::vector<Extent>::const_iterator it = old_ext.begin();
+	     it != old_ext.end(); it++)
+		freeExtent(*it);
+	if (old_ref && old_alloc)
+		freePages(old_ref, old_alloc);
+}
+
+} // namespace page
@@ -0,0 +1,93 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdlib.h>
+#include <new>
+#include <pgdb2-arena.h>
+
+namespace page {
+
+static const size_t ARENA_ALIGN = 16;
+
+ScratchArena::~ScratchArena()
+{
+	for (size_t i = 0; i < blocks.size(); i++)
+		free(blocks[i].data);
+}
+
+ScratchArena& ScratchArena::local()
+{
+	static thread_local ScratchArena arena;
+	return arena;
+}
+
+void *ScratchArena::alloc(size_t bytes)
+{
+	bytes = (bytes + (ARENA_ALIGN - 1)) & ~(ARENA_ALIGN - 1);
+	if (bytes == 0)
+		bytes = ARENA_ALIGN;
+
+	// first block is always standard size, so that oversized
+	// blocks follow it and are released on rewind
+	if (blocks.empty())
+		newBlock(0, block_size);
+
+	// fits in current block
+	if ((cur_off + bytes) <= blocks[cur_block].size) {
+		void *p = blocks[cur_block].data + cur_off;
+		cur_off += bytes;
+		return p;
+	}
+
+	// move on to the next retained block, if large enough;
+	// otherwise insert a new block after the current one,
+	// keeping marks into later blocks meaningful
+	size_t next = cur_block + 1;
+	if ((next >= blocks.size()) || (blocks[next].size < bytes))
+		newBlock(next, (bytes > block_size) ? bytes : block_size);
+
+	cur_block = next;
+	cur_off = bytes;
+	return blocks[cur_block].data;
+}
+
+void ScratchArena::newBlock(size_t pos, size_t size)
+{
+	Block b;
+	b.size = size;
+	b.data = (unsigned char *) malloc(size);
+	if (!b.data)
+		throw std::bad_alloc();
+
+	blocks.insert(blocks.begin() + pos, b);
+	n_heap++;
+}
+
+void ScratchArena::rewind(const Mark& m)
+{
+	cur_block = m.block;
+	cur_off = m.off;
+
+	// return oversized blocks, used by rare large operations
+	for (size_t i = blocks.size(); i-- > (cur_block + 1); ) {
+		if (blocks[i].size > keep_max) {
+			free(blocks[i].data);
+			blocks.erase(blocks.begin() + i);
+		}
+	}
+}
+
+size_t ScratchArena::reserved() const
+{
+	size_t total = 0;
+	for (size_t i = 0; i < blocks.size(); i++)
+		total += blocks[i].size;
+
+	return total;
+}
+
+} // namespace page
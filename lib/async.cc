@@ -0,0 +1,156 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdexcept>
+#include <string>
+#include <pgdb2-async.h>
+
+namespace page {
+
+ThreadPool::ThreadPool(unsigned int n_threads)
+{
+	stopping = false;
+
+	if (n_threads == 0)
+		n_threads = 1;
+
+	for (unsigned int i = 0; i < n_threads; i++) {
+		pthread_t th;
+		if (pthread_create(&th, NULL, worker, this) != 0) {
+			if (threads.empty())
+				throw std::runtime_error("Failed thread create");
+			break;
+		}
+		threads.push_back(th);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		MutexGuard guard(mtx);
+		stopping = true;
+		cv.broadcast();
+	}
+
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+}
+
+void ThreadPool::submit(AsyncTask *task)
+{
+	MutexGuard guard(mtx);
+	queue.push_back(task);
+	cv.signal();
+}
+
+void *ThreadPool::worker(void *arg)
+{
+	((ThreadPool *) arg)->runTasks();
+	return NULL;
+}
+
+void ThreadPool::runTasks()
+{
+	while (true) {
+		AsyncTask *task;
+		{
+			MutexGuard guard(mtx);
+			while (queue.empty() && !stopping)
+				cv.wait(mtx);
+			if (queue.empty())
+				return;
+
+			task = queue.front();
+			queue.pop_front();
+		}
+
+		task->run();
+		delete task;
+	}
+}
+
+template <typename K>
+class GetTask : public AsyncTask {
+private:
+	DB&		db;
+	K		key;
+	AsyncGetDone	*done;
+
+public:
+	GetTask(DB& db_, const K& key_, AsyncGetDone *done_)
+		: db(db_), key(key_), done(done_) {}
+
+	void run() {
+		AsyncGetResult result;
+		try {
+			result.found = db.get(key, result.value);
+		}
+		catch (std::exception& e) {
+			result.error = e.what();
+		}
+
+		done->done(result);
+	}
+};
+
+template <typename K>
+static bool tryGetKey(DB& db, const K& key, AsyncGetResult& result)
+{
+	try {
+		return db.tryGet(key, result.found, result.value);
+	}
+	catch (std::exception& e) {
+		result.error = e.what();
+		return true;
+	}
+}
+
+bool tryGet(DB& db, const std::string& key, AsyncGetResult& result)
+{
+	return tryGetKey(db, key, result);
+}
+
+bool tryGet(DB& db, uint64_t key, AsyncGetResult& result)
+{
+	return tryGetKey(db, key, result);
+}
+
+void submitGet(DB& db, Executor& ex, const std::string& key,
+	       AsyncGetDone *done)
+{
+	ex.submit(new GetTask<std::string>(db, key, done));
+}
+
+void submitGet(DB& db, Executor& ex, uint64_t key, AsyncGetDone *done)
+{
+	ex.submit(new GetTask<uint64_t>(db, key, done));
+}
+
+template <typename K>
+static void asyncGetKey(DB& db, Executor& ex, const K& key,
+			AsyncGetDone *done)
+{
+	AsyncGetResult result;
+	if (tryGetKey(db, key, result))
+		done->done(result);
+	else
+		ex.submit(new GetTask<K>(db, key, done));
+}
+
+void asyncGet(DB& db, Executor& ex, const std::string& key,
+	      AsyncGetDone *done)
+{
+	asyncGetKey(db, ex, key, done);
+}
+
+void asyncGet(DB& db, Executor& ex, uint64_t key, AsyncGetDone *done)
+{
+	asyncGetKey(db, ex, key, done);
+}
+
+} // namespace page
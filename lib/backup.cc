@@ -0,0 +1,344 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <pgdb2.h>
+
+namespace page {
+
+void ChangeMap::mark(uint64_t index, size_t page_count)
+{
+	if (page_count == 0)
+		return;
+
+	uint64_t first = index / run_pages;
+	uint64_t last = (index + page_count - 1) / run_pages;
+	if (last >= stamps.size())
+		stamps.resize(last + 1, 0);
+
+	for (uint64_t run = first; run <= last; run++)
+		stamps[run] = gen;
+}
+
+bool ChangeMap::load(const std::string& path, uint64_t db_id,
+		     uint64_t change_gen)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	ChangeMapHdr hdr;
+	bool ok = (::pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t) sizeof(hdr));
+	if (ok) {
+		hdr.swap_n2h();
+		ok = hdr.valid() && (hdr.run_pages == run_pages) &&
+		     (hdr.db_id == db_id) && (hdr.change_gen == change_gen) &&
+		     (hdr.base <= (change_gen + 1)) &&
+		     (hdr.n_runs <= (((uint64_t) 1 << 40) / sizeof(uint64_t)));
+	}
+
+	std::vector<uint64_t> v;
+	if (ok) {
+		v.resize(hdr.n_runs);
+		size_t len = v.size() * sizeof(uint64_t);
+		ok = (len == 0) ||
+		     (::pread(fd, &v[0], len, sizeof(hdr)) == (ssize_t) len);
+	}
+
+	::close(fd);
+	if (!ok)
+		return false;
+
+	for (size_t i = 0; i < v.size(); i++)
+		v[i] = le64toh(v[i]);
+
+	stamps.swap(v);
+	base = hdr.base;
+	gen = change_gen + 1;
+	return true;
+}
+
+void ChangeMap::save(const std::string& path, uint64_t db_id,
+		     uint64_t change_gen) const
+{
+	ChangeMapHdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CHANGES_MAGIC, sizeof(hdr.magic));
+	hdr.version = 1;
+	hdr.run_pages = run_pages;
+	hdr.db_id = db_id;
+	hdr.change_gen = change_gen;
+	hdr.base = base;
+	hdr.n_runs = stamps.size();
+	hdr.swap_h2n();
+
+	std::vector<unsigned char> buf(sizeof(hdr) +
+				       (stamps.size() * sizeof(uint64_t)));
+	memcpy(&buf[0], &hdr, sizeof(hdr));
+	for (size_t i = 0; i < stamps.size(); i++) {
+		uint64_t le = htole64(stamps[i]);
+		memcpy(&buf[sizeof(hdr) + (i * sizeof(le))], &le, sizeof(le));
+	}
+
+	// replace atomically: a torn file would pass for valid
+	std::string tmp = path + ".tmp";
+	int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		throw std::runtime_error("Failed open " + tmp + ": " + strerror(errno));
+
+	bool ok = (::write(fd, &buf[0], buf.size()) == (ssize_t) buf.size()) &&
+		  (::fsync(fd) == 0);
+	int err = errno;
+	::close(fd);
+
+	if (!ok || (::rename(tmp.c_str(), path.c_str()) < 0)) {
+		if (ok)
+			err = errno;
+		::unlink(tmp.c_str());
+		throw std::runtime_error("Failed write " + path + ": " + strerror(err));
+	}
+}
+
+// Copy methods, best first; each is dropped once it fails as
+// unsupported for this pair of files
+class BackupCopier {
+private:
+	int		src;
+	int		dst;
+	bool		try_clone;
+	bool		try_cfr;
+	std::vector<unsigned char> buf;
+
+	static bool unsupported(int err) {
+		return (err == ENOSYS) || (err == EXDEV) || (err == EINVAL) ||
+		       (err == EOPNOTSUPP) || (err == ENOTTY) || (err == EBADF);
+	}
+
+public:
+	BackupCopier(int src_, int dst_)
+		: src(src_), dst(dst_), try_clone(true), try_cfr(true) {}
+
+	bool cloneFile();
+	void copy(uint64_t off, uint64_t len);
+};
+
+// Share all of src's storage, replacing dst's contents
+bool BackupCopier::cloneFile()
+{
+#ifdef FICLONE
+	if (::ioctl(dst, FICLONE, src) == 0)
+		return true;
+	if (!unsupported(errno))
+		throw std::runtime_error(std::string("Failed clone: ") + strerror(errno));
+#endif
+	try_clone = false;
+	return false;
+}
+
+void BackupCopier::copy(uint64_t off, uint64_t len)
+{
+#ifdef FICLONERANGE
+	if (try_clone) {
+		struct file_clone_range r;
+		r.src_fd = src;
+		r.src_offset = off;
+		r.src_length = len;
+		r.dest_offset = off;
+		if (::ioctl(dst, FICLONERANGE, &r) == 0)
+			return;
+		if (!unsupported(errno))
+			throw std::runtime_error(std::string("Failed clone: ") + strerror(errno));
+
+		// usually misaligned to filesystem blocks; keep trying
+		// the others
+		if (errno != EINVAL)
+			try_clone = false;
+	}
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (try_cfr && (len > 0)) {
+		loff_t in_off = off, out_off = off;
+		ssize_t n = ::copy_file_range(src, &in_off, dst, &out_off, len, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!unsupported(errno))
+				throw std::runtime_error(std::string("Failed copy_file_range: ") + strerror(errno));
+			try_cfr = false;
+			break;
+		}
+		if (n == 0)
+			break;		// short source: copy the rest below
+
+		off += n;
+		len -= n;
+	}
+#endif
+
+	if (buf.empty())
+		buf.resize(1024 * 1024);
+
+	while (len > 0) {
+		size_t n = (len < buf.size()) ? len : buf.size();
+		ssize_t rrc = ::pread(src, &buf[0], n, off);
+		if (rrc < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error(std::string("Failed backup read: ") + strerror(errno));
+		}
+		if (rrc == 0)
+			throw std::runtime_error("Short backup read");
+
+		for (ssize_t done = 0; done < rrc; ) {
+			ssize_t wrc = ::pwrite(dst, &buf[done], rrc - done, off + done);
+			if (wrc < 0) {
+				if (errno == EINTR)
+					continue;
+				throw std::runtime_error(std::string("Failed backup write: ") + strerror(errno));
+			}
+			done += wrc;
+		}
+
+		off += rrc;
+		len -= rrc;
+	}
+}
+
+static void syncBackup(int fd)
+{
+	if (::fsync(fd) < 0)
+		throw std::runtime_error(std::string("Failed backup fsync: ") + strerror(errno));
+}
+
+// Close the generation the backup captures: every write so far is
+// stamped with it, later writes with the next.  With the DB locked
+// exclusively.
+void DB::markBackup()
+{
+	sb.change_gen = changes.generation();
+	sb_dirty = true;
+	flush();
+
+	changes.setGeneration(sb.change_gen + 1);
+}
+
+// Copy what dest lacks.  With no metadata awaiting write-back, and
+// writers held off.
+void DB::copyTo(int dest_fd, BackupStats& stats)
+{
+	uint64_t n_pages = f.size();
+	uint64_t page_size = sb.page_size;
+
+	stats = BackupStats();
+	stats.pages = n_pages;
+
+	// dest's own superblock tells what it holds, unless torn
+	Superblock dsb;
+	bool incremental = options.f_write && options.f_track_changes &&
+		(::pread(dest_fd, &dsb, sizeof(dsb), 0) == (ssize_t) sizeof(dsb));
+	if (incremental) {
+		dsb.swap_n2h();
+		incremental = dsb.valid() && (dsb.db_id == sb.db_id) &&
+			      (dsb.page_size == sb.page_size) &&
+			      (dsb.change_gen <= sb.change_gen) &&
+			      (dsb.change_gen >= changes.tracked());
+	}
+
+	BackupCopier copier(f.fileno(), dest_fd);
+
+	if (!incremental && copier.cloneFile()) {
+		syncBackup(dest_fd);
+		stats.cloned = true;
+		stats.pages_copied = n_pages;
+		return;
+	}
+
+	// runs changed since dest's generation, coalesced.  The
+	// superblock goes last: an interrupted backup leaves dest at
+	// its earlier generation, so the next one copies it all again.
+	uint64_t start = 0, end = 0;		// pending, in pages
+	for (uint64_t page = 1; page < n_pages; ) {
+		uint64_t run = page / ChangeMap::run_pages;
+		uint64_t run_end = (run + 1) * ChangeMap::run_pages;
+		if (run_end > n_pages)
+			run_end = n_pages;
+
+		if (!incremental || (changes.stamp(run) > dsb.change_gen)) {
+			if (page != end) {
+				if (end > start)
+					copier.copy(start * page_size,
+						    (end - start) * page_size);
+				start = page;
+			}
+			end = run_end;
+			stats.pages_copied += run_end - page;
+		}
+
+		page = run_end;
+	}
+	if (end > start)
+		copier.copy(start * page_size, (end - start) * page_size);
+
+	if (::ftruncate(dest_fd, n_pages * page_size) < 0)
+		throw std::runtime_error(std::string("Failed backup ftruncate: ") + strerror(errno));
+	syncBackup(dest_fd);
+
+	copier.copy(0, page_size);
+	syncBackup(dest_fd);
+	stats.pages_copied++;
+	stats.incremental = incremental;
+}
+
+void DB::backup(const std::string& path, BackupStats *out)
+{
+	if (!running)
+		throw std::runtime_error("DB not open");
+
+	StatTimer timer(stats, OP_BACKUP);
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0666);
+	if (fd < 0)
+		throw std::runtime_error("Failed open " + path + ": " + strerror(errno));
+
+	BackupStats st;
+	try {
+		if (options.f_write) {
+			CommitScope commit(*this);
+			markBackup();
+		}
+
+		// copy alongside readers; puts wait.  Puts committed since
+		// the mark are copied too, though dest is labeled with the
+		// marked generation: they are stamped after it, so the next
+		// backup copies them again.  dest is a superset snapshot.
+		ReadScope scope(*this);
+		copyTo(fd, st);
+	}
+	catch (...) {
+		::close(fd);
+		throw;
+	}
+
+	::close(fd);
+
+	if (out)
+		*out = st;
+}
+
+} // namespace page
@@ -0,0 +1,385 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cassert>
+#include <new>
+#include <pgdb2.h>
+
+namespace page {
+
+MemBudget::MemBudget()
+{
+	limit = 32 * 1024 * 1024;
+
+	share[MEM_PAGES] = 50;
+	share[MEM_DIRS] = 25;
+	share[MEM_INODES] = 25;
+
+	for (unsigned int i = 0; i < MEM__COUNT; i++)
+		consumers[i] = NULL;
+
+	retired = 0;
+}
+
+bool MemBudget::overLimit() const
+{
+	uint64_t total = __atomic_load_n(&retired, __ATOMIC_RELAXED);
+	for (unsigned int i = 0; i < MEM__COUNT; i++)
+		total += __atomic_load_n(&stats[i].used, __ATOMIC_RELAXED);
+
+	return (total > limit);
+}
+
+uint64_t MemBudget::used() const
+{
+	uint64_t total = 0;
+	for (unsigned int i = 0; i < MEM__COUNT; i++)
+		total += stats[i].used;
+
+	return total;
+}
+
+void MemBudget::reclaim(unsigned int mask)
+{
+	while (used() > limit) {
+		// pick the consumer furthest over its share
+		int victim = -1;
+		int64_t victim_over = 0;
+		for (unsigned int i = 0; i < MEM__COUNT; i++) {
+			if (!(mask & (1U << i)) || !consumers[i])
+				continue;
+
+			int64_t over = (int64_t) stats[i].used -
+				       (int64_t) ((limit / 100) * share[i]);
+			if ((victim < 0) || (over > victim_over)) {
+				victim = i;
+				victim_over = over;
+			}
+		}
+
+		if (victim < 0)
+			break;		// nothing left to evict
+
+		if (consumers[victim]->evictOne())
+			stats[victim].evictions++;
+		else
+			mask &= ~(1U << victim);
+	}
+}
+
+void PageCache::setPageSize(size_t sz)
+{
+	if (sz == page_size)
+		return;
+
+	clear();
+	page_size = sz;
+}
+
+// Size the table for a file of n_pages.  Only while no reader holds
+// the DB lock: the table may move.
+void PageCache::setCapacity(uint64_t n_pages)
+{
+	size_t n_leaves = (n_pages + leaf_len - 1) >> leaf_bits;
+	if (n_leaves > leaves.size())
+		leaves.resize(n_leaves, NULL);
+}
+
+PageCache::Frame *PageCache::lookup(uint64_t index) const
+{
+	uint64_t leaf = index >> leaf_bits;
+	if (leaf >= leaves.size())
+		return NULL;
+
+	Frame **fp = __atomic_load_n(&leaves[leaf], __ATOMIC_ACQUIRE);
+	if (!fp)
+		return NULL;
+
+	return __atomic_load_n(&fp[index & (leaf_len - 1)], __ATOMIC_ACQUIRE);
+}
+
+// Frame pointer slot for index, or NULL if beyond capacity; with the
+// budget mutex held
+PageCache::Frame **PageCache::slot(uint64_t index)
+{
+	uint64_t leaf = index >> leaf_bits;
+	if (leaf >= leaves.size())
+		return NULL;
+
+	Frame **fp = leaves[leaf];
+	if (!fp) {
+		fp = new Frame *[leaf_len];
+		memset(fp, 0, leaf_len * sizeof(Frame *));
+		__atomic_store_n(&leaves[leaf], fp, __ATOMIC_RELEASE);
+	}
+
+	return &fp[index & (leaf_len - 1)];
+}
+
+void PageCache::freeFrame(Frame *fr)
+{
+	free(fr);
+}
+
+bool PageCache::get(uint64_t index, size_t page_count, unsigned char *out)
+{
+	// all or nothing
+	for (size_t i = 0; i < page_count; i++) {
+		Frame *fr = lookup(index + i);
+		if (!fr) {
+			mem->miss(MEM_PAGES);
+			return false;
+		}
+
+		memcpy(out + (i * page_size), fr->data, page_size);
+
+		if (!__atomic_load_n(&fr->referenced, __ATOMIC_RELAXED))
+			__atomic_store_n(&fr->referenced, 1, __ATOMIC_RELAXED);
+	}
+
+	mem->hit(MEM_PAGES);
+	return true;
+}
+
+void PageCache::put(uint64_t index, size_t page_count, const unsigned char *in)
+{
+	MutexGuard guard(mem->mutex());
+
+	for (size_t i = 0; i < page_count; i++) {
+		// resident frames are never rewritten by readers; the
+		// page read is the same
+		Frame **fs = slot(index + i);
+		if (!fs || *fs)
+			continue;
+
+		Frame *fr = (Frame *) malloc(sizeof(Frame) + page_size);
+		if (!fr)
+			throw std::bad_alloc();
+		fr->index = index + i;
+		fr->referenced = 0;
+		fr->data = (unsigned char *) (fr + 1);
+		memcpy(fr->data, in + (i * page_size), page_size);
+
+		__atomic_store_n(fs, fr, __ATOMIC_RELEASE);
+		resident.push_back(fr);
+
+		mem->charge(MEM_PAGES, entBytes());
+	}
+
+	// evicted frames are retired, not freed, so eviction is
+	// safe at any time
+	mem->reclaim(1U << MEM_PAGES);
+}
+
+// Writers only, with the DB locked exclusively
+void PageCache::update(uint64_t index, size_t page_count, const unsigned char *in)
+{
+	MutexGuard guard(mem->mutex());
+
+	for (size_t i = 0; i < page_count; i++) {
+		Frame *fr = lookup(index + i);
+		if (fr)
+			memcpy(fr->data, in + (i * page_size), page_size);
+	}
+}
+
+// Free retired frames.  Only while no reader holds the DB lock.
+void PageCache::quiesce()
+{
+	if (!mem)
+		return;		// never used
+
+	MutexGuard guard(mem->mutex());
+
+	for (size_t i = 0; i < retired.size(); i++)
+		freeFrame(retired[i]);
+
+	mem->unretire(retired.size() * entBytes());
+	retired.clear();
+}
+
+void PageCache::clear()
+{
+	if (!mem)
+		return;		// never used
+
+	quiesce();
+
+	MutexGuard guard(mem->mutex());
+
+	mem->release(MEM_PAGES, resident.size() * entBytes());
+
+	for (size_t i = 0; i < resident.size(); i++)
+		freeFrame(resident[i]);
+	for (size_t i = 0; i < leaves.size(); i++) {
+		delete [] leaves[i];
+		leaves[i] = NULL;
+	}
+
+	resident.clear();
+	hand = 0;
+}
+
+// CLOCK: evict the first frame not referenced since the hand last
+// passed it
+bool PageCache::evictOne()
+{
+	while (!resident.empty()) {
+		if (hand >= resident.size())
+			hand = 0;
+
+		Frame *fr = resident[hand];
+		if (__atomic_load_n(&fr->referenced, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&fr->referenced, 0, __ATOMIC_RELAXED);
+			hand++;
+			continue;
+		}
+
+		Frame **fs = slot(fr->index);
+		__atomic_store_n(fs, (Frame *) NULL, __ATOMIC_RELEASE);
+
+		resident[hand] = resident.back();
+		resident.pop_back();
+
+		retired.push_back(fr);
+		mem->retire(MEM_PAGES, entBytes());
+		return true;
+	}
+
+	return false;
+}
+
+size_t DirCache::dirBytes(const Dir& d)
+{
+	size_t bytes = sizeof(Ent) + 64 + (d.ents.capacity() * sizeof(DirEntry));
+
+	for (std::vector<DirEntry>::const_iterator it = d.ents.begin();
+	     it != d.ents.end(); it++)
+		bytes += (*it).key.capacity() + (*it).key_end.capacity() +
+			 (*it).value.capacity();
+
+	return bytes;
+}
+
+// Size the table for n inodes.  Only while no reader holds the DB
+// lock: the table may move.
+void DirCache::resize(size_t n)
+{
+	if (n > dirs.size())
+		dirs.resize(n, NULL);
+}
+
+const Dir *DirCache::find(uint32_t ino_idx)
+{
+	Ent *ent = NULL;
+	if (ino_idx < dirs.size())
+		ent = __atomic_load_n(&dirs[ino_idx], __ATOMIC_ACQUIRE);
+
+	if (!ent) {
+		mem->miss(MEM_DIRS);
+		return NULL;
+	}
+
+	if (!__atomic_load_n(&ent->referenced, __ATOMIC_RELAXED))
+		__atomic_store_n(&ent->referenced, 1, __ATOMIC_RELAXED);
+
+	mem->hit(MEM_DIRS);
+	return &ent->dir;
+}
+
+const Dir& DirCache::insert(uint32_t ino_idx, Dir& d)
+{
+	MutexGuard guard(mem->mutex());
+
+	// another reader decoded it first: keep theirs, which
+	// they may hold references to
+	if ((ino_idx < dirs.size()) && dirs[ino_idx])
+		return dirs[ino_idx]->dir;
+
+	return put(ino_idx, d);
+}
+
+const Dir& DirCache::put(uint32_t ino_idx, Dir& d)
+{
+	MutexGuard guard(mem->mutex());
+
+	if (ino_idx >= dirs.size())
+		throw std::runtime_error("Dir cache inode out of range");
+
+	erase(ino_idx);
+
+	Ent *ent = new Ent;
+	ent->dir.key_type = d.key_type;
+	ent->dir.ents.swap(d.ents);
+	ent->bytes = dirBytes(ent->dir);
+	ent->referenced = 0;
+	lru.push_front(ino_idx);
+	ent->lru_it = lru.begin();
+
+	__atomic_store_n(&dirs[ino_idx], ent, __ATOMIC_RELEASE);
+
+	// directories may be referenced until the operation ends;
+	// only pages are evicted here
+	mem->charge(MEM_DIRS, ent->bytes);
+	mem->reclaim(1U << MEM_PAGES);
+
+	return ent->dir;
+}
+
+// Only while no reader holds the DB lock
+void DirCache::erase(uint32_t ino_idx)
+{
+	MutexGuard guard(mem->mutex());
+
+	if ((ino_idx >= dirs.size()) || !dirs[ino_idx])
+		return;
+
+	Ent *ent = dirs[ino_idx];
+	mem->release(MEM_DIRS, ent->bytes);
+	lru.erase(ent->lru_it);
+	dirs[ino_idx] = NULL;
+	delete ent;
+}
+
+void DirCache::clear()
+{
+	if (!mem)
+		return;		// never used
+
+	MutexGuard guard(mem->mutex());
+
+	while (!lru.empty())
+		erase(lru.back());
+}
+
+// Least recently inserted directory not referenced since it was last
+// passed over
+bool DirCache::evictOne()
+{
+	for (size_t n = lru.size(); n > 0; n--) {
+		uint32_t ino_idx = lru.back();
+		Ent *ent = dirs[ino_idx];
+		if (!ent->referenced) {
+			erase(ino_idx);
+			return true;
+		}
+
+		ent->referenced = 0;
+		lru.splice(lru.begin(), lru, ent->lru_it);
+	}
+
+	if (lru.empty())
+		return false;
+
+	erase(lru.back());
+	return true;
+}
+
+} // namespace page
@@ -0,0 +1,201 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <stdexcept>
+#include <vector>
+#include <pgdb2-codec.h>
+
+namespace page {
+
+enum lz_constants {
+	LZ_MIN_MATCH	= 4,			// shortest encoded match
+	LZ_MAX_OFFSET	= 65535,		// 16-bit match offset
+	LZ_HASH_BITS	= 12,			// match finder table size
+};
+
+static const unsigned int LZ_RUN_MASK = 0xf;	// token nibble mask
+
+static inline uint32_t lzHash(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static void lzPutLen(std::vector<unsigned char>& out, size_t len)
+{
+	while (len >= 255) {
+		out.push_back(255);
+		len -= 255;
+	}
+	out.push_back((unsigned char) len);
+}
+
+static void lzPutLiterals(std::vector<unsigned char>& out,
+			  const unsigned char *lit, size_t lit_len,
+			  unsigned int match_nibble)
+{
+	unsigned int lit_nibble = (lit_len >= LZ_RUN_MASK) ?
+		LZ_RUN_MASK : lit_len;
+
+	out.push_back((unsigned char) ((lit_nibble << 4) | match_nibble));
+	if (lit_nibble == LZ_RUN_MASK)
+		lzPutLen(out, lit_len - LZ_RUN_MASK);
+
+	out.insert(out.end(), lit, lit + lit_len);
+}
+
+void LZCodec::compress(const unsigned char *in, size_t in_len,
+		       std::vector<unsigned char>& out) const
+{
+	// match finder: input position + 1 of last 4-byte sequence seen
+	std::vector<uint32_t> table(1U << LZ_HASH_BITS, 0);
+
+	size_t anchor = 0;
+	size_t pos = 0;
+
+	out.reserve(out.size() + in_len + (in_len / 255) + 16);
+
+	while ((pos + LZ_MIN_MATCH) <= in_len) {
+		uint32_t h = lzHash(in + pos);
+		size_t cand = table[h];
+		table[h] = pos + 1;
+
+		if ((cand == 0) ||
+		    ((pos - (cand - 1)) > LZ_MAX_OFFSET) ||
+		    (memcmp(in + cand - 1, in + pos, LZ_MIN_MATCH) != 0)) {
+			pos++;
+			continue;
+		}
+
+		// extend match
+		size_t ref = cand - 1;
+		size_t match_len = LZ_MIN_MATCH;
+		while (((pos + match_len) < in_len) &&
+		       (in[ref + match_len] == in[pos + match_len]))
+			match_len++;
+
+		// emit sequence: literals, offset, match length
+		size_t match_code = match_len - LZ_MIN_MATCH;
+		unsigned int match_nibble = (match_code >= LZ_RUN_MASK) ?
+			LZ_RUN_MASK : match_code;
+
+		lzPutLiterals(out, in + anchor, pos - anchor, match_nibble);
+
+		size_t offset = pos - ref;
+		out.push_back((unsigned char) (offset & 0xff));
+		out.push_back((unsigned char) (offset >> 8));
+
+		if (match_nibble == LZ_RUN_MASK)
+			lzPutLen(out, match_code - LZ_RUN_MASK);
+
+		pos += match_len;
+		anchor = pos;
+	}
+
+	// final sequence: trailing literals only
+	lzPutLiterals(out, in + anchor, in_len - anchor, 0);
+}
+
+static size_t lzGetLen(const unsigned char *in, size_t in_len, size_t& ip)
+{
+	size_t len = 0;
+	unsigned char b;
+
+	do {
+		if (ip >= in_len)
+			throw std::runtime_error("LZ data truncated");
+		b = in[ip++];
+		len += b;
+	} while (b == 255);
+
+	return len;
+}
+
+void LZCodec::decompress(const unsigned char *in, size_t in_len,
+			 unsigned char *out, size_t out_len) const
+{
+	size_t ip = 0;
+	size_t op = 0;
+
+	while (ip < in_len) {
+		unsigned char token = in[ip++];
+
+		// literals
+		size_t lit_len = token >> 4;
+		if (lit_len == LZ_RUN_MASK)
+			lit_len += lzGetLen(in, in_len, ip);
+
+		if ((lit_len > (in_len - ip)) || (lit_len > (out_len - op)))
+			throw std::runtime_error("LZ literal overrun");
+
+		memcpy(out + op, in + ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		// final sequence has no match
+		if (ip == in_len)
+			break;
+
+		// match
+		if ((in_len - ip) < 2)
+			throw std::runtime_error("LZ data truncated");
+
+		size_t offset = in[ip] | (in[ip + 1] << 8);
+		ip += 2;
+
+		if ((offset == 0) || (offset > op))
+			throw std::runtime_error("LZ invalid match offset");
+
+		size_t match_len = token & LZ_RUN_MASK;
+		if (match_len == LZ_RUN_MASK)
+			match_len += lzGetLen(in, in_len, ip);
+		match_len += LZ_MIN_MATCH;
+
+		if (match_len > (out_len - op))
+			throw std::runtime_error("LZ match overrun");
+
+		// byte-wise copy; source and destination may overlap
+		const unsigned char *src = out + op - offset;
+		for (size_t i = 0; i < match_len; i++)
+			out[op + i] = src[i];
+		op += match_len;
+	}
+
+	if (op != out_len)
+		throw std::runtime_error("LZ data length mismatch");
+}
+
+static LZCodec lzCodec;
+
+static const Codec *codecs[CODEC__LAST + 1] = {
+	NULL,			// CODEC_NONE
+	&lzCodec,		// CODEC_LZ
+};
+
+void registerCodec(const Codec *codec)
+{
+	uint32_t id = codec->id();
+	if ((id == CODEC_NONE) || (id > CODEC__LAST))
+		throw std::runtime_error("Invalid codec id");
+	if (codecs[id] && (codecs[id] != codec))
+		throw std::runtime_error("Codec id already registered");
+
+	codecs[id] = codec;
+}
+
+const Codec *getCodec(uint32_t id)
+{
+	if (id > CODEC__LAST)
+		return NULL;
+
+	return codecs[id];
+}
+
+} // namespace page
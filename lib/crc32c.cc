@@ -0,0 +1,132 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pgdb2-file.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_SSE42 1
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#define CRC32C_ARMV8 1
+#include <arm_acle.h>
+#endif
+
+namespace page {
+
+// Castagnoli polynomial, reflected
+static const uint32_t CRC32C_POLY = 0x82f63b78;
+
+static uint32_t crcTable[256];
+
+static bool initTable()
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (unsigned int j = 0; j < 8; j++)
+			crc = (crc & 1) ? ((crc >> 1) ^ CRC32C_POLY) : (crc >> 1);
+		crcTable[i] = crc;
+	}
+
+	return true;
+}
+
+static bool tableReady = initTable();
+
+static uint32_t crc32cTable(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len-- > 0)
+		crc = crcTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(CRC32C_SSE42)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHw(uint32_t crc, const unsigned char *p, size_t len)
+{
+#if defined(__x86_64__)
+	uint64_t crc64 = crc;
+	while (len >= sizeof(uint64_t)) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		crc64 = _mm_crc32_u64(crc64, v);
+		p += sizeof(uint64_t);
+		len -= sizeof(uint64_t);
+	}
+	crc = (uint32_t) crc64;
+#endif
+	while (len >= sizeof(uint32_t)) {
+		uint32_t v;
+		memcpy(&v, p, sizeof(v));
+		crc = _mm_crc32_u32(crc, v);
+		p += sizeof(uint32_t);
+		len -= sizeof(uint32_t);
+	}
+	while (len-- > 0)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+static bool haveHw()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#elif defined(CRC32C_ARMV8)
+
+static uint32_t crc32cHw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len >= sizeof(uint64_t)) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32cd(crc, v);
+		p += sizeof(uint64_t);
+		len -= sizeof(uint64_t);
+	}
+	while (len-- > 0)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+
+static bool haveHw()
+{
+	return true;		// guaranteed by __ARM_FEATURE_CRC32
+}
+
+#endif
+
+#if defined(CRC32C_SSE42) || defined(CRC32C_ARMV8)
+static bool useHw = haveHw();
+#else
+static bool useHw = false;
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) buf;
+
+	crc = ~crc;
+
+#if defined(CRC32C_SSE42) || defined(CRC32C_ARMV8)
+	if (useHw)
+		return ~crc32cHw(crc, p, len);
+#endif
+
+	if (!tableReady)
+		tableReady = initTable();
+
+	return ~crc32cTable(crc, p, len);
+}
+
+} // namespace page
@@ -7,38 +7,109 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <stdio.h>
 #include <stdexcept>
 #include <vector>
+#include <list>
 #include <assert.h>
 #include <pgdb2.h>
+#include <pgdb2-probes.h>
+#include <pgdb2-trace.h>
 
 namespace page {
 
+// f_shared: fcntl lock bytes, well past any DB page
+static const off_t WRITER_LOCK_OFF = 0x7ffffff0;
+static const off_t COMMIT_LOCK_OFF = 0x7ffffff1;
+
+// DB identity, telling its backups from other files
+static uint64_t newDbId()
+{
+	uint64_t id = 0;
+
+	int fd = ::open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		if (::read(fd, &id, sizeof(id)) != (ssize_t) sizeof(id))
+			id = 0;
+		::close(fd);
+	}
+
+	if (id == 0) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		id = ((uint64_t) tv.tv_sec << 32) ^ ((uint64_t) tv.tv_usec << 12) ^
+		     (uint64_t) getpid();
+	}
+
+	return id;
+}
+
 DB::DB(std::string filename_, const Options& opt_)
 {
 	running = false;
+	trace = NULL;
 
 	filename = filename_;
 	options = opt_;
 
+	sb_dirty = false;
+	inotab_dirty = false;
+	freelist_dirty = false;
+	generation = 0;
+
+	// all caches share one memory budget
+	mem.setLimit(options.mem_budget);
+	mem.attach(MEM_PAGES, &pagecache);
+	mem.attach(MEM_DIRS, &dircache);
+	mem.attach(MEM_INODES, &inotab);
+	pagecache.init(&mem);
+	dircache.init(&mem);
+	inotab.init(&mem);
+	f.setCache(&pagecache);
+	f.setStats(&stats);
+	stats.setEnabled(options.f_stats);
+
 	open();
 
-	// special case: if create option + empty file
-	// initialize brand new database structures
-	if ((f.size() == 0) && (options.f_create)) {
-		clear();
-	} else {
-		readSuperblock();
-		readInodeTable();
+	// other processes must not commit while we read, or create
+	if (sharedReader())
+		commit_lock.lockShared();
+	else if (options.f_shared)
+		commit_lock.lockExclusive();
+
+	try {
+		// special case: if create option + empty file
+		// initialize brand new database structures
+		if ((f.size() == 0) && (options.f_create)) {
+			clear();
+		} else {
+			readSuperblock();
+			readInodeTable();
+			readFreeList();
+		}
+
+		// for verification
+		getDir(DBINO_ROOT_DIR);
+
+		if (options.f_write)
+			openChanges();
+
+		if (options.f_shared)
+			openShared();
 	}
+	catch (...) {
+		endCommit();
+		throw;
+	}
+
+	endCommit();
 
-	// for verification
-	Dir dummyDir;
-	readDir(DBINO_ROOT_DIR, dummyDir);
+	reclaim();
 
 	running = true;
 }
@@ -62,8 +133,172 @@ void DB::open()
 		flags |= O_CREAT;
 	}
 
+	// validate codec option
+	if ((options.codec != CODEC_NONE) && !getCodec(options.codec))
+		throw std::runtime_error("Invalid codec option");
+
+	// validate page size option
+	if (options.f_create && !validPageSize(options.page_size))
+		throw std::runtime_error("Invalid page size option");
+
 	// open OS file
+	f.setReadahead(options.readahead_max);
 	f.open(filename, flags, sizeof(Superblock));
+
+	// one writer at a time, among processes
+	if (options.f_shared) {
+		writer_lock.init(f.fileno(), WRITER_LOCK_OFF);
+		commit_lock.init(f.fileno(), COMMIT_LOCK_OFF);
+
+		if (options.f_write && !writer_lock.tryExclusive())
+			throw std::runtime_error("DB locked by another writer");
+	}
+}
+
+// Map the region shared with other processes.  Called with the
+// commit lock held.
+void DB::openShared()
+{
+	shm.open(filename + "-shm", f.fileno(), sb.page_size,
+		 options.shm_cache);
+
+	// pages cached by an earlier writer may be stale
+	if (options.f_write)
+		shm.reset();
+
+	f.setShared(&shm);
+	generation = shm.generation();
+}
+
+// Another process committed: drop decoded metadata, and read it
+// again.  Called with the DB locked exclusively, and the commit
+// lock held.
+void DB::refresh()
+{
+	MutexGuard guard(mem.mutex());
+
+	dircache.clear();
+	f.refresh();
+
+	readSuperblock();
+	readInodeTable();
+
+	generation = shm.generation();
+}
+
+bool DB::beginRead(bool wait)
+{
+	if (!readerReclaim(wait))
+		return false;
+
+	if (sharedReader()) {
+		if (!wait) {
+			if (!commit_lock.tryShared())
+				return false;
+		} else
+			commit_lock.lockShared();
+	}
+
+	if (!wait) {
+		if (!rwlock.tryReadLock()) {
+			if (sharedReader())
+				commit_lock.unlockShared();
+			return false;
+		}
+	} else
+		rwlock.readLock();
+
+	if (!sharedReader() || (shm.generation() == generation))
+		return true;
+
+	if (!wait) {
+		endRead();
+		return false;
+	}
+
+	// first reader to see the commit refreshes
+	rwlock.unlock();
+	try {
+		WriteGuard guard(rwlock);
+		if (shm.generation() != generation)
+			refresh();
+	}
+	catch (...) {
+		commit_lock.unlockShared();
+		throw;
+	}
+	rwlock.readLock();
+	return true;
+}
+
+void DB::endRead()
+{
+	rwlock.unlock();
+
+	if (sharedReader())
+		commit_lock.unlockShared();
+}
+
+void DB::beginCommit()
+{
+	if (options.f_shared)
+		commit_lock.lockExclusive();
+}
+
+// Publish a commit to reader processes; also ends the constructor's
+// hold of the commit lock
+void DB::endCommit()
+{
+	if (!options.f_shared)
+		return;
+
+	if (sharedReader()) {
+		commit_lock.unlockShared();
+		return;
+	}
+
+	if (shm.isOpen()) {
+		shm.bumpGeneration();
+		generation = shm.generation();
+	}
+	commit_lock.unlockExclusive();
+}
+
+// Track writes for incremental backup, continuing from the last
+// clean close if possible.  Untracked, any earlier record is dropped:
+// it would miss this handle's writes.
+void DB::openChanges()
+{
+	// databases predating backup support
+	if (sb.db_id == 0) {
+		sb.db_id = newDbId();
+		sb_dirty = true;
+	}
+
+	std::string path = filename + "-changes";
+	if (options.f_track_changes &&
+	    !changes.load(path, sb.db_id, sb.change_gen))
+		changes.reset(sb.change_gen + 1);
+
+	// valid again once saved by a clean close
+	if ((::unlink(path.c_str()) < 0) && (errno != ENOENT))
+		throw std::runtime_error("Failed unlink " + path + ": " + strerror(errno));
+
+	if (options.f_track_changes)
+		f.setChanges(&changes);
+}
+
+void DB::closeChanges()
+{
+	if (!options.f_track_changes)
+		return;
+
+	try {
+		changes.save(filename + "-changes", sb.db_id, sb.change_gen);
+	}
+	catch (std::exception& e) {
+		// the next backup is a full copy
+	}
 }
 
 void DB::clear()
@@ -73,19 +308,44 @@ void DB::clear()
 
 	// init superblock
 	memcpy(sb.magic, SB_MAGIC, sizeof(sb.magic));
-	sb.version = 1;
-	sb.page_size = 4096;
+	sb.version = SB_VERSION;
+	sb.page_size = options.page_size;
 	sb.features = SBF_MBO;
 	sb.inode_table_ref = 1;
+	sb.inode_table_len = 1;
+	sb.alloc_end = 4;
+	sb.vh_page = 0;
+	sb.ino_free = DBINO__LAST + 1;
+	sb.ino_unused = 0;
+	sb.ino_count = DBINO__LAST + 1;
+	sb.db_id = newDbId();
+
+	if (options.f_checksum)
+		sb.features |= SBF_CSUM;
+
+	switch (options.key_type) {
+	case KT_BYTES:
+		break;
+	case KT_U32:
+		sb.features |= SBF_KEY_U32;
+		break;
+	case KT_U64:
+		sb.features |= SBF_KEY_U64;
+		break;
+	default:
+		throw std::runtime_error("Invalid key type option");
+	}
 
 	f.setPageSize(sb.page_size);
+	f.setChecksum(options.f_checksum);
 
 	// init inode table
 	inotab.clear();
-	inotab.reserve(16);
+	inotab.setGeometry(f.pageDataSize());
+	freelist.clear();
 
 	// DBINO_TABLE(0): inode table
-	Inode tab_ino;
+	Inode& tab_ino = inotab.table_ino;
 	tab_ino.e_ref = 1;		// inode table elist start
 	tab_ino.e_alloc = 1;		// inode table elist len
 
@@ -93,19 +353,24 @@ void DB::clear()
 	inoref.ext_page = 2;		// inode table offset=2
 	inoref.ext_len = 1;		// inode table length=1
 	inoref.ext_flags = EF_MBO;
-	tab_ino.ext.push_back(inoref);
+	tab_ino.setExtent(inoref);
+	assert(tab_ino.size() == 1);
+	inotab.ext_dirty = true;
 
-	inotab.push_back(tab_ino);
-	assert(inotab.getIdx(DBINO_TABLE).size() == 1);
+	inotab.setSize(DBINO__LAST + 1);
+	dircache.resize(inotab.size());
+	InodeChunk *ch = new InodeChunk;
+	inotab.addChunk(0, ch);
+	ch->inodes.push_back(Inode());	// see table_ino
+	ch->dirty = true;
 
 	// DBINO_FREELIST(1): list of free extents (empty)
 	Inode freelist_ino;
 	freelist_ino.e_ref = 0;
 	freelist_ino.e_alloc = 0;
-	freelist_ino.ext.clear();
 
-	inotab.push_back(freelist_ino);
-	assert(inotab.getIdx(DBINO_FREELIST).size() == 0);
+	ch->inodes.push_back(freelist_ino);
+	assert(getInode(DBINO_FREELIST).size() == 0);
 
 	// DBINO_ROOT_DIR(2): root directory
 	Inode root_ino;
@@ -116,25 +381,33 @@ void DB::clear()
 	root_ref.ext_page = 3;
 	root_ref.ext_len = 1;
 	root_ref.ext_flags = EF_MBO;
-	root_ino.ext.push_back(root_ref);
+	root_ino.setExtent(root_ref);
 
-	inotab.push_back(root_ino);
+	ch->inodes.push_back(root_ino);
+
+	// write everything; directory first, as it updates
+	// the inode table
+	Dir emptyDir(keyType());
+	writeDir(DBINO_ROOT_DIR, emptyDir);
 
-	// write everything
 	writeSuperblock();
 	writeInodeTable();
 	// writeFreeList(); -- none to write
 
-	Dir emptyDir;
-	writeDir(DBINO_ROOT_DIR, emptyDir);
-
 	f.sync();
+
+	sb_dirty = false;
+	inotab_dirty = false;
+	freelist_dirty = false;
 }
 
 void DB::readSuperblock()
 {
-	// read superblock into buffer
-	std::vector<unsigned char> sb_buf(4096);
+	PageKindScope kind(PK_SUPER);
+
+	// read superblock into buffer; file page size is
+	// sizeof(Superblock) until the real page size is known
+	std::vector<unsigned char> sb_buf;
 	f.read(sb_buf, 0);
 
 	// fill and validate superblock struct
@@ -142,17 +415,39 @@ void DB::readSuperblock()
 
 	sb.swap_n2h();
 
+	// ours, but a format this code cannot read
+	if ((memcmp(sb.magic, SB_MAGIC, sizeof(sb.magic)) == 0) &&
+	    (sb.version != SB_VERSION)) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "Unsupported format version %u",
+			 sb.version);
+		throw std::runtime_error(buf);
+	}
+
 	if (!sb.valid())
 		throw std::runtime_error("Superblock invalid");
 
 	// reset page file size, now that it is known
 	f.setPageSize(sb.page_size);
+
+	// key type, page size and checksums are fixed at creation time
+	options.key_type = sb.keyType();
+	options.page_size = sb.page_size;
+	options.f_checksum = (sb.features & SBF_CSUM);
+
+	// verify superblock page checksum, now that page size is known
+	if (options.f_checksum) {
+		f.setChecksum(true);
+		f.read(sb_buf, 0);
+	}
 }
 
 void DB::writeSuperblock()
 {
 	assert(f.isOpen());
 
+	PageKindScope kind(PK_SUPER);
+
 	// copy current sb
 	Superblock write_sb(sb);
 	write_sb.swap_h2n();
@@ -163,176 +458,563 @@ void DB::writeSuperblock()
 
 	// write to storage
 	f.write(page, 0);
+
+	sb_dirty = false;
 }
 
 void DB::readInodeTable()
 {
 	inotab.clear();
-	inotab.reserve(16);
+	inotab.setGeometry(f.pageDataSize());
 
 	// magic inode #0 is the inode table itself; handle its
 	// extent list as a special case
-	Inode tab_ino;
+	Inode& tab_ino = inotab.table_ino;
 	tab_ino.e_ref = sb.inode_table_ref;
-	tab_ino.e_alloc = 1;
-	readExtList(tab_ino.ext, tab_ino.e_ref);
-	inotab.push_back(tab_ino);
+	tab_ino.e_alloc = sb.inode_table_len;
 
-	// read inode table buffer from storage
-	uint32_t inotab_pages = tab_ino.size();
-	std::vector<unsigned char> inotab_buf(inotab_pages * sb.page_size);
-	tab_ino.read(f, inotab_buf);
+	std::vector<Extent> ext_list;
+	readExtList(ext_list, tab_ino.e_ref, tab_ino.e_alloc);
+	tab_ino.setExtents(inotab.table_arena, ext_list);
 
-	// decode buffer into inode table
-	inotab.decode(inotab_buf);
+	// table pages are decoded on first use
+	if (sb.ino_count < (DBINO__LAST+1))
+		throw std::runtime_error("Inode table truncated");
+	if (sb.ino_count > UINT32_MAX)
+		throw std::runtime_error("Inode table invalid length");
 
-	// deferred I/O from inotab decode step: read inode extent lists
-	for (std::vector<Inode>::iterator it = inotab.inodes.begin();
-	     it != inotab.inodes.end(); it++) {
-		Inode& ino = (*it);
-		if (ino.e_ref && ino.e_alloc)
-			readExtList(ino.ext, ino.e_ref, ino.e_alloc);
-	}
+	inotab.setSize(sb.ino_count);
+	dircache.resize(inotab.size());
+	if (inotab.pageCount() > tab_ino.size())
+		throw std::runtime_error("Inode table invalid length");
 
-	if (inotab.size() < (DBINO__LAST+1))
-		throw std::runtime_error("Inode table truncated");
+	// special inodes, always resident
+	loadInodeChunk(0);
 }
 
 void DB::writeInodeTable()
 {
-	std::vector<unsigned char> inotab_buf;
-	inotab.encode(inotab_buf);
-
 	// special case: inode table's own extent list
-	const Inode& tab_ino = inotab.getIdx(DBINO_TABLE);
+	Inode& tab_ino = inotab.table_ino;
 	assert(tab_ino.e_ref == sb.inode_table_ref);
-	assert(tab_ino.e_alloc == 1);
-	assert((tab_ino.size() * sb.page_size) >= inotab_buf.size());
+	assert(tab_ino.e_alloc == sb.inode_table_len);
 
-	writeExtList(tab_ino.ext, tab_ino.e_ref);
+	if (inotab.ext_dirty) {
+		const Extent *ext = tab_ino.extents(inotab.table_arena);
+		std::vector<Extent> ext_list(ext, ext + tab_ino.e_count);
+		writeExtList(ext_list, tab_ino.e_ref, tab_ino.e_alloc);
+		inotab.ext_dirty = false;
+	}
 
-	// inode table encoded data
-	bufSizeAlign(inotab_buf, sb.page_size);
-	tab_ino.write(f, inotab_buf);
+	// write back modified table pages, one page per chunk
+	PageKindScope kind(PK_INOTAB);
+	std::vector<unsigned char> buf;
+	const std::list<uint32_t>& resident = inotab.resident();
+	for (std::list<uint32_t>::const_iterator it = resident.begin();
+	     it != resident.end(); it++) {
+		uint32_t chunk = *it;
+		InodeChunk *ch = inotab.peekChunk(chunk);
+		if (!ch->dirty)
+			continue;
+
+		buf.assign(f.pageDataSize(), 0);
+		inotab.encodePage(chunk, buf);
+
+		bufToPages(buf);
+		f.write(buf, tablePage(chunk));
+
+		ch->dirty = false;
+	}
+
+	inotab_dirty = false;
+}
+
+void DB::growInodeTable()
+{
+	Inode& tab_ino = inotab.table_ino;
+
+	// grow by doubling, keeping the table's extent list short
+	uint32_t grow = tab_ino.size();
+	Extent e = allocPages(grow);
+
+	const Extent *ext = tab_ino.extents(inotab.table_arena);
+	std::vector<Extent> ext_list(ext, ext + tab_ino.e_count);
+
+	Extent& last = ext_list.back();
+	if ((last.ext_page + last.ext_len) == e.ext_page)
+		last.ext_len += grow;
+	else
+		ext_list.push_back(e);
+
+	inotab.table_arena.clear();
+	tab_ino.setExtents(inotab.table_arena, ext_list);
+
+	inotab.ext_dirty = true;
+	inotab_dirty = true;
+
+	// move extent list to larger storage, if it outgrew its own
+	size_t need = (ext_list.size() + 1) * sizeof(Extent);
+	if (need > (tab_ino.e_alloc * f.pageDataSize())) {
+		uint32_t n_pages = tab_ino.e_alloc * 2;
+		Extent le = allocPages(n_pages);
+
+		freePages(tab_ino.e_ref, tab_ino.e_alloc);
+
+		tab_ino.e_ref = le.ext_page;
+		tab_ino.e_alloc = n_pages;
+
+		sb.inode_table_ref = tab_ino.e_ref;
+		sb.inode_table_len = tab_ino.e_alloc;
+		sb_dirty = true;
+	}
+}
+
+InodeChunk *DB::loadInodeChunk(uint32_t chunk)
+{
+	ArenaScope scope;
+	unsigned char *buf = scope.arena().allocBytes(sb.page_size);
+	{
+		PageKindScope kind(PK_INOTAB);
+		f.read(buf, tablePage(chunk));
+	}
+	size_t len = pagesToBuf(buf, 1);
+
+	std::vector<Inode> inodes;
+	inotab.decodePage(chunk, buf, len, inodes);
+
+	InodeChunk *ch = new InodeChunk;
+	ch->inodes.swap(inodes);
+
+	// read external extent lists now: once resident, a chunk
+	// is modified only by writers
+	try {
+		std::vector<Extent> ext_list;
+		for (std::vector<Inode>::iterator it = ch->inodes.begin();
+		     it != ch->inodes.end(); it++) {
+			Inode& ino = *it;
+			if (ino.e_ref && ino.e_alloc && (ino.e_count == 0)) {
+				readExtList(ext_list, ino.e_ref, ino.e_alloc);
+				ino.setExtents(ch->arena, ext_list);
+			}
+		}
+	}
+	catch (...) {
+		delete ch;
+		throw;
+	}
+
+	// if another reader loaded it meanwhile, use theirs
+	return inotab.addChunk(chunk, ch);
+}
+
+const Inode& DB::getInode(uint32_t ino_idx)
+{
+	if (ino_idx >= inotab.size())
+		throw std::runtime_error("InodeTable idx out of range");
+	if (ino_idx == DBINO_TABLE)
+		return inotab.table_ino;
+
+	uint32_t chunk = inotab.chunkOf(ino_idx);
+	InodeChunk *ch = inotab.getChunk(chunk);
+	if (!ch)
+		ch = loadInodeChunk(chunk);
+
+	return ch->inodes[ino_idx - (chunk * inotab.chunk_ents)];
+}
+
+Inode& DB::getMutInode(uint32_t ino_idx)
+{
+	assert(ino_idx != DBINO_TABLE);
+
+	const Inode& ino = getInode(ino_idx);
+
+	inotab.peekChunk(inotab.chunkOf(ino_idx))->dirty = true;
+	inotab_dirty = true;
+
+	return const_cast<Inode&>(ino);
+}
+
+const Extent *DB::inodeExt(uint32_t ino_idx)
+{
+	const Inode& ino = getInode(ino_idx);
+	if (ino_idx == DBINO_TABLE)
+		return ino.extents(inotab.table_arena);
+
+	InodeChunk *ch = inotab.peekChunk(inotab.chunkOf(ino_idx));
+	return ino.extents(ch->arena);
+}
+
+uint64_t DB::tablePage(uint64_t lpage) const
+{
+	const Inode& tab_ino = inotab.table_ino;
+	const Extent *ext = tab_ino.extents(inotab.table_arena);
+
+	for (uint32_t i = 0; i < tab_ino.e_count; i++) {
+		if (lpage < ext[i].ext_len)
+			return ext[i].ext_page + lpage;
+		lpage -= ext[i].ext_len;
+	}
+
+	throw std::runtime_error("Inode table page out of range");
 }
 
 void DB::readInodeData(uint32_t ino_idx, std::vector<unsigned char>& buf)
+{
+	ArenaScope scope;
+	const unsigned char *data;
+	size_t len = readInodeData(ino_idx, scope.arena(), data);
+
+	buf.assign(data, data + len);
+}
+
+// Read inode data into scratch memory from arena; data remains
+// valid until the arena is rewound
+size_t DB::readInodeData(uint32_t ino_idx, ScratchArena& arena,
+			 const unsigned char *& data)
 {
 	// lookup inode
-	assert(ino_idx < inotab.size());
-	const Inode& ino = inotab.getIdx(ino_idx);
+	const Inode& ino = getInode(ino_idx);
 	uint32_t n_pages = ino.size();
 
-	// read from storage into buffer
-	buf.resize(n_pages * sb.page_size);
-	ino.read(f, buf);
+	// read from storage into scratch buffer
+	unsigned char *pages = arena.allocBytes(n_pages * sb.page_size);
+	ino.read(f, pages, inodeExt(ino_idx));
+	size_t len = pagesToBuf(pages, n_pages);
+
+	// uncompressed: done
+	if (ino.codec == CODEC_NONE) {
+		data = pages;
+		return len;
+	}
+
+	const Codec *codec = getCodec(ino.codec);
+	if (!codec)
+		throw std::runtime_error("Inode data unknown codec");
+
+	if (len < sizeof(CompressedHdr))
+		throw std::runtime_error("Inode data compressed hdr short read");
+
+	CompressedHdr zhdr;
+	memcpy(&zhdr, pages, sizeof(zhdr));
+	zhdr.swap_n2h();
+
+	if ((zhdr.z_codec != ino.codec) ||
+	    (zhdr.z_len > (len - sizeof(CompressedHdr))))
+		throw std::runtime_error("Inode data compressed hdr invalid");
+
+	// decompress into second scratch buffer
+	unsigned char *out = arena.allocBytes(ino.raw_len);
+	codec->decompress(pages + sizeof(CompressedHdr), zhdr.z_len,
+			  out, ino.raw_len);
+	stats.count(ST_BYTES_DECODED, ino.raw_len);
+
+	data = out;
+	return ino.raw_len;
 }
 
-void DB::readDir(uint32_t ino_idx, Dir& d)
+void DB::writeInodeData(uint32_t ino_idx, std::vector<unsigned char>& buf)
 {
-	d.clear();
+	// lookup inode
+	const Inode& ino = getInode(ino_idx);
+	dircache.erase(ino_idx);
+
+	uint32_t new_codec = CODEC_NONE;
+	uint32_t new_raw_len = 0;
+
+	// compress, if enabled and if that saves at least one page
+	const Codec *codec = getCodec(options.codec);
+	size_t data_size = f.pageDataSize();
+	if (codec && (buf.size() > data_size)) {
+		std::vector<unsigned char> zbuf(sizeof(CompressedHdr));
+		codec->compress(&buf[0], buf.size(), zbuf);
+
+		size_t raw_pages = (buf.size() + data_size - 1) / data_size;
+		size_t z_pages = (zbuf.size() + data_size - 1) / data_size;
+
+		if (z_pages < raw_pages) {
+			CompressedHdr zhdr;
+			zhdr.z_len = zbuf.size() - sizeof(CompressedHdr);
+			zhdr.z_codec = codec->id();
+			zhdr.swap_h2n();
+			memcpy(&zbuf[0], &zhdr, sizeof(zhdr));
+
+			new_codec = codec->id();
+			new_raw_len = buf.size();
+			buf.swap(zbuf);
+		}
+	}
 
-	// read from storage into buffer
-	std::vector<unsigned char> buf;
-	readInodeData(ino_idx, buf);
+	if ((ino.codec != new_codec) || (ino.raw_len != new_raw_len)) {
+		Inode& mut_ino = getMutInode(ino_idx);
+		mut_ino.codec = new_codec;
+		mut_ino.raw_len = new_raw_len;
+	}
+
+	// grow inode storage, if needed
+	bufToPages(buf);
+	uint32_t n_pages = buf.size() / sb.page_size;
+	if (ino.size() < n_pages)
+		resizeInode(ino_idx, n_pages);
+
+	// write to storage
+	ino.write(f, buf, inodeExt(ino_idx));
+}
+
+// Decoded directory, from cache or storage.  The reference remains
+// valid until the directory is written, or the operation ends.
+const Dir& DB::getDir(uint32_t ino_idx)
+{
+	const Dir *cached = dircache.find(ino_idx);
+	if (cached)
+		return *cached;
+
+	Dir d;
+	loadDir(ino_idx, d);
+
+	// readers may race to decode the same directory
+	return dircache.insert(ino_idx, d);
+}
+
+// Decode directory from storage, bypassing the cache
+void DB::loadDir(uint32_t ino_idx, Dir& d)
+{
+	PageKindScope kind(PK_DIR);
+	PGDB2_PROBE1(dir__load__start, ino_idx);
+
+	// read from storage into scratch buffer
+	ArenaScope scope;
+	const unsigned char *data;
+	size_t len = readInodeData(ino_idx, scope.arena(), data);
 
 	// decode directory buffer
-	d.decode(buf);
+	d.decode(data, len);
+	stats.count(ST_DIRS_DECODED);
+	stats.count(ST_BYTES_DECODED, len);
+	PGDB2_PROBE3(dir__load__done, ino_idx, len, d.ents.size());
+
+	if (d.key_type != keyType())
+		throw std::runtime_error("Dir key type mismatch");
+}
+
+void DB::readDir(uint32_t ino_idx, Dir& d)
+{
+	d = getDir(ino_idx);
 }
 
 void DB::writeDir(uint32_t ino_idx, const Dir& d)
 {
+	PageKindScope kind(PK_DIR);
+
 	std::vector<unsigned char> buf;
 	d.encode(buf);
 
-	// lookup inode
-	assert(ino_idx < inotab.size());
-	const Inode& dir_ino = inotab.getIdx(ino_idx);
-	assert((dir_ino.size() * sb.page_size) >= buf.size());
+	// write directory to storage; caller writes inode table
+	writeInodeData(ino_idx, buf);
 
-	// write root directory to storage
-	bufSizeAlign(buf, sb.page_size);
-	dir_ino.write(f, buf);
+	Dir copy(d);
+	dircache.put(ino_idx, copy);
 }
 
 void DB::readExtList(std::vector<Extent> &ext_list, uint64_t ref, uint32_t len)
 {
-	ext_list.clear();
+	PageKindScope kind(PK_EXTLIST);
 
-	// input page
-	std::vector<unsigned char> page(sb.page_size);
-	f.read(page, ref, len);
+	// input pages, in scratch memory
+	ArenaScope scope;
+	unsigned char *pages = scope.arena().allocBytes(sb.page_size * len);
+	f.read(pages, ref, len);
+	size_t data_len = pagesToBuf(pages, len);
 
-	// decode header
-	const Extent *in_ext = (Extent *) &page[0];
+	decodeExtList(pages, data_len, ext_list);
+	PGDB2_PROBE3(extlist__load, ref, len, ext_list.size());
+}
 
-	Extent hdr(in_ext[0]);
-	hdr.swap_n2h();
+void DB::writeExtList(const std::vector<Extent>& ext_list,
+		      uint64_t ref, uint32_t max_len)
+{
+	assert(((ext_list.size() + 1) * sizeof(Extent)) <= (max_len * f.pageDataSize()));
 
-	// check header
-	if (hdr.ext_page != 0)
-		throw std::runtime_error("Extent list invalid hdr page");
-	if ((!(hdr.ext_flags & EF_MBO)) || (hdr.ext_flags & EF_MBZ) ||
-	    (!(hdr.ext_flags & EF_HDR)))
-		throw std::runtime_error("Extent list invalid hdr flags");
+	PageKindScope kind(PK_EXTLIST);
 
-	// pre-size input
-	ext_list.reserve(hdr.ext_len - 1);
+	std::vector<unsigned char> pages(f.pageDataSize() * max_len);
+	encodeExtList(ext_list, pages);
 
-	// decode extent list
-	for (unsigned int i = 1; i < hdr.ext_len; i++) {
-		Extent e(in_ext[i]);
-		e.swap_n2h();
+	// write to storage
+	bufToPages(pages);
+	f.write(pages, ref, max_len);
+}
 
-		if (e.ext_page == 0)
-			throw std::runtime_error("Extent list invalid page");
-		if ((!(e.ext_flags & EF_MBO)) || (e.ext_flags & EF_MBZ) ||
-		    (e.ext_flags & EF_HDR))
-			throw std::runtime_error("Extent list invalid flags");
+void DB::readFreeList()
+{
+	freelist.clear();
 
-		ext_list.push_back(e);
+	PageKindScope kind(PK_FREELIST);
+	const Inode& ino = getInode(DBINO_FREELIST);
+	if (ino.size() == 0)
+		return;
+
+	ArenaScope scope;
+	const unsigned char *data;
+	size_t len = readInodeData(DBINO_FREELIST, scope.arena(), data);
+
+	decodeExtList(data, len, freelist);
+}
+
+void DB::writeFreeList()
+{
+	const Inode& ino = getInode(DBINO_FREELIST);
+	size_t data_size = f.pageDataSize();
+
+	// grow storage from end of file, never from the free list
+	// itself; releasing the old storage adds at most one entry
+	size_t need = (freelist.size() + 2) * sizeof(Extent);
+	if ((ino.size() * data_size) < need) {
+		uint32_t n_pages = ((need * 2) + data_size - 1) / data_size;
+
+		Inode& mut_ino = getMutInode(DBINO_FREELIST);
+
+		const Extent *ext = inodeExt(DBINO_FREELIST);
+		std::vector<Extent> old_ext(ext, ext + mut_ino.e_count);
+		mut_ino.setExtent(allocPages(n_pages, false));
+
+		for (std::vector<Extent>::const_iterator it = old_ext.begin();
+		     it != old_ext.end(); it++)
+			freeExtent(*it);
 	}
+
+	std::vector<unsigned char> buf(ino.size() * data_size);
+	encodeExtList(freelist, buf);
+
+	PageKindScope kind(PK_FREELIST);
+	bufToPages(buf);
+	ino.write(f, buf, inodeExt(DBINO_FREELIST));
+
+	freelist_dirty = false;
 }
 
-void DB::writeExtList(const std::vector<Extent>& ext_list,
-		      uint64_t ref, uint32_t max_len)
+void DB::flush()
 {
-	assert(((ext_list.size() + 1) * sizeof(Extent)) <= (max_len * sb.page_size));
+	// order matters: writing the free list may update the
+	// inode table, and both may update the superblock
+	if (freelist_dirty)
+		writeFreeList();
+	if (inotab_dirty)
+		writeInodeTable();
+	if (sb_dirty)
+		writeSuperblock();
+}
 
-	std::vector<unsigned char> pages(sb.page_size * max_len);
+void DB::reclaim()
+{
+	// only with the DB locked exclusively: inodes and directories
+	// may be referenced for the duration of a read, and no reader
+	// can hold a page frame retired since the last call
+	MutexGuard guard(mem.mutex());
+	pagecache.quiesce();
+	mem.reclaim(~0U);
+}
 
-	Extent *out_ext = (Extent *) &pages[0];
+// Called by readers, before taking the DB lock shared.  Unless wait,
+// returns false if memory must be reclaimed first.
+bool DB::readerReclaim(bool wait)
+{
+	if (!mem.overLimit())
+		return true;
 
-	// encode header
-	out_ext[0].ext_page = 0;
-	out_ext[0].ext_len = ext_list.size() + 1;
-	out_ext[0].ext_flags = EF_MBO | EF_HDR;
-	out_ext[0].swap_h2n();
+	if (!wait)
+		return false;
 
-	// encode list
-	unsigned int out_idx = 1;
-	for (unsigned int i = 0; i < ext_list.size(); i++) {
-		const Extent& in_ext = ext_list[i];
+	WriteGuard guard(rwlock);
+	reclaim();
+	return true;
+}
 
-		if (((out_idx+1) * sizeof(Extent)) > pages.size())
-			throw std::runtime_error("Extent list exceeds max");
+void DB::sync()
+{
+	StatTimer timer(stats, OP_SYNC);
+	CommitScope commit(*this);
+	TraceScope tr(trace, TR_SYNC);
 
-		out_ext[out_idx] = in_ext;
-		out_ext[out_idx].swap_h2n();
+	flush();
+	f.sync();
+	tr.done();
+}
 
-		out_idx++;
+void DB::getStats(DBStats& out) const
+{
+	stats.snapshot(out);
+
+	// cache counts are updated by plain stores, see MemBudget
+	for (unsigned int id = 0; id < MEM__COUNT; id++) {
+		const MemStats& st = mem.stats[id];
+		MemStats& o = out.mem[id];
+		o.used = __atomic_load_n(&st.used, __ATOMIC_RELAXED);
+		o.peak = __atomic_load_n(&st.peak, __ATOMIC_RELAXED);
+		o.hits = __atomic_load_n(&st.hits, __ATOMIC_RELAXED);
+		o.misses = __atomic_load_n(&st.misses, __ATOMIC_RELAXED);
+		o.evictions = __atomic_load_n(&st.evictions, __ATOMIC_RELAXED);
 	}
 
-	// write to storage
-	f.write(pages, ref, max_len);
+	out.shm_hits = shm.hits();
+	out.shm_misses = shm.misses();
+}
+
+void DB::bufToPages(std::vector<unsigned char>& buf)
+{
+	size_t data_size = f.pageDataSize();
+	if (data_size == sb.page_size) {
+		bufSizeAlign(buf, sb.page_size);
+		return;
+	}
+
+	// spread logical data across pages, leaving room for
+	// each page's trailer.  Work backwards, as pages move up.
+	size_t n_pages = (buf.size() + data_size - 1) / data_size;
+	if (n_pages == 0)
+		n_pages = 1;
+
+	buf.resize(n_pages * sb.page_size);
+
+	for (size_t i = n_pages - 1; i > 0; i--)
+		memmove(&buf[i * sb.page_size], &buf[i * data_size], data_size);
+}
+
+void DB::pagesToBuf(std::vector<unsigned char>& buf)
+{
+	buf.resize(pagesToBuf(buf.empty() ? NULL : &buf[0],
+			      buf.size() / sb.page_size));
+}
+
+// squeeze out page trailers in place; returns data length
+size_t DB::pagesToBuf(unsigned char *buf, size_t n_pages)
+{
+	size_t data_size = f.pageDataSize();
+	if (data_size == sb.page_size)
+		return n_pages * sb.page_size;
+
+	// trailers already verified by File::read
+	for (size_t i = 1; i < n_pages; i++)
+		memmove(&buf[i * data_size], &buf[i * sb.page_size], data_size);
+
+	return n_pages * data_size;
 }
 
 DB::~DB()
 {
+	try {
+		stopTrace();
+	}
+	catch (std::exception& e) {
+		// records lost; nobody left to tell
+	}
+
 	if (!running)
 		return;
 
 	running = false;
+
+	if (options.f_write)
+		closeChanges();
 }
 
 } // namespace page
@@ -13,14 +13,47 @@
 
 namespace page {
 
+static uint64_t getLEInt(const unsigned char *p, size_t width)
+{
+	if (width == sizeof(uint32_t)) {
+		uint32_t v;
+		memcpy(&v, p, sizeof(v));
+		return le32toh(v);
+	}
+
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static void putLEInt(std::vector<unsigned char>& buf, uint64_t val,
+		     size_t width)
+{
+	unsigned char tmp[sizeof(uint64_t)];
+
+	if (width == sizeof(uint32_t)) {
+		uint32_t v = htole32((uint32_t) val);
+		memcpy(tmp, &v, sizeof(v));
+	} else {
+		uint64_t v = htole64(val);
+		memcpy(tmp, &v, sizeof(v));
+	}
+
+	buf.insert(buf.end(), tmp, tmp + width);
+}
+
 void Dir::decode(const std::vector<unsigned char>& buf)
+{
+	decode(buf.empty() ? NULL : &buf[0], buf.size());
+}
+
+void Dir::decode(const unsigned char *p, size_t len)
 {
 	// clear self
 	clear();
 
 	// initialize buffer walk
-	const unsigned char *p = &buf[0];
-	uint32_t bytes = buf.size();
+	uint32_t bytes = len;
 
 	// Decode directory header
 	if (bytes < sizeof(DirectoryHdr))
@@ -34,6 +67,12 @@ void Dir::decode(const std::vector<unsigned char>& buf)
 	if (!hdr->valid())
 		throw std::runtime_error("Dir hdr corrupted");
 
+	key_type = hdr->keyType();
+	if (key_type != KT_BYTES) {
+		decodeFixed(p, bytes, hdr->d_len);
+		return;
+	}
+
 	// quick size sanity check and pre-alloc
 	if (bytes < (sizeof(DirectoryEnt) * hdr->d_len))	// rough
 		throw std::runtime_error("Dir truncated");
@@ -109,6 +148,23 @@ void Dir::decode(const std::vector<unsigned char>& buf)
 			de.key_len = buf_de->de_key_len;
 			de.value_len = buf_de->de_val_len;
 			break;
+
+		case DE_KEY_PACKED:
+			if (bytes < (buf_de->de_key_len + sizeof(uint64_t)))
+				throw std::runtime_error("Invalid dirent ksz");
+			de.key.assign((const char *) p, buf_de->de_key_len);
+			p += buf_de->de_key_len;
+			bytes -= buf_de->de_key_len;
+
+			de.vh_page = getLEInt(p, sizeof(uint64_t));
+			p += sizeof(uint64_t);
+			bytes -= sizeof(uint64_t);
+
+			de.vh_slot = buf_de->de_ino;
+			de.ino_idx = 0;
+			de.key_len = buf_de->de_key_len;
+			de.value_len = buf_de->de_val_len;
+			break;
 		}
 
 		ents.push_back(de);
@@ -127,11 +183,20 @@ void Dir::encode(std::vector<unsigned char>& buf) const
 	memcpy(hdr.magic, DIR_MAGIC, sizeof(hdr.magic));
 	hdr.d_len = ents.size();
 	hdr.d_flags = DF_MBO;
+	if (key_type == KT_U32)
+		hdr.d_flags |= DF_KEY_U32;
+	else if (key_type == KT_U64)
+		hdr.d_flags |= DF_KEY_U64;
 	hdr.swap_h2n();
 
 	unsigned char *p = (unsigned char *) &hdr;
 	buf.insert(buf.end(), p, p + sizeof(hdr));
 
+	if (key_type != KT_BYTES) {
+		encodeFixed(buf);
+		return;
+	}
+
 	// Encode directory entries
 	for (std::vector<DirEntry>::const_iterator it = ents.begin();
 	     it != ents.end(); it++) {
@@ -157,7 +222,7 @@ void Dir::encode(std::vector<unsigned char>& buf) const
 
 		case DE_KEY:
 			buf_de.de_key_len = de.key.size();
-			buf_de.de_val_len = 0;
+			buf_de.de_val_len = de.value_len;
 			buf_de.de_ino = de.ino_idx;
 			break;
 
@@ -166,6 +231,12 @@ void Dir::encode(std::vector<unsigned char>& buf) const
 			buf_de.de_val_len = de.value.size();
 			buf_de.de_ino = 0;
 			break;
+
+		case DE_KEY_PACKED:
+			buf_de.de_key_len = de.key.size();
+			buf_de.de_val_len = de.value_len;
+			buf_de.de_ino = de.vh_slot;
+			break;
 		}
 
 		buf_de.swap_h2n();
@@ -194,28 +265,155 @@ void Dir::encode(std::vector<unsigned char>& buf) const
 			buf.insert(buf.end(), de.key.begin(), de.key.end());
 			buf.insert(buf.end(), de.value.begin(), de.value.end());
 			break;
+
+		case DE_KEY_PACKED:
+			buf.insert(buf.end(), de.key.begin(), de.key.end());
+			putLEInt(buf, de.vh_page, sizeof(uint64_t));
+			break;
 		}
 
 	}
 }
 
-bool Dir::match(const std::string& key, unsigned int& idx) const
+void Dir::decodeFixed(const unsigned char *p, uint32_t bytes, uint32_t n_ents)
 {
-	for (idx = 0; idx < ents.size(); idx++) {
-		const DirEntry& ent = ents[idx];
-
-		int key_cmp = key.compare(ent.key);
-		if (key_cmp < 0)
-			return false;
-		if (key_cmp == 0)
-			return true;
-
-		if ((ent.d_type == DE_DIR) &&
-		    (key.compare(ent.key_end) <= 0))
-			return true;
+	const size_t width = keyTypeWidth(key_type);
+
+	// quick size sanity check and pre-alloc
+	if (bytes < ((sizeof(DirectoryEntFixed) + width) * n_ents))
+		throw std::runtime_error("Dir truncated");
+
+	ents.reserve(n_ents);
+
+	for (unsigned int dir_idx = 0; dir_idx < n_ents; dir_idx++) {
+
+		// Decode fixed length portion of dir ent, plus key slot
+		if (bytes < (sizeof(DirectoryEntFixed) + width))
+			throw std::runtime_error("Dir ent truncated");
+
+		DirectoryEntFixed buf_de;
+		memcpy(&buf_de, p, sizeof(buf_de));
+		p += sizeof(DirectoryEntFixed);
+		bytes -= sizeof(DirectoryEntFixed);
+
+		buf_de.swap_n2h();
+		if (!buf_de.valid())
+			throw std::runtime_error("Dir ent buf corrupted");
+
+		DirEntry de;
+		de.d_type = buf_de.dType();
+		de.ino_idx = buf_de.de_ino;
+		de.key_len = width;
+
+		de.ikey = getLEInt(p, width);
+		p += width;
+		bytes -= width;
+
+		// Decode variable length trailer
+		switch (de.d_type) {
+		case DE_NONE:
+		default:
+			throw std::runtime_error("Invalid dirent type");
+
+		case DE_DIR:
+			if (bytes < width)
+				throw std::runtime_error("Invalid dirent kesz");
+			de.ikey_end = getLEInt(p, width);
+			p += width;
+			bytes -= width;
+
+			de.key_end_len = width;
+			break;
+
+		case DE_KEY:
+			de.value_len = buf_de.de_val_len;
+			break;
+
+		case DE_KEY_VALUE:
+			if (bytes < buf_de.de_val_len)
+				throw std::runtime_error("Invalid dirent vsz");
+			de.value.assign((const char *) p, buf_de.de_val_len);
+			p += buf_de.de_val_len;
+			bytes -= buf_de.de_val_len;
+
+			de.value_len = buf_de.de_val_len;
+			break;
+
+		case DE_KEY_PACKED:
+			if (bytes < sizeof(uint64_t))
+				throw std::runtime_error("Invalid dirent vhsz");
+			de.vh_page = getLEInt(p, sizeof(uint64_t));
+			p += sizeof(uint64_t);
+			bytes -= sizeof(uint64_t);
+
+			de.vh_slot = buf_de.de_ino;
+			de.ino_idx = 0;
+			de.value_len = buf_de.de_val_len;
+			break;
+		}
+
+		ents.push_back(de);
 	}
+}
+
+void Dir::encodeFixed(std::vector<unsigned char>& buf) const
+{
+	const size_t width = keyTypeWidth(key_type);
+
+	buf.reserve(buf.size() +
+		    ((sizeof(DirectoryEntFixed) + width) * ents.size()));
+
+	for (std::vector<DirEntry>::const_iterator it = ents.begin();
+	     it != ents.end(); it++) {
+		const DirEntry& de = (*it);
+
+		// Encode fixed length directory entry
+		DirectoryEntFixed buf_de;
+		buf_de.de_flags = DF_MBO | de.d_type;
+		buf_de.de_val_len = 0;
+		buf_de.de_ino = 0;
+
+		switch (de.d_type) {
+		case DE_NONE:
+		default:
+			// should never happen
+			assert(0);
+			break;
+
+		case DE_DIR:
+			buf_de.de_ino = de.ino_idx;
+			break;
+
+		case DE_KEY:
+			buf_de.de_val_len = de.value_len;
+			buf_de.de_ino = de.ino_idx;
+			break;
+
+		case DE_KEY_VALUE:
+			buf_de.de_val_len = de.value.size();
+			break;
+
+		case DE_KEY_PACKED:
+			buf_de.de_val_len = de.value_len;
+			buf_de.de_ino = de.vh_slot;
+			break;
+		}
+
+		buf_de.swap_h2n();
+
+		unsigned char *p = (unsigned char *) &buf_de;
+		buf.insert(buf.end(), p, p + sizeof(buf_de));
 
-	return false;
+		// Encode key slot(s) and variable length trailer
+		putLEInt(buf, de.ikey, width);
+
+		if (de.d_type == DE_DIR)
+			putLEInt(buf, de.ikey_end, width);
+		else if (de.d_type == DE_KEY_VALUE)
+			buf.insert(buf.end(), de.value.begin(), de.value.end());
+		else if (de.d_type == DE_KEY_PACKED)
+			putLEInt(buf, de.vh_page, sizeof(uint64_t));
+	}
 }
 
 } // namespace page
@@ -15,9 +15,44 @@
 #include <vector>
 #include <assert.h>
 #include <pgdb2-file.h>
+#include <pgdb2-probes.h>
 
 namespace page {
 
+bool Readahead::access(uint64_t pos, uint64_t len,
+		       uint64_t& ra_pos, uint64_t& ra_len)
+{
+	uint64_t end = pos + len;
+	bool seq = (pos == next);
+	next = end;
+
+	// random access: end any sequential run
+	if (!seq || (max_window == 0)) {
+		hinted = end;
+		window = 0;
+		return false;
+	}
+
+	if (hinted < end)
+		hinted = end;
+
+	// wait until less than half a window remains prefetched
+	if (window && ((hinted - end) >= (window / 2)))
+		return false;
+
+	window = window ? (window * 2) : min_window;
+	if (window < len)
+		window = len;
+	if (window > max_window)
+		window = max_window;
+
+	ra_pos = hinted;
+	ra_len = (end + window) - hinted;
+	hinted = end + window;
+
+	return (ra_len > 0);
+}
+
 File::File(const std::string& filename_, int o_flags_, size_t page_size_)
 {
 	fd = -1;
@@ -25,7 +60,13 @@ File::File(const std::string& filename_, int o_flags_, size_t page_size_)
 	filename = filename_;
 	page_size = page_size_;
 	n_pages = 0;
-	cur_fpos = -1;
+	csum = false;
+	cache = NULL;
+	shm = NULL;
+	changes = NULL;
+	stats = NULL;
+	ra_hints = 0;
+	ra_max = 1024 * 1024;
 }
 
 File::~File()
@@ -39,8 +80,8 @@ void File::open()
 	if (fd < 0)
 		throw std::runtime_error("Failed open " + filename + ": " + strerror(errno));
 
-	cur_fpos = 0;
-
+	// point lookups dominate; sequential runs are detected
+	// and prefetched explicitly, see willNeed()
 #ifdef HAVE_POSIX_FADVISE
 	if (::posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM) < 0)
 		throw std::runtime_error("Failed fadvise " + filename + ": " + strerror(errno));
@@ -59,11 +100,16 @@ void File::setPageCount()
 
 		n_pages = st.st_size / page_size;
 	}
+
+	if (cache)
+		cache->setCapacity(n_pages);
 }
 
 void File::setPageSize(size_t sz)
 {
 	page_size = sz;
+	if (cache)
+		cache->setPageSize(page_size);
 
 	setPageCount();
 }
@@ -75,6 +121,8 @@ void File::open(std::string filename_, int o_flags_, size_t page_size_)
 	filename = filename_;
 	o_flags = o_flags_;
 	page_size = page_size_;
+	if (cache)
+		cache->setPageSize(page_size);
 
 	open();
 }
@@ -89,7 +137,101 @@ void File::close()
 	o_flags = 0;
 	filename.clear();
 	n_pages = 0;
-	cur_fpos = -1;
+	csum = false;
+	if (cache)
+		cache->clear();
+}
+
+// Another process changed the file: forget its size and contents
+void File::refresh()
+{
+	setPageCount();
+	if (cache)
+		cache->clear();
+}
+
+void File::setCache(PageCache *cache_)
+{
+	cache = cache_;
+	if (cache) {
+		cache->setPageSize(page_size);
+		cache->setCapacity(n_pages);
+	}
+}
+
+// Hint that pages will soon be read; the kernel reads them
+// asynchronously, despite POSIX_FADV_RANDOM
+void File::willNeed(uint64_t index, uint64_t page_count)
+{
+	if (index >= n_pages)
+		return;
+	if (page_count > (n_pages - index))
+		page_count = n_pages - index;
+	if (page_count == 0)
+		return;
+
+	__atomic_fetch_add(&ra_hints, 1, __ATOMIC_RELAXED);
+	if (stats)
+		stats->count(ST_PREFETCHES);
+
+#ifdef HAVE_POSIX_FADVISE
+	// advisory only: failure is not an error
+	(void) ::posix_fadvise(fd, index * page_size, page_count * page_size,
+			       POSIX_FADV_WILLNEED);
+#endif
+}
+
+void File::sealPages(unsigned char *buf, uint64_t index, size_t page_count) const
+{
+	size_t data_size = pageDataSize();
+
+	for (size_t i = 0; i < page_count; i++) {
+		unsigned char *p = buf + (i * page_size);
+
+		PageTrailer pt;
+		pt.pt_crc = crc32c(0, p, data_size);
+		pt.pt_page = (uint32_t) (index + i);
+		pt.swap_h2n();
+
+		memcpy(p + data_size, &pt, sizeof(pt));
+	}
+}
+
+void File::verifyPages(const unsigned char *buf, uint64_t index, size_t page_count) const
+{
+	size_t data_size = pageDataSize();
+
+	for (size_t i = 0; i < page_count; i++) {
+		const unsigned char *p = buf + (i * page_size);
+
+		PageTrailer pt;
+		memcpy(&pt, p + data_size, sizeof(pt));
+		pt.swap_n2h();
+
+		if ((pt.pt_page != (uint32_t) (index + i)) ||
+		    (pt.pt_crc != crc32c(0, p, data_size)))
+			throw std::runtime_error("Page checksum mismatch " + filename);
+	}
+}
+
+bool& NoBlockScope::flag()
+{
+	static thread_local bool no_block = false;
+	return no_block;
+}
+
+ReadaheadScope::ReadaheadScope(const File& f)
+	: file(&f), prev(current())
+{
+	uint64_t max_pages = f.readaheadMax() / f.pageSize();
+	ra.setWindow((max_pages < 4) ? max_pages : 4, max_pages);
+	current() = this;
+}
+
+ReadaheadScope*& ReadaheadScope::current()
+{
+	static thread_local ReadaheadScope *cur = NULL;
+	return cur;
 }
 
 void File::read(void *buf, uint64_t index, size_t page_count)
@@ -97,21 +239,61 @@ void File::read(void *buf, uint64_t index, size_t page_count)
 	if ((index + page_count) > n_pages)
 		throw std::runtime_error("Read past EOF");
 
-	// seek to page
-	off_t lrc = ::lseek(fd, index * page_size, SEEK_SET);
-	if (lrc < 0)
-		throw std::runtime_error("Failed seek " + filename + ": " + strerror(errno));
+	unsigned int kind = PageKindScope::kind();
+
+	PGDB2_PROBE2(file__read__start, index, page_count);
+
+	bool cacheable = cache && (page_count <= PageCache::max_io_pages);
+	if (cacheable && cache->get(index, page_count, (unsigned char *) buf)) {
+		if (stats)
+			stats->pages(IO_CACHED, kind, page_count);
+		PGDB2_PROBE3(file__read__done, index, page_count, 0);
+		return;
+	}
+
+	// pages verified by another process
+	if (cacheable && shm &&
+	    shm->getPages(index, page_count, (unsigned char *) buf)) {
+		cache->put(index, page_count, (const unsigned char *) buf);
+		if (stats)
+			stats->pages(IO_CACHED, kind, page_count);
+		PGDB2_PROBE3(file__read__done, index, page_count, 1);
+		return;
+	}
+
+	if (NoBlockScope::active())
+		throw WouldBlock();
 
 	size_t io_size = page_size * page_count;
 
-	// begin I/O
-	ssize_t rrc = ::read(fd, buf, io_size);
+	// positioned I/O: no shared file position between readers
+	ssize_t rrc = ::pread(fd, buf, io_size, index * page_size);
 	if (rrc < 0)
 		throw std::runtime_error("Failed read " + filename + ": " + strerror(errno));
 	if (rrc != (ssize_t)io_size)
 		throw std::runtime_error("Short read");
 
-	cur_fpos = lrc + io_size;
+	if (stats) {
+		stats->count(ST_READ_CALLS);
+		stats->pages(IO_READ, kind, page_count);
+	}
+
+	// sequential runs of this thread's stream: prefetch ahead
+	Readahead *ra = ReadaheadScope::stream(this);
+	uint64_t ra_index, ra_count;
+	if (ra && ra->access(index, page_count, ra_index, ra_count))
+		willNeed(ra_index, ra_count);
+
+	if (csum)
+		verifyPages((const unsigned char *) buf, index, page_count);
+
+	if (cacheable) {
+		cache->put(index, page_count, (const unsigned char *) buf);
+		if (shm)
+			shm->putPages(index, page_count, (const unsigned char *) buf);
+	}
+
+	PGDB2_PROBE3(file__read__done, index, page_count, 2);
 }
 
 void File::read(std::vector<unsigned char>& buf_vec, uint64_t index,
@@ -127,29 +309,47 @@ void File::read(std::vector<unsigned char>& buf_vec, uint64_t index,
 
 void File::write(const void *buf, uint64_t index, size_t page_count)
 {
-	// seek to page, if not already there
-	off_t lrc = cur_fpos;
-	off_t want_fpos = index * page_size;
-	if (want_fpos != lrc) {
-		lrc = ::lseek(fd, want_fpos, SEEK_SET);
-		if (lrc < 0)
-			throw std::runtime_error("Failed seek " + filename + ": " + strerror(errno));
+	size_t io_size = page_size * page_count;
+
+	// checksum a private copy of the caller's pages
+	std::vector<unsigned char> sealed;
+	if (csum) {
+		sealed.assign((const unsigned char *) buf,
+			      (const unsigned char *) buf + io_size);
+		sealPages(&sealed[0], index, page_count);
+		buf = &sealed[0];
 	}
 
-	size_t io_size = page_size * page_count;
+	PGDB2_PROBE2(file__write__start, index, page_count);
 
 	// begin I/O
-	ssize_t rrc = ::write(fd, buf, io_size);
+	ssize_t rrc = ::pwrite(fd, buf, io_size, index * page_size);
 	if (rrc < 0)
 		throw std::runtime_error("Failed write " + filename + ": " + strerror(errno));
 	if (rrc != (ssize_t)io_size)
 		throw std::runtime_error("Short write");
 
-	// update cached file position, file size
-	cur_fpos = lrc + io_size;
+	if (stats) {
+		stats->count(ST_WRITE_CALLS);
+		stats->pages(IO_WRITTEN, PageKindScope::kind(), page_count);
+	}
 
-	if ((index + page_count) > n_pages)
+	// update cached file size, resident pages
+	if (cache)
+		cache->update(index, page_count, (const unsigned char *) buf);
+	// the shared cache must never hold a stale page
+	if (shm)
+		shm->putPages(index, page_count, (const unsigned char *) buf, true);
+	if (changes)
+		changes->mark(index, page_count);
+
+	if ((index + page_count) > n_pages) {
 		n_pages = index + page_count;
+		if (cache)
+			cache->setCapacity(n_pages);
+	}
+
+	PGDB2_PROBE2(file__write__done, index, page_count);
 }
 
 void File::write(const std::vector<unsigned char>& buf_vec, uint64_t index,
@@ -171,9 +371,16 @@ void File::stat(struct stat& st)
 
 void File::sync()
 {
+	PGDB2_PROBE0(file__sync__start);
+
 	int frc = ::fsync(fd);
 	if (frc < 0)
 		throw std::runtime_error("Failed fsync " + filename + ": " + strerror(errno));
+
+	if (stats)
+		stats->count(ST_FSYNCS);
+
+	PGDB2_PROBE0(file__sync__done);
 }
 
 void File::resize(uint64_t page_count)
@@ -201,13 +408,8 @@ void File::resize(uint64_t page_count)
 			throw std::runtime_error("Failed ftruncate " + filename + ": " + strerror(errno));
 
 		n_pages = page_count;
-
-		if (cur_fpos > new_size) {
-			off_t lrc = ::lseek(fd, 0, SEEK_SET);
-			if (lrc < 0)
-				throw std::runtime_error("Failed seek " + filename + ": " + strerror(errno));
-			cur_fpos = 0;
-		}
+		if (cache)
+			cache->clear();
 	}
 
 	// full sync to update OS filesystem inode, directory etc.
@@ -5,73 +5,488 @@
 
 #include "pgdb2-config.h"
 
+#include <string.h>
 #include <assert.h>
+#include <algorithm>
 #include <pgdb2.h>
+#include <pgdb2-probes.h>
+#include <pgdb2-trace.h>
 
 namespace page {
 
-bool DB::get(const std::string& key, std::string& valueOut)
+// Upper bound on bytes read per I/O by ranged and streaming reads
+static const size_t READ_CHUNK_BYTES = 256 * 1024;
+
+void DB::readValue(const DirEntry& ent, std::string& valueOut)
 {
+	PageKindScope kind(PK_VALUE);
+
+	switch (ent.d_type) {
+
+	// value in dirent
+	case DE_KEY_VALUE:
+		valueOut = ent.value;
+		break;
+
+	// value in inode
+	case DE_KEY: {
+		// uncompressed: read straight into caller's string
+		if (getInode(ent.ino_idx).codec == CODEC_NONE) {
+			valueOut.resize(ent.value_len);
+			if (ent.value_len > 0)
+				readInodeRange(ent.ino_idx, 0, ent.value_len,
+					       (unsigned char *) &valueOut[0]);
+			break;
+		}
+
+		ArenaScope scope;
+		const unsigned char *data;
+		size_t len = readInodeData(ent.ino_idx, scope.arena(), data);
+
+		if (ent.value_len > len)
+			throw std::runtime_error("Value inode truncated");
+
+		valueOut.assign((const char *) data, ent.value_len);
+		break;
+	}
+
+	// value in shared value heap page
+	case DE_KEY_PACKED: {
+		ArenaScope scope;
+		ValueHeapPage vhp;
+		readHeapPage(ent.vh_page, scope.arena(), vhp);
+
+		if (!vhp.get(ent.vh_slot, valueOut) ||
+		    (valueOut.size() != ent.value_len))
+			throw std::runtime_error("Value heap slot invalid");
+		break;
+	}
+
+	case DE_DIR:
+	case DE_NONE:
+	default:
+		throw std::runtime_error("Invalid dirent type");
+	}
+}
+
+void DB::readInodeRange(uint32_t ino_idx, uint64_t offset, size_t len,
+			unsigned char *out)
+{
+	PageKindScope kind(PK_VALUE);
+	size_t data_size = f.pageDataSize();
+
+	const Inode& ino = getInode(ino_idx);
+	if ((offset + len) > ((uint64_t) ino.size() * data_size))
+		throw std::runtime_error("Value inode truncated");
+
+	const Extent *ext = inodeExt(ino_idx);
+
+	// locate extent holding first logical page
+	uint64_t lpage = offset / data_size;
+	size_t pg_off = offset % data_size;
+
+	uint32_t ei = 0;
+	uint64_t ext_start = 0;		// logical page at start of ext[ei]
+	while (lpage >= (ext_start + ext[ei].ext_len)) {
+		ext_start += ext[ei].ext_len;
+		ei++;
+	}
+
+	// read only the pages covering the range, at most
+	// READ_CHUNK_BYTES at a time, never crossing an extent
+	uint64_t chunk_pages = READ_CHUNK_BYTES / sb.page_size;
+	if (chunk_pages == 0)
+		chunk_pages = 1;
+
+	uint64_t max_pages = (pg_off + len + data_size - 1) / data_size;
+	if (max_pages > chunk_pages)
+		max_pages = chunk_pages;
+
+	ArenaScope scope;
+	unsigned char *buf = scope.arena().allocBytes(max_pages * sb.page_size);
+
+	uint64_t range_end = offset + len;
+	uint64_t ra_end = 0;		// logical bytes prefetched through
+
+	while (len > 0) {
+		uint64_t n = (pg_off + len + data_size - 1) / data_size;
+		uint64_t ext_left = ext_start + ext[ei].ext_len - lpage;
+		if (n > ext_left)
+			n = ext_left;
+		if (n > chunk_pages)
+			n = chunk_pages;
+
+		// multi-chunk reads: keep up to readahead_max bytes
+		// prefetched past this chunk, across extents, so the
+		// kernel reads them while we copy
+		uint64_t chunk_end = (lpage + n) * data_size;
+		uint64_t ra_want = chunk_end + options.readahead_max;
+		if (ra_want > range_end)
+			ra_want = range_end;
+		if (ra_end < chunk_end)
+			ra_end = chunk_end;
+		if ((ra_want > ra_end) &&
+		    (((ra_want - ra_end) >= (options.readahead_max / 2)) ||
+		     (ra_want == range_end))) {
+			prefetchInode(ino_idx, ra_end, ra_want - ra_end);
+			ra_end = ra_want;
+		}
+
+		f.read(buf, ext[ei].ext_page + (lpage - ext_start), n);
+		pagesToBuf(buf, n);
+
+		size_t copy = std::min(len, (size_t)(n * data_size) - pg_off);
+		memcpy(out, &buf[pg_off], copy);
+
+		out += copy;
+		len -= copy;
+		pg_off = 0;
+		lpage += n;
+
+		if (lpage == (ext_start + ext[ei].ext_len)) {
+			ext_start += ext[ei].ext_len;
+			ei++;
+		}
+	}
+}
+
+// Hint that logical byte range of inode data will soon be read
+void DB::prefetchInode(uint32_t ino_idx, uint64_t offset, uint64_t len)
+{
+	size_t data_size = f.pageDataSize();
+
+	const Inode& ino = getInode(ino_idx);
+	const Extent *ext = inodeExt(ino_idx);
+
+	uint64_t first = offset / data_size;
+	uint64_t last = (offset + len + data_size - 1) / data_size;
+	if (last > ino.size())
+		last = ino.size();
+
+	// one hint per extent touched
+	uint64_t ext_start = 0;		// logical page at start of ext[i]
+	for (uint32_t i = 0; (i < ino.e_count) && (first < last); i++) {
+		uint64_t ext_end = ext_start + ext[i].ext_len;
+		if (first < ext_end) {
+			uint64_t n = std::min(last, ext_end) - first;
+			f.willNeed(ext[i].ext_page + (first - ext_start), n);
+			first += n;
+		}
+		ext_start = ext_end;
+	}
+}
+
+void DB::readValueRange(ValueReader& reader, uint64_t offset, size_t len,
+			unsigned char *out)
+{
+	const DirEntry& ent = reader.ent;
+
+	// value in dirent
+	if (ent.d_type == DE_KEY_VALUE) {
+		memcpy(out, ent.value.data() + offset, len);
+		return;
+	}
+
+	// uncompressed value in inode: read touched pages only
+	if ((ent.d_type == DE_KEY) &&
+	    (getInode(ent.ino_idx).codec == CODEC_NONE)) {
+		// streaming: prefetch ahead of sequential reads
+		uint64_t ra_pos, ra_len;
+		if (reader.ra.access(offset, len, ra_pos, ra_len))
+			prefetchInode(ent.ino_idx, ra_pos, ra_len);
+
+		readInodeRange(ent.ino_idx, offset, len, out);
+		return;
+	}
+
+	// value heap slot, or compressed inode: read whole value once
+	if (!reader.cached) {
+		readValue(ent, reader.cache);
+		reader.cached = true;
+	}
+
+	memcpy(out, reader.cache.data() + offset, len);
+}
+
+// Search for key; the returned entry points into the directory
+// cache, and remains valid until the operation ends.  If depth,
+// sets it to the number of directories searched.
+template <class Cmp>
+const DirEntry *DB::findKey(const typename Cmp::key_type& key,
+			    unsigned int *depth)
+{
+	unsigned int levels;
+	if (!depth)
+		depth = &levels;
+	*depth = 0;
+
 	if (!running)
-		return false;	// not found
+		return NULL;	// not found
 
 	// Start search at root directory
 	uint32_t dir_ino = DBINO_ROOT_DIR;
-	bool recurse = false;
 
-	// Loop through successive directories as needed
-	while (recurse) {
+	// Loop through successive directories as needed; a deeper
+	// tree is corrupt, perhaps cyclic
+	while (*depth < DIR_MAX_DEPTH) {
 
 		// Read directory
-		Dir dir;
-		readDir(dir_ino, dir);
-
-		// Loop through directory entry keys
-		for (size_t i = 0; i < dir.ents.size(); i++) {
-			const DirEntry& ent = dir.ents[i];
-
-			// ASCII compare search key to dirent key
-			int cmpres = key.compare(ent.key);
-
-			// Key entry larger: Search key not in db
-			if (cmpres < 0) 
-				return false;	// not found
-
-			// Case 1: Matched key inside key range
-			else if ((ent.d_type == DE_DIR) &&
-			    (key.compare(ent.key_end) <= 0)) {
-				recurse = true;
-				dir_ino = ent.ino_idx;
-				continue;
-			}
-
-			// Case 2: Matched key, value in dirent
-			else if ((ent.d_type == DE_KEY_VALUE) &&
-				 (cmpres == 0)) {
-				valueOut = ent.value;
-				return true;	// found
-			}
-
-			// Case 3: Matched key, value in inode
-			else if ((ent.d_type == DE_KEY) &&
-				 (cmpres == 0)) {
-				// Read data from inode
-				std::vector<unsigned char> buf;
-				readInodeData(ent.ino_idx, buf);
-
-				// Return data
-				valueOut.assign(buf.begin(),buf.end());
-				return true;	// found
-			}
-
-			// Otherwise, continue searching through directory
-			assert(cmpres > 0);
+		const Dir& dir = getDir(dir_ino);
+		stats.count(ST_DIR_LEVELS);
+		(*depth)++;
+
+		// Search directory entry keys
+		unsigned int idx;
+		if (!dir.match<Cmp>(key, idx))
+			return NULL;	// not found
+
+		const DirEntry& ent = dir.ents[idx];
+
+		switch (ent.d_type) {
+
+		// Case 1: Matched key inside key range
+		case DE_DIR:
+			dir_ino = ent.ino_idx;
+			break;		// recurse
+
+		// Case 2: Matched key; value in dirent, inode or heap
+		default:
+			return &ent;	// found
 		}
+	}
+
+	throw std::runtime_error("Directory tree too deep");
+}
+
+const DirEntry *DB::lookup(const std::string& key, unsigned int *depth)
+{
+	if (keyType() != KT_BYTES)
+		throw std::runtime_error("DB key type mismatch");
 
-		break;	// fall through to 'not found'
+	return findKey<BytewiseCompare>(key, depth);
+}
+
+const DirEntry *DB::lookup(uint64_t key, unsigned int *depth)
+{
+	switch (keyType()) {
+	case KT_U32:
+		if (key > UINT32_MAX) {
+			if (depth)
+				*depth = 0;
+			return NULL;	// not found
+		}
+		return findKey<U32Compare>((uint32_t) key, depth);
+
+	case KT_U64:
+		return findKey<U64Compare>(key, depth);
+
+	case KT_BYTES:
+	default:
+		throw std::runtime_error("DB key type mismatch");
+	}
+}
+
+// get__start arguments: byte keys as (key, key_len, 0), fixed-width
+// keys as (NULL, 0, ikey)
+struct ProbeKey {
+	const char	*data;
+	size_t		len;
+	uint64_t	ikey;
+
+	ProbeKey(const std::string& key)
+		: data(key.data()), len(key.size()), ikey(0) {}
+	ProbeKey(uint64_t key) : data(NULL), len(0), ikey(key) {}
+};
+
+template <typename K>
+bool DB::getKey(const K& key, std::string& valueOut)
+{
+	ProbeKey pk(key);
+	PGDB2_PROBE3(get__start, pk.data, pk.len, pk.ikey);
+
+	StatTimer timer(stats, OP_GET);
+	ReadScope scope(*this);
+	TraceScope tr(trace, TR_GET, key);
+
+	unsigned int depth;
+	const DirEntry *ent = lookup(key, &depth);
+	if (!ent) {
+		PGDB2_PROBE3(get__done, 0, depth, (size_t) 0);
+		tr.done(0, false);
+		return false;
+	}
+
+	readValue(*ent, valueOut);
+	PGDB2_PROBE3(get__done, 1, depth, valueOut.size());
+	tr.done(valueOut.size());
+	return true;
+}
+
+bool DB::get(const std::string& key, std::string& valueOut)
+{
+	return getKey(key, valueOut);
+}
+
+bool DB::get(uint64_t key, std::string& valueOut)
+{
+	return getKey(key, valueOut);
+}
+
+template <typename K>
+bool DB::tryGetKey(const K& key, bool& found, std::string& valueOut)
+{
+	StatTimer timer(stats, OP_GET);
+	ReadScope scope(*this, false);
+	if (!scope.locked()) {
+		stats.count(ST_WOULD_BLOCK);
+		return false;
+	}
+
+	TraceScope tr(trace, TR_GET, key);
+	const DirEntry *ent;
+	std::string value;
+
+	try {
+		NoBlockScope no_block;
+
+		ent = lookup(key);
+		if (ent)
+			readValue(*ent, value);
+	}
+	catch (WouldBlock& e) {
+		stats.count(ST_WOULD_BLOCK);
+		tr.cancel();
+		return false;
+	}
+
+	found = (ent != NULL);
+	tr.done(value.size(), found);
+	valueOut.swap(value);
+	return true;
+}
+
+bool DB::tryGet(const std::string& key, bool& found, std::string& valueOut)
+{
+	return tryGetKey(key, found, valueOut);
+}
+
+bool DB::tryGet(uint64_t key, bool& found, std::string& valueOut)
+{
+	return tryGetKey(key, found, valueOut);
+}
+
+template <typename K>
+bool DB::openValueKey(const K& key, ValueReader& reader)
+{
+	StatTimer timer(stats, OP_GET);
+	ReadScope scope(*this);
+	TraceScope tr(trace, TR_OPEN, key);
+
+	const DirEntry *ent = lookup(key);
+	if (!ent) {
+		tr.done(0, false);
+		return false;
+	}
+
+	reader.open(this, *ent);
+	tr.done(reader.size());
+	return true;
+}
+
+bool DB::openValue(const std::string& key, ValueReader& reader)
+{
+	return openValueKey(key, reader);
+}
+
+bool DB::openValue(uint64_t key, ValueReader& reader)
+{
+	return openValueKey(key, reader);
+}
+
+// Read up to len bytes at offset; empty if offset is past the end
+void DB::readerRange(ValueReader& reader, uint64_t offset, size_t len,
+		     std::string& valueOut)
+{
+	valueOut.clear();
+	if (offset >= reader.size())
+		return;
+
+	if (len > (reader.size() - offset))
+		len = reader.size() - offset;
+
+	valueOut.resize(len);
+	if (len > 0)
+		readValueRange(reader, offset, len,
+			       (unsigned char *) &valueOut[0]);
+}
+
+template <typename K>
+bool DB::getRangeKey(const K& key, uint64_t offset, size_t len,
+		     std::string& valueOut)
+{
+	StatTimer timer(stats, OP_GET);
+	ReadScope scope(*this);
+	TraceScope tr(trace, TR_GET_RANGE, key);
+	tr.setArg(offset);
+
+	const DirEntry *ent = lookup(key);
+	if (!ent) {
+		tr.done(0, false);
+		return false;
 	}
 
-	return false;	// not found
+	ValueReader reader;
+	reader.open(this, *ent);
+	readerRange(reader, offset, len, valueOut);
+	tr.done(valueOut.size());
+	return true;
+}
+
+bool DB::getRange(const std::string& key, uint64_t offset, size_t len,
+		  std::string& valueOut)
+{
+	return getRangeKey(key, offset, len, valueOut);
+}
+
+bool DB::getRange(uint64_t key, uint64_t offset, size_t len,
+		  std::string& valueOut)
+{
+	return getRangeKey(key, offset, len, valueOut);
+}
+
+void ValueReader::open(DB *db_, const DirEntry& ent_)
+{
+	db = db_;
+	ent = ent_;
+	pos = 0;
+	cache.clear();
+	cached = false;
+	ra.setWindow(READ_CHUNK_BYTES,
+		     db->options.readahead_max);
 }
 
+size_t ValueReader::pread(void *buf, size_t len, uint64_t offset)
+{
+	if (!db)
+		throw std::runtime_error("ValueReader not open");
+
+	if (offset >= ent.value_len)
+		return 0;
+	if (len > (ent.value_len - offset))
+		len = ent.value_len - offset;
+	if (len == 0)
+		return 0;
+
+	DB::ReadScope scope(*db);
+	db->readValueRange(*this, offset, len, (unsigned char *) buf);
+	return len;
 }
+
+size_t ValueReader::read(void *buf, size_t len)
+{
+	size_t n = pread(buf, len, pos);
+	pos += n;
+	return n;
+}
+
+} // namespace page
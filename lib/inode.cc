@@ -13,33 +13,58 @@
 
 namespace page {
 
-void Inode::read(File& f, std::vector<unsigned char>& pagebuf) const
+void Inode::setExtents(std::vector<Extent>& arena,
+			const std::vector<Extent>& ext_list)
+{
+	n_pages = 0;
+	for (std::vector<Extent>::const_iterator it = ext_list.begin();
+	     it != ext_list.end(); it++)
+		n_pages += (*it).ext_len;
+
+	e_count = ext_list.size();
+	e_off = 0;
+
+	// single extent: inline fast path
+	if (e_count == 1) {
+		e_one = ext_list[0];
+		return;
+	}
+
+	if (e_count > 1) {
+		e_off = arena.size();
+		arena.insert(arena.end(), ext_list.begin(), ext_list.end());
+	}
+}
+
+void Inode::read(File& f, std::vector<unsigned char>& pagebuf,
+		 const Extent *ext) const
 {
 	size_t pgsz = f.pageSize();
-	uint32_t n_pages = size();
 
 	if (pagebuf.size() < (pgsz * n_pages))
 		pagebuf.resize(pgsz * n_pages);
 
-	unsigned char *p = &pagebuf[0];
+	read(f, &pagebuf[0], ext);
+}
 
-	// read each extent into consolidated buffer pagebuf
-	for (std::vector<Extent>::const_iterator it = ext.begin();
-	     it != ext.end(); it++) {
-		const Extent& e = (*it);
+void Inode::read(File& f, unsigned char *p, const Extent *ext) const
+{
+	size_t pgsz = f.pageSize();
+
+	// read each extent into consolidated buffer p, n_pages long
+	for (uint32_t i = 0; i < e_count; i++) {
+		const Extent& e = ext[i];
 
 		f.read((void *) p, e.ext_page, e.ext_len);
 
 		p += (e.ext_len * pgsz);
-
-		assert(p <= (&pagebuf[0] + pagebuf.size()));
 	}
 }
 
-void Inode::write(File& f, const std::vector<unsigned char>& pagebuf) const
+void Inode::write(File& f, const std::vector<unsigned char>& pagebuf,
+		  const Extent *ext) const
 {
 	size_t pgsz = f.pageSize();
-	uint32_t n_pages = size();
 
 	assert((pagebuf.size() % pgsz) == 0);
 	assert(pagebuf.size() <= (pgsz * n_pages));
@@ -48,9 +73,8 @@ void Inode::write(File& f, const std::vector<unsigned char>& pagebuf) const
 	uint32_t out_pages = pagebuf.size() / pgsz;
 
 	// iter thru pagebuf, writing at extent boundaries
-	for (std::vector<Extent>::const_iterator it = ext.begin();
-	     (it != ext.end()) && (out_pages > 0); it++) {
-		const Extent& e = (*it);
+	for (uint32_t i = 0; (i < e_count) && (out_pages > 0); i++) {
+		const Extent& e = ext[i];
 
 		size_t write_pages = e.ext_len;
 		if (write_pages > out_pages)
@@ -65,140 +89,316 @@ void Inode::write(File& f, const std::vector<unsigned char>& pagebuf) const
 	}
 }
 
-void InodeTable::decode(std::vector<unsigned char>& inotab_buf)
+void Inode::decode(const unsigned char *p)
 {
-	// initialize buffer walk
-	unsigned char *p = &inotab_buf[0];
-	uint32_t bytes = inotab_buf.size();
+	// Decode inode table entry header
+	InodeTableHdr hdr;
+	memcpy(&hdr, p, sizeof(hdr));
+	hdr.swap_n2h();
+	if (!hdr.valid() || (hdr.it_flags & ITF_HDR))
+		throw std::runtime_error("Inode table ent invalid");
+
+	// Decode inode table extent data
+	Extent e;
+	memcpy(&e, p + sizeof(hdr), sizeof(e));
+	e.swap_n2h();
+
+	bool ext_empty = false;
+	if (e.isNull())
+		ext_empty = true;
+	else if (!e.valid())
+		throw std::runtime_error("Inode table ext invalid");
+
+	e_count = 0;
+	e_off = 0;
+	n_pages = 0;
+
+	// empty (null) extent
+	if (ext_empty) {
+		e_ref = 0;
+		e_alloc = 0;
+
+	// internal extent
+	} else if (hdr.it_flags & ITF_EXT_INT) {
+		e_ref = 0;
+		e_alloc = 0;
+		setExtent(e);
+
+	// external extent
+	} else {
+		e_ref = e.ext_page;
+		e_alloc = e.ext_len;
+
+		// deferred: ext list read from storage on first use
+	}
 
-	// inode table header
-	if (bytes < sizeof(InodeTableHdr))
-		throw std::runtime_error("inode table hdr short read");
+	unused = (hdr.it_flags & ITF_UNUSED);
 
-	InodeTableHdr* ith = (InodeTableHdr *) p;
-	p += sizeof(InodeTableHdr);
-	bytes -= sizeof(InodeTableHdr);
+	codec = hdr.it_flags & ITF_CODEC;
+	raw_len = (codec != CODEC_NONE) ? hdr.it_len : 0;
+}
+
+void Inode::encode(unsigned char *p) const
+{
+	bool int_list = (e_ref == 0);
+	assert((!int_list) || (int_list && (e_count <= 1)));
+
+	// encode inode table header
+	InodeTableHdr hdr;
+	memcpy(hdr.magic, INOTABENT_MAGIC, sizeof(hdr.magic));
+	hdr.it_len = (codec != CODEC_NONE) ? raw_len : 0;
+	hdr.it_flags = ITF_MBO | (int_list ? (uint32_t) ITF_EXT_INT : 0) |
+		       (unused ? (uint32_t) ITF_UNUSED : 0) |
+		       (codec & ITF_CODEC);
+	hdr.swap_h2n();
+
+	memcpy(p, &hdr, sizeof(hdr));
+
+	Extent e;
+	if (int_list) {
+		if (e_count > 0)
+			e = e_one;
+		else {
+			e.ext_page = 0;
+			e.ext_len = 0;
+			e.ext_flags = EF_MBO;
+		}
+	} else {
+		e.ext_page = e_ref;
+		e.ext_len = e_alloc;
+		e.ext_flags = EF_MBO;
+	}
+	e.swap_h2n();
 
-	ith->swap_n2h();
+	memcpy(p + sizeof(hdr), &e, sizeof(e));
+}
 
-	if (!ith->valid())
-		throw std::runtime_error("Inode table invalid header");
-	if (inotab_buf.size() < (ith->it_len * (sizeof(InodeTableHdr)+sizeof(Extent)))) //rough
-		throw std::runtime_error("Inode table invalid length");
+void decodeExtList(const unsigned char *buf, size_t len,
+		   std::vector<Extent>& ext_list)
+{
+	ext_list.clear();
 
-	// walk inode table entries
-	for (unsigned int idx = 0; (bytes > 0) && (idx < ith->it_len); idx++) {
+	if (len < sizeof(Extent))
+		throw std::runtime_error("Extent list short read");
 
-		// Decode inode table entry header
-		if (bytes < sizeof(InodeTableHdr))
-			throw std::runtime_error("inode table ent short read");
+	// decode header
+	const Extent *in_ext = (const Extent *) buf;
 
-		InodeTableHdr* hdr = (InodeTableHdr *) p;
-		p += sizeof(InodeTableHdr);
-		bytes -= sizeof(InodeTableHdr);
+	Extent hdr(in_ext[0]);
+	hdr.swap_n2h();
 
-		hdr->swap_n2h();
-		if (!hdr->valid())
-			throw std::runtime_error("Inode table ent invalid");
+	if ((hdr.ext_len * sizeof(Extent)) > len)
+		throw std::runtime_error("Extent list invalid hdr len");
 
-		// Decode inode table extent data
-		if (bytes < sizeof(Extent))
-			throw std::runtime_error("inode table ent ext short read");
+	// check header
+	if (hdr.ext_page != 0)
+		throw std::runtime_error("Extent list invalid hdr page");
+	if ((!(hdr.ext_flags & EF_MBO)) || (hdr.ext_flags & EF_MBZ) ||
+	    (!(hdr.ext_flags & EF_HDR)))
+		throw std::runtime_error("Extent list invalid hdr flags");
 
-		Extent* e = (Extent *) p;
-		p += sizeof(Extent);
-		bytes -= sizeof(Extent);
+	// pre-size input
+	ext_list.reserve(hdr.ext_len - 1);
 
-		e->swap_n2h();
+	// decode extent list
+	for (unsigned int i = 1; i < hdr.ext_len; i++) {
+		Extent e(in_ext[i]);
+		e.swap_n2h();
 
-		bool ext_empty = false;
-		if (e->isNull())
-			ext_empty = true;
-		else if (!e->valid())
-			throw std::runtime_error("Inode table ext invalid");
+		if (e.ext_page == 0)
+			throw std::runtime_error("Extent list invalid page");
+		if ((!(e.ext_flags & EF_MBO)) || (e.ext_flags & EF_MBZ) ||
+		    (e.ext_flags & EF_HDR))
+			throw std::runtime_error("Extent list invalid flags");
 
-		Inode ino;
+		ext_list.push_back(e);
+	}
+}
+
+void encodeExtList(const std::vector<Extent>& ext_list,
+		   std::vector<unsigned char>& buf)
+{
+	if (buf.size() < ((ext_list.size() + 1) * sizeof(Extent)))
+		throw std::runtime_error("Extent list exceeds max");
+
+	Extent *out_ext = (Extent *) &buf[0];
+
+	// encode header
+	out_ext[0].ext_page = 0;
+	out_ext[0].ext_len = ext_list.size() + 1;
+	out_ext[0].ext_flags = EF_MBO | EF_HDR;
+	out_ext[0].swap_h2n();
+
+	// encode list
+	for (unsigned int i = 0; i < ext_list.size(); i++) {
+		out_ext[i + 1] = ext_list[i];
+		out_ext[i + 1].swap_h2n();
+	}
+}
+
+void InodeTable::setGeometry(size_t data_size)
+{
+	assert(data_size >= (sizeof(InodeTableHdr) + ent_size));
+
+	chunk_ents = (data_size - sizeof(InodeTableHdr)) / ent_size;
+}
+
+void InodeTable::setSize(size_t n)
+{
+	n_inodes = n;
+
+	size_t n_chunks = (n + chunk_ents - 1) / chunk_ents;
+	if (n_chunks > chunks.size())
+		chunks.resize(n_chunks, NULL);
+}
+
+size_t InodeTable::chunkLen(uint32_t chunk) const
+{
+	size_t first = (size_t) chunk * chunk_ents;
+	assert(first < n_inodes);
 
-		// empty (null) extent
-		if (ext_empty) {
-			ino.e_ref = 0;
-			ino.e_alloc = 0;
+	size_t len = n_inodes - first;
+	return (len < chunk_ents) ? len : chunk_ents;
+}
+
+// Lock-free; chunks are evicted only while no reader holds the DB lock
+InodeChunk *InodeTable::getChunk(uint32_t chunk)
+{
+	assert(chunk < chunks.size());
+
+	InodeChunk *ch = __atomic_load_n(&chunks[chunk], __ATOMIC_ACQUIRE);
+	if (ch && !__atomic_load_n(&ch->referenced, __ATOMIC_RELAXED))
+		__atomic_store_n(&ch->referenced, true, __ATOMIC_RELAXED);
+
+	return ch;
+}
+
+InodeChunk *InodeTable::addChunk(uint32_t chunk, InodeChunk *ch)
+{
+	MutexGuard guard(mem->mutex());
+
+	assert(chunk < chunks.size());
+
+	// another reader loaded it first: keep theirs
+	if (chunks[chunk]) {
+		delete ch;
+		return chunks[chunk];
+	}
 
-		// internal extent
-		} else if (hdr->it_flags & ITF_EXT_INT) {
-			ino.e_ref = 0;
-			ino.e_alloc = 0;
-			ino.ext.push_back(*e);
+	// never reallocated, so references to entries stay valid
+	ch->inodes.reserve(chunk_ents);
 
-		// external extent
-		} else {
-			ino.e_ref = e->ext_page;
-			ino.e_alloc = e->ext_len;
+	lru.push_front(chunk);
+	ch->lru_it = lru.begin();
+	__atomic_store_n(&chunks[chunk], ch, __ATOMIC_RELEASE);
 
-			// deferred: read ext list from storage
+	charge(ch, sizeof(InodeChunk) + (chunk_ents * sizeof(Inode)) +
+		   (ch->arena.capacity() * sizeof(Extent)));
+
+	return ch;
+}
+
+void InodeTable::charge(InodeChunk *ch, size_t bytes)
+{
+	MutexGuard guard(mem->mutex());
+
+	ch->bytes += bytes;
+	mem->charge(MEM_INODES, bytes);
+}
+
+bool InodeTable::evictOne()
+{
+	MutexGuard guard(mem->mutex());
+
+	// oldest chunk not referenced since last passed over, skipping
+	// those awaiting write-back and chunk 0.  Two passes: the first
+	// may only clear referenced bits.
+	for (size_t n = 2 * lru.size(); n > 0; n--) {
+		uint32_t chunk = lru.back();
+		InodeChunk *ch = chunks[chunk];
+		if (ch->referenced || ch->dirty || (chunk == 0)) {
+			ch->referenced = false;
+			lru.splice(lru.begin(), lru, ch->lru_it);
+			continue;
 		}
 
-		if (hdr->it_flags & ITF_UNUSED)
-			ino.unused = true;
+		mem->release(MEM_INODES, ch->bytes);
+		lru.pop_back();
+		chunks[chunk] = NULL;
+		delete ch;
+		return true;
+	}
+
+	return false;
+}
 
-		// add to inode table in memory
-		inodes.push_back(ino);
+void InodeTable::clear()
+{
+	for (std::vector<InodeChunk *>::iterator it = chunks.begin();
+	     it != chunks.end(); it++) {
+		if (*it && mem)
+			mem->release(MEM_INODES, (*it)->bytes);
+		delete *it;
 	}
+
+	chunks.clear();
+	lru.clear();
+	n_inodes = 0;
+	table_ino = Inode();
+	table_arena.clear();
+	ext_dirty = false;
 }
 
-void InodeTable::encode(std::vector<unsigned char>& inotab_buf) const
+void InodeTable::decodePage(uint32_t chunk, const unsigned char *buf,
+			    size_t len, std::vector<Inode>& inodes) const
 {
-	assert(inodes.size() > 0);
+	if (len < (sizeof(InodeTableHdr) + (chunk_ents * ent_size)))
+		throw std::runtime_error("Inode table page short read");
 
-	inotab_buf.clear();
-	inotab_buf.reserve(inodes.size() * (sizeof(InodeTableHdr)+sizeof(Extent)));
+	// table page header
+	InodeTableHdr ith;
+	memcpy(&ith, buf, sizeof(ith));
+	ith.swap_n2h();
+
+	if (!ith.valid() || !(ith.it_flags & ITF_HDR))
+		throw std::runtime_error("Inode table invalid header");
+	if (ith.it_len != chunkLen(chunk))
+		throw std::runtime_error("Inode table page invalid length");
+
+	// table page entries; extent lists are read on first use
+	inodes.clear();
+	inodes.reserve(chunk_ents);
+
+	const unsigned char *p = &buf[sizeof(ith)];
+	for (uint32_t i = 0; i < ith.it_len; i++) {
+		Inode ino;
+		ino.decode(p);
+		inodes.push_back(ino);
+		p += ent_size;
+	}
+}
+
+void InodeTable::encodePage(uint32_t chunk, std::vector<unsigned char>& buf) const
+{
+	const InodeChunk *ch = chunks[chunk];
+	assert(ch != NULL);
+	assert(ch->inodes.size() == chunkLen(chunk));
+	assert(buf.size() >= (sizeof(InodeTableHdr) + (chunk_ents * ent_size)));
 
 	InodeTableHdr ith;
 	memcpy(ith.magic, INOTAB_MAGIC, sizeof(ith.magic));
-	ith.it_len = inodes.size() - 1;
+	ith.it_len = ch->inodes.size();
 	ith.it_flags = ITF_MBO | ITF_HDR;
 	ith.swap_h2n();
 
-	unsigned char *p = (unsigned char *) &ith;
-	inotab_buf.insert(inotab_buf.end(), p, p + sizeof(ith));
-
-	for (unsigned int idx = 0; idx < inodes.size(); idx++) {
-		// skip; special case: ext list written manually
-		if (idx == DBINO_TABLE)
-			continue;
-
-		const Inode& ino = inodes[idx];
-		bool int_list = (ino.e_ref == 0);
-		assert((!int_list) || (int_list && (ino.ext.size() <= 1)));
-
-		// encode inode table header
-		InodeTableHdr hdr;
-		memcpy(hdr.magic, INOTABENT_MAGIC, sizeof(hdr.magic));
-		hdr.it_len = 0;
-		hdr.it_flags = ITF_MBO | (int_list ? ITF_EXT_INT : 0);
-		hdr.swap_h2n();
-
-		p = (unsigned char *) &hdr;
-		inotab_buf.insert(inotab_buf.end(), p, p + sizeof(hdr));
-
-		Extent e;
-		if (int_list) {
-			if (ino.ext.size() > 0)
-				e = ino.ext[0];
-			else {
-				e.ext_page = 0;
-				e.ext_len = 0;
-				e.ext_flags = EF_MBO;
-			}
-		} else {
-			e.ext_page = ino.e_ref;
-			e.ext_len = ino.e_alloc;
-			e.ext_flags = EF_MBO;
-		}
-		e.swap_h2n();
+	memcpy(&buf[0], &ith, sizeof(ith));
 
-		p = (unsigned char *) &e;
-		inotab_buf.insert(inotab_buf.end(), p, p + sizeof(e));
+	// entry 0 of chunk 0 is a placeholder; see table_ino
+	unsigned char *p = &buf[sizeof(ith)];
+	for (std::vector<Inode>::const_iterator it = ch->inodes.begin();
+	     it != ch->inodes.end(); it++) {
+		(*it).encode(p);
+		p += ent_size;
 	}
 }
 
@@ -0,0 +1,623 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <pgdb2-inspect.h>
+#include <pgdb2-async.h>
+
+namespace page {
+
+// Inodes surveyed per task
+static const uint32_t INODES_PER_TASK = 4096;
+
+InspectReport::InspectReport()
+	: key_type(KT_BYTES), page_size(0), checksum(false), file_pages(0),
+	  alloc_end(0), free_extents(0), free_pages(0), inodes(0),
+	  inodes_unused(0), table_pages(0), extlist_pages(0), fragmented(0),
+	  max_extents(0), extent_counts(max_ext_bucket + 1, 0),
+	  max_dir_entries(0), dir_fill(10, 0), keys(0), key_bytes(0),
+	  value_bytes(0), values_inline(0), values_packed(0),
+	  values_inode(0), heap_pages(0), value_inode_pages(0)
+{
+}
+
+uint64_t InspectReport::dirs() const
+{
+	uint64_t n = 0;
+	for (size_t i = 0; i < levels.size(); i++)
+		n += levels[i].dirs;
+	return n;
+}
+
+uint64_t InspectReport::dirPages() const
+{
+	uint64_t n = 0;
+	for (size_t i = 0; i < levels.size(); i++)
+		n += levels[i].pages;
+	return n;
+}
+
+double InspectReport::spaceAmp() const
+{
+	uint64_t data = key_bytes + value_bytes;
+	if (data == 0)
+		return 0.0;
+	return ((double) file_pages * page_size) / data;
+}
+
+// Costliest first; ties in key order, whatever order threads
+// finish in
+static bool costlier(const InspectPath& a, const InspectPath& b)
+{
+	if (a.pages() != b.pages())
+		return a.pages() > b.pages();
+	if (a.depth != b.depth)
+		return a.depth > b.depth;
+	if (a.keys != b.keys)
+		return a.keys > b.keys;
+	if (a.first != b.first)
+		return a.first < b.first;
+	return a.ifirst < b.ifirst;
+}
+
+class InspectJob;
+
+class InspectTask : public AsyncTask {
+protected:
+	InspectJob&	job;
+
+	virtual void runInspect() = 0;
+
+public:
+	explicit InspectTask(InspectJob& job_) : job(job_) {}
+
+	void run();
+};
+
+// One directory, and the path to it
+class InspectDirTask : public InspectTask {
+private:
+	InspectPath	path;		// leaf fields: directory's own
+
+	void runInspect();
+
+public:
+	InspectDirTask(InspectJob& job_, const InspectPath& path_)
+		: InspectTask(job_), path(path_) {}
+};
+
+// A range of the inode table
+class InspectInodeTask : public InspectTask {
+private:
+	uint32_t	first;
+	uint32_t	end;
+
+	void runInspect();
+
+public:
+	InspectInodeTask(InspectJob& job_, uint32_t first_, uint32_t end_)
+		: InspectTask(job_), first(first_), end(end_) {}
+};
+
+// One DB::inspect.  Tasks tally locally, then merge into the report
+// under the job mutex.  The caller holds the DB lock shared
+// throughout.
+class InspectJob {
+private:
+	Mutex			mtx;		// guards below
+	CondVar			cv;
+	size_t			pending;
+	bool			failed;
+	std::string		error;
+	std::set<uint64_t>	heap_pages;
+	ThreadPool		*pool;
+
+	InspectJob(const InspectJob&);
+	InspectJob& operator=(const InspectJob&);
+
+public:
+	DB&			db;
+	InspectReport&		rep;
+	size_t			top_paths;
+
+	InspectJob(DB& db_, InspectReport& rep_, size_t top_paths_)
+		: pending(0), failed(false), pool(NULL), db(db_), rep(rep_),
+		  top_paths(top_paths_) {}
+
+	void run(unsigned int n_threads);
+
+	void submit(InspectTask *task) {
+		{
+			MutexGuard guard(mtx);
+			pending++;
+		}
+		pool->submit(task);
+	}
+	void finish(const std::string *err) {
+		MutexGuard guard(mtx);
+		if (err && !failed) {
+			failed = true;
+			error = *err;
+		}
+		if (--pending == 0)
+			cv.broadcast();
+	}
+	bool isFailed() {
+		MutexGuard guard(mtx);
+		return failed;
+	}
+
+	void inspectDir(InspectPath path);
+	void inspectInodes(uint32_t first, uint32_t end);
+
+	void addDir(const InspectPath& path, const InspectLevel& lvl,
+		    unsigned int fill, const InspectReport& tally,
+		    const std::set<uint64_t>& heap);
+	void addInodes(const InspectReport& tally);
+};
+
+void InspectTask::run()
+{
+	std::string err;
+	bool err_set = false;
+	try {
+		if (!job.isFailed())
+			runInspect();
+	}
+	catch (std::exception& e) {
+		err = e.what();
+		err_set = true;
+	}
+
+	job.finish(err_set ? &err : NULL);
+}
+
+void InspectDirTask::runInspect()
+{
+	job.inspectDir(path);
+}
+
+void InspectInodeTask::runInspect()
+{
+	job.inspectInodes(first, end);
+}
+
+void InspectJob::inspectDir(InspectPath path)
+{
+	Dir dir;
+	db.loadDir(path.ino, dir);
+	const Inode& ino = db.getInode(path.ino);
+
+	// a directory fills whole pages; measure its encoding
+	std::vector<unsigned char> buf;
+	dir.encode(buf);
+	size_t len = buf.size();
+
+	InspectLevel lvl;
+	lvl.dirs = 1;
+	lvl.entries = dir.ents.size();
+	lvl.pages = ino.size();
+	lvl.bytes = len;
+
+	uint64_t capacity = (uint64_t) ino.size() * db.f.pageDataSize();
+	unsigned int fill = capacity ? ((len * 10) / capacity) : 0;
+	if (fill > 9)
+		fill = 9;
+
+	size_t ikey_len = (db.keyType() == KT_U32) ? 4 : 8;
+
+	InspectReport tally;
+	std::set<uint64_t> heap;
+	path.dir_pages += ino.size();
+
+	for (size_t i = 0; i < dir.ents.size(); i++) {
+		const DirEntry& ent = dir.ents[i];
+
+		if (ent.d_type == DE_DIR) {
+			InspectPath sub;
+			sub.ino = ent.ino_idx;
+			sub.depth = path.depth + 1;
+			sub.dir_pages = path.dir_pages;
+			sub.first = ent.key;
+			sub.last = ent.key_end;
+			sub.ifirst = ent.ikey;
+			sub.ilast = ent.ikey_end;
+			submit(new InspectDirTask(*this, sub));
+			continue;
+		}
+
+		uint64_t value_pages = 0;
+		switch (ent.d_type) {
+		case DE_KEY_VALUE:
+			tally.values_inline++;
+			break;
+		case DE_KEY_PACKED:
+			tally.values_packed++;
+			heap.insert(ent.vh_page);
+			value_pages = 1;
+			break;
+		case DE_KEY:
+			value_pages = db.getInode(ent.ino_idx).size();
+			tally.values_inode++;
+			tally.value_inode_pages += value_pages;
+			break;
+		default:
+			throw std::runtime_error("Invalid dirent type");
+		}
+
+		tally.keys++;
+		tally.key_bytes += (db.keyType() == KT_BYTES) ? ent.key.size() :
+							       ikey_len;
+		tally.value_bytes += ent.value_len;
+		path.keys++;
+		if (value_pages > path.max_value_pages)
+			path.max_value_pages = value_pages;
+	}
+
+	addDir(path, lvl, fill, tally, heap);
+}
+
+void InspectJob::inspectInodes(uint32_t first, uint32_t end)
+{
+	InspectReport tally;
+
+	for (uint32_t idx = first; idx < end; idx++) {
+		const Inode& ino = db.getInode(idx);
+		if (ino.unused) {
+			tally.inodes_unused++;
+			continue;
+		}
+
+		uint32_t n = ino.e_count;
+		tally.extent_counts[std::min(n, InspectReport::max_ext_bucket)]++;
+		if (n > 1)
+			tally.fragmented++;
+		if (n > tally.max_extents)
+			tally.max_extents = n;
+		if (ino.e_ref)
+			tally.extlist_pages += ino.e_alloc;
+	}
+
+	addInodes(tally);
+}
+
+void InspectJob::addDir(const InspectPath& path, const InspectLevel& lvl,
+			unsigned int fill, const InspectReport& tally,
+			const std::set<uint64_t>& heap)
+{
+	MutexGuard guard(mtx);
+
+	if (rep.levels.size() < path.depth)
+		rep.levels.resize(path.depth);
+	InspectLevel& l = rep.levels[path.depth - 1];
+	l.dirs += lvl.dirs;
+	l.entries += lvl.entries;
+	l.pages += lvl.pages;
+	l.bytes += lvl.bytes;
+
+	if (lvl.entries > rep.max_dir_entries)
+		rep.max_dir_entries = lvl.entries;
+	rep.dir_fill[fill]++;
+
+	rep.keys += tally.keys;
+	rep.key_bytes += tally.key_bytes;
+	rep.value_bytes += tally.value_bytes;
+	rep.values_inline += tally.values_inline;
+	rep.values_packed += tally.values_packed;
+	rep.values_inode += tally.values_inode;
+	rep.value_inode_pages += tally.value_inode_pages;
+	heap_pages.insert(heap.begin(), heap.end());
+
+	// directories holding keys are lookup destinations
+	if ((path.keys == 0) || (top_paths == 0))
+		return;
+
+	std::vector<InspectPath>& paths = rep.paths;
+	if ((paths.size() == top_paths) && !costlier(path, paths.back()))
+		return;
+
+	paths.insert(std::upper_bound(paths.begin(), paths.end(), path,
+				      costlier), path);
+	if (paths.size() > top_paths)
+		paths.pop_back();
+}
+
+void InspectJob::addInodes(const InspectReport& tally)
+{
+	MutexGuard guard(mtx);
+
+	rep.inodes_unused += tally.inodes_unused;
+	rep.fragmented += tally.fragmented;
+	rep.extlist_pages += tally.extlist_pages;
+	if (tally.max_extents > rep.max_extents)
+		rep.max_extents = tally.max_extents;
+	for (size_t i = 0; i < rep.extent_counts.size(); i++)
+		rep.extent_counts[i] += tally.extent_counts[i];
+}
+
+void InspectJob::run(unsigned int n_threads)
+{
+	if (n_threads == 0)
+		n_threads = 1;
+
+	{
+		ThreadPool tp(n_threads);
+		pool = &tp;
+
+		InspectPath root;
+		root.ino = DBINO_ROOT_DIR;
+		root.depth = 1;
+		root.ilast = ~0ULL;
+		submit(new InspectDirTask(*this, root));
+
+		uint32_t n_inodes = rep.inodes;
+		for (uint32_t i = 0; i < n_inodes; i += INODES_PER_TASK)
+			submit(new InspectInodeTask(*this, i,
+				std::min(n_inodes - i, INODES_PER_TASK) + i));
+
+		MutexGuard guard(mtx);
+		while (pending > 0)
+			cv.wait(mtx);
+	}
+	pool = NULL;
+
+	if (failed)
+		throw std::runtime_error(error);
+
+	rep.heap_pages = heap_pages.size();
+}
+
+void DB::inspect(InspectReport& report, unsigned int n_threads,
+		 size_t top_paths)
+{
+	ReadScope scope(*this);
+
+	InspectReport& rep = report;
+	rep = InspectReport();
+	rep.key_type = keyType();
+	rep.page_size = sb.page_size;
+	rep.checksum = f.checksum();
+	rep.file_pages = f.size();
+	rep.alloc_end = sb.alloc_end;
+	rep.inodes = inotab.size();
+	rep.table_pages = inotab.table_ino.size();
+
+	rep.free_extents = freelist.size();
+	for (size_t i = 0; i < freelist.size(); i++)
+		rep.free_pages += freelist[i].ext_len;
+
+	InspectJob job(*this, rep, top_paths);
+	job.run(n_threads);
+}
+
+static void appendf(std::string& s, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void appendf(std::string& s, const char *fmt, ...)
+{
+	char buf[256];
+
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	s.append(buf);
+}
+
+// Printable ASCII as is, other bytes as \xNN
+static std::string escapeKey(const std::string& key)
+{
+	std::string s;
+	for (size_t i = 0; i < key.size(); i++) {
+		unsigned char c = key[i];
+		if ((c >= 0x20) && (c < 0x7f) && (c != '\\'))
+			s += c;
+		else
+			appendf(s, "\\x%02x", c);
+	}
+	return s;
+}
+
+static std::string jsonString(const std::string& str)
+{
+	std::string s = "\"";
+	for (size_t i = 0; i < str.size(); i++) {
+		char c = str[i];
+		if ((c == '"') || (c == '\\'))
+			s += '\\';
+		s += c;
+	}
+	s += "\"";
+	return s;
+}
+
+static std::string keyRange(const InspectReport& rep, const InspectPath& p)
+{
+	std::string s;
+	if (rep.key_type == KT_BYTES)
+		s = "[" + escapeKey(p.first) + " .. " +
+		    ((p.depth > 1) ? escapeKey(p.last) : std::string()) + "]";
+	else
+		appendf(s, "[%llu .. %llu]", (unsigned long long) p.ifirst,
+			(unsigned long long) p.ilast);
+	return s;
+}
+
+static const char *keyTypeName(enum key_types kt)
+{
+	switch (kt) {
+	case KT_U32:	return "u32";
+	case KT_U64:	return "u64";
+	case KT_BYTES:
+	default:	return "bytes";
+	}
+}
+
+static double pct(uint64_t n, uint64_t total)
+{
+	return total ? ((100.0 * n) / total) : 0.0;
+}
+
+std::string InspectReport::toText() const
+{
+	std::string s;
+	uint64_t data_size = checksum ? (page_size - sizeof(PageTrailer)) :
+					page_size;
+
+	appendf(s, "page size        %u%s\n", page_size,
+		checksum ? " (checksummed)" : "");
+	appendf(s, "key type         %s\n", keyTypeName(key_type));
+	appendf(s, "file             %llu pages, %.1f MiB\n",
+		(unsigned long long) file_pages,
+		((double) file_pages * page_size) / (1024.0 * 1024.0));
+	appendf(s, "allocated        %llu pages\n",
+		(unsigned long long) alloc_end);
+	appendf(s, "free list        %llu extents, %llu pages (%.1f%%)\n",
+		(unsigned long long) free_extents,
+		(unsigned long long) free_pages, pct(free_pages, file_pages));
+	appendf(s, "inode table      %llu inodes, %llu unused, %llu pages\n",
+		(unsigned long long) inodes, (unsigned long long) inodes_unused,
+		(unsigned long long) table_pages);
+	appendf(s, "extents          %llu inodes fragmented, max %llu, "
+		"%llu extent list pages\n",
+		(unsigned long long) fragmented,
+		(unsigned long long) max_extents,
+		(unsigned long long) extlist_pages);
+	s.append("  per inode     ");
+	for (size_t i = 0; i < extent_counts.size(); i++)
+		if (extent_counts[i])
+			appendf(s, " %zu%s:%llu", i,
+				(i == max_ext_bucket) ? "+" : "",
+				(unsigned long long) extent_counts[i]);
+	s.append("\n");
+
+	appendf(s, "keys             %llu, %llu key bytes, %llu value bytes\n",
+		(unsigned long long) keys, (unsigned long long) key_bytes,
+		(unsigned long long) value_bytes);
+	appendf(s, "values           %llu inline, %llu packed in %llu heap "
+		"pages, %llu in %llu inode pages\n",
+		(unsigned long long) values_inline,
+		(unsigned long long) values_packed,
+		(unsigned long long) heap_pages,
+		(unsigned long long) values_inode,
+		(unsigned long long) value_inode_pages);
+	appendf(s, "space amp        %.2f\n", spaceAmp());
+
+	appendf(s, "\ntree depth       %u, %llu directories, %llu pages, "
+		"max %llu entries\n", depth(), (unsigned long long) dirs(),
+		(unsigned long long) dirPages(),
+		(unsigned long long) max_dir_entries);
+	appendf(s, "  %5s %10s %12s %10s %7s\n", "depth", "dirs", "entries",
+		"pages", "fill");
+	for (size_t i = 0; i < levels.size(); i++) {
+		const InspectLevel& l = levels[i];
+		appendf(s, "  %5zu %10llu %12llu %10llu %6.1f%%\n", i + 1,
+			(unsigned long long) l.dirs,
+			(unsigned long long) l.entries,
+			(unsigned long long) l.pages,
+			pct(l.bytes, l.pages * data_size));
+	}
+	s.append("  fill          ");
+	for (size_t i = 0; i < dir_fill.size(); i++)
+		appendf(s, " %zu0%%:%llu", i, (unsigned long long) dir_fill[i]);
+	s.append("\n");
+
+	s.append("\ncostliest lookups, pages read cold\n");
+	appendf(s, "  %5s %5s %8s %10s  %s\n", "pages", "depth", "keys", "ino",
+		"key range");
+	for (size_t i = 0; i < paths.size(); i++) {
+		const InspectPath& p = paths[i];
+		appendf(s, "  %5llu %5u %8llu %10u  ",
+			(unsigned long long) p.pages(), p.depth,
+			(unsigned long long) p.keys, p.ino);
+		s.append(keyRange(*this, p));
+		s.append("\n");
+	}
+
+	return s;
+}
+
+std::string InspectReport::toJSON() const
+{
+	std::string s;
+
+	appendf(s, "{\"page_size\":%u,\"checksum\":%s,\"key_type\":\"%s\","
+		"\"file_pages\":%llu,\"alloc_end\":%llu,"
+		"\"free_extents\":%llu,\"free_pages\":%llu,",
+		page_size, checksum ? "true" : "false", keyTypeName(key_type),
+		(unsigned long long) file_pages, (unsigned long long) alloc_end,
+		(unsigned long long) free_extents,
+		(unsigned long long) free_pages);
+	appendf(s, "\"inodes\":%llu,\"inodes_unused\":%llu,"
+		"\"table_pages\":%llu,\"extlist_pages\":%llu,"
+		"\"fragmented\":%llu,\"max_extents\":%llu,\"extent_counts\":[",
+		(unsigned long long) inodes, (unsigned long long) inodes_unused,
+		(unsigned long long) table_pages,
+		(unsigned long long) extlist_pages,
+		(unsigned long long) fragmented,
+		(unsigned long long) max_extents);
+	for (size_t i = 0; i < extent_counts.size(); i++)
+		appendf(s, "%s%llu", i ? "," : "",
+			(unsigned long long) extent_counts[i]);
+
+	appendf(s, "],\"keys\":%llu,\"key_bytes\":%llu,\"value_bytes\":%llu,"
+		"\"values_inline\":%llu,\"values_packed\":%llu,"
+		"\"values_inode\":%llu,\"heap_pages\":%llu,"
+		"\"value_inode_pages\":%llu,\"space_amp\":%.4f,",
+		(unsigned long long) keys, (unsigned long long) key_bytes,
+		(unsigned long long) value_bytes,
+		(unsigned long long) values_inline,
+		(unsigned long long) values_packed,
+		(unsigned long long) values_inode,
+		(unsigned long long) heap_pages,
+		(unsigned long long) value_inode_pages, spaceAmp());
+
+	appendf(s, "\"depth\":%u,\"max_dir_entries\":%llu,\"levels\":[",
+		depth(), (unsigned long long) max_dir_entries);
+	for (size_t i = 0; i < levels.size(); i++) {
+		const InspectLevel& l = levels[i];
+		appendf(s, "%s{\"dirs\":%llu,\"entries\":%llu,\"pages\":%llu,"
+			"\"bytes\":%llu}", i ? "," : "",
+			(unsigned long long) l.dirs,
+			(unsigned long long) l.entries,
+			(unsigned long long) l.pages,
+			(unsigned long long) l.bytes);
+	}
+	s.append("],\"dir_fill\":[");
+	for (size_t i = 0; i < dir_fill.size(); i++)
+		appendf(s, "%s%llu", i ? "," : "",
+			(unsigned long long) dir_fill[i]);
+
+	s.append("],\"paths\":[");
+	for (size_t i = 0; i < paths.size(); i++) {
+		const InspectPath& p = paths[i];
+		appendf(s, "%s{\"pages\":%llu,\"dir_pages\":%llu,\"depth\":%u,"
+			"\"keys\":%llu,\"ino\":%u,", i ? "," : "",
+			(unsigned long long) p.pages(),
+			(unsigned long long) p.dir_pages, p.depth,
+			(unsigned long long) p.keys, p.ino);
+		if (key_type == KT_BYTES)
+			s += "\"first\":" + jsonString(escapeKey(p.first)) +
+			     ",\"last\":" + jsonString(escapeKey(p.last)) + "}";
+		else
+			appendf(s, "\"first\":%llu,\"last\":%llu}",
+				(unsigned long long) p.ifirst,
+				(unsigned long long) p.ilast);
+	}
+	s.append("]}");
+
+	return s;
+}
+
+} // namespace page
@@ -0,0 +1,201 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <pgdb2-lock.h>
+
+namespace page {
+
+// Reader slot ids, one per live thread, shared by all locks
+static Mutex& slotMutex()
+{
+	static Mutex mtx;
+	return mtx;
+}
+
+static std::vector<bool> slot_used;
+static uint32_t slot_high;		// ids ever handed out
+
+class ThreadSlot {
+public:
+	int	id;
+
+	ThreadSlot() : id(-1) {
+		MutexGuard guard(slotMutex());
+
+		for (unsigned int i = 0; i < RWLock::max_slots; i++) {
+			if (i == slot_used.size())
+				slot_used.push_back(false);
+			if (!slot_used[i]) {
+				slot_used[i] = true;
+				id = i;
+				break;
+			}
+		}
+
+		if ((id >= 0) && ((uint32_t) id >= slot_high))
+			__atomic_store_n(&slot_high, id + 1, __ATOMIC_RELEASE);
+	}
+	~ThreadSlot() {
+		if (id < 0)
+			return;
+
+		MutexGuard guard(slotMutex());
+		slot_used[id] = false;
+	}
+};
+
+int RWLock::slotId()
+{
+	static thread_local ThreadSlot slot;
+	return slot.id;
+}
+
+RWLock::RWLock()
+{
+	memset(slots, 0, sizeof(slots));
+	overflow = 0;
+	writer = 0;
+	writing = false;
+}
+
+bool RWLock::enter(bool wait)
+{
+	int id = slotId();
+
+	// nested read: a waiting writer is waiting on us
+	if ((id >= 0) && slots[id].active) {
+		__atomic_store_n(&slots[id].active, slots[id].active + 1,
+				 __ATOMIC_RELAXED);
+		return true;
+	}
+
+	while (true) {
+		// announce, then look for a writer; the writer does
+		// the reverse, so one of us sees the other
+		if (id >= 0)
+			__atomic_store_n(&slots[id].active, 1, __ATOMIC_RELAXED);
+		else
+			__atomic_add_fetch(&overflow, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (!__atomic_load_n(&writer, __ATOMIC_ACQUIRE))
+			return true;
+
+		leave();
+		if (!wait)
+			return false;
+
+		MutexGuard guard(wait_mtx);
+		while (__atomic_load_n(&writer, __ATOMIC_ACQUIRE))
+			wait_cv.wait(wait_mtx);
+	}
+}
+
+void RWLock::leave()
+{
+	int id = slotId();
+	if (id >= 0)
+		__atomic_store_n(&slots[id].active, slots[id].active - 1,
+				 __ATOMIC_RELEASE);
+	else
+		__atomic_sub_fetch(&overflow, 1, __ATOMIC_RELEASE);
+}
+
+void RWLock::writeLock()
+{
+	writer_mtx.lock();
+
+	__atomic_store_n(&writer, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	// wait out readers in flight
+	uint32_t n = __atomic_load_n(&slot_high, __ATOMIC_ACQUIRE);
+	for (uint32_t i = 0; i < n; i++)
+		while (__atomic_load_n(&slots[i].active, __ATOMIC_ACQUIRE))
+			sched_yield();
+	while (__atomic_load_n(&overflow, __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	owner = pthread_self();
+	writing = true;
+}
+
+void RWLock::unlock()
+{
+	// no reader holds the lock while a writer does
+	if (!writing || !pthread_equal(owner, pthread_self())) {
+		leave();
+		return;
+	}
+
+	writing = false;
+	{
+		MutexGuard guard(wait_mtx);
+		__atomic_store_n(&writer, 0, __ATOMIC_RELEASE);
+		wait_cv.broadcast();
+	}
+
+	writer_mtx.unlock();
+}
+
+bool FileLock::setLock(short type, bool wait)
+{
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = off;
+	fl.l_len = 1;
+
+	while (::fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl) < 0) {
+		if (errno == EINTR)
+			continue;
+		if (!wait && ((errno == EAGAIN) || (errno == EACCES)))
+			return false;
+		throw std::runtime_error(std::string("Failed fcntl lock: ") + strerror(errno));
+	}
+
+	return true;
+}
+
+bool FileLock::tryShared()
+{
+	MutexGuard guard(mtx);
+
+	if ((n_shared == 0) && !setLock(F_RDLCK, false))
+		return false;
+	n_shared++;
+	return true;
+}
+
+void FileLock::lockShared()
+{
+	MutexGuard guard(mtx);
+
+	if (n_shared == 0)
+		setLock(F_RDLCK, true);
+	n_shared++;
+}
+
+void FileLock::unlockShared()
+{
+	MutexGuard guard(mtx);
+
+	if (--n_shared == 0)
+		setLock(F_UNLCK, false);
+}
+
+} // namespace page
@@ -0,0 +1,270 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <assert.h>
+#include <pgdb2.h>
+#include <pgdb2-trace.h>
+
+namespace page {
+
+void DB::writeValue(DirEntry& ent, const std::string& value)
+{
+	ent.value_len = value.size();
+
+	// Case 1: small value, in dirent
+	if (value.size() <= options.inline_max) {
+		ent.d_type = DE_KEY_VALUE;
+		ent.value = value;
+	}
+
+	// Case 2: medium value, packed into shared value heap page
+	else if (value.size() <= packedMax()) {
+		ent.d_type = DE_KEY_PACKED;
+		heapPut(value, ent.vh_page, ent.vh_slot);
+	}
+
+	// Case 3: large value, in dedicated inode
+	else {
+		ent.d_type = DE_KEY;
+		ent.ino_idx = allocInode();
+
+		PageKindScope kind(PK_VALUE);
+		std::vector<unsigned char> buf(value.begin(), value.end());
+		writeInodeData(ent.ino_idx, buf);
+	}
+}
+
+void DB::freeValue(const DirEntry& ent)
+{
+	switch (ent.d_type) {
+	case DE_KEY:
+		freeInode(ent.ino_idx);
+		break;
+
+	case DE_KEY_PACKED:
+		heapErase(ent.vh_page, ent.vh_slot);
+		break;
+
+	default:
+		break;		// nothing stored outside dirent
+	}
+}
+
+// Build a directory entry spanning the key range of directory d
+static DirEntry dirRange(const Dir& d, uint32_t ino_idx)
+{
+	assert(!d.ents.empty());
+
+	const DirEntry& first = d.ents.front();
+	const DirEntry& last = d.ents.back();
+
+	DirEntry ent;
+	ent.d_type = DE_DIR;
+	ent.ino_idx = ino_idx;
+
+	ent.key = first.key;
+	ent.ikey = first.ikey;
+	ent.key_len = first.key_len;
+
+	if (last.d_type == DE_DIR) {
+		ent.key_end = last.key_end;
+		ent.ikey_end = last.ikey_end;
+		ent.key_end_len = last.key_end_len;
+	} else {
+		ent.key_end = last.key;
+		ent.ikey_end = last.ikey;
+		ent.key_end_len = last.key_len;
+	}
+
+	return ent;
+}
+
+void DB::splitDir(std::vector<DirPathEnt>& path, size_t level)
+{
+	DirPathEnt& pe = path[level];
+	Dir& dir = pe.dir;
+	assert(dir.ents.size() >= 2);
+
+	// move upper half of entries to a new directory
+	size_t mid = dir.ents.size() / 2;
+
+	Dir hi(dir.key_type);
+	hi.ents.assign(dir.ents.begin() + mid, dir.ents.end());
+	dir.ents.erase(dir.ents.begin() + mid, dir.ents.end());
+
+	uint32_t hi_ino = allocInode();
+	writeDir(hi_ino, hi);
+
+	// root directory inode never moves: push both halves
+	// down one level, increasing tree depth
+	if (level == 0) {
+		Dir lo(dir.key_type);
+		lo.ents.swap(dir.ents);
+
+		uint32_t lo_ino = allocInode();
+		writeDir(lo_ino, lo);
+
+		dir.ents.push_back(dirRange(lo, lo_ino));
+		dir.ents.push_back(dirRange(hi, hi_ino));
+		writeDir(pe.ino_idx, dir);
+		return;
+	}
+
+	// otherwise, lower half stays; parent gains an entry
+	writeDir(pe.ino_idx, dir);
+
+	DirPathEnt& parent = path[level - 1];
+	parent.dir.ents[pe.parent_idx] = dirRange(dir, pe.ino_idx);
+	parent.dir.ents.insert(parent.dir.ents.begin() + pe.parent_idx + 1,
+			       dirRange(hi, hi_ino));
+	parent.dirty = true;
+}
+
+template <class Cmp>
+void DB::putKey(const typename Cmp::key_type& key, const std::string& value)
+{
+	if (!running || !options.f_write)
+		throw std::runtime_error("DB not writable");
+
+	// Evict only while no reader holds references
+	reclaim();
+
+	ArenaScope scope;
+
+	std::vector<DirPathEnt> path;
+	path.reserve(8);
+
+	// Walk from root directory down to a leaf directory, widening
+	// key ranges along the way to cover the new key
+	uint32_t dir_ino = DBINO_ROOT_DIR;
+	unsigned int parent_idx = 0;
+
+	while (true) {
+		if (path.size() >= DIR_MAX_DEPTH)
+			throw std::runtime_error("Dir tree too deep");
+
+		path.push_back(DirPathEnt());
+		DirPathEnt& pe = path.back();
+		pe.ino_idx = dir_ino;
+		pe.parent_idx = parent_idx;
+		readDir(dir_ino, pe.dir);
+
+		std::vector<DirEntry>& ents = pe.dir.ents;
+		if (ents.empty() || (ents[0].d_type != DE_DIR))
+			break;		// leaf directory
+
+		// first range ending at or after key
+		unsigned int idx = 0;
+		while ((idx < ents.size()) && (Cmp::keyEnd(key, ents[idx]) > 0))
+			idx++;
+
+		// key beyond all ranges: widen last range
+		if (idx == ents.size()) {
+			idx--;
+			Cmp::setKeyEnd(ents[idx], key);
+			pe.dirty = true;
+
+		// key between ranges: widen preceding range
+		} else if (Cmp::key(key, ents[idx]) < 0) {
+			if (idx > 0) {
+				idx--;
+				Cmp::setKeyEnd(ents[idx], key);
+			} else
+				Cmp::setKey(ents[idx], key);
+			pe.dirty = true;
+		}
+
+		if (ents[idx].d_type != DE_DIR)
+			throw std::runtime_error("Dir mixes ranges and keys");
+
+		dir_ino = ents[idx].ino_idx;
+		parent_idx = idx;
+	}
+
+	// Insert or replace entry in leaf directory
+	DirPathEnt& leaf = path.back();
+	std::vector<DirEntry>& ents = leaf.dir.ents;
+
+	unsigned int idx = 0;
+	int cmp = 1;
+	while ((idx < ents.size()) && ((cmp = Cmp::key(key, ents[idx])) > 0))
+		idx++;
+
+	DirEntry ent;
+	Cmp::setKey(ent, key);
+	writeValue(ent, value);
+
+	if ((idx < ents.size()) && (cmp == 0)) {
+		freeValue(ents[idx]);
+		ents[idx] = ent;
+	} else
+		ents.insert(ents.begin() + idx, ent);
+
+	leaf.dirty = true;
+
+	// Write changed directories, leaf to root, splitting
+	// directories that outgrew their size limit
+	size_t max_bytes = options.dir_max_pages * f.pageDataSize();
+
+	for (size_t level = path.size(); level-- > 0; ) {
+		DirPathEnt& pe = path[level];
+		if (!pe.dirty)
+			continue;
+
+		std::vector<unsigned char> buf;
+		pe.dir.encode(buf);
+
+		if ((buf.size() > max_bytes) && (pe.dir.ents.size() >= 2))
+			splitDir(path, level);
+		else
+			writeInodeData(pe.ino_idx, buf);
+	}
+
+	// Write allocation metadata, inode table, superblock
+	flush();
+}
+
+void DB::put(const std::string& key, const std::string& value)
+{
+	if (keyType() != KT_BYTES)
+		throw std::runtime_error("DB key type mismatch");
+	if (key.size() > INT_KEY_MAX)
+		throw std::runtime_error("Key too large");
+
+	StatTimer timer(stats, OP_PUT);
+	CommitScope commit(*this);
+	TraceScope tr(trace, TR_PUT, key);
+	putKey<BytewiseCompare>(key, value);
+	tr.done(value.size());
+}
+
+void DB::put(uint64_t key, const std::string& value)
+{
+	StatTimer timer(stats, OP_PUT);
+	CommitScope commit(*this);
+	TraceScope tr(trace, TR_PUT, key);
+
+	switch (keyType()) {
+	case KT_U32:
+		if (key > UINT32_MAX)
+			throw std::runtime_error("Key out of range");
+		putKey<U32Compare>((uint32_t) key, value);
+		break;
+
+	case KT_U64:
+		putKey<U64Compare>(key, value);
+		break;
+
+	case KT_BYTES:
+	default:
+		throw std::runtime_error("DB key type mismatch");
+	}
+
+	tr.done(value.size());
+}
+
+} // namespace page
@@ -0,0 +1,481 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <pthread.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <deque>
+#include <pgdb2.h>
+#include <pgdb2-trace.h>
+
+namespace page {
+
+// Ordered scans: the output of one directory, in key order.  Runs of
+// keys alternate with the output of subdirectories, each filled in
+// by its own task.
+struct ScanNode;
+
+struct ScanPart {
+	std::vector<ScanItem>	items;
+	size_t			bytes;		// of items, buffered
+	ScanNode		*child;
+
+	ScanPart() : bytes(0), child(NULL) {}
+};
+
+struct ScanNode {
+	std::vector<ScanPart>	parts;
+	bool			done;
+
+	ScanNode() : done(false) {}
+};
+
+struct ScanTask {
+	uint32_t	dir_ino;
+	ScanNode	*node;		// ordered scans only
+};
+
+// Scan bounds, per key type
+template <class Cmp> struct ScanBounds;
+
+template <> struct ScanBounds<BytewiseCompare> {
+	static std::string first(const ScanRange& r) { return r.first; }
+	static std::string last(const ScanRange& r) { return r.last; }
+	static bool hasLast(const ScanRange& r) { return r.has_last; }
+	static void setKey(ScanItem& item, const DirEntry& ent) {
+		item.key = ent.key;
+	}
+};
+
+template <typename T, enum key_types KT>
+struct ScanBounds< FixedCompare<T, KT> > {
+	static T first(const ScanRange& r) {
+		return (r.ifirst > (T) ~0ULL) ? (T) ~0ULL : (T) r.ifirst;
+	}
+	static T last(const ScanRange& r) {
+		return (r.ilast > (T) ~0ULL) ? (T) ~0ULL : (T) r.ilast;
+	}
+	static bool hasLast(const ScanRange&) { return true; }
+	static void setKey(ScanItem& item, const DirEntry& ent) {
+		item.ikey = ent.ikey;
+	}
+};
+
+// One parallel scan.  Each task reads one directory, visiting its
+// keys and spawning a task per subdirectory.  Workers run their own
+// newest tasks first, depth first, and steal the oldest task of
+// another worker, the largest remaining subtree, when idle.  The
+// caller holds the DB lock shared throughout.
+//
+// Ordered scans buffer items until the caller emits them.  Workers
+// wait for room once buffer_max bytes are buffered, except on the
+// frontier, the node being emitted; the caller runs the frontier's
+// task itself if no worker has begun it, so the scan always
+// progresses.
+class ScanJob {
+private:
+	struct Worker {
+		ScanJob			*job;
+		unsigned int		id;
+		Mutex			mtx;	// guards tasks
+		std::deque<ScanTask>	tasks;
+		pthread_t		thread;
+	};
+
+	DB&			db;
+	const ScanRange&	range;
+	ScanVisitor&		visitor;
+	bool			ordered;
+
+	std::vector<Worker *>	workers;
+
+	Mutex			mtx;		// guards below
+	CondVar			cv;
+	size_t			queued;		// tasks in worker queues
+	size_t			outstanding;	// queued or running
+	bool			failed;
+	std::string		error;
+	std::vector<ScanNode *>	nodes;		// ordered: all, for cleanup
+	size_t			buffered;	// ordered: item bytes
+	size_t			buffer_max;
+	ScanNode		*frontier;	// ordered: being emitted
+
+	ScanJob(const ScanJob&);
+	ScanJob& operator=(const ScanJob&);
+
+	static void *workerMain(void *arg);
+	void runWorker(Worker *w);
+	bool nextTask(Worker *w, ScanTask& t);
+	void push(Worker *w, const ScanTask& t);
+	bool claim(ScanNode *node, ScanTask& t);
+	void runOne(Worker *w, const ScanTask& t);
+	void finishTask();
+	void fail(const std::string& msg);
+	bool reserve(ScanNode *node, size_t bytes);
+	void unreserve(size_t bytes);
+
+	template <class Cmp>
+	void runTask(Worker *w, const ScanTask& t);
+	void runTask(Worker *w, const ScanTask& t);
+
+	ScanNode *newNode();
+	void emit(ScanNode *node);
+
+public:
+	ScanJob(DB& db_, const ScanRange& range_, ScanVisitor& visitor_,
+		bool ordered_)
+		: db(db_), range(range_), visitor(visitor_), ordered(ordered_),
+		  queued(0), outstanding(0), failed(false), buffered(0),
+		  buffer_max(db_.options.scan_buffer_max), frontier(NULL) {}
+	~ScanJob();
+
+	void run(unsigned int n_threads);
+};
+
+ScanJob::~ScanJob()
+{
+	for (size_t i = 0; i < workers.size(); i++)
+		delete workers[i];
+	for (size_t i = 0; i < nodes.size(); i++)
+		delete nodes[i];
+}
+
+void *ScanJob::workerMain(void *arg)
+{
+	Worker *w = (Worker *) arg;
+	w->job->runWorker(w);
+	return NULL;
+}
+
+ScanNode *ScanJob::newNode()
+{
+	ScanNode *node = new ScanNode;
+
+	MutexGuard guard(mtx);
+	nodes.push_back(node);
+	return node;
+}
+
+void ScanJob::push(Worker *w, const ScanTask& t)
+{
+	{
+		MutexGuard guard(w->mtx);
+		w->tasks.push_back(t);
+	}
+
+	MutexGuard guard(mtx);
+	queued++;
+	outstanding++;
+	cv.broadcast();
+}
+
+// Take node's task from the worker queues, unless a worker has
+// already begun it
+bool ScanJob::claim(ScanNode *node, ScanTask& t)
+{
+	bool got = false;
+	for (size_t i = 0; !got && (i < workers.size()); i++) {
+		Worker *w = workers[i];
+
+		MutexGuard guard(w->mtx);
+		for (std::deque<ScanTask>::iterator it = w->tasks.begin();
+		     it != w->tasks.end(); it++)
+			if ((*it).node == node) {
+				t = *it;
+				w->tasks.erase(it);
+				got = true;
+				break;
+			}
+	}
+
+	if (got) {
+		MutexGuard guard(mtx);
+		queued--;
+	}
+	return got;
+}
+
+void ScanJob::finishTask()
+{
+	MutexGuard guard(mtx);
+	if (--outstanding == 0)
+		cv.broadcast();
+}
+
+void ScanJob::fail(const std::string& msg)
+{
+	MutexGuard guard(mtx);
+	if (!failed) {
+		failed = true;
+		error = msg;
+	}
+	cv.broadcast();
+}
+
+// Ordered scans: wait for room to buffer bytes more, unless node is
+// the frontier.  False if the scan failed meanwhile.
+bool ScanJob::reserve(ScanNode *node, size_t bytes)
+{
+	MutexGuard guard(mtx);
+	while ((buffered > 0) && ((buffered + bytes) > buffer_max) &&
+	       (node != frontier) && !failed)
+		cv.wait(mtx);
+	if (failed)
+		return false;
+
+	buffered += bytes;
+	return true;
+}
+
+void ScanJob::unreserve(size_t bytes)
+{
+	MutexGuard guard(mtx);
+	buffered -= bytes;
+	cv.broadcast();
+}
+
+// Own newest task, else another worker's oldest.  False when the
+// scan is over.
+bool ScanJob::nextTask(Worker *w, ScanTask& t)
+{
+	while (true) {
+		{
+			MutexGuard guard(mtx);
+			while ((queued == 0) && (outstanding > 0) && !failed)
+				cv.wait(mtx);
+			if ((outstanding == 0) || failed)
+				return false;
+		}
+
+		bool got = false;
+		{
+			MutexGuard guard(w->mtx);
+			if (!w->tasks.empty()) {
+				t = w->tasks.back();
+				w->tasks.pop_back();
+				got = true;
+			}
+		}
+
+		for (size_t i = 1; !got && (i < workers.size()); i++) {
+			Worker *victim = workers[(w->id + i) % workers.size()];
+
+			MutexGuard guard(victim->mtx);
+			if (!victim->tasks.empty()) {
+				t = victim->tasks.front();
+				victim->tasks.pop_front();
+				got = true;
+			}
+		}
+
+		if (got) {
+			MutexGuard guard(mtx);
+			queued--;
+			return true;
+		}
+	}
+}
+
+void ScanJob::runWorker(Worker *w)
+{
+	ReadaheadScope stream(db.f);
+	ScanTask t;
+	while (nextTask(w, t))
+		runOne(w, t);
+}
+
+void ScanJob::runOne(Worker *w, const ScanTask& t)
+{
+	try {
+		runTask(w, t);
+	}
+	catch (std::exception& e) {
+		fail(e.what());
+	}
+
+	if (ordered) {
+		MutexGuard guard(mtx);
+		t.node->done = true;
+		cv.broadcast();
+	}
+	finishTask();
+}
+
+void ScanJob::runTask(Worker *w, const ScanTask& t)
+{
+	switch (db.keyType()) {
+	case KT_U32:
+		runTask<U32Compare>(w, t);
+		break;
+	case KT_U64:
+		runTask<U64Compare>(w, t);
+		break;
+	case KT_BYTES:
+	default:
+		runTask<BytewiseCompare>(w, t);
+		break;
+	}
+}
+
+template <class Cmp>
+void ScanJob::runTask(Worker *w, const ScanTask& t)
+{
+	typedef ScanBounds<Cmp> Bounds;
+	typename Cmp::key_type first = Bounds::first(range);
+	typename Cmp::key_type last = Bounds::last(range);
+	bool has_last = Bounds::hasLast(range);
+
+	// scan reads bypass the directory cache
+	ArenaScope scope;
+	Dir dir;
+	db.loadDir(t.dir_ino, dir);
+
+	ScanItem item;
+	for (size_t i = 0; i < dir.ents.size(); i++) {
+		const DirEntry& ent = dir.ents[i];
+
+		if (has_last && (Cmp::key(last, ent) < 0))
+			break;		// past end of range
+
+		if (ent.d_type == DE_DIR) {
+			if (Cmp::keyEnd(first, ent) > 0)
+				continue;	// before range
+
+			ScanTask sub;
+			sub.dir_ino = ent.ino_idx;
+			sub.node = NULL;
+			if (ordered) {
+				sub.node = newNode();
+				t.node->parts.push_back(ScanPart());
+				t.node->parts.back().child = sub.node;
+			}
+			push(w, sub);
+			continue;
+		}
+
+		if (Cmp::key(first, ent) > 0)
+			continue;		// before range
+
+		Bounds::setKey(item, ent);
+		db.readValue(ent, item.value);
+		db.stats.count(ST_ENTRIES_SCANNED);
+
+		if (!ordered) {
+			visitor.visit(item);
+			continue;
+		}
+
+		size_t bytes = sizeof(ScanItem) + item.key.size() +
+			       item.value.size();
+		if (!reserve(t.node, bytes))
+			return;		// scan failed
+
+		if (t.node->parts.empty() || t.node->parts.back().child)
+			t.node->parts.push_back(ScanPart());
+		ScanPart& part = t.node->parts.back();
+		part.items.push_back(item);
+		part.bytes += bytes;
+	}
+}
+
+// Visit a node's output once its task is done, in key order
+void ScanJob::emit(ScanNode *node)
+{
+	{
+		MutexGuard guard(mtx);
+		frontier = node;
+		cv.broadcast();		// its task may wait for room
+	}
+
+	// no worker has begun it: run it here, rather than wait
+	ScanTask t;
+	if (claim(node, t))
+		runOne(workers[0], t);
+
+	{
+		MutexGuard guard(mtx);
+		while (!node->done && !failed)
+			cv.wait(mtx);
+		if (failed)
+			return;
+	}
+
+	for (size_t i = 0; i < node->parts.size(); i++) {
+		ScanPart& part = node->parts[i];
+		for (size_t j = 0; j < part.items.size(); j++)
+			visitor.visit(part.items[j]);
+		std::vector<ScanItem>().swap(part.items);
+		unreserve(part.bytes);
+
+		if (part.child)
+			emit(part.child);
+	}
+}
+
+void ScanJob::run(unsigned int n_threads)
+{
+	if (n_threads == 0)
+		n_threads = 1;
+
+	for (unsigned int i = 0; i < n_threads; i++) {
+		Worker *w = new Worker;
+		w->job = this;
+		w->id = i;
+		workers.push_back(w);
+	}
+
+	ScanTask root;
+	root.dir_ino = DBINO_ROOT_DIR;
+	root.node = ordered ? newNode() : NULL;
+	push(workers[0], root);
+
+	size_t n_started = 0;
+	for (; n_started < workers.size(); n_started++)
+		if (pthread_create(&workers[n_started]->thread, NULL,
+				   workerMain, workers[n_started]) != 0) {
+			fail("Failed thread create");
+			break;
+		}
+
+	if (ordered && (n_started == workers.size())) {
+		ReadaheadScope stream(db.f);	// tasks run by emit
+		try {
+			emit(root.node);
+		}
+		catch (std::exception& e) {
+			fail(e.what());
+		}
+	}
+
+	// unordered, or done emitting: wait out the workers
+	{
+		MutexGuard guard(mtx);
+		while ((outstanding > 0) && !failed)
+			cv.wait(mtx);
+	}
+	for (size_t i = 0; i < n_started; i++)
+		pthread_join(workers[i]->thread, NULL);
+
+	if (failed)
+		throw std::runtime_error(error);
+}
+
+void DB::parallelScan(const ScanRange& range, ScanVisitor& visitor,
+		      unsigned int n_threads, bool ordered)
+{
+	StatTimer timer(stats, OP_SCAN);
+	ReadScope scope(*this);
+	TraceScope tr(trace, TR_SCAN);
+	tr.setArg(n_threads);
+
+	ScanJob job(*this, range, visitor, ordered);
+	job.run(n_threads);
+	tr.done();
+}
+
+} // namespace page
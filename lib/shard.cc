@@ -0,0 +1,416 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <pgdb2-shard.h>
+#include <pgdb2-file.h>
+
+namespace page {
+
+// Tasks of one batch operation, one per shard.  The caller waits for
+// all, then sees the first error, if any.
+class ShardBatch {
+private:
+	Mutex		mtx;
+	CondVar		cv;
+	size_t		pending;
+	std::string	error;
+
+	ShardBatch(const ShardBatch&);
+	ShardBatch& operator=(const ShardBatch&);
+
+public:
+	ShardBatch() : pending(0) {}
+
+	void start() {
+		MutexGuard guard(mtx);
+		pending++;
+	}
+	void finish(const std::string *err) {
+		MutexGuard guard(mtx);
+		if (err && error.empty())
+			error = *err;
+		if (--pending == 0)
+			cv.broadcast();
+	}
+	void wait() {
+		{
+			MutexGuard guard(mtx);
+			while (pending > 0)
+				cv.wait(mtx);
+		}
+		if (!error.empty())
+			throw std::runtime_error(error);
+	}
+};
+
+class ShardTask : public AsyncTask {
+private:
+	ShardBatch&	batch;
+
+protected:
+	DB&		db;
+
+	virtual void runShard() = 0;
+
+public:
+	ShardTask(ShardBatch& batch_, DB& db_) : batch(batch_), db(db_) {}
+
+	void run() {
+		std::string err;
+		bool failed = false;
+		try {
+			runShard();
+		}
+		catch (std::exception& e) {
+			err = e.what();
+			failed = true;
+		}
+
+		// last touch of the batch: the caller may return now
+		batch.finish(failed ? &err : NULL);
+	}
+};
+
+// Run a shard's task on the pool, or on the calling thread
+static void submitShard(ThreadPool *pool, ShardBatch& batch, ShardTask *task)
+{
+	batch.start();
+	if (pool)
+		pool->submit(task);
+	else {
+		task->run();
+		delete task;
+	}
+}
+
+// Keys of one shard in a batch, and their results.  Per shard, so
+// tasks share no output.
+template <typename K>
+class ShardKeys {
+public:
+	std::vector<size_t>		pos;	// in caller's vectors
+	std::vector<K>			keys;
+	std::vector<std::string>	values;
+	std::vector<char>		found;
+};
+
+template <typename K>
+class ShardGetTask : public ShardTask {
+private:
+	ShardKeys<K>&	sk;
+
+	void runShard() {
+		sk.values.resize(sk.keys.size());
+		sk.found.resize(sk.keys.size());
+		for (size_t i = 0; i < sk.keys.size(); i++)
+			sk.found[i] = db.get(sk.keys[i], sk.values[i]);
+	}
+
+public:
+	ShardGetTask(ShardBatch& batch_, DB& db_, ShardKeys<K>& sk_)
+		: ShardTask(batch_, db_), sk(sk_) {}
+};
+
+template <typename K>
+class ShardPutTask : public ShardTask {
+private:
+	ShardKeys<K>&			sk;
+	const std::vector<std::string>&	values;
+
+	void runShard() {
+		for (size_t i = 0; i < sk.keys.size(); i++)
+			db.put(sk.keys[i], values[sk.pos[i]]);
+	}
+
+public:
+	ShardPutTask(ShardBatch& batch_, DB& db_, ShardKeys<K>& sk_,
+		     const std::vector<std::string>& values_)
+		: ShardTask(batch_, db_), sk(sk_), values(values_) {}
+};
+
+class ShardSyncTask : public ShardTask {
+private:
+	void runShard() { db.sync(); }
+
+public:
+	ShardSyncTask(ShardBatch& batch_, DB& db_) : ShardTask(batch_, db_) {}
+};
+
+class ShardScanTask : public ShardTask {
+private:
+	const ScanRange&	range;
+	ScanVisitor&		visitor;
+	unsigned int		n_threads;
+
+	void runShard() { db.parallelScan(range, visitor, n_threads); }
+
+public:
+	ShardScanTask(ShardBatch& batch_, DB& db_, const ScanRange& range_,
+		      ScanVisitor& visitor_, unsigned int n_threads_)
+		: ShardTask(batch_, db_), range(range_), visitor(visitor_),
+		  n_threads(n_threads_) {}
+};
+
+ShardedDB::ShardedDB(const std::vector<std::string>& filenames,
+		     const Options& opts, const ShardOptions& sopts_)
+	: sopts(sopts_), pool(NULL)
+{
+	if (filenames.empty())
+		throw std::runtime_error("No shard files");
+
+	try {
+		for (size_t i = 0; i < filenames.size(); i++) {
+			shards.push_back(NULL);
+			shards.back() = new DB(filenames[i], opts);
+
+			if (shards[i]->keyType() != shards[0]->keyType())
+				throw std::runtime_error("Shard key type mismatch: " + filenames[i]);
+		}
+
+		if (sopts.scheme == SHARD_RANGE) {
+			bool bytes = (keyType() == KT_BYTES);
+			size_t n_splits = bytes ? sopts.splits.size() :
+						  sopts.isplits.size();
+			if (n_splits != (shards.size() - 1))
+				throw std::runtime_error("Shard split count mismatch");
+
+			for (size_t i = 1; i < n_splits; i++)
+				if (bytes ? (sopts.splits[i - 1] >= sopts.splits[i]) :
+					    (sopts.isplits[i - 1] >= sopts.isplits[i]))
+					throw std::runtime_error("Shard splits not ascending");
+		} else if (sopts.scheme != SHARD_HASH)
+			throw std::runtime_error("Invalid shard scheme");
+
+		if (shards.size() > 1)
+			pool = new ThreadPool(shards.size());
+	}
+	catch (...) {
+		close();
+		throw;
+	}
+}
+
+ShardedDB::~ShardedDB()
+{
+	close();
+}
+
+void ShardedDB::close()
+{
+	delete pool;
+	pool = NULL;
+
+	for (size_t i = 0; i < shards.size(); i++)
+		delete shards[i];
+	shards.clear();
+}
+
+// The mappings below decide where keys live on disk: never change
+// them.
+size_t ShardedDB::shardOf(const std::string& key) const
+{
+	if (sopts.scheme == SHARD_RANGE)
+		return std::upper_bound(sopts.splits.begin(), sopts.splits.end(),
+					key) - sopts.splits.begin();
+
+	return crc32c(0, key.data(), key.size()) % shards.size();
+}
+
+size_t ShardedDB::shardOf(uint64_t key) const
+{
+	if (sopts.scheme == SHARD_RANGE)
+		return std::upper_bound(sopts.isplits.begin(), sopts.isplits.end(),
+					key) - sopts.isplits.begin();
+
+	// 64-bit finalizer: consecutive keys spread evenly
+	uint64_t h = key;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h % shards.size();
+}
+
+bool ShardedDB::get(const std::string& key, std::string& valueOut)
+{
+	return shards[shardOf(key)]->get(key, valueOut);
+}
+
+bool ShardedDB::get(uint64_t key, std::string& valueOut)
+{
+	return shards[shardOf(key)]->get(key, valueOut);
+}
+
+void ShardedDB::put(const std::string& key, const std::string& value)
+{
+	shards[shardOf(key)]->put(key, value);
+}
+
+void ShardedDB::put(uint64_t key, const std::string& value)
+{
+	shards[shardOf(key)]->put(key, value);
+}
+
+template <typename K>
+void ShardedDB::multiGetKeys(const std::vector<K>& keys,
+			     std::vector<std::string>& values,
+			     std::vector<bool>& found)
+{
+	std::vector< ShardKeys<K> > sks(shards.size());
+	for (size_t i = 0; i < keys.size(); i++) {
+		ShardKeys<K>& sk = sks[shardOf(keys[i])];
+		sk.pos.push_back(i);
+		sk.keys.push_back(keys[i]);
+	}
+
+	ShardBatch batch;
+	for (size_t s = 0; s < shards.size(); s++)
+		if (!sks[s].keys.empty())
+			submitShard(pool, batch,
+				    new ShardGetTask<K>(batch, *shards[s], sks[s]));
+	batch.wait();
+
+	values.resize(keys.size());
+	found.assign(keys.size(), false);
+	for (size_t s = 0; s < sks.size(); s++) {
+		ShardKeys<K>& sk = sks[s];
+		for (size_t i = 0; i < sk.pos.size(); i++) {
+			values[sk.pos[i]].swap(sk.values[i]);
+			found[sk.pos[i]] = sk.found[i];
+		}
+	}
+}
+
+void ShardedDB::multiGet(const std::vector<std::string>& keys,
+			 std::vector<std::string>& values,
+			 std::vector<bool>& found)
+{
+	multiGetKeys(keys, values, found);
+}
+
+void ShardedDB::multiGet(const std::vector<uint64_t>& keys,
+			 std::vector<std::string>& values,
+			 std::vector<bool>& found)
+{
+	multiGetKeys(keys, values, found);
+}
+
+template <typename K>
+void ShardedDB::multiPutKeys(const std::vector<K>& keys,
+			     const std::vector<std::string>& values)
+{
+	if (keys.size() != values.size())
+		throw std::runtime_error("Key and value counts differ");
+
+	std::vector< ShardKeys<K> > sks(shards.size());
+	for (size_t i = 0; i < keys.size(); i++) {
+		ShardKeys<K>& sk = sks[shardOf(keys[i])];
+		sk.pos.push_back(i);
+		sk.keys.push_back(keys[i]);
+	}
+
+	ShardBatch batch;
+	for (size_t s = 0; s < shards.size(); s++)
+		if (!sks[s].keys.empty())
+			submitShard(pool, batch,
+				    new ShardPutTask<K>(batch, *shards[s], sks[s],
+							values));
+	batch.wait();
+}
+
+void ShardedDB::multiPut(const std::vector<std::string>& keys,
+			 const std::vector<std::string>& values)
+{
+	multiPutKeys(keys, values);
+}
+
+void ShardedDB::multiPut(const std::vector<uint64_t>& keys,
+			 const std::vector<std::string>& values)
+{
+	multiPutKeys(keys, values);
+}
+
+void ShardedDB::sync()
+{
+	ShardBatch batch;
+	for (size_t s = 0; s < shards.size(); s++)
+		submitShard(pool, batch, new ShardSyncTask(batch, *shards[s]));
+	batch.wait();
+}
+
+// May shard hold keys in range?  Always, unless range sharded.
+bool ShardedDB::overlaps(size_t shard, const ScanRange& range) const
+{
+	if (sopts.scheme != SHARD_RANGE)
+		return true;
+
+	// shard keys: [split shard - 1, split shard)
+	if (keyType() == KT_BYTES) {
+		if ((shard > 0) && range.has_last &&
+		    (range.last < sopts.splits[shard - 1]))
+			return false;
+		if ((shard < sopts.splits.size()) &&
+		    (sopts.splits[shard] <= range.first))
+			return false;
+	} else {
+		if ((shard > 0) && (range.ilast < sopts.isplits[shard - 1]))
+			return false;
+		if ((shard < sopts.isplits.size()) &&
+		    (sopts.isplits[shard] <= range.ifirst))
+			return false;
+	}
+
+	return true;
+}
+
+void ShardedDB::parallelScan(const ScanRange& range, ScanVisitor& visitor,
+			     unsigned int n_threads, bool ordered)
+{
+	std::vector<size_t> scan;
+	for (size_t s = 0; s < shards.size(); s++)
+		if (overlaps(s, range))
+			scan.push_back(s);
+
+	// range shards hold successive key ranges
+	if (ordered) {
+		if (sopts.scheme != SHARD_RANGE)
+			throw std::runtime_error("Ordered scan needs range shards");
+
+		for (size_t i = 0; i < scan.size(); i++)
+			shards[scan[i]]->parallelScan(range, visitor, n_threads,
+						      true);
+		return;
+	}
+
+	unsigned int per_shard = scan.empty() ? 1 : (n_threads / scan.size());
+	if (per_shard == 0)
+		per_shard = 1;
+
+	ShardBatch batch;
+	for (size_t i = 0; i < scan.size(); i++)
+		submitShard(pool, batch,
+			    new ShardScanTask(batch, *shards[scan[i]], range,
+					      visitor, per_shard));
+	batch.wait();
+}
+
+void ShardedDB::getStats(DBStats& out) const
+{
+	shards[0]->getStats(out);
+	for (size_t s = 1; s < shards.size(); s++) {
+		DBStats st;
+		shards[s]->getStats(st);
+		out.merge(st);
+	}
+}
+
+} // namespace page
@@ -0,0 +1,208 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdexcept>
+#include <pgdb2-shm.h>
+#include <pgdb2-lock.h>
+
+namespace page {
+
+static const size_t SHM_SLOT_ALIGN = 64;
+
+void SharedRegion::open(const std::string& path, int db_fd, size_t page_size_,
+			uint64_t cache_bytes)
+{
+	close();
+
+	struct stat db_st;
+	if (::fstat(db_fd, &db_st) < 0)
+		throw std::runtime_error("Failed fstat " + path + ": " + strerror(errno));
+
+	page_size = page_size_;
+	slot_size = (sizeof(ShmSlot) + page_size + SHM_SLOT_ALIGN - 1) &
+		    ~(SHM_SLOT_ALIGN - 1);
+
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0666);
+	if (fd < 0)
+		throw std::runtime_error("Failed open " + path + ": " + strerror(errno));
+
+	// one process at a time sets up the region
+	FileLock init_lock;
+	init_lock.init(fd, 0);
+	init_lock.lockExclusive();
+
+	struct stat st;
+	if (::fstat(fd, &st) < 0) {
+		int err = errno;
+		close();
+		throw std::runtime_error("Failed fstat " + path + ": " + strerror(err));
+	}
+
+	// adopt an existing region for this DB; otherwise start over,
+	// never shrinking a file others may have mapped
+	ShmHdr cur;
+	memset(&cur, 0, sizeof(cur));
+	if ((size_t) st.st_size >= sizeof(cur) &&
+	    (::pread(fd, &cur, sizeof(cur), 0) != (ssize_t) sizeof(cur)))
+		memset(&cur, 0, sizeof(cur));
+
+	bool reuse = cur.valid() && (cur.page_size == page_size) &&
+		     (cur.n_slots > 0) &&
+		     (cur.db_dev == (uint64_t) db_st.st_dev) &&
+		     (cur.db_ino == (uint64_t) db_st.st_ino) &&
+		     ((uint64_t) st.st_size >=
+		      (sizeof(ShmHdr) + (cur.n_slots * slot_size)));
+
+	uint64_t n_slots = reuse ? cur.n_slots : (cache_bytes / slot_size);
+	if (n_slots == 0)
+		n_slots = 1;
+
+	map_len = sizeof(ShmHdr) + (n_slots * slot_size);
+	if (!reuse && ((uint64_t) st.st_size < map_len) &&
+	    (::ftruncate(fd, map_len) < 0)) {
+		int err = errno;
+		close();
+		throw std::runtime_error("Failed ftruncate " + path + ": " + strerror(err));
+	}
+
+	void *p = ::mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		int err = errno;
+		close();
+		throw std::runtime_error("Failed mmap " + path + ": " + strerror(err));
+	}
+
+	map = (unsigned char *) p;
+	hdr = (ShmHdr *) map;
+
+	if (!reuse) {
+		memset(map, 0, map_len);
+		memcpy(hdr->magic, SHM_MAGIC, sizeof(hdr->magic));
+		hdr->version = 1;
+		hdr->page_size = page_size;
+		hdr->n_slots = n_slots;
+		hdr->generation = 0;
+		hdr->db_dev = db_st.st_dev;
+		hdr->db_ino = db_st.st_ino;
+	}
+
+	init_lock.unlockExclusive();
+}
+
+void SharedRegion::close()
+{
+	if (map) {
+		::munmap(map, map_len);
+		map = NULL;
+		hdr = NULL;
+	}
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+	map_len = 0;
+}
+
+// Forget all cached pages, announcing a new generation.  Called by
+// the writer on open, while no reader can be active.
+void SharedRegion::reset()
+{
+	for (uint64_t i = 0; i < hdr->n_slots; i++) {
+		ShmSlot *s = slot(i);
+		__atomic_store_n(&s->page, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->seq, s->seq & ~1ULL, __ATOMIC_RELEASE);
+	}
+
+	bumpGeneration();
+}
+
+uint64_t SharedRegion::generation() const
+{
+	return __atomic_load_n(&hdr->generation, __ATOMIC_ACQUIRE);
+}
+
+void SharedRegion::bumpGeneration()
+{
+	__atomic_add_fetch(&hdr->generation, 1, __ATOMIC_RELEASE);
+}
+
+bool SharedRegion::getPages(uint64_t index, size_t page_count,
+			    unsigned char *out)
+{
+	// all or nothing
+	for (size_t i = 0; i < page_count; i++) {
+		ShmSlot *s = slot(index + i);
+		const unsigned char *data = (const unsigned char *) (s + 1);
+
+		uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) ||
+		    (__atomic_load_n(&s->page, __ATOMIC_RELAXED) != (index + i + 1)))
+			goto miss;
+
+		memcpy(out + (i * page_size), data, page_size);
+
+		// slot refilled while copying?
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq)
+			goto miss;
+	}
+
+	__atomic_add_fetch(&n_hits, 1, __ATOMIC_RELAXED);
+	return true;
+
+miss:
+	__atomic_add_fetch(&n_misses, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+// Fill slots with pages read from storage, skipping any busy slot.
+// The writer forces its writes in, even over a slot left busy by a
+// process that died while filling it.
+void SharedRegion::putPages(uint64_t index, size_t page_count,
+			    const unsigned char *in, bool force)
+{
+	for (size_t i = 0; i < page_count; i++) {
+		ShmSlot *s = slot(index + i);
+		unsigned char *data = (unsigned char *) (s + 1);
+
+		// claim slot; if another process is filling it, skip
+		uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+		if (force) {
+			seq &= ~1ULL;
+			__atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+		} else if ((seq & 1) ||
+			   !__atomic_compare_exchange_n(&s->seq, &seq, seq + 1,
+							false, __ATOMIC_ACQUIRE,
+							__ATOMIC_RELAXED))
+			continue;
+
+		__atomic_store_n(&s->page, index + i + 1, __ATOMIC_RELAXED);
+		memcpy(data, in + (i * page_size), page_size);
+
+		__atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+	}
+}
+
+uint64_t SharedRegion::hits() const
+{
+	return __atomic_load_n(&n_hits, __ATOMIC_RELAXED);
+}
+
+uint64_t SharedRegion::misses() const
+{
+	return __atomic_load_n(&n_misses, __ATOMIC_RELAXED);
+}
+
+} // namespace page
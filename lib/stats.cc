@@ -0,0 +1,367 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <string>
+#include <pgdb2-stats.h>
+
+namespace page {
+
+static const char *page_kind_names[PK__COUNT] = {
+	"other", "superblock", "inode_table", "extent_list",
+	"free_list", "directory", "value", "value_heap",
+};
+
+static const char *io_names[IO__COUNT] = {
+	"cached", "read", "written",
+};
+
+static const char *counter_names[ST__COUNT] = {
+	"read_calls", "write_calls", "fsyncs", "prefetches",
+	"dir_levels", "dirs_decoded", "bytes_decoded", "entries_scanned",
+	"would_block",
+};
+
+static const char *op_names[OP__COUNT] = {
+	"get", "put", "sync", "scan", "backup",
+};
+
+static const char *mem_names[MEM__COUNT] = {
+	"pages", "dirs", "inodes",
+};
+
+const char *pageKindName(unsigned int kind)
+{
+	return (kind < PK__COUNT) ? page_kind_names[kind] : "unknown";
+}
+
+const char *statCounterName(unsigned int ctr)
+{
+	return (ctr < ST__COUNT) ? counter_names[ctr] : "unknown";
+}
+
+const char *statOpName(unsigned int op)
+{
+	return (op < OP__COUNT) ? op_names[op] : "unknown";
+}
+
+void LatencyHistogram::clear()
+{
+	memset(counts, 0, sizeof(counts));
+	total = 0;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& h)
+{
+	for (unsigned int b = 0; b < n_buckets; b++)
+		counts[b] += h.counts[b];
+	total += h.total;
+}
+
+uint64_t LatencyHistogram::count() const
+{
+	uint64_t n = 0;
+	for (unsigned int b = 0; b < n_buckets; b++)
+		n += counts[b];
+	return n;
+}
+
+uint64_t LatencyHistogram::mean() const
+{
+	uint64_t n = count();
+	return n ? (total / n) : 0;
+}
+
+uint64_t LatencyHistogram::max() const
+{
+	for (unsigned int b = n_buckets; b > 0; b--)
+		if (counts[b - 1])
+			return bucketHigh(b - 1);
+	return 0;
+}
+
+uint64_t LatencyHistogram::bucketLow(unsigned int b)
+{
+	if (b < (1U << sub_bits))
+		return b;
+
+	unsigned int shift = (b >> sub_bits) - 1;
+	return ((uint64_t) ((1U << sub_bits) + (b & ((1U << sub_bits) - 1))))
+		<< shift;
+}
+
+uint64_t LatencyHistogram::bucketHigh(unsigned int b)
+{
+	if (b < (1U << sub_bits))
+		return b;
+
+	unsigned int shift = (b >> sub_bits) - 1;
+	return bucketLow(b) + (1ULL << shift) - 1;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+	uint64_t n = count();
+	if (n == 0)
+		return 0;
+
+	// rank of the value sought, 1-based
+	uint64_t rank = (uint64_t) ((p * n) + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > n)
+		rank = n;
+
+	uint64_t seen = 0;
+	for (unsigned int b = 0; b < n_buckets; b++) {
+		seen += counts[b];
+		if (seen >= rank)
+			return bucketHigh(b);
+	}
+
+	return bucketHigh(n_buckets - 1);
+}
+
+DBStats::DBStats()
+	: shm_hits(0), shm_misses(0)
+{
+	memset(pages, 0, sizeof(pages));
+	memset(counters, 0, sizeof(counters));
+}
+
+uint64_t DBStats::pagesTotal(unsigned int io) const
+{
+	uint64_t n = 0;
+	for (unsigned int k = 0; k < PK__COUNT; k++)
+		n += pages[io][k];
+	return n;
+}
+
+// Sum of two DBs' statistics; cache peaks add up too
+void DBStats::merge(const DBStats& st)
+{
+	for (unsigned int io = 0; io < IO__COUNT; io++)
+		for (unsigned int k = 0; k < PK__COUNT; k++)
+			pages[io][k] += st.pages[io][k];
+	for (unsigned int c = 0; c < ST__COUNT; c++)
+		counters[c] += st.counters[c];
+	for (unsigned int m = 0; m < MEM__COUNT; m++) {
+		mem[m].used += st.mem[m].used;
+		mem[m].peak += st.mem[m].peak;
+		mem[m].hits += st.mem[m].hits;
+		mem[m].misses += st.mem[m].misses;
+		mem[m].evictions += st.mem[m].evictions;
+	}
+	shm_hits += st.shm_hits;
+	shm_misses += st.shm_misses;
+	for (unsigned int op = 0; op < OP__COUNT; op++)
+		latency[op].merge(st.latency[op]);
+}
+
+static void appendf(std::string& s, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void appendf(std::string& s, const char *fmt, ...)
+{
+	char buf[256];
+
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	s.append(buf);
+}
+
+std::string DBStats::toText() const
+{
+	std::string s;
+
+	appendf(s, "%-12s %12s %12s %12s\n", "pages", "cached", "read",
+		"written");
+	for (unsigned int k = 0; k < PK__COUNT; k++)
+		appendf(s, "%-12s %12llu %12llu %12llu\n", page_kind_names[k],
+			(unsigned long long) pages[IO_CACHED][k],
+			(unsigned long long) pages[IO_READ][k],
+			(unsigned long long) pages[IO_WRITTEN][k]);
+	appendf(s, "%-12s %12llu %12llu %12llu\n", "total",
+		(unsigned long long) pagesTotal(IO_CACHED),
+		(unsigned long long) pagesTotal(IO_READ),
+		(unsigned long long) pagesTotal(IO_WRITTEN));
+
+	s.append("\n");
+	for (unsigned int c = 0; c < ST__COUNT; c++)
+		appendf(s, "%-16s %12llu\n", counter_names[c],
+			(unsigned long long) counters[c]);
+	appendf(s, "%-16s %12llu\n", "shm_hits", (unsigned long long) shm_hits);
+	appendf(s, "%-16s %12llu\n", "shm_misses",
+		(unsigned long long) shm_misses);
+
+	s.append("\n");
+	appendf(s, "%-8s %12s %12s %12s %12s %12s\n", "cache", "used", "peak",
+		"hits", "misses", "evictions");
+	for (unsigned int m = 0; m < MEM__COUNT; m++)
+		appendf(s, "%-8s %12llu %12llu %12llu %12llu %12llu\n",
+			mem_names[m],
+			(unsigned long long) mem[m].used,
+			(unsigned long long) mem[m].peak,
+			(unsigned long long) mem[m].hits,
+			(unsigned long long) mem[m].misses,
+			(unsigned long long) mem[m].evictions);
+
+	s.append("\n");
+	appendf(s, "%-8s %10s %10s %10s %10s %10s %10s\n", "ns", "count",
+		"mean", "p50", "p99", "p99.9", "max");
+	for (unsigned int op = 0; op < OP__COUNT; op++) {
+		const LatencyHistogram& h = latency[op];
+		appendf(s, "%-8s %10llu %10llu %10llu %10llu %10llu %10llu\n",
+			op_names[op],
+			(unsigned long long) h.count(),
+			(unsigned long long) h.mean(),
+			(unsigned long long) h.percentile(0.50),
+			(unsigned long long) h.percentile(0.99),
+			(unsigned long long) h.percentile(0.999),
+			(unsigned long long) h.max());
+	}
+
+	return s;
+}
+
+// One JSON object.  Histograms list their non-empty buckets as
+// [low, high, count] triples.
+std::string DBStats::toJSON() const
+{
+	std::string s = "{\"pages\":{";
+
+	for (unsigned int io = 0; io < IO__COUNT; io++) {
+		appendf(s, "%s\"%s\":{", io ? "," : "", io_names[io]);
+		for (unsigned int k = 0; k < PK__COUNT; k++)
+			appendf(s, "%s\"%s\":%llu", k ? "," : "",
+				page_kind_names[k],
+				(unsigned long long) pages[io][k]);
+		s.append("}");
+	}
+
+	s.append("},\"counters\":{");
+	for (unsigned int c = 0; c < ST__COUNT; c++)
+		appendf(s, "%s\"%s\":%llu", c ? "," : "", counter_names[c],
+			(unsigned long long) counters[c]);
+	appendf(s, ",\"shm_hits\":%llu,\"shm_misses\":%llu",
+		(unsigned long long) shm_hits, (unsigned long long) shm_misses);
+
+	s.append("},\"caches\":{");
+	for (unsigned int m = 0; m < MEM__COUNT; m++)
+		appendf(s, "%s\"%s\":{\"used\":%llu,\"peak\":%llu,"
+			"\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu}",
+			m ? "," : "", mem_names[m],
+			(unsigned long long) mem[m].used,
+			(unsigned long long) mem[m].peak,
+			(unsigned long long) mem[m].hits,
+			(unsigned long long) mem[m].misses,
+			(unsigned long long) mem[m].evictions);
+
+	s.append("},\"latency_ns\":{");
+	for (unsigned int op = 0; op < OP__COUNT; op++) {
+		const LatencyHistogram& h = latency[op];
+		appendf(s, "%s\"%s\":{\"count\":%llu,\"mean\":%llu,"
+			"\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,"
+			"\"max\":%llu,\"buckets\":[",
+			op ? "," : "", op_names[op],
+			(unsigned long long) h.count(),
+			(unsigned long long) h.mean(),
+			(unsigned long long) h.percentile(0.50),
+			(unsigned long long) h.percentile(0.90),
+			(unsigned long long) h.percentile(0.99),
+			(unsigned long long) h.percentile(0.999),
+			(unsigned long long) h.max());
+
+		bool first = true;
+		for (unsigned int b = 0; b < LatencyHistogram::n_buckets; b++) {
+			if (!h.counts[b])
+				continue;
+			appendf(s, "%s[%llu,%llu,%llu]", first ? "" : ",",
+				(unsigned long long) LatencyHistogram::bucketLow(b),
+				(unsigned long long) LatencyHistogram::bucketHigh(b),
+				(unsigned long long) h.counts[b]);
+			first = false;
+		}
+		s.append("]}");
+	}
+	s.append("}}");
+
+	return s;
+}
+
+Stats::Stats()
+	: enabled(true)
+{
+	shards = new Shard[n_shards];
+	reset();
+}
+
+Stats::~Stats()
+{
+	delete [] shards;
+}
+
+// Shard of the calling thread: threads are dealt out round robin
+unsigned int Stats::shardId()
+{
+	static unsigned int next = 0;
+	static thread_local unsigned int id =
+		__atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % n_shards;
+	return id;
+}
+
+// Counts move while we sum: each is exact, their sum merely recent
+void Stats::snapshot(DBStats& out) const
+{
+	memset(out.pages, 0, sizeof(out.pages));
+	memset(out.counters, 0, sizeof(out.counters));
+	for (unsigned int op = 0; op < OP__COUNT; op++)
+		out.latency[op].clear();
+
+	for (unsigned int i = 0; i < n_shards; i++) {
+		const Shard& s = shards[i];
+
+		for (unsigned int io = 0; io < IO__COUNT; io++)
+			for (unsigned int k = 0; k < PK__COUNT; k++)
+				out.pages[io][k] += __atomic_load_n(&s.pages[io][k],
+								    __ATOMIC_RELAXED);
+		for (unsigned int c = 0; c < ST__COUNT; c++)
+			out.counters[c] += __atomic_load_n(&s.counters[c],
+							   __ATOMIC_RELAXED);
+
+		for (unsigned int op = 0; op < OP__COUNT; op++) {
+			LatencyHistogram& h = out.latency[op];
+			for (unsigned int b = 0; b < LatencyHistogram::n_buckets; b++)
+				h.counts[b] += __atomic_load_n(&s.lat[op][b],
+							       __ATOMIC_RELAXED);
+			h.total += __atomic_load_n(&s.lat_total[op],
+						   __ATOMIC_RELAXED);
+		}
+	}
+}
+
+// Counts racing with the reset may survive it
+void Stats::reset()
+{
+	uint64_t *p = (uint64_t *) shards;
+	size_t n = (n_shards * sizeof(Shard)) / sizeof(uint64_t);
+	for (size_t i = 0; i < n; i++)
+		__atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
+}
+
+unsigned int& PageKindScope::current()
+{
+	static thread_local unsigned int kind = PK_OTHER;
+	return kind;
+}
+
+} // namespace page
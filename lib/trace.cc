@@ -0,0 +1,260 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <pgdb2.h>
+#include <pgdb2-trace.h>
+
+namespace page {
+
+static const char *trace_op_names[TR__COUNT] = {
+	"get", "get_range", "open", "put", "sync", "scan",
+};
+
+const char *traceOpName(unsigned int op)
+{
+	return (op < TR__COUNT) ? trace_op_names[op] : "unknown";
+}
+
+// Write all of len, or fail
+static bool writeAll(int fd, const void *p, size_t len)
+{
+	const char *buf = (const char *) p;
+	while (len > 0) {
+		ssize_t n = ::write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+TraceRecorder::TraceRecorder()
+	: fd(-1), shards(NULL), start_ns(0), key_width(0), failed(false),
+	  dropped(0)
+{
+}
+
+TraceRecorder::~TraceRecorder()
+{
+	if (fd >= 0)
+		::close(fd);
+	delete [] shards;
+}
+
+void TraceRecorder::open(const std::string& path_, enum key_types kt)
+{
+	path = path_;
+	fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		throw std::runtime_error("Failed open " + path + ": " + strerror(errno));
+
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	TraceHdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = 1;
+	hdr.key_type = kt;
+	hdr.start_time = ((uint64_t) tv.tv_sec * 1000000000ULL) +
+			 ((uint64_t) tv.tv_usec * 1000ULL);
+	hdr.swap_h2n();
+
+	if (!writeAll(fd, &hdr, sizeof(hdr)))
+		throw std::runtime_error("Failed write " + path + ": " + strerror(errno));
+
+	shards = new Shard[n_shards];
+	for (unsigned int i = 0; i < n_shards; i++)
+		shards[i].n = 0;
+
+	key_width = keyTypeWidth(kt);
+	start_ns = Stats::now();
+}
+
+// Write out the shard's records; called with its lock held
+void TraceRecorder::flush(Shard& s)
+{
+	if (s.n == 0)
+		return;
+
+	for (unsigned int i = 0; i < s.n; i++)
+		s.recs[i].swap_h2n();
+
+	MutexGuard guard(write_mtx);
+
+	if (__atomic_load_n(&failed, __ATOMIC_RELAXED) ||
+	    !writeAll(fd, s.recs, s.n * sizeof(TraceRecord))) {
+		__atomic_store_n(&failed, true, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&dropped, s.n, __ATOMIC_RELAXED);
+	}
+
+	s.n = 0;
+}
+
+void TraceRecorder::record(TraceRecord& r)
+{
+	unsigned int id = threadId();
+	Shard& s = shards[id % n_shards];
+
+	r.t_ns = (r.t_ns > start_ns) ? (r.t_ns - start_ns) : 0;
+	r.thread = id;
+
+	MutexGuard guard(s.mtx);
+
+	s.recs[s.n++] = r;
+	if (s.n == shard_records)
+		flush(s);
+}
+
+// Flush every shard; no record may be in progress
+void TraceRecorder::close()
+{
+	if (fd < 0)
+		return;
+
+	for (unsigned int i = 0; i < n_shards; i++) {
+		MutexGuard guard(shards[i].mtx);
+		flush(shards[i]);
+	}
+
+	int rc = ::close(fd);
+	fd = -1;
+
+	if (failed || (rc < 0)) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), " (%llu records lost)",
+			 (unsigned long long) dropped);
+		throw std::runtime_error("Failed write " + path + buf);
+	}
+}
+
+// FNV-1a, 64 bits
+uint64_t TraceRecorder::keyHash(const std::string& key)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < key.size(); i++) {
+		h ^= (unsigned char) key[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// Threads are numbered in order of their first record
+unsigned int TraceRecorder::threadId()
+{
+	static unsigned int next = 0;
+	static thread_local unsigned int id =
+		__atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) & 0xffff;
+	return id;
+}
+
+void TraceReader::open(const std::string& path)
+{
+	close();
+
+	fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("Failed open " + path + ": " + strerror(errno));
+
+	if ((::read(fd, &hdr, sizeof(hdr)) != (ssize_t) sizeof(hdr)) ||
+	    (hdr.swap_n2h(), !hdr.valid()))
+		throw std::runtime_error("Invalid trace file " + path);
+
+	buf.clear();
+	pos = 0;
+}
+
+void TraceReader::close()
+{
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+}
+
+bool TraceReader::next(TraceRecord& r)
+{
+	if (pos == buf.size()) {
+		if (fd < 0)
+			return false;
+
+		buf.resize(TraceRecorder::shard_records);
+		ssize_t n;
+		do {
+			n = ::read(fd, &buf[0], buf.size() * sizeof(TraceRecord));
+		} while ((n < 0) && (errno == EINTR));
+
+		if (n < 0)
+			throw std::runtime_error(std::string("Failed read trace: ") + strerror(errno));
+		if ((n % sizeof(TraceRecord)) != 0)
+			throw std::runtime_error("Trace file truncated");
+
+		buf.resize(n / sizeof(TraceRecord));
+		pos = 0;
+		if (buf.empty())
+			return false;
+	}
+
+	r = buf[pos++];
+	r.swap_n2h();
+	return true;
+}
+
+void DB::startTrace(const std::string& path)
+{
+	WriteGuard guard(rwlock);
+
+	if (trace)
+		throw std::runtime_error("Trace already started");
+
+	TraceRecorder *rec = new TraceRecorder;
+	try {
+		rec->open(path, keyType());
+	}
+	catch (...) {
+		delete rec;
+		throw;
+	}
+
+	trace = rec;
+}
+
+void DB::stopTrace()
+{
+	TraceRecorder *rec;
+	{
+		WriteGuard guard(rwlock);
+		rec = trace;
+		trace = NULL;
+	}
+
+	if (!rec)
+		return;
+
+	try {
+		rec->close();
+	}
+	catch (...) {
+		delete rec;
+		throw;
+	}
+	delete rec;
+}
+
+} // namespace page
@@ -0,0 +1,314 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <cassert>
+#include <vector>
+#include <algorithm>
+#include <pgdb2.h>
+
+namespace page {
+
+void ValueHeapPage::init(unsigned char *buf_, size_t data_size)
+{
+	attach(buf_, data_size);
+	memset(buf, 0, len);
+
+	ValueHeapHdr hdr;
+	memcpy(hdr.magic, VHEAP_MAGIC, sizeof(hdr.magic));
+	hdr.vh_slots = 0;
+	hdr.vh_flags = VHF_MBO;
+	hdr.swap_h2n();
+
+	memcpy(&buf[0], &hdr, sizeof(hdr));
+}
+
+void ValueHeapPage::attach(unsigned char *buf_, size_t data_size)
+{
+	buf = buf_;
+	len = data_size;
+}
+
+void ValueHeapPage::validate() const
+{
+	if (len < sizeof(ValueHeapHdr))
+		throw std::runtime_error("Value heap page short read");
+
+	ValueHeapHdr hdr;
+	memcpy(&hdr, &buf[0], sizeof(hdr));
+	hdr.swap_n2h();
+
+	if (!hdr.valid())
+		throw std::runtime_error("Value heap page invalid hdr");
+
+	size_t slot_end = sizeof(ValueHeapHdr) +
+			  (hdr.vh_slots * sizeof(ValueHeapSlot));
+	if (slot_end > len)
+		throw std::runtime_error("Value heap page invalid slot count");
+
+	for (uint32_t i = 0; i < hdr.vh_slots; i++) {
+		ValueHeapSlot vs = getSlot(i);
+		if (vs.vs_off &&
+		    ((vs.vs_off < slot_end) ||
+		     (vs.vs_len > (len - vs.vs_off))))
+			throw std::runtime_error("Value heap page invalid slot");
+	}
+}
+
+uint32_t ValueHeapPage::slots() const
+{
+	uint32_t n;
+	memcpy(&n, &buf[offsetof(ValueHeapHdr, vh_slots)], sizeof(n));
+	return le32toh(n);
+}
+
+void ValueHeapPage::setSlotCount(uint32_t n)
+{
+	n = htole32(n);
+	memcpy(&buf[offsetof(ValueHeapHdr, vh_slots)], &n, sizeof(n));
+}
+
+ValueHeapSlot ValueHeapPage::getSlot(uint32_t slot) const
+{
+	ValueHeapSlot vs;
+	memcpy(&vs, &buf[sizeof(ValueHeapHdr) + (slot * sizeof(vs))], sizeof(vs));
+	vs.swap_n2h();
+	return vs;
+}
+
+void ValueHeapPage::setSlot(uint32_t slot, const ValueHeapSlot& vs_in)
+{
+	ValueHeapSlot vs(vs_in);
+	vs.swap_h2n();
+	memcpy(&buf[sizeof(ValueHeapHdr) + (slot * sizeof(vs))], &vs, sizeof(vs));
+}
+
+uint32_t ValueHeapPage::liveSlots() const
+{
+	uint32_t n_slots = slots();
+	uint32_t live = 0;
+
+	for (uint32_t i = 0; i < n_slots; i++)
+		if (getSlot(i).vs_off)
+			live++;
+
+	return live;
+}
+
+uint32_t ValueHeapPage::dataStart() const
+{
+	uint32_t n_slots = slots();
+	uint32_t start = len;
+
+	for (uint32_t i = 0; i < n_slots; i++) {
+		ValueHeapSlot vs = getSlot(i);
+		if (vs.vs_off && (vs.vs_off < start))
+			start = vs.vs_off;
+	}
+
+	return start;
+}
+
+size_t ValueHeapPage::freeSpace() const
+{
+	uint32_t n_slots = slots();
+	size_t used = sizeof(ValueHeapHdr) + (n_slots * sizeof(ValueHeapSlot));
+
+	for (uint32_t i = 0; i < n_slots; i++) {
+		ValueHeapSlot vs = getSlot(i);
+		if (vs.vs_off)
+			used += vs.vs_len;
+	}
+
+	return len - used;
+}
+
+size_t ValueHeapPage::maxValue(size_t data_size)
+{
+	return data_size - sizeof(ValueHeapHdr) - sizeof(ValueHeapSlot);
+}
+
+bool ValueHeapPage::get(uint32_t slot, std::string& valueOut) const
+{
+	if (slot >= slots())
+		return false;
+
+	ValueHeapSlot vs = getSlot(slot);
+	if (!vs.vs_off)
+		return false;
+
+	valueOut.assign((const char *) &buf[vs.vs_off], vs.vs_len);
+	return true;
+}
+
+static bool cmpSlotOff(const std::pair<uint32_t, ValueHeapSlot>& a,
+		       const std::pair<uint32_t, ValueHeapSlot>& b)
+{
+	return a.second.vs_off > b.second.vs_off;
+}
+
+void ValueHeapPage::compact()
+{
+	uint32_t n_slots = slots();
+
+	// collect live slots, highest offset first
+	std::vector<std::pair<uint32_t, ValueHeapSlot> > live;
+	for (uint32_t i = 0; i < n_slots; i++) {
+		ValueHeapSlot vs = getSlot(i);
+		if (vs.vs_off)
+			live.push_back(std::make_pair(i, vs));
+	}
+	std::sort(live.begin(), live.end(), cmpSlotOff);
+
+	// slide values up against the end of the page; each move
+	// is to an equal or higher offset, and never overlaps a
+	// value not yet moved
+	uint32_t end = len;
+	for (size_t i = 0; i < live.size(); i++) {
+		ValueHeapSlot& vs = live[i].second;
+		end -= vs.vs_len;
+		memmove(&buf[end], &buf[vs.vs_off], vs.vs_len);
+		vs.vs_off = end;
+		setSlot(live[i].first, vs);
+	}
+}
+
+bool ValueHeapPage::insert(const std::string& value, uint32_t& slot)
+{
+	assert(value.size() > 0);
+
+	uint32_t n_slots = slots();
+
+	// find free slot, or append a new one
+	slot = n_slots;
+	for (uint32_t i = 0; i < n_slots; i++) {
+		if (!getSlot(i).vs_off) {
+			slot = i;
+			break;
+		}
+	}
+
+	size_t new_slot = (slot == n_slots) ? sizeof(ValueHeapSlot) : 0;
+	size_t need = value.size() + new_slot;
+
+	if (freeSpace() < need)
+		return false;
+
+	size_t slot_end = sizeof(ValueHeapHdr) +
+			  ((n_slots * sizeof(ValueHeapSlot)) + new_slot);
+	if ((dataStart() - slot_end) < value.size())
+		compact();
+
+	uint32_t off = dataStart() - value.size();
+	assert(off >= slot_end);
+	memcpy(&buf[off], value.data(), value.size());
+
+	if (new_slot)
+		setSlotCount(n_slots + 1);
+
+	ValueHeapSlot vs;
+	vs.vs_off = off;
+	vs.vs_len = value.size();
+	setSlot(slot, vs);
+
+	return true;
+}
+
+void ValueHeapPage::erase(uint32_t slot)
+{
+	uint32_t n_slots = slots();
+	if (slot >= n_slots)
+		throw std::runtime_error("Value heap slot out of range");
+
+	ValueHeapSlot vs;
+	vs.vs_off = 0;
+	vs.vs_len = 0;
+	setSlot(slot, vs);
+
+	// trim trailing free slots; live slots never move
+	while ((n_slots > 0) && !getSlot(n_slots - 1).vs_off)
+		n_slots--;
+	setSlotCount(n_slots);
+}
+
+// Read a heap page into scratch memory from arena; the page remains
+// valid until the arena is rewound
+void DB::readHeapPage(uint64_t pgno, ScratchArena& arena, ValueHeapPage& vhp)
+{
+	PageKindScope kind(PK_VHEAP);
+
+	unsigned char *page = arena.allocBytes(sb.page_size);
+	f.read(page, pgno);
+
+	vhp.attach(page, pagesToBuf(page, 1));
+	vhp.validate();
+}
+
+// vhp views a whole page buffer: its data area, then room for the
+// page trailer
+void DB::writeHeapPage(uint64_t pgno, const ValueHeapPage& vhp)
+{
+	PageKindScope kind(PK_VHEAP);
+
+	assert(vhp.len == f.pageDataSize());
+	f.write(vhp.buf, pgno);
+}
+
+size_t DB::packedMax() const
+{
+	size_t heap_max = ValueHeapPage::maxValue(f.pageDataSize());
+	return std::min((size_t) options.packed_max, heap_max);
+}
+
+void DB::heapPut(const std::string& value, uint64_t& pgno, uint32_t& slot)
+{
+	ArenaScope scope;
+	ValueHeapPage vhp;
+
+	// try the heap page currently being filled
+	if (sb.vh_page) {
+		readHeapPage(sb.vh_page, scope.arena(), vhp);
+		if (vhp.insert(value, slot)) {
+			writeHeapPage(sb.vh_page, vhp);
+			pgno = sb.vh_page;
+			return;
+		}
+	}
+
+	// start a new heap page
+	Extent e = allocPages(1);
+	vhp.init(scope.arena().allocBytes(sb.page_size), f.pageDataSize());
+
+	if (!vhp.insert(value, slot))
+		throw std::runtime_error("Value heap insert failed");
+
+	writeHeapPage(e.ext_page, vhp);
+
+	pgno = e.ext_page;
+	sb.vh_page = pgno;
+	sb_dirty = true;
+}
+
+void DB::heapErase(uint64_t pgno, uint32_t slot)
+{
+	ArenaScope scope;
+	ValueHeapPage vhp;
+	readHeapPage(pgno, scope.arena(), vhp);
+
+	vhp.erase(slot);
+
+	// release pages no longer holding any value, except the one
+	// currently being filled
+	if ((vhp.liveSlots() == 0) && (pgno != sb.vh_page))
+		freePages(pgno, 1);
+	else
+		writeHeapPage(pgno, vhp);
+}
+
+} // namespace page
@@ -0,0 +1,191 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdexcept>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <pthread.h>
+#include <pgdb2.h>
+#include <pgdb2-async.h>
+#include "util.h"
+
+#define TESTFN "async.db"
+
+static const unsigned int N_KEYS = 500;
+
+static std::string mkval(unsigned int i)
+{
+	return mkval(i, vallen(i));
+}
+
+// Counts down completions; waited on by the test thread
+class Latch {
+private:
+	page::Mutex	mtx;
+	page::CondVar	cv;
+	unsigned int	n;
+
+public:
+	explicit Latch(unsigned int n_) : n(n_) {}
+
+	void countDown() {
+		page::MutexGuard guard(mtx);
+		if (--n == 0)
+			cv.broadcast();
+	}
+	void wait() {
+		page::MutexGuard guard(mtx);
+		while (n > 0)
+			cv.wait(mtx);
+	}
+};
+
+class CheckGet : public page::AsyncGetDone {
+public:
+	unsigned int	i;
+	bool		expect_found;
+	bool		ran;
+	pthread_t	thread;
+	Latch		*latch;
+
+	void done(page::AsyncGetResult& r) {
+		assert(r.ok());
+		assert(r.found == expect_found);
+		if (expect_found)
+			assert(r.value == mkval(i));
+
+		ran = true;
+		thread = pthread_self();
+		latch->countDown();
+	}
+};
+
+static void test_callbacks(page::DB& db, page::Executor& ex)
+{
+	pthread_t self = pthread_self();
+
+	for (unsigned int pass = 0; pass < 2; pass++) {
+		std::vector<CheckGet> checks(N_KEYS + 1);
+		Latch latch(checks.size());
+
+		for (unsigned int i = 0; i < N_KEYS; i++) {
+			checks[i].i = i;
+			checks[i].expect_found = true;
+			checks[i].ran = false;
+			checks[i].latch = &latch;
+			page::asyncGet(db, ex, mkkey(i), &checks[i]);
+		}
+
+		CheckGet& missing = checks[N_KEYS];
+		missing.expect_found = false;
+		missing.latch = &latch;
+		page::asyncGet(db, ex, "nokey", &missing);
+
+		latch.wait();
+
+		unsigned int n_inline = 0;
+		for (unsigned int i = 0; i < N_KEYS; i++) {
+			assert(checks[i].ran);
+			if (pthread_equal(checks[i].thread, self))
+				n_inline++;
+			else
+				assert(pass == 0 || (vallen(i) > 700));
+		}
+
+		// cold: storage reads go to the pool; warm: small
+		// values come straight from cache
+		if (pass == 0)
+			assert(n_inline < N_KEYS);
+		else
+			assert(n_inline >= (N_KEYS / 2));
+	}
+}
+
+#ifdef __cpp_impl_coroutine
+
+// Fire-and-forget coroutine
+struct Detached {
+	struct promise_type {
+		Detached get_return_object() { return Detached(); }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { abort(); }
+	};
+};
+
+static Detached lookupAll(page::DB& db, page::Executor& ex,
+			  unsigned int first, Latch& latch)
+{
+	// one at a time
+	for (unsigned int n = 0; n < 5; n++) {
+		unsigned int i = (first + n) % N_KEYS;
+		page::AsyncGetResult r = co_await page::asyncGet(db, ex, mkkey(i));
+		assert(r.found && (r.value == mkval(i)));
+	}
+
+	// batched
+	std::vector<std::string> keys;
+	for (unsigned int n = 0; n < 20; n++)
+		keys.push_back(mkkey((first + (n * 7)) % N_KEYS));
+	keys.push_back("nokey");
+
+	std::vector<page::AsyncGetResult> rs =
+		co_await page::asyncMultiGet(db, ex, keys);
+	assert(rs.size() == keys.size());
+	for (unsigned int n = 0; n < 20; n++) {
+		unsigned int i = (first + (n * 7)) % N_KEYS;
+		assert(rs[n].ok() && rs[n].found && (rs[n].value == mkval(i)));
+	}
+	assert(rs[20].ok() && !rs[20].found);
+
+	latch.countDown();
+}
+
+static void test_coroutines(page::DB& db, page::Executor& ex)
+{
+	// hundreds of lookups in flight, from one thread
+	const unsigned int n_coros = 200;
+	Latch latch(n_coros);
+
+	for (unsigned int c = 0; c < n_coros; c++)
+		lookupAll(db, ex, c * 13, latch);
+
+	latch.wait();
+}
+
+#endif // __cpp_impl_coroutine
+
+int main (int argc, char *argv[])
+{
+	{
+		page::DB db(TESTFN, createOpts());
+		for (unsigned int i = 0; i < N_KEYS; i++)
+			db.put(mkkey(i), mkval(i));
+	}
+
+	page::ThreadPool pool(4);
+
+	{
+		page::DB db(TESTFN, readOpts());
+		test_callbacks(db, pool);
+	}
+
+#ifdef __cpp_impl_coroutine
+	{
+		page::DB db(TESTFN, readOpts());
+		test_coroutines(db, pool);
+	}
+#endif
+
+	assert(unlink(TESTFN) == 0);
+	return 0;
+}
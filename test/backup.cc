@@ -0,0 +1,198 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <pthread.h>
+#include <stdexcept>
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <pgdb2.h>
+#include "util.h"
+
+#define TESTFN "backup.db"
+#define CHANGESFN "backup.db-changes"
+#define BACKUPFN "backup-copy.db"
+#define OTHERFN "backup-other.db"
+
+static const unsigned int N_KEYS = 3000;
+
+// key i's value as of round
+static std::string roundval(unsigned int i, unsigned int round)
+{
+	size_t len = ((i % 7) == 0) ? 4000 : (20 + (i % 300));
+	return mkval(i, round, len);
+}
+
+// writable, recording pages written
+static page::Options trackOpts(bool create = false)
+{
+	page::Options opts = create ? createOpts() : writeOpts();
+	opts.f_track_changes = true;
+	return opts;
+}
+
+// backup holds key i at round[i]
+static void verify(const std::vector<unsigned int>& round)
+{
+	page::DB db(BACKUPFN, readOpts());
+
+	for (unsigned int i = 0; i < N_KEYS; i++) {
+		std::string val;
+		assert(db.get(mkkey(i), val));
+		assert(val == roundval(i, round[i]));
+	}
+}
+
+// a few neighboring keys change
+static void churn(page::DB& db, std::vector<unsigned int>& round,
+		  unsigned int r)
+{
+	for (unsigned int i = r * 500; i < ((r * 500) + 30); i++) {
+		db.put(mkkey(i), roundval(i, r));
+		round[i] = r;
+	}
+}
+
+struct Churner {
+	page::DB			*db;
+	std::vector<unsigned int>	*round;
+};
+
+static void *churner(void *arg)
+{
+	Churner *c = (Churner *) arg;
+	for (unsigned int r = 4; r < 10; r++)
+		for (unsigned int i = (r - 4) * 500; i < ((r - 4) * 500) + 300; i++) {
+			c->db->put(mkkey(i), roundval(i, r));
+			(*c->round)[i] = r;
+		}
+	return NULL;
+}
+
+// backups taken while puts commit are each whole, and the next
+// backup picks up what they raced
+static void test_racing_puts(std::vector<unsigned int>& round)
+{
+	page::DB db(TESTFN, trackOpts());
+	page::BackupStats st;
+
+	Churner c;
+	c.db = &db;
+	c.round = &round;
+
+	pthread_t thread;
+	assert(pthread_create(&thread, NULL, churner, &c) == 0);
+	for (unsigned int i = 0; i < 20; i++) {
+		db.backup(BACKUPFN, &st);
+
+		page::DB copy(BACKUPFN, readOpts());
+		std::string val;
+		for (unsigned int k = 0; k < N_KEYS; k += 7)
+			assert(copy.get(mkkey(k), val));
+	}
+	pthread_join(thread, NULL);
+
+	db.backup(BACKUPFN, &st);
+	assert(st.incremental);
+}
+
+int main (int argc, char *argv[])
+{
+	std::vector<unsigned int> round(N_KEYS, 0);
+	page::BackupStats st;
+
+	{
+		page::DB db(TESTFN, trackOpts(true));
+		for (unsigned int i = 0; i < N_KEYS; i++)
+			db.put(mkkey(i), roundval(i, 0));
+
+		db.backup(BACKUPFN, &st);
+		assert(!st.incremental);
+		assert(st.pages_copied == st.pages);
+		verify(round);
+
+		// unsynced puts are captured too
+		churn(db, round, 1);
+		db.backup(BACKUPFN, &st);
+		assert(st.incremental);
+		assert((st.pages_copied > 0) && (st.pages_copied < (st.pages / 2)));
+		verify(round);
+
+		// nothing changed: superblock, and the runs it shares
+		db.backup(BACKUPFN, &st);
+		assert(st.incremental);
+		assert(st.pages_copied <= (2 * page::ChangeMap::run_pages));
+	}
+
+	// tracking survives a clean close
+	{
+		page::DB db(TESTFN, trackOpts());
+		churn(db, round, 2);
+		db.backup(BACKUPFN, &st);
+		assert(st.incremental);
+		assert(st.pages_copied < (st.pages / 2));
+	}
+	verify(round);
+
+	// but not a crash
+	assert(unlink(CHANGESFN) == 0);
+	{
+		page::DB db(TESTFN, trackOpts());
+		churn(db, round, 3);
+		db.backup(BACKUPFN, &st);
+		assert(!st.incremental);
+		assert(st.pages_copied == st.pages);
+	}
+	verify(round);
+
+	// nor writes by an untracked handle, which leave no record
+	{
+		page::DB db(TESTFN, writeOpts());
+		churn(db, round, 4);
+	}
+	assert(access(CHANGESFN, F_OK) < 0);
+	{
+		page::DB db(TESTFN, trackOpts());
+		db.backup(BACKUPFN, &st);
+		assert(!st.incremental);
+	}
+	verify(round);
+
+	// nor a backup of another DB
+	{
+		page::DB db(OTHERFN, trackOpts(true));
+		db.put("other", "value");
+		db.backup(BACKUPFN, &st);
+		assert(!st.incremental);
+	}
+	{
+		page::DB db(TESTFN, trackOpts());
+		db.backup(BACKUPFN, &st);
+		assert(!st.incremental);
+	}
+	verify(round);
+
+	test_racing_puts(round);
+	verify(round);
+
+	// read-only handles copy everything
+	{
+		page::DB db(TESTFN, readOpts());
+		db.backup(BACKUPFN, &st);
+		assert(!st.incremental);
+	}
+	verify(round);
+
+	assert(unlink(TESTFN) == 0);
+	assert(unlink(CHANGESFN) == 0);
+	assert(unlink(BACKUPFN) == 0);
+	assert(unlink(OTHERFN) == 0);
+	assert(unlink(OTHERFN "-changes") == 0);
+	return 0;
+}
@@ -9,6 +9,8 @@
 #include <stdexcept>
 #include <assert.h>
 #include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
 
 int main (int argc, char *argv[])
 {
@@ -78,6 +80,78 @@ int main (int argc, char *argv[])
 		assert(0);
 	}
 
+	// TEST: create, reopen checksummed foo.db
+	unlink("foo.db");
+
+	opts.f_read = true;
+	opts.f_write = true;
+	opts.f_create = true;
+	opts.f_checksum = true;
+
+	try {
+		page::DB db("foo.db", opts);
+	}
+	catch (const std::runtime_error& error) {
+		std::cerr << error.what() << "\n";
+		assert(0);
+	}
+
+	opts.f_write = false;
+	opts.f_create = false;
+	opts.f_checksum = false;	// from superblock
+
+	try {
+		page::DB db("foo.db", opts);
+		std::string val;
+		assert(db.get("foo", val) == false);
+	}
+	catch (const std::runtime_error& error) {
+		std::cerr << error.what() << "\n";
+		assert(0);
+	}
+
+	// TEST: corrupt root directory (page 3); open fails
+	int fd = open("foo.db", O_RDWR);
+	assert(fd >= 0);
+	unsigned char bad = 0xff;
+	assert(pwrite(fd, &bad, 1, (3 * 4096) + 64) == 1);
+	close(fd);
+
+	saw_err = false;
+	try {
+		page::DB db("foo.db", opts);
+	}
+	catch (const std::runtime_error& error) {
+		saw_err = true;
+	}
+	assert(saw_err == true);
+
+	// TEST: older format version; open fails, saying so
+	unlink("foo.db");
+	opts.f_write = true;
+	opts.f_create = true;
+	{
+		page::DB db("foo.db", opts);
+	}
+
+	fd = open("foo.db", O_RDWR);
+	assert(fd >= 0);
+	unsigned char v1[4] = { 1, 0, 0, 0 };		// le32 version
+	assert(pwrite(fd, v1, sizeof(v1), 8) == sizeof(v1));
+	close(fd);
+
+	opts.f_write = false;
+	opts.f_create = false;
+	saw_err = false;
+	try {
+		page::DB db("foo.db", opts);
+	}
+	catch (const std::runtime_error& error) {
+		saw_err = (std::string(error.what()) ==
+			   "Unsupported format version 1");
+	}
+	assert(saw_err == true);
+
 	return 0;
 }
 
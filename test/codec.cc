@@ -0,0 +1,157 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdexcept>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string.h>
+#include <vector>
+#include <unistd.h>
+#include <pgdb2.h>
+
+#define TESTFN "codec.db"
+
+static void roundtrip(const page::Codec *codec,
+		      const std::vector<unsigned char>& in,
+		      size_t *z_len_out = NULL)
+{
+	std::vector<unsigned char> z;
+	codec->compress(in.empty() ? NULL : &in[0], in.size(), z);
+
+	std::vector<unsigned char> out(in.size());
+	codec->decompress(&z[0], z.size(), out.empty() ? NULL : &out[0],
+			  out.size());
+	assert(out == in);
+
+	if (z_len_out)
+		*z_len_out = z.size();
+}
+
+static void test_lz()
+{
+	const page::Codec *codec = page::getCodec(page::CODEC_LZ);
+	assert(codec != NULL);
+	assert(codec->id() == page::CODEC_LZ);
+	assert(page::getCodec(page::CODEC_NONE) == NULL);
+
+	// empty, tiny
+	std::vector<unsigned char> buf;
+	roundtrip(codec, buf);
+	buf.push_back('x');
+	roundtrip(codec, buf);
+
+	// JSON-ish records compress well
+	buf.clear();
+	for (unsigned int i = 0; i < 200; i++) {
+		char rec[128];
+		snprintf(rec, sizeof(rec),
+			 "{\"id\":%u,\"name\":\"user%u\",\"active\":true,"
+			 "\"tags\":[\"alpha\",\"beta\"]}\n", i, i * 7);
+		buf.insert(buf.end(), rec, rec + strlen(rec));
+	}
+	size_t z_len;
+	roundtrip(codec, buf, &z_len);
+	assert((z_len * 3) < buf.size());
+
+	// long runs exercise extended literal and match lengths
+	buf.assign(100000, 'a');
+	roundtrip(codec, buf, &z_len);
+	assert(z_len < 1000);
+
+	// incompressible data
+	srand(1);
+	buf.resize(70000);
+	for (unsigned int i = 0; i < buf.size(); i++)
+		buf[i] = rand() & 0xff;
+	roundtrip(codec, buf);
+
+	// corrupt input
+	std::vector<unsigned char> z;
+	buf.assign(1000, 'b');
+	codec->compress(&buf[0], buf.size(), z);
+	std::vector<unsigned char> out(buf.size());
+
+	bool saw_err = false;
+	try {
+		codec->decompress(&z[0], 3, &out[0], out.size());
+	}
+	catch (const std::runtime_error& error) {
+		saw_err = true;
+	}
+	assert(saw_err == true);
+}
+
+class NullCodec : public page::Codec {
+public:
+	uint32_t id() const { return page::CODEC_USER; }
+	const char *name() const { return "null"; }
+
+	void compress(const unsigned char *in, size_t in_len,
+		      std::vector<unsigned char>& out) const {
+		out.insert(out.end(), in, in + in_len);
+	}
+	void decompress(const unsigned char *in, size_t in_len,
+			unsigned char *out, size_t out_len) const {
+		if (in_len != out_len)
+			throw std::runtime_error("null codec length mismatch");
+		memcpy(out, in, in_len);
+	}
+};
+
+static void test_registry()
+{
+	static NullCodec nullCodec;
+
+	assert(page::getCodec(page::CODEC_USER) == NULL);
+	page::registerCodec(&nullCodec);
+	assert(page::getCodec(page::CODEC_USER) == &nullCodec);
+
+	std::vector<unsigned char> buf(5000, 'n');
+	roundtrip(&nullCodec, buf);
+}
+
+static void test_db_codec()
+{
+	page::Options opts;
+	opts.f_read = true;
+	opts.f_write = true;
+	opts.f_create = true;
+	opts.codec = 77;		// not registered
+
+	bool saw_err = false;
+	try {
+		page::DB db(TESTFN, opts);
+	}
+	catch (const std::runtime_error& error) {
+		saw_err = true;
+	}
+	assert(saw_err == true);
+
+	opts.codec = page::CODEC_LZ;
+	{
+		page::DB db(TESTFN, opts);
+	}
+
+	opts.f_write = false;
+	opts.f_create = false;
+	{
+		page::DB db(TESTFN, opts);
+		std::string val;
+		assert(db.get("foo", val) == false);
+	}
+
+	assert(unlink(TESTFN) == 0);
+}
+
+int main (int argc, char *argv[])
+{
+	test_lz();
+	test_registry();
+	test_db_codec();
+	return 0;
+}
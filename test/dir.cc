@@ -0,0 +1,152 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdexcept>
+#include <cassert>
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+#include <pgdb2.h>
+
+#define TESTFN "dir.db"
+
+static void fillDir(page::Dir& d)
+{
+	page::DirEntry de;
+
+	de.d_type = page::DE_KEY_VALUE;
+	de.key = "apple";
+	de.ikey = 10;
+	de.value = "red";
+	d.ents.push_back(de);
+
+	de.clear();
+	de.d_type = page::DE_DIR;
+	de.key = "cherry";
+	de.key_end = "fig";
+	de.ikey = 20;
+	de.ikey_end = 29;
+	de.ino_idx = 7;
+	d.ents.push_back(de);
+
+	de.clear();
+	de.d_type = page::DE_KEY;
+	de.key = "kiwi";
+	de.ikey = 40;
+	de.ino_idx = 8;
+	de.value_len = 9000;
+	d.ents.push_back(de);
+}
+
+static void test_bytewise()
+{
+	page::Dir d;
+	fillDir(d);
+
+	std::vector<unsigned char> buf;
+	d.encode(buf);
+
+	page::Dir d2;
+	d2.decode(buf);
+	assert(d2.key_type == page::KT_BYTES);
+	assert(d2.ents.size() == 3);
+	assert(d2.ents[0].value == "red");
+	assert(d2.ents[1].key_end == "fig");
+	assert(d2.ents[2].value_len == 9000);
+
+	unsigned int idx;
+	assert(d2.match("apple", idx) && (idx == 0));
+	assert(d2.match("date", idx) && (idx == 1));
+	assert(d2.match("kiwi", idx) && (idx == 2));
+	assert(!d2.match("aardvark", idx));
+	assert(!d2.match("grape", idx));
+	assert(!d2.match("zucchini", idx));
+}
+
+static void test_fixed(enum page::key_types kt)
+{
+	page::Dir d(kt);
+	fillDir(d);
+
+	std::vector<unsigned char> buf;
+	d.encode(buf);
+
+	// fixed-width keys are stored more compactly than strings
+	page::Dir bd;
+	fillDir(bd);
+	std::vector<unsigned char> bbuf;
+	bd.encode(bbuf);
+	assert(buf.size() < bbuf.size());
+
+	page::Dir d2;
+	d2.decode(buf);
+	assert(d2.key_type == kt);
+	assert(d2.ents.size() == 3);
+	assert(d2.ents[0].ikey == 10);
+	assert(d2.ents[0].value == "red");
+	assert(d2.ents[1].ikey_end == 29);
+	assert(d2.ents[1].ino_idx == 7);
+	assert(d2.ents[2].value_len == 9000);
+
+	unsigned int idx;
+	if (kt == page::KT_U32) {
+		assert(d2.match<page::U32Compare>(10, idx) && (idx == 0));
+		assert(d2.match<page::U32Compare>(25, idx) && (idx == 1));
+		assert(!d2.match<page::U32Compare>(30, idx));
+	} else {
+		assert(d2.match<page::U64Compare>(10, idx) && (idx == 0));
+		assert(d2.match<page::U64Compare>(25, idx) && (idx == 1));
+		assert(d2.match<page::U64Compare>(40, idx) && (idx == 2));
+		assert(!d2.match<page::U64Compare>(5, idx));
+		assert(!d2.match<page::U64Compare>(1ULL << 40, idx));
+	}
+}
+
+static void test_db_keytype()
+{
+	page::Options opts;
+	opts.f_read = true;
+	opts.f_write = true;
+	opts.f_create = true;
+	opts.key_type = page::KT_U64;
+
+	{
+		page::DB db(TESTFN, opts);
+		assert(db.keyType() == page::KT_U64);
+	}
+
+	// key type is read back from superblock, not options
+	opts.f_write = false;
+	opts.f_create = false;
+	opts.key_type = page::KT_BYTES;
+
+	page::DB db(TESTFN, opts);
+	assert(db.keyType() == page::KT_U64);
+
+	std::string val;
+	assert(db.get(42, val) == false);
+
+	bool saw_err = false;
+	try {
+		db.get(std::string("foo"), val);
+	}
+	catch (const std::runtime_error& error) {
+		saw_err = true;
+	}
+	assert(saw_err == true);
+
+	assert(unlink(TESTFN) == 0);
+}
+
+int main (int argc, char *argv[])
+{
+	test_bytewise();
+	test_fixed(page::KT_U32);
+	test_fixed(page::KT_U64);
+	test_db_keytype();
+	return 0;
+}
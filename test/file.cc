@@ -139,10 +139,115 @@ static void test2()
 	assert(unlink(TESTFN) == 0);
 }
 
+static void test3()
+{
+	// TEST: CRC32C check value
+	const char *check = "123456789";
+	assert(page::crc32c(0, check, 9) == 0xe3069283);
+	assert(page::crc32c(page::crc32c(0, check, 4), check + 4, 5) == 0xe3069283);
+
+	// TEST: checksummed pages
+	page::File f;
+	try {
+		f.open(TESTFN, O_RDWR | O_CREAT | O_TRUNC);
+	}
+	catch (...) {
+		assert(0);
+	}
+
+	f.setChecksum(true);
+	assert(f.pageDataSize() == (f.pageSize() - sizeof(page::PageTrailer)));
+
+	std::vector<unsigned char> buf(f.pageSize() * 2, 0x5a);
+	f.write(buf, 0, 2);
+
+	std::vector<unsigned char> buf2;
+	f.read(buf2, 0, 2);
+	for (unsigned int i = 0; i < f.pageDataSize(); i++)
+		assert(buf2[i] == 0x5a);
+
+	// corrupt one byte of page 1, behind File's back
+	unsigned char bad = 0xa5;
+	assert(pwrite(f.fileno(), &bad, 1, f.pageSize() + 100) == 1);
+
+	f.read(buf2, 0, 1);		// page 0 still fine
+
+	bool saw_err = false;
+	try {
+		f.read(buf2, 0, 2);
+	}
+	catch (const std::runtime_error& error) {
+		saw_err = true;
+	}
+	assert(saw_err == true);
+
+	f.close();
+	assert(unlink(TESTFN) == 0);
+}
+
+static void test4()
+{
+	// TEST: sequential run detection
+	page::Readahead ra(4, 16);
+	uint64_t pos, len;
+
+	assert(!ra.access(10, 1, pos, len));		// first read
+	assert(!ra.access(50, 1, pos, len));		// random
+	assert(ra.access(51, 1, pos, len));		// sequential
+	assert((pos == 52) && (len == 4));
+	assert(!ra.access(52, 1, pos, len));		// still ahead
+	assert(!ra.access(53, 1, pos, len));
+	assert(ra.access(54, 1, pos, len));		// window doubles
+	assert((pos == 56) && (len == 7));
+	for (uint64_t i = 55; i < 200; i++)
+		if (ra.access(i, 1, pos, len))
+			assert(len <= 16);
+	assert(!ra.access(7, 1, pos, len));		// random again
+
+	page::Readahead off(0, 0);			// disabled
+	assert(!off.access(0, 1, pos, len));
+	assert(!off.access(1, 1, pos, len));
+
+	// TEST: File prefetches ahead of sequential streams only
+	page::File f;
+	f.open(TESTFN, O_RDWR | O_CREAT | O_TRUNC);
+
+	std::vector<unsigned char> buf(f.pageSize() * 64);
+	f.write(buf, 0, 64);
+
+	for (uint64_t i = 0; i < 32; i++)		// no stream
+		f.read(buf, i);
+	assert(f.readaheadHints() == 0);
+
+	{
+		page::ReadaheadScope stream(f);
+		for (uint64_t i = 0; i < 64; i += 7)
+			f.read(buf, 63 - i);
+		assert(f.readaheadHints() == 0);
+	}
+
+	// random reads of another stream do not break the run
+	{
+		page::ReadaheadScope stream(f);
+		for (uint64_t i = 0; i < 32; i++) {
+			f.read(buf, i);
+
+			page::ReadaheadScope other(f);
+			f.read(buf, 63 - (i * 3) % 31);
+		}
+		assert(f.readaheadHints() >= 3);
+	}
+
+	f.close();
+	assert(unlink(TESTFN) == 0);
+}
+
 static void runtests()
 {
 	test1();
 	test2();
+	test3();
+	test4();
 }
 
 int main (int argc, char *argv[])
@@ -0,0 +1,101 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdexcept>
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+#include <pgdb2-inspect.h>
+#include "util.h"
+
+#define TESTFN "inspect.db"
+
+static const unsigned int N_KEYS = 3000;
+
+// inline, packed and inode values
+static size_t vlen(unsigned int i)
+{
+	static const size_t lens[] = { 50, 1000, 10000 };
+	return lens[i % 3];
+}
+
+static void check(const page::InspectReport& rep, unsigned int n_inode)
+{
+	assert(rep.keys == N_KEYS);
+	assert(rep.key_bytes == (N_KEYS * mkkey(0).size()));
+	assert(rep.values_inline == (N_KEYS / 3));
+	assert(rep.values_packed == (N_KEYS / 3) + ((N_KEYS / 3) - n_inode));
+	assert(rep.values_inode == n_inode);
+	assert(rep.heap_pages > 0);
+	assert(rep.value_inode_pages >= (n_inode * 3));
+
+	// splits made a tree, rooted in one directory
+	assert(rep.depth() >= 2);
+	assert(rep.levels[0].dirs == 1);
+	assert(rep.dirs() > 1);
+
+	uint64_t fill = 0;
+	for (size_t i = 0; i < rep.dir_fill.size(); i++)
+		fill += rep.dir_fill[i];
+	assert(fill == rep.dirs());
+
+	uint64_t used = 0;
+	for (size_t i = 0; i < rep.extent_counts.size(); i++)
+		used += rep.extent_counts[i];
+	assert((used + rep.inodes_unused) == rep.inodes);
+
+	assert(rep.file_pages >= rep.alloc_end);
+	assert(rep.spaceAmp() > 1.0);
+
+	assert(!rep.paths.empty() && (rep.paths.size() <= 5));
+	for (size_t i = 0; i < rep.paths.size(); i++) {
+		assert(rep.paths[i].depth == rep.depth());
+		assert(rep.paths[i].keys > 0);
+		if (i > 0)
+			assert(rep.paths[i - 1].pages() >= rep.paths[i].pages());
+	}
+}
+
+int main (int argc, char *argv[])
+{
+	page::DB db(TESTFN, createOpts());
+	for (unsigned int i = 0; i < N_KEYS; i++)
+		db.put(mkkey(i), std::string(vlen(i), 'v'));
+
+	page::InspectReport rep;
+	db.inspect(rep, 1, 5);
+	check(rep, N_KEYS / 3);
+	assert(rep.inodes_unused == 0);
+
+	// shrink half the inode values: their inodes and pages are freed
+	unsigned int n_inode = N_KEYS / 3;
+	for (unsigned int i = 2; i < N_KEYS; i += 6) {
+		db.put(mkkey(i), std::string(1000, 'w'));
+		n_inode--;
+	}
+	db.sync();
+
+	page::InspectReport par;
+	db.inspect(par, 4, 5);
+	check(par, n_inode);
+	assert(par.inodes_unused > 0);
+	assert((par.free_extents > 0) && (par.free_pages > 0));
+
+	// same answer, one thread or several
+	db.inspect(rep, 1, 5);
+	assert(rep.toJSON() == par.toJSON());
+	assert(rep.toText() == par.toText());
+
+	std::string json = rep.toJSON();
+	assert((json[0] == '{') && (json[json.size() - 1] == '}'));
+	assert(json.find("\"keys\":3000,") != std::string::npos);
+
+	assert(unlink(TESTFN) == 0);
+	assert(unlink(TESTFN "-changes") != 0);
+	return 0;
+}
@@ -0,0 +1,394 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdexcept>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <pgdb2.h>
+#include "util.h"
+
+#define TESTFN "put.db"
+
+static off_t fileSize()
+{
+	struct stat st;
+	assert(stat(TESTFN, &st) == 0);
+	return st.st_size;
+}
+
+static void test_storage_classes()
+{
+	std::string val;
+
+	{
+		page::DB db(TESTFN, createOpts());
+
+		db.put("inline", "small");
+		db.put("packed", mkval(1, 600));
+		db.put("inode", mkval(2, 10000));
+		db.put("empty", "");
+
+		assert(db.get("inline", val) && (val == "small"));
+		assert(db.get("packed", val) && (val == mkval(1, 600)));
+		assert(db.get("inode", val) && (val == mkval(2, 10000)));
+		assert(db.get("empty", val) && (val == ""));
+		assert(!db.get("missing", val));
+
+		// overwrite, moving each key to another storage class
+		db.put("inline", mkval(3, 10000));
+		db.put("packed", "tiny");
+		db.put("inode", mkval(4, 700));
+
+		assert(db.get("inline", val) && (val == mkval(3, 10000)));
+		assert(db.get("packed", val) && (val == "tiny"));
+		assert(db.get("inode", val) && (val == mkval(4, 700)));
+	}
+
+	// read-only reopen
+	page::DB db(TESTFN, readOpts());
+	assert(db.get("inline", val) && (val == mkval(3, 10000)));
+	assert(db.get("packed", val) && (val == "tiny"));
+	assert(db.get("inode", val) && (val == mkval(4, 700)));
+
+	bool saw_err = false;
+	try {
+		db.put("foo", "bar");
+	}
+	catch (const std::runtime_error& error) {
+		saw_err = true;
+	}
+	assert(saw_err == true);
+
+	assert(unlink(TESTFN) == 0);
+}
+
+static void test_packing()
+{
+	// 100 600-byte values share heap pages
+	{
+		page::DB db(TESTFN, createOpts());
+		for (unsigned int i = 0; i < 100; i++)
+			db.put(mkkey(i), mkval(i, 600));
+	}
+	assert(fileSize() < (40 * 4096));
+
+	// same values, one inode each
+	assert(unlink(TESTFN) == 0);
+	{
+		page::Options opts = createOpts();
+		opts.packed_max = 0;
+		page::DB db(TESTFN, opts);
+		for (unsigned int i = 0; i < 100; i++)
+			db.put(mkkey(i), mkval(i, 600));
+	}
+	assert(fileSize() >= (100 * 4096));
+
+	page::DB db(TESTFN, readOpts());
+	std::string val;
+	for (unsigned int i = 0; i < 100; i++)
+		assert(db.get(mkkey(i), val) && (val == mkval(i, 600)));
+
+	assert(unlink(TESTFN) == 0);
+}
+
+static void test_many(const page::Options& opts, unsigned int n_keys)
+{
+	std::vector<unsigned int> order;
+	for (unsigned int i = 0; i < n_keys; i++)
+		order.push_back(i);
+
+	srand(42);
+	for (unsigned int i = n_keys - 1; i > 0; i--) {
+		unsigned int j = rand() % (i + 1);
+		std::swap(order[i], order[j]);
+	}
+
+	// insert even keys, random order and value sizes
+	{
+		page::DB db(TESTFN, opts);
+		for (unsigned int i = 0; i < n_keys; i++) {
+			unsigned int k = order[i] * 2;
+			size_t len = (k % 7 == 0) ? 5000 : (k % 3 == 0) ? 300 : 20;
+			if (opts.key_type == page::KT_BYTES)
+				db.put(mkkey(k), mkval(k, len));
+			else
+				db.put((uint64_t) k, mkval(k, len));
+		}
+	}
+
+	page::DB db(TESTFN, readOpts());
+	std::string val;
+	for (unsigned int k = 0; k < (n_keys * 2); k++) {
+		size_t len = (k % 7 == 0) ? 5000 : (k % 3 == 0) ? 300 : 20;
+		bool found;
+		if (opts.key_type == page::KT_BYTES)
+			found = db.get(mkkey(k), val);
+		else
+			found = db.get((uint64_t) k, val);
+
+		if (k & 1)
+			assert(!found);
+		else
+			assert(found && (val == mkval(k, len)));
+	}
+
+	assert(unlink(TESTFN) == 0);
+}
+
+static void test_reuse()
+{
+	page::DB db(TESTFN, createOpts());
+
+	// repeated overwrites reuse freed pages
+	for (unsigned int i = 0; i < 50; i++) {
+		db.put("big", mkval(i, 20000));
+		db.put("mid", mkval(i, 1500));
+	}
+	assert(fileSize() < (40 * 4096));
+
+	std::string val;
+	assert(db.get("big", val) && (val == mkval(49, 20000)));
+	assert(db.get("mid", val) && (val == mkval(49, 1500)));
+
+	assert(unlink(TESTFN) == 0);
+}
+
+static void test_inode_cache()
+{
+	page::Options opts = createOpts();
+	opts.f_checksum = true;
+	opts.packed_max = 0;		// one inode per value
+	opts.mem_budget = 64 * 1024;	// far less than in use
+
+	const unsigned int n_keys = 1500;
+	std::string val;
+
+	{
+		page::DB db(TESTFN, opts);
+		for (unsigned int i = 0; i < n_keys; i++)
+			db.put(mkkey(i), mkval(i, 200));
+	}
+
+	// reopen, overwriting values in place of freed inodes
+	opts.f_create = false;
+	{
+		page::DB db(TESTFN, opts);
+		for (unsigned int i = 0; i < n_keys; i += 3)
+			db.put(mkkey(i), mkval(i + 1, 300));
+	}
+	off_t size = fileSize();
+
+	{
+		page::DB db(TESTFN, opts);
+		for (unsigned int i = 0; i < n_keys; i += 3)
+			db.put(mkkey(i), mkval(i + 2, 250));
+	}
+	assert(fileSize() == size);
+
+	// nothing cached beyond the current operation
+	{
+		page::Options ro = readOpts();
+		ro.mem_budget = 1;
+		page::DB db(TESTFN, ro);
+		for (unsigned int i = n_keys; i-- > 0; ) {
+			size_t len = (i % 3) ? 200 : 250;
+			unsigned int v = (i % 3) ? i : (i + 2);
+			assert(db.get(mkkey(i), val) && (val == mkval(v, len)));
+		}
+	}
+
+	// repeated reads are served from cache, within budget
+	page::Options ro = readOpts();
+	ro.mem_budget = 256 * 1024;
+	page::DB db(TESTFN, ro);
+	for (unsigned int pass = 0; pass < 2; pass++)
+		for (unsigned int i = 0; i < 40; i++)
+			assert(db.get(mkkey(i), val));
+
+	const page::MemBudget& mem = db.memory();
+	assert(mem.used() <= mem.getLimit());
+
+	// what one cold read loads
+	uint64_t one_read;
+	{
+		page::DB cold(TESTFN, readOpts());
+		assert(cold.get(mkkey(0), val));
+		one_read = cold.memory().used();
+	}
+
+	// the budget is met as each read starts, and exceeded after it
+	// by at most what it loads; directories vary in size
+	{
+		page::Options small = readOpts();
+		small.mem_budget = 32 * 1024;
+		page::DB sdb(TESTFN, small);
+		const page::MemBudget& smem = sdb.memory();
+		for (unsigned int i = 0; i < n_keys; i++) {
+			assert(sdb.get(mkkey((i * 7919) % n_keys), val));
+			assert(smem.used() <= (smem.getLimit() + (2 * one_read)));
+		}
+	}
+	assert(mem.stats[page::MEM_PAGES].hits > 0);
+	assert(mem.stats[page::MEM_DIRS].hits > 0);
+	assert(mem.stats[page::MEM_INODES].used > 0);
+
+	// warm lookups take scratch memory from the thread's arena only
+	page::ScratchArena& arena = page::ScratchArena::local();
+	uint64_t n_heap = arena.heapAllocs();
+	for (unsigned int i = 0; i < 40; i++)
+		assert(db.get(mkkey(i), val));
+	assert(arena.heapAllocs() == n_heap);
+
+	assert(unlink(TESTFN) == 0);
+}
+
+static void test_page_size()
+{
+	static const uint32_t bad_sizes[] = { 0, 512, 3000, 131072 };
+
+	for (unsigned int i = 0; i < 4; i++) {
+		page::Options opts = createOpts();
+		opts.page_size = bad_sizes[i];
+
+		bool saw_err = false;
+		try {
+			page::DB db(TESTFN, opts);
+		}
+		catch (const std::runtime_error& error) {
+			saw_err = true;
+		}
+		assert(saw_err == true);
+	}
+
+	// page size fixed at create time, found on open
+	{
+		page::Options opts = createOpts();
+		opts.page_size = 16384;
+		page::DB db(TESTFN, opts);
+		db.put("key", mkval(1, 40000));
+	}
+	assert(fileSize() % 16384 == 0);
+
+	page::DB db(TESTFN, readOpts());
+	std::string val;
+	assert(db.get("key", val) && (val == mkval(1, 40000)));
+
+	assert(unlink(TESTFN) == 0);
+}
+
+static void test_arena()
+{
+	page::ScratchArena& arena = page::ScratchArena::local();
+
+	{
+		page::ArenaScope outer;
+		unsigned char *a = arena.allocBytes(100);
+		size_t reserved;
+
+		{
+			page::ArenaScope inner;
+			unsigned char *b = arena.allocBytes(100);
+			assert(b >= (a + 100));
+
+			// oversized, released when scope exits
+			arena.allocBytes(4 * page::ScratchArena::keep_max);
+			reserved = arena.reserved();
+		}
+		assert(arena.reserved() < reserved);
+
+		// memory reused after rewind
+		uint64_t n_heap = arena.heapAllocs();
+		{
+			page::ArenaScope inner;
+			assert(arena.allocBytes(100) >= (a + 100));
+			arena.allocBytes(page::ScratchArena::block_size);
+		}
+		{
+			page::ArenaScope inner;
+			arena.allocBytes(100);
+			arena.allocBytes(page::ScratchArena::block_size);
+		}
+		assert(arena.heapAllocs() == n_heap + 1);
+	}
+}
+
+// warm lookups of every storage class, under the default inline and
+// packed limits, take scratch memory from the thread's arena only
+static void test_arena_lookup()
+{
+	static const size_t sizes[] = { 20, 129, 600, 1500, 2048, 5000 };
+	const unsigned int n_keys = 120;
+	std::string val;
+
+	for (unsigned int pass = 0; pass < 2; pass++) {
+		page::Options opts = createOpts();
+		opts.f_checksum = (pass == 1);
+		{
+			page::DB db(TESTFN, opts);
+			for (unsigned int i = 0; i < n_keys; i++)
+				db.put(mkkey(i), mkval(i, sizes[i % 6]));
+		}
+
+		page::DB db(TESTFN, readOpts());
+		for (unsigned int i = 0; i < n_keys; i++)
+			assert(db.get(mkkey(i), val) &&
+			       (val == mkval(i, sizes[i % 6])));
+
+		page::ScratchArena& arena = page::ScratchArena::local();
+		uint64_t n_heap = arena.heapAllocs();
+		for (unsigned int i = 0; i < n_keys; i++)
+			assert(db.get(mkkey(i), val) &&
+			       (val.size() == sizes[i % 6]));
+		assert(arena.heapAllocs() == n_heap);
+
+		assert(unlink(TESTFN) == 0);
+	}
+}
+
+int main (int argc, char *argv[])
+{
+	test_storage_classes();
+	test_packing();
+	test_reuse();
+	test_inode_cache();
+	test_arena();
+	test_arena_lookup();
+	test_page_size();
+
+	page::Options opts = createOpts();
+	test_many(opts, 3000);
+
+	opts.key_type = page::KT_U64;
+	test_many(opts, 3000);
+
+	opts.key_type = page::KT_U32;
+	opts.f_checksum = true;
+	opts.codec = page::CODEC_LZ;
+	test_many(opts, 2000);
+
+	// other page sizes
+	opts = createOpts();
+	opts.page_size = 1024;
+	opts.f_checksum = true;
+	test_many(opts, 1500);
+
+	opts.page_size = 16384;
+	opts.f_checksum = false;
+	test_many(opts, 1500);
+
+	opts.page_size = 65536;
+	opts.codec = page::CODEC_LZ;
+	test_many(opts, 1500);
+
+	return 0;
+}
@@ -0,0 +1,134 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdexcept>
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <pgdb2.h>
+#include "util.h"
+
+#define TESTFN "range.db"
+
+// incompressible, position-dependent bytes
+static std::string randval(unsigned int seed, size_t len)
+{
+	std::string val(len, 0);
+	uint32_t x = seed * 2654435761U + 1;
+	for (size_t i = 0; i < len; i++) {
+		x = (x * 1103515245U) + 12345U;
+		val[i] = (char) (x >> 16);
+	}
+	return val;
+}
+
+static void check_ranges(page::DB& db, const std::string& key,
+			 const std::string& expect)
+{
+	static const uint64_t offsets[] = {
+		0, 1, 4087, 4088, 4095, 4096, 4097, 8191, 100000,
+	};
+	static const size_t lens[] = { 0, 1, 100, 4096, 9000, 300000 };
+
+	std::string val;
+	for (unsigned int i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+		for (unsigned int j = 0; j < sizeof(lens) / sizeof(lens[0]); j++) {
+			uint64_t off = offsets[i];
+			size_t len = lens[j];
+
+			assert(db.getRange(key, off, len, val));
+			if (off >= expect.size())
+				assert(val.empty());
+			else
+				assert(val == expect.substr(off, len));
+		}
+	}
+
+	// streaming read, odd-sized chunks
+	page::ValueReader reader;
+	assert(db.openValue(key, reader));
+	assert(reader.size() == expect.size());
+
+	std::string out;
+	char buf[1000];
+	size_t n;
+	while ((n = reader.read(buf, sizeof(buf))) > 0)
+		out.append(buf, n);
+	assert(out == expect);
+	assert(reader.tell() == expect.size());
+
+	reader.seek(expect.size() / 2);
+	n = reader.read(buf, 10);
+	assert(std::string(buf, n) == expect.substr(expect.size() / 2, 10));
+}
+
+static void test_ranges(const page::Options& opts)
+{
+	std::string big = randval(1, 300000);
+	std::string packed = randval(2, 1500);
+	std::string small = randval(3, 50);
+	std::string zbig(200000, 'z');
+
+	{
+		page::DB db(TESTFN, opts);
+		db.put("big", big);
+		db.put("packed", packed);
+		db.put("small", small);
+		db.put("zbig", zbig);
+		db.put("empty", "");
+
+		check_ranges(db, "big", big);
+	}
+
+	page::DB db(TESTFN, readOpts());
+
+	check_ranges(db, "big", big);
+	check_ranges(db, "packed", packed);
+	check_ranges(db, "small", small);
+	check_ranges(db, "zbig", zbig);
+	check_ranges(db, "empty", "");
+
+	std::string val;
+	assert(!db.getRange("missing", 0, 10, val));
+
+	// streaming a large value prefetches ahead of the reader
+	if (opts.codec == page::CODEC_NONE) {
+		uint64_t hints = db.file().readaheadHints();
+
+		page::ValueReader rd;
+		assert(db.openValue("big", rd));
+		char buf[4096];
+		while (rd.read(buf, sizeof(buf)) > 0)
+			;
+		assert(db.file().readaheadHints() > hints);
+	}
+
+	page::ValueReader reader;
+	assert(!db.openValue("missing", reader));
+	assert(!reader.isOpen());
+
+	assert(unlink(TESTFN) == 0);
+}
+
+int main (int argc, char *argv[])
+{
+	page::Options opts = createOpts();
+
+	test_ranges(opts);
+
+	opts.f_checksum = true;
+	opts.codec = page::CODEC_LZ;
+	test_ranges(opts);
+
+	opts.codec = page::CODEC_NONE;
+	opts.page_size = 1024;
+	test_ranges(opts);
+
+	return 0;
+}
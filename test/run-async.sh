@@ -0,0 +1,10 @@
+#!/bin/sh
+
+TESTFILES=async.db
+
+./async
+retval=$?
+
+rm -f $TESTFILES
+
+exit $retval
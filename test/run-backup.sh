@@ -0,0 +1,10 @@
+#!/bin/sh
+
+TESTFILES="backup.db backup.db-changes backup-copy.db backup-other.db backup-other.db-changes"
+
+./backup
+retval=$?
+
+rm -f $TESTFILES
+
+exit $retval
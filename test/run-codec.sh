@@ -0,0 +1,10 @@
+#!/bin/sh
+
+TESTFILES=codec.db
+
+./codec
+retval=$?
+
+rm -f $TESTFILES
+
+exit $retval
@@ -0,0 +1,10 @@
+#!/bin/sh
+
+TESTFILES=dir.db
+
+./dir
+retval=$?
+
+rm -f $TESTFILES
+
+exit $retval
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+TESTFILES="inspect.db inspect.db-changes"
+
+./inspect
+retval=$?
+
+rm -f $TESTFILES
+
+exit $retval
+
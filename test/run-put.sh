@@ -0,0 +1,10 @@
+#!/bin/sh
+
+TESTFILES=put.db
+
+./put
+retval=$?
+
+rm -f $TESTFILES
+
+exit $retval
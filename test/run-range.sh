@@ -0,0 +1,10 @@
+#!/bin/sh
+
+TESTFILES=range.db
+
+./range
+retval=$?
+
+rm -f $TESTFILES
+
+exit $retval
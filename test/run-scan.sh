@@ -0,0 +1,10 @@
+#!/bin/sh
+
+TESTFILES=scan.db
+
+./scan
+retval=$?
+
+rm -f $TESTFILES
+
+exit $retval
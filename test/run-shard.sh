@@ -0,0 +1,10 @@
+#!/bin/sh
+
+TESTFILES="shard0.db shard1.db shard2.db shard3.db"
+
+./shard
+retval=$?
+
+rm -f $TESTFILES
+
+exit $retval
@@ -0,0 +1,10 @@
+#!/bin/sh
+
+TESTFILES="shm.db shm.db-shm"
+
+./shm
+retval=$?
+
+rm -f $TESTFILES
+
+exit $retval
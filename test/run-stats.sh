@@ -0,0 +1,11 @@
+#!/bin/sh
+
+TESTFILES="stats.db stats.db-changes"
+
+./stats
+retval=$?
+
+rm -f $TESTFILES
+
+exit $retval
+
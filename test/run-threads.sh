@@ -0,0 +1,10 @@
+#!/bin/sh
+
+TESTFILES=threads.db
+
+./threads
+retval=$?
+
+rm -f $TESTFILES
+
+exit $retval
@@ -0,0 +1,10 @@
+#!/bin/sh
+
+TESTFILES="trace.db trace.db-changes trace-u64.db trace-u64.db-changes trace.trc"
+
+./trace
+retval=$?
+
+rm -f $TESTFILES
+
+exit $retval
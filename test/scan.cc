@@ -0,0 +1,182 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdexcept>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <set>
+#include <unistd.h>
+#include <pgdb2.h>
+#include "util.h"
+
+#define TESTFN "scan.db"
+
+static const unsigned int N_KEYS = 3000;
+
+// inline, packed and inode values
+static std::string mkval(unsigned int i)
+{
+	return mkval(i, ((i % 3) == 0) ? 5000 : (10 + (i % 400)));
+}
+
+class Collect : public page::ScanVisitor {
+private:
+	page::Mutex	mtx;
+
+public:
+	std::vector<page::ScanItem> items;
+
+	void visit(const page::ScanItem& item) {
+		page::MutexGuard guard(mtx);
+		items.push_back(item);
+	}
+};
+
+// Visits slowly, noting how far the workers have read ahead
+class Slow : public page::ScanVisitor {
+private:
+	page::DB&	db;
+
+public:
+	uint64_t	visited;
+	uint64_t	max_ahead;		// entries read, not yet visited
+
+	Slow(page::DB& db_) : db(db_), visited(0), max_ahead(0) {}
+
+	void visit(const page::ScanItem&) {
+		page::DBStats st;
+		db.getStats(st);
+		uint64_t ahead = st.counters[page::ST_ENTRIES_SCANNED] - visited;
+		if (ahead > max_ahead)
+			max_ahead = ahead;
+
+		visited++;
+		usleep(20);
+	}
+};
+
+class Fail : public page::ScanVisitor {
+public:
+	void visit(const page::ScanItem&) {
+		throw std::runtime_error("visitor failed");
+	}
+};
+
+static void check(const std::vector<page::ScanItem>& items,
+		  unsigned int first, unsigned int last, bool ordered)
+{
+	assert(items.size() == (last - first + 1));
+
+	std::set<std::string> seen;
+	for (size_t n = 0; n < items.size(); n++) {
+		const page::ScanItem& item = items[n];
+		unsigned int i = atoi(item.key.c_str() + 3);
+		assert((i >= first) && (i <= last));
+		assert(item.value == mkval(i));
+		assert(seen.insert(item.key).second);
+
+		if (ordered)
+			assert(item.key == mkkey(first + n));
+	}
+}
+
+static void test_bytes()
+{
+	page::DB db(TESTFN, createOpts());
+	for (unsigned int i = 0; i < N_KEYS; i++)
+		db.put(mkkey(i), mkval(i));
+
+	for (unsigned int threads = 1; threads <= 4; threads += 3) {
+		page::ScanRange all;
+
+		Collect c1;
+		db.parallelScan(all, c1, threads);
+		check(c1.items, 0, N_KEYS - 1, false);
+
+		Collect c2;
+		db.parallelScan(all, c2, threads, true);
+		check(c2.items, 0, N_KEYS - 1, true);
+
+		page::ScanRange part;
+		part.first = mkkey(1234);
+		part.last = mkkey(2345);
+		part.has_last = true;
+
+		Collect c3;
+		db.parallelScan(part, c3, threads, true);
+		check(c3.items, 1234, 2345, true);
+	}
+
+	// errors reach the caller
+	Fail f;
+	bool threw = false;
+	try {
+		db.parallelScan(page::ScanRange(), f, 4);
+	}
+	catch (std::runtime_error& e) {
+		threw = true;
+	}
+	assert(threw);
+
+	assert(unlink(TESTFN) == 0);
+}
+
+static void test_u64()
+{
+	page::Options opts = createOpts();
+	opts.key_type = page::KT_U64;
+
+	page::DB db(TESTFN, opts);
+	for (unsigned int i = 0; i < N_KEYS; i++)
+		db.put((uint64_t) i * 1000, mkval(i));
+
+	page::ScanRange part;
+	part.ifirst = 500;
+	part.ilast = 10000;
+
+	Collect c;
+	db.parallelScan(part, c, 4, true);
+	assert(c.items.size() == 10);
+	for (unsigned int n = 0; n < 10; n++) {
+		assert(c.items[n].ikey == (n + 1) * 1000);
+		assert(c.items[n].value == mkval(n + 1));
+	}
+
+	assert(unlink(TESTFN) == 0);
+}
+
+// ordered scans read a bounded distance ahead of a slow visitor
+static void test_buffer()
+{
+	page::Options opts = createOpts();
+	opts.scan_buffer_max = 64 * 1024;
+
+	page::DB db(TESTFN, opts);
+	for (unsigned int i = 0; i < N_KEYS; i++)
+		db.put(mkkey(i), std::string(1000, 'v'));
+
+	Slow s(db);
+	db.parallelScan(page::ScanRange(), s, 4, true);
+	assert(s.visited == N_KEYS);
+
+	// the buffer, the directory being visited, and an item per
+	// worker; far from the whole range
+	assert(s.max_ahead < (N_KEYS / 5));
+
+	assert(unlink(TESTFN) == 0);
+}
+
+int main (int argc, char *argv[])
+{
+	test_bytes();
+	test_buffer();
+	test_u64();
+	return 0;
+}
@@ -0,0 +1,194 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdexcept>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <set>
+#include <unistd.h>
+#include <pgdb2-shard.h>
+#include "util.h"
+
+static const unsigned int N_SHARDS = 4;
+static const unsigned int N_KEYS = 2000;
+
+static std::string mkval(unsigned int i)
+{
+	return mkval(i, ((i % 5) == 0) ? 3000 : (10 + (i % 200)));
+}
+
+static std::vector<std::string> shardFiles()
+{
+	std::vector<std::string> files;
+	for (unsigned int i = 0; i < N_SHARDS; i++) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "shard%u.db", i);
+		files.push_back(buf);
+	}
+	return files;
+}
+
+static void removeFiles()
+{
+	std::vector<std::string> files = shardFiles();
+	for (size_t i = 0; i < files.size(); i++)
+		assert(unlink(files[i].c_str()) == 0);
+}
+
+class Collect : public page::ScanVisitor {
+private:
+	page::Mutex	mtx;
+
+public:
+	std::vector<page::ScanItem> items;
+
+	void visit(const page::ScanItem& item) {
+		page::MutexGuard guard(mtx);
+		items.push_back(item);
+	}
+};
+
+static void test_hash()
+{
+	page::Options opts = createOpts();
+
+	page::ShardOptions sopts;
+	sopts.scheme = page::SHARD_HASH;
+
+	std::vector<std::string> keys, values;
+	for (unsigned int i = 0; i < N_KEYS; i++) {
+		keys.push_back(mkkey(i));
+		values.push_back(mkval(i));
+	}
+
+	{
+		page::ShardedDB db(shardFiles(), opts, sopts);
+		assert(db.size() == N_SHARDS);
+
+		db.multiPut(keys, values);
+		db.put(mkkey(N_KEYS), mkval(N_KEYS));
+		db.sync();
+
+		// every shard holds some keys, and only its own
+		for (unsigned int s = 0; s < N_SHARDS; s++) {
+			Collect c;
+			db.shard(s).parallelScan(page::ScanRange(), c, 2);
+			assert(!c.items.empty());
+			for (size_t n = 0; n < c.items.size(); n++)
+				assert(db.shardOf(c.items[n].key) == s);
+		}
+
+		// ordered scans need range shards
+		Collect c;
+		bool threw = false;
+		try {
+			db.parallelScan(page::ScanRange(), c, 4, true);
+		}
+		catch (std::runtime_error& e) {
+			threw = true;
+		}
+		assert(threw);
+	}
+
+	// reopen with the same layout
+	opts.f_write = false;
+	opts.f_create = false;
+	page::ShardedDB db(shardFiles(), opts, sopts);
+
+	std::string val;
+	assert(db.get(mkkey(N_KEYS), val) && (val == mkval(N_KEYS)));
+
+	std::vector<std::string> lookup(keys);
+	lookup.push_back("missing");
+
+	std::vector<std::string> out;
+	std::vector<bool> found;
+	db.multiGet(lookup, out, found);
+	assert((out.size() == lookup.size()) && (found.size() == lookup.size()));
+	for (unsigned int i = 0; i < N_KEYS; i++)
+		assert(found[i] && (out[i] == mkval(i)));
+	assert(!found[N_KEYS]);
+
+	Collect c;
+	db.parallelScan(page::ScanRange(), c, 4);
+	assert(c.items.size() == (N_KEYS + 1));
+
+	std::set<std::string> seen;
+	for (size_t n = 0; n < c.items.size(); n++)
+		assert(seen.insert(c.items[n].key).second);
+
+	removeFiles();
+}
+
+static void test_range()
+{
+	page::Options opts = createOpts();
+	opts.key_type = page::KT_U64;
+
+	page::ShardOptions sopts;
+	sopts.scheme = page::SHARD_RANGE;
+	sopts.isplits.push_back(500);
+	sopts.isplits.push_back(1000);
+	sopts.isplits.push_back(1500);
+
+	page::ShardedDB db(shardFiles(), opts, sopts);
+	assert(db.shardOf((uint64_t) 499) == 0);
+	assert(db.shardOf((uint64_t) 500) == 1);
+	assert(db.shardOf((uint64_t) 1999) == 3);
+
+	// reverse order: shards sort their own keys
+	std::vector<uint64_t> keys;
+	std::vector<std::string> values;
+	for (unsigned int i = N_KEYS; i > 0; i--) {
+		keys.push_back(i - 1);
+		values.push_back(mkval(i - 1));
+	}
+	db.multiPut(keys, values);
+
+	Collect all;
+	db.parallelScan(page::ScanRange(), all, 4, true);
+	assert(all.items.size() == N_KEYS);
+	for (unsigned int n = 0; n < N_KEYS; n++) {
+		assert(all.items[n].ikey == n);
+		assert(all.items[n].value == mkval(n));
+	}
+
+	// spans shards 1 and 2 only
+	page::ScanRange part;
+	part.ifirst = 700;
+	part.ilast = 1200;
+
+	Collect c;
+	db.parallelScan(part, c, 4, true);
+	assert(c.items.size() == 501);
+	for (unsigned int n = 0; n < c.items.size(); n++)
+		assert(c.items[n].ikey == (700 + n));
+
+	std::vector<uint64_t> lookup;
+	lookup.push_back(1999);
+	lookup.push_back(N_KEYS + 7);
+	lookup.push_back(0);
+
+	std::vector<std::string> out;
+	std::vector<bool> found;
+	db.multiGet(lookup, out, found);
+	assert(found[0] && (out[0] == mkval(1999)));
+	assert(!found[1]);
+	assert(found[2] && (out[2] == mkval(0)));
+
+	removeFiles();
+}
+
+int main (int argc, char *argv[])
+{
+	test_hash();
+	test_range();
+	return 0;
+}
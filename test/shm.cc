@@ -0,0 +1,163 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdexcept>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <pgdb2.h>
+#include "util.h"
+
+#define TESTFN "shm.db"
+
+static const unsigned int N_KEYS = 200;
+static const unsigned int N_READERS = 4;
+static const unsigned int N_WRITES = 400;
+
+static std::string versionval(unsigned int i, unsigned int version)
+{
+	return mkval(i, version, vallen(i));
+}
+
+static unsigned int parseVersion(const std::string& val)
+{
+	unsigned int i, version;
+	assert(sscanf(val.c_str(), "%u.%u|", &i, &version) == 2);
+	return version;
+}
+
+static page::Options sharedOpts(bool write)
+{
+	page::Options opts;
+	opts.f_read = true;
+	opts.f_write = write;
+	opts.f_shared = true;
+	opts.shm_cache = 1024 * 1024;
+	return opts;
+}
+
+// reader process: follow the writer's commits without reopening
+static void reader(unsigned int seed)
+{
+	alarm(60);
+
+	page::DB db(TESTFN, sharedOpts(false));
+	std::string val;
+	unsigned int last = 0;
+
+	while (last < N_WRITES) {
+		assert(db.get("ver", val));
+		unsigned int ver = atoi(val.c_str());
+		assert(ver >= last);
+		last = ver;
+
+		unsigned int i = rand_r(&seed) % N_KEYS;
+		assert(db.get(mkkey(i), val));
+		assert(val == versionval(i, parseVersion(val)));
+	}
+
+	// every write is visible
+	for (unsigned int i = 0; i < N_KEYS; i++) {
+		unsigned int version = i;
+		while ((version + N_KEYS) < N_WRITES)
+			version += N_KEYS;
+		assert(db.get(mkkey(i), val) && (val == versionval(i, version)));
+	}
+
+	assert(db.shared().hits() > 0);
+}
+
+static pid_t spawn(void (*fn)(unsigned int), unsigned int arg)
+{
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		try {
+			fn(arg);
+		}
+		catch (std::exception& e) {
+			fprintf(stderr, "child: %s\n", e.what());
+			_exit(1);
+		}
+		_exit(0);
+	}
+	return pid;
+}
+
+static bool waitOk(pid_t pid)
+{
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	return WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+}
+
+static void second_writer(unsigned int)
+{
+	try {
+		page::DB db(TESTFN, sharedOpts(true));
+	}
+	catch (std::runtime_error& e) {
+		return;
+	}
+	_exit(1);
+}
+
+static void test_shm()
+{
+	unlink(TESTFN);
+	unlink(TESTFN "-shm");
+
+	{
+		page::Options opts(sharedOpts(true));
+		opts.f_create = true;
+
+		page::DB db(TESTFN, opts);
+		for (unsigned int i = 0; i < N_KEYS; i++)
+			db.put(mkkey(i), versionval(i, i));
+		db.put("ver", "0");
+	}
+
+	page::DB db(TESTFN, sharedOpts(true));
+
+	// only one writer process
+	assert(waitOk(spawn(second_writer, 0)));
+
+	pid_t pids[N_READERS];
+	for (unsigned int t = 0; t < N_READERS; t++)
+		pids[t] = spawn(reader, t + 1);
+
+	for (unsigned int n = N_KEYS; n < N_WRITES; n++) {
+		unsigned int i = n % N_KEYS;
+		db.put(mkkey(i), versionval(i, n));
+
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%u", n + 1);
+		db.put("ver", buf);
+	}
+
+	for (unsigned int t = 0; t < N_READERS; t++)
+		assert(waitOk(pids[t]));
+
+	// reopened reader starts warm
+	page::DB rdb(TESTFN, sharedOpts(false));
+	std::string val;
+	assert(rdb.get(mkkey(0), val));
+	assert(rdb.shared().hits() > 0);
+}
+
+int main (int argc, char *argv[])
+{
+	test_shm();
+
+	unlink(TESTFN);
+	unlink(TESTFN "-shm");
+	return 0;
+}
@@ -0,0 +1,138 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdexcept>
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+#include <pgdb2.h>
+#include "util.h"
+
+#define TESTFN "stats.db"
+
+static const unsigned int N_KEYS = 2000;
+
+// inline, packed and inode values
+static std::string mkval(unsigned int i)
+{
+	static const size_t lens[] = { 50, 1000, 10000 };
+	return std::string(lens[i % 3], 'a' + (i % 26));
+}
+
+class Count : public page::ScanVisitor {
+public:
+	void visit(const page::ScanItem&) {}
+};
+
+static void test_histogram()
+{
+	typedef page::LatencyHistogram H;
+
+	// buckets tile the value range, each within 1/8 of its values
+	for (unsigned int b = 0; (b + 1) < H::n_buckets; b++) {
+		assert(H::bucketHigh(b) + 1 == H::bucketLow(b + 1));
+		assert(H::bucketOf(H::bucketLow(b)) == b);
+		assert(H::bucketOf(H::bucketHigh(b)) == b);
+		assert((H::bucketHigh(b) - H::bucketLow(b)) <=
+		       (H::bucketLow(b) / 8));
+	}
+	assert(H::bucketOf(~0ULL) == (H::n_buckets - 1));
+
+	H h;
+	for (uint64_t v = 1; v <= 1000; v++)
+		h.add(v * 1000);
+	assert(h.count() == 1000);
+	assert(h.mean() == 500500);
+
+	uint64_t p50 = h.percentile(0.5), p99 = h.percentile(0.99);
+	assert((p50 >= 500000) && (p50 <= (500000 + 500000 / 8)));
+	assert((p99 >= 990000) && (p99 <= (990000 + 990000 / 8)));
+	assert(h.max() >= 1000000);
+}
+
+int main (int argc, char *argv[])
+{
+	test_histogram();
+
+	{
+		page::DB db(TESTFN, createOpts());
+		db.resetStats();
+
+		for (unsigned int i = 0; i < N_KEYS; i++)
+			db.put(mkkey(i), mkval(i));
+		db.sync();
+
+		page::DBStats st;
+		db.getStats(st);
+		assert(st.latency[page::OP_PUT].count() == N_KEYS);
+		assert(st.latency[page::OP_SYNC].count() == 1);
+		assert(st.counters[page::ST_FSYNCS] == 1);
+		assert(st.counters[page::ST_WRITE_CALLS] > 0);
+		assert(st.pages[page::IO_WRITTEN][page::PK_SUPER] > 0);
+		assert(st.pages[page::IO_WRITTEN][page::PK_INOTAB] > 0);
+		assert(st.pages[page::IO_WRITTEN][page::PK_DIR] > 0);
+		assert(st.pages[page::IO_WRITTEN][page::PK_VALUE] > 0);
+		assert(st.pages[page::IO_WRITTEN][page::PK_VHEAP] > 0);
+	}
+
+	page::DB db(TESTFN, readOpts());
+	db.resetStats();
+
+	for (unsigned int i = 0; i < N_KEYS; i++) {
+		std::string val;
+		assert(db.get(mkkey(i), val) && (val == mkval(i)));
+	}
+
+	page::DBStats st;
+	db.getStats(st);
+	assert(st.latency[page::OP_GET].count() == N_KEYS);
+	assert(st.counters[page::ST_DIR_LEVELS] >= N_KEYS);
+	assert(st.counters[page::ST_DIRS_DECODED] > 0);
+	assert(st.counters[page::ST_READ_CALLS] > 0);
+	assert(st.pages[page::IO_READ][page::PK_DIR] > 0);
+	assert(st.pages[page::IO_READ][page::PK_INOTAB] > 0);
+	assert(st.pages[page::IO_READ][page::PK_VALUE] > 0);
+	assert(st.pages[page::IO_READ][page::PK_VHEAP] > 0);
+	assert(st.pages[page::IO_WRITTEN][page::PK_DIR] == 0);
+	assert(st.mem[page::MEM_DIRS].hits > 0);
+
+	// heap pages are shared: most are found cached
+	assert(st.pages[page::IO_CACHED][page::PK_VHEAP] > 0);
+
+	Count c;
+	db.parallelScan(page::ScanRange(), c, 4);
+	db.getStats(st);
+	assert(st.counters[page::ST_ENTRIES_SCANNED] == N_KEYS);
+	assert(st.latency[page::OP_SCAN].count() == 1);
+
+	std::string json = st.toJSON();
+	assert((json[0] == '{') && (json[json.size() - 1] == '}'));
+	assert(json.find("\"get\":{\"count\":2000,") != std::string::npos);
+	assert(st.toText().find("directory") != std::string::npos);
+
+	db.resetStats();
+	db.getStats(st);
+	assert(st.latency[page::OP_GET].count() == 0);
+	assert(st.pagesTotal(page::IO_READ) == 0);
+
+	// disabled: nothing counted
+	{
+		page::Options off;
+		off.f_stats = false;
+		page::DB db2(TESTFN, off);
+		std::string val;
+		assert(db2.get(mkkey(7), val));
+
+		db2.getStats(st);
+		assert(st.latency[page::OP_GET].count() == 0);
+		assert(st.pagesTotal(page::IO_READ) == 0);
+	}
+
+	assert(unlink(TESTFN) == 0);
+	return 0;
+}
@@ -0,0 +1,141 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <stdexcept>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <pthread.h>
+#include <pgdb2.h>
+#include "util.h"
+
+#define TESTFN "threads.db"
+
+static const unsigned int N_KEYS = 2000;
+static const unsigned int N_READERS = 8;
+static const unsigned int N_WRITES = 300;
+
+struct ReaderArgs {
+	page::DB	*db;
+	unsigned int	seed;
+};
+
+static void *reader_thread(void *arg)
+{
+	ReaderArgs *ra = (ReaderArgs *) arg;
+	page::DB& db = *ra->db;
+	unsigned int seed = ra->seed;
+	std::string val;
+
+	for (unsigned int n = 0; n < 3000; n++) {
+		unsigned int i = rand_r(&seed) % N_KEYS;
+		std::string expect = mkval(i, 0, vallen(i));
+
+		switch (n % 3) {
+		case 0:
+			assert(db.get(mkkey(i), val) && (val == expect));
+			break;
+
+		case 1: {
+			uint64_t off = rand_r(&seed) % expect.size();
+			assert(db.getRange(mkkey(i), off, 500, val));
+			assert(val == expect.substr(off, 500));
+			break;
+		}
+
+		default: {
+			page::ValueReader reader;
+			assert(db.openValue(mkkey(i), reader));
+
+			char buf[4096];
+			std::string out;
+			size_t len;
+			while ((len = reader.read(buf, sizeof(buf))) > 0)
+				out.append(buf, len);
+			assert(out == expect);
+			break;
+		}
+		}
+	}
+
+	return NULL;
+}
+
+static void *writer_thread(void *arg)
+{
+	page::DB& db = *(page::DB *) arg;
+
+	// overwrite keys beyond those being read
+	for (unsigned int n = 0; n < N_WRITES; n++) {
+		unsigned int i = N_KEYS + (n % 50);
+		db.put(mkkey(i), mkval(i, n, vallen(n)));
+	}
+
+	return NULL;
+}
+
+static void test_threads(const page::Options& opts_in)
+{
+	page::Options opts(opts_in);
+	opts.f_read = true;
+	opts.f_write = true;
+	opts.f_create = true;
+
+	{
+		page::DB db(TESTFN, opts);
+		for (unsigned int i = 0; i < N_KEYS; i++)
+			db.put(mkkey(i), mkval(i, 0, vallen(i)));
+	}
+
+	// many readers, one writer, sharing one DB
+	opts.f_create = false;
+	page::DB db(TESTFN, opts);
+
+	pthread_t writer;
+	assert(pthread_create(&writer, NULL, writer_thread, &db) == 0);
+
+	pthread_t readers[N_READERS];
+	ReaderArgs args[N_READERS];
+	for (unsigned int t = 0; t < N_READERS; t++) {
+		args[t].db = &db;
+		args[t].seed = t + 1;
+		assert(pthread_create(&readers[t], NULL, reader_thread,
+				      &args[t]) == 0);
+	}
+
+	for (unsigned int t = 0; t < N_READERS; t++)
+		assert(pthread_join(readers[t], NULL) == 0);
+	assert(pthread_join(writer, NULL) == 0);
+
+	// last write to each writer key wins
+	std::string val;
+	for (unsigned int n = N_WRITES - 50; n < N_WRITES; n++) {
+		unsigned int i = N_KEYS + (n % 50);
+		assert(db.get(mkkey(i), val) && (val == mkval(i, n, vallen(n))));
+	}
+
+	const page::MemBudget& mem = db.memory();
+	assert(mem.stats[page::MEM_DIRS].hits > 0);
+
+	assert(unlink(TESTFN) == 0);
+}
+
+int main (int argc, char *argv[])
+{
+	page::Options opts;
+	test_threads(opts);
+
+	// constant eviction pressure
+	opts.f_checksum = true;
+	opts.mem_budget = 128 * 1024;
+	test_threads(opts);
+
+	return 0;
+}
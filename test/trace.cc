@@ -0,0 +1,200 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include "pgdb2-config.h"
+
+#include <pthread.h>
+#include <stdexcept>
+#include <cassert>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <pgdb2.h>
+#include <pgdb2-trace.h>
+#include "util.h"
+
+#define TESTFN "trace.db"
+#define TESTFN_U64 "trace-u64.db"
+#define TRACEFN "trace.trc"
+
+static const unsigned int N_KEYS = 100;
+static const unsigned int N_THREADS = 4;
+static const unsigned int N_READS = 3000;	// per thread
+
+static void *reader(void *arg)
+{
+	page::DB *db = (page::DB *) arg;
+	std::string val;
+
+	for (unsigned int i = 0; i < N_READS; i++) {
+		bool found = db->get(mkkey(i % N_KEYS), val);
+		assert(found);
+	}
+	return NULL;
+}
+
+class NullVisitor : public page::ScanVisitor {
+public:
+	void visit(const page::ScanItem&) {}
+};
+
+static void readTrace(const char *path, std::vector<page::TraceRecord>& recs,
+		      enum page::key_types& kt)
+{
+	page::TraceReader rd;
+	rd.open(path);
+	kt = rd.keyType();
+
+	page::TraceRecord r;
+	recs.clear();
+	while (rd.next(r))
+		recs.push_back(r);
+}
+
+static void testBytes()
+{
+	page::DB db(TESTFN, createOpts());
+	db.put(mkkey(0), "untraced");
+
+	db.stopTrace();				// not started: no-op
+	db.startTrace(TRACEFN);
+
+	bool threw = false;
+	try {
+		db.startTrace(TRACEFN);
+	}
+	catch (std::runtime_error& e) {
+		threw = true;
+	}
+	assert(threw);
+
+	for (unsigned int i = 0; i < N_KEYS; i++)
+		db.put(mkkey(i), std::string(i + 1, 'v'));
+	db.sync();
+
+	std::string val;
+	assert(!db.get("missing", val));
+	assert(db.getRange(mkkey(50), 10, 20, val) && (val.size() == 20));
+
+	page::ValueReader vr;
+	assert(db.openValue(mkkey(99), vr));
+
+	bool found;
+	assert(db.tryGet(mkkey(7), found, val) && found);
+
+	NullVisitor nv;
+	db.parallelScan(page::ScanRange(), nv, 2);
+
+	pthread_t threads[N_THREADS];
+	for (unsigned int i = 0; i < N_THREADS; i++)
+		assert(pthread_create(&threads[i], NULL, reader, &db) == 0);
+	for (unsigned int i = 0; i < N_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	db.stopTrace();
+	db.get(mkkey(0), val);			// not traced
+
+	std::vector<page::TraceRecord> recs;
+	enum page::key_types kt;
+	readTrace(TRACEFN, recs, kt);
+	assert(kt == page::KT_BYTES);
+
+	std::map<unsigned int, unsigned int> ops;
+	std::map<unsigned int, uint64_t> last_t;	// by thread
+	for (size_t i = 0; i < recs.size(); i++) {
+		const page::TraceRecord& r = recs[i];
+		ops[r.op]++;
+
+		// in time order, within each thread
+		assert((last_t.count(r.thread) == 0) ||
+		       (last_t[r.thread] <= r.t_ns));
+		last_t[r.thread] = r.t_ns;
+
+		assert(!(r.flags & page::TRF_FAILED));
+		if (r.op == page::TR_PUT) {
+			assert(r.key_len == mkkey(0).size());
+			unsigned int i = r.value_len - 1;
+			assert(r.key == page::TraceRecorder::keyHash(mkkey(i)));
+		}
+	}
+
+	assert(ops[page::TR_PUT] == N_KEYS);
+	assert(ops[page::TR_SYNC] == 1);
+	assert(ops[page::TR_GET] == (1 + 1 + (N_THREADS * N_READS)));
+	assert(ops[page::TR_GET_RANGE] == 1);
+	assert(ops[page::TR_OPEN] == 1);
+	assert(ops[page::TR_SCAN] == 1);
+	assert(recs.size() == (N_KEYS + 6 + (N_THREADS * N_READS)));
+
+	for (size_t i = 0; i < recs.size(); i++) {
+		const page::TraceRecord& r = recs[i];
+		switch (r.op) {
+		case page::TR_GET_RANGE:
+			assert((r.arg == 10) && (r.value_len == 20));
+			assert(r.flags == page::TRF_FOUND);
+			break;
+		case page::TR_OPEN:
+			assert((r.value_len == 100) &&
+			       (r.flags == page::TRF_FOUND));
+			break;
+		case page::TR_SCAN:
+			assert(r.arg == 2);
+			break;
+		case page::TR_GET:
+			if (r.key == page::TraceRecorder::keyHash("missing"))
+				assert((r.flags == 0) && (r.key_len == 7));
+			else
+				assert(r.flags == page::TRF_FOUND);
+			break;
+		}
+	}
+}
+
+static void testFixed()
+{
+	page::Options opts = createOpts();
+	opts.key_type = page::KT_U64;
+
+	page::DB db(TESTFN_U64, opts);
+	db.startTrace(TRACEFN);
+	db.put(12345, "value");
+	std::string val;
+	assert(db.get(12345, val));
+	assert(!db.get(54321, val));
+	db.stopTrace();
+
+	std::vector<page::TraceRecord> recs;
+	enum page::key_types kt;
+	readTrace(TRACEFN, recs, kt);
+	assert(kt == page::KT_U64);
+	assert(recs.size() == 3);
+	assert((recs[0].op == page::TR_PUT) && (recs[0].key == 12345) &&
+	       (recs[0].key_len == 8) && (recs[0].value_len == 5));
+	assert((recs[1].op == page::TR_GET) && (recs[1].key == 12345) &&
+	       (recs[1].flags == page::TRF_FOUND));
+	assert((recs[2].op == page::TR_GET) && (recs[2].key == 54321) &&
+	       (recs[2].flags == 0));
+}
+
+int main (int argc, char *argv[])
+{
+	testBytes();
+	testFixed();
+
+	// no such directory
+	page::DB db(TESTFN, readOpts());
+	bool threw = false;
+	try {
+		db.startTrace("no/such/dir/" TRACEFN);
+	}
+	catch (std::runtime_error& e) {
+		threw = true;
+	}
+	assert(threw);
+
+	return 0;
+}
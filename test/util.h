@@ -0,0 +1,84 @@
+#ifndef __PGDB2_TEST_UTIL_H__
+#define __PGDB2_TEST_UTIL_H__
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+// Fixtures shared by the tests
+
+#include <cstdio>
+#include <string>
+#include <pgdb2.h>
+
+// keys sort as their numbers do
+inline std::string mkkey(unsigned int i)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "key%08u", i);
+	return std::string(buf);
+}
+
+// len bytes, naming key i
+inline std::string mkval(unsigned int i, size_t len)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%u|", i);
+
+	std::string val;
+	while (val.size() < len)
+		val.append(buf);
+	val.resize(len);
+	return val;
+}
+
+// len bytes, naming key i and a version of its value
+inline std::string mkval(unsigned int i, unsigned int version, size_t len)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%u.%u|", i, version);
+
+	std::string val;
+	while (val.size() < len)
+		val.append(buf);
+	val.resize(len);
+	return val;
+}
+
+// value sizes spanning inline, packed and inode storage
+inline size_t vallen(unsigned int i)
+{
+	switch (i % 4) {
+	case 0:		return 20;
+	case 1:		return 700;
+	case 2:		return 9000;
+	default:	return 60000;
+	}
+}
+
+inline page::Options createOpts()
+{
+	page::Options opts;
+	opts.f_read = true;
+	opts.f_write = true;
+	opts.f_create = true;
+	return opts;
+}
+
+inline page::Options writeOpts()
+{
+	page::Options opts;
+	opts.f_read = true;
+	opts.f_write = true;
+	return opts;
+}
+
+inline page::Options readOpts()
+{
+	page::Options opts;
+	opts.f_read = true;
+	opts.f_write = false;
+	return opts;
+}
+
+#endif // __PGDB2_TEST_UTIL_H__
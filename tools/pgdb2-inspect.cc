@@ -0,0 +1,119 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+// pgdb2-inspect: report the layout of a database file
+
+#include "pgdb2-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <string>
+#include <pgdb2-inspect.h>
+
+struct InspectOptions {
+	std::string	db;
+	bool		json;
+	bool		shared;
+	unsigned int	threads;
+	unsigned int	top;
+	uint64_t	cache_size;
+
+	InspectOptions()
+		: json(false), shared(false), threads(0), top(10),
+		  cache_size(64 * 1024 * 1024) {}
+};
+
+static InspectOptions iopt;
+
+static void usage(const char *prog)
+{
+	InspectOptions d;
+	fprintf(stderr,
+		"usage: %s [--option=value ...] FILE\n"
+		"  --json=0|1          JSON output [0]\n"
+		"  --threads=N         directory reader threads [online CPUs]\n"
+		"  --top=N             costliest lookup paths listed [%u]\n"
+		"  --cache_size=N      memory budget, bytes [%llu]\n"
+		"  --shared=0|1        open f_shared, beside a live writer [0]\n",
+		prog, d.top, (unsigned long long) d.cache_size);
+}
+
+static bool parseArg(const char *arg)
+{
+	if (strncmp(arg, "--", 2) != 0) {
+		if (!iopt.db.empty())
+			return false;
+		iopt.db = arg;
+		return true;
+	}
+
+	const char *eq = strchr(arg, '=');
+	if (!eq)
+		return false;
+
+	std::string name(arg + 2, eq - (arg + 2));
+	unsigned long long n = strtoull(eq + 1, NULL, 10);
+
+	if (name == "json")
+		iopt.json = (n != 0);
+	else if (name == "threads")
+		iopt.threads = n;
+	else if (name == "top")
+		iopt.top = n;
+	else if (name == "cache_size")
+		iopt.cache_size = n;
+	else if (name == "shared")
+		iopt.shared = (n != 0);
+	else
+		return false;
+
+	return true;
+}
+
+int main (int argc, char *argv[])
+{
+	for (int i = 1; i < argc; i++)
+		if (!parseArg(argv[i])) {
+			usage(argv[0]);
+			return 1;
+		}
+
+	if (iopt.db.empty()) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (iopt.threads == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		iopt.threads = (n > 0) ? n : 1;
+	}
+
+	page::Options opts;
+	opts.f_read = true;
+	opts.f_shared = iopt.shared;
+	opts.mem_budget = iopt.cache_size;
+
+	try {
+		page::DB db(iopt.db, opts);
+
+		page::InspectReport rep;
+		db.inspect(rep, iopt.threads, iopt.top);
+
+		if (iopt.json)
+			printf("%s\n", rep.toJSON().c_str());
+		else
+			printf("file             %s\n%s", iopt.db.c_str(),
+			       rep.toText().c_str());
+	}
+	catch (std::exception& e) {
+		fprintf(stderr, "%s: %s\n", iopt.db.c_str(), e.what());
+		return 1;
+	}
+
+	return 0;
+}
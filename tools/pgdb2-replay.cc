@@ -0,0 +1,448 @@
+/* Copyright 2015 Bloq Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+// pgdb2-replay: run a trace recorded by DB::startTrace against a
+// database, and report throughput and latency per operation, beside
+// the latencies recorded.
+//
+// Traces hold key hashes, not keys: each traced key is replayed as a
+// synthetic key of the same size, derived from its hash, so the
+// replay has the trace's key sizes, repetition and read/write mix,
+// but not its key order.  Fixed-width keys are traced as is.
+// Values are replayed at their traced size.  --load first puts every
+// key the trace finds before writing it, so that a fresh database
+// answers as the traced one did.
+//
+// Each traced thread's ops are replayed in order by one replay
+// thread; --threads=N folds traced threads onto N.  At --speed=0,
+// ops are issued as fast as possible; otherwise at their traced
+// times, divided by speed.
+
+#include "pgdb2-config.h"
+
+#include <time.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <pgdb2.h>
+#include <pgdb2-trace.h>
+
+using namespace page;
+
+struct ReplayOptions {
+	std::string	trace;
+	std::string	db;
+	double		speed;
+	unsigned int	threads;		// 0: one per traced thread
+	bool		load;
+	bool		scans;
+	uint64_t	cache_size;
+	bool		json;
+
+	ReplayOptions() : speed(0.0), threads(0), load(false), scans(false),
+		cache_size(64 * 1024 * 1024), json(false) {}
+};
+
+static ReplayOptions ropt;
+
+// Ops replayed, and their outcomes, per op type
+class ReplayStats {
+public:
+	uint64_t		ops[TR__COUNT];
+	uint64_t		mismatched[TR__COUNT];	// found != traced
+	LatencyHistogram	latency[TR__COUNT];
+
+	ReplayStats() {
+		memset(ops, 0, sizeof(ops));
+		memset(mismatched, 0, sizeof(mismatched));
+	}
+
+	void merge(const ReplayStats& st) {
+		for (unsigned int op = 0; op < TR__COUNT; op++) {
+			ops[op] += st.ops[op];
+			mismatched[op] += st.mismatched[op];
+			latency[op].merge(st.latency[op]);
+		}
+	}
+};
+
+struct ReplayThread {
+	pthread_t		thread;
+	DB			*db;
+	std::vector<TraceRecord> recs;		// in time order
+	uint64_t		start_ns;		// replay epoch
+	ReplayStats		stats;
+	std::string		error;
+};
+
+// Synthetic byte key: the hash in hex, repeated to key_len bytes
+static std::string mkkey(uint64_t hash, size_t key_len)
+{
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) hash);
+
+	std::string key;
+	key.reserve(key_len);
+	while (key.size() < key_len)
+		key.append(hex, std::min((size_t) 16, key_len - key.size()));
+	return key;
+}
+
+class CountVisitor : public ScanVisitor {
+public:
+	uint64_t	n;
+
+	CountVisitor() : n(0) {}
+	void visit(const ScanItem&) {
+		__atomic_fetch_add(&n, 1, __ATOMIC_RELAXED);
+	}
+};
+
+// Replay one op; returns whether the key was found
+static bool replayOne(DB& db, const TraceRecord& r, std::string& value)
+{
+	bool fixed = (db.keyType() != KT_BYTES);
+	std::string key;
+	if (!fixed)
+		key = mkkey(r.key, r.key_len);
+
+	switch (r.op) {
+	case TR_GET:
+		return fixed ? db.get(r.key, value) : db.get(key, value);
+
+	case TR_GET_RANGE:
+		return fixed ? db.getRange(r.key, r.arg, r.value_len, value) :
+			       db.getRange(key, r.arg, r.value_len, value);
+
+	case TR_OPEN: {
+		ValueReader reader;
+		return fixed ? db.openValue(r.key, reader) :
+			       db.openValue(key, reader);
+	}
+
+	case TR_PUT:
+		value.assign(r.value_len, 'v');
+		if (fixed)
+			db.put(r.key, value);
+		else
+			db.put(key, value);
+		return true;
+
+	case TR_SYNC:
+		db.sync();
+		return true;
+
+	case TR_SCAN: {
+		// the range is not traced: scan it all
+		CountVisitor visitor;
+		db.parallelScan(ScanRange(), visitor, r.arg ? r.arg : 1);
+		return true;
+	}
+	}
+
+	return false;
+}
+
+static void *replayThread(void *arg)
+{
+	ReplayThread& t = *(ReplayThread *) arg;
+	std::string value;
+
+	try {
+		for (size_t i = 0; i < t.recs.size(); i++) {
+			const TraceRecord& r = t.recs[i];
+
+			if (ropt.speed > 0.0) {
+				uint64_t due = t.start_ns +
+					(uint64_t) (r.t_ns / ropt.speed);
+				uint64_t now = Stats::now();
+				if (due > now) {
+					struct timespec ts;
+					ts.tv_sec = (due - now) / 1000000000ULL;
+					ts.tv_nsec = (due - now) % 1000000000ULL;
+					nanosleep(&ts, NULL);
+				}
+			}
+
+			uint64_t t0 = Stats::now();
+			bool found = replayOne(*t.db, r, value);
+			t.stats.latency[r.op].add(Stats::now() - t0);
+			t.stats.ops[r.op]++;
+			if (found != ((r.flags & TRF_FOUND) != 0))
+				t.stats.mismatched[r.op]++;
+		}
+	}
+	catch (std::exception& e) {
+		t.error = e.what();
+	}
+
+	return NULL;
+}
+
+static bool byTime(const TraceRecord& a, const TraceRecord& b)
+{
+	return a.t_ns < b.t_ns;
+}
+
+static bool replayable(const TraceRecord& r)
+{
+	return (r.op < TR__COUNT) && !(r.flags & TRF_FAILED) &&
+	       ((r.op != TR_SCAN) || ropt.scans);
+}
+
+// Put each key the trace reads, found, before it writes it
+static uint64_t load(DB& db, const std::vector<TraceRecord>& recs)
+{
+	std::set<std::pair<uint64_t, uint16_t> > seen;
+	std::string value;
+	uint64_t n = 0;
+
+	for (size_t i = 0; i < recs.size(); i++) {
+		const TraceRecord& r = recs[i];
+		if ((r.op != TR_GET) && (r.op != TR_GET_RANGE) &&
+		    (r.op != TR_OPEN) && (r.op != TR_PUT))
+			continue;
+		if (!seen.insert(std::make_pair(r.key, r.key_len)).second)
+			continue;
+		if ((r.op == TR_PUT) || !(r.flags & TRF_FOUND))
+			continue;
+
+		TraceRecord put(r);
+		put.op = TR_PUT;
+		if (r.op == TR_GET_RANGE)
+			put.value_len = r.arg + r.value_len;
+		replayOne(db, put, value);
+		n++;
+	}
+
+	db.sync();
+	return n;
+}
+
+static double usOf(uint64_t ns)
+{
+	return ns / 1000.0;
+}
+
+static void report(const ReplayStats& st, const ReplayStats& traced,
+		   double secs, double traced_secs, uint64_t loaded,
+		   unsigned int n_threads)
+{
+	uint64_t total = 0;
+	for (unsigned int op = 0; op < TR__COUNT; op++)
+		total += st.ops[op];
+
+	if (ropt.json) {
+		printf("{\"ops\":%llu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+		       "\"traced_seconds\":%.6f,\"threads\":%u,\"speed\":%g,"
+		       "\"loaded\":%llu,\"by_op\":{",
+		       (unsigned long long) total, secs, total / secs,
+		       traced_secs, n_threads, ropt.speed,
+		       (unsigned long long) loaded);
+		bool first = true;
+		for (unsigned int op = 0; op < TR__COUNT; op++) {
+			if (st.ops[op] == 0)
+				continue;
+			const LatencyHistogram& h = st.latency[op];
+			const LatencyHistogram& th = traced.latency[op];
+			printf("%s\"%s\":{\"ops\":%llu,\"mismatched\":%llu,"
+			       "\"avg_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,"
+			       "\"max_us\":%.3f,\"traced_p50_us\":%.3f,"
+			       "\"traced_p99_us\":%.3f}",
+			       first ? "" : ",", traceOpName(op),
+			       (unsigned long long) st.ops[op],
+			       (unsigned long long) st.mismatched[op],
+			       usOf(h.mean()), usOf(h.percentile(0.50)),
+			       usOf(h.percentile(0.99)), usOf(h.max()),
+			       usOf(th.percentile(0.50)),
+			       usOf(th.percentile(0.99)));
+			first = false;
+		}
+		printf("}}\n");
+		return;
+	}
+
+	printf("ops %llu in %.3f s, %.1f ops/sec; traced %.3f s\n"
+	       "threads %u, speed %g, keys loaded %llu\n\n",
+	       (unsigned long long) total, secs, total / secs, traced_secs,
+	       n_threads, ropt.speed, (unsigned long long) loaded);
+	printf("%-10s %10s %10s %9s %9s %9s %10s %11s %11s\n",
+	       "op", "ops", "mismatch", "avg us", "p50 us", "p99 us",
+	       "max us", "traced p50", "traced p99");
+	for (unsigned int op = 0; op < TR__COUNT; op++) {
+		if (st.ops[op] == 0)
+			continue;
+		const LatencyHistogram& h = st.latency[op];
+		const LatencyHistogram& th = traced.latency[op];
+		printf("%-10s %10llu %10llu %9.3f %9.3f %9.3f %10.3f %11.3f %11.3f\n",
+		       traceOpName(op), (unsigned long long) st.ops[op],
+		       (unsigned long long) st.mismatched[op],
+		       usOf(h.mean()), usOf(h.percentile(0.50)),
+		       usOf(h.percentile(0.99)), usOf(h.max()),
+		       usOf(th.percentile(0.50)), usOf(th.percentile(0.99)));
+	}
+}
+
+static void usage(const char *prog)
+{
+	ReplayOptions d;
+	fprintf(stderr,
+		"usage: %s [--option=value ...] TRACE DB\n"
+		"  --speed=X           0: as fast as possible; else traced\n"
+		"                      timing, X times faster [0]\n"
+		"  --threads=N         replay threads; 0: one per traced\n"
+		"                      thread [0]\n"
+		"  --load=0|1          first put the keys the trace finds [0]\n"
+		"  --scans=0|1         replay scans, of the whole DB [0]\n"
+		"  --cache_size=N      memory budget, bytes [%llu]\n"
+		"  --json=0|1          JSON output [0]\n"
+		"DB is created, with the trace's key type, if missing.\n",
+		prog, (unsigned long long) d.cache_size);
+}
+
+static bool parseArg(const char *arg)
+{
+	if (strncmp(arg, "--", 2) != 0) {
+		if (ropt.trace.empty())
+			ropt.trace = arg;
+		else if (ropt.db.empty())
+			ropt.db = arg;
+		else
+			return false;
+		return true;
+	}
+
+	const char *eq = strchr(arg, '=');
+	if (!eq)
+		return false;
+
+	std::string name(arg + 2, eq - (arg + 2));
+	const char *v = eq + 1;
+	unsigned long long n = strtoull(v, NULL, 10);
+
+	if (name == "speed")
+		ropt.speed = strtod(v, NULL);
+	else if (name == "threads")
+		ropt.threads = n;
+	else if (name == "load")
+		ropt.load = (n != 0);
+	else if (name == "scans")
+		ropt.scans = (n != 0);
+	else if (name == "cache_size")
+		ropt.cache_size = n;
+	else if (name == "json")
+		ropt.json = (n != 0);
+	else
+		return false;
+
+	return true;
+}
+
+int main (int argc, char *argv[])
+{
+	for (int i = 1; i < argc; i++)
+		if (!parseArg(argv[i])) {
+			usage(argv[0]);
+			return 1;
+		}
+
+	if (ropt.trace.empty() || ropt.db.empty() || (ropt.speed < 0.0)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	try {
+		TraceReader reader;
+		reader.open(ropt.trace);
+
+		std::vector<TraceRecord> recs;
+		ReplayStats traced;
+		TraceRecord r;
+		while (reader.next(r)) {
+			if (!replayable(r))
+				continue;
+			recs.push_back(r);
+			traced.ops[r.op]++;
+			traced.latency[r.op].add(r.lat_ns);
+		}
+		std::stable_sort(recs.begin(), recs.end(), byTime);
+
+		page::Options opts;
+		opts.f_read = true;
+		opts.f_write = true;
+		opts.f_create = true;
+		opts.key_type = reader.keyType();
+		opts.mem_budget = ropt.cache_size;
+
+		DB db(ropt.db, opts);
+		if (db.keyType() != reader.keyType())
+			throw std::runtime_error("DB key type differs from trace");
+
+		uint64_t loaded = ropt.load ? load(db, recs) : 0;
+
+		// traced threads, densely numbered, in order of first op
+		std::map<uint16_t, unsigned int> thread_ids;
+		for (size_t i = 0; i < recs.size(); i++)
+			thread_ids.insert(std::make_pair(recs[i].thread,
+							 thread_ids.size()));
+
+		unsigned int n_threads = ropt.threads;
+		if (n_threads == 0)
+			n_threads = thread_ids.empty() ? 1 : thread_ids.size();
+
+		std::vector<ReplayThread> threads(n_threads);
+		for (size_t i = 0; i < recs.size(); i++) {
+			unsigned int t = thread_ids[recs[i].thread] % n_threads;
+			threads[t].recs.push_back(recs[i]);
+		}
+
+		uint64_t start_ns = Stats::now();
+		unsigned int started = 0;
+		for (; started < n_threads; started++) {
+			ReplayThread& t = threads[started];
+			t.db = &db;
+			t.start_ns = start_ns;
+			if (pthread_create(&t.thread, NULL, replayThread,
+					   &t) != 0) {
+				t.error = "pthread_create failed";
+				break;
+			}
+		}
+
+		ReplayStats total;
+		std::string error;
+		for (unsigned int i = 0; i < n_threads; i++) {
+			if (i < started)
+				pthread_join(threads[i].thread, NULL);
+			if (error.empty())
+				error = threads[i].error;
+			total.merge(threads[i].stats);
+		}
+		if (!error.empty())
+			throw std::runtime_error(error);
+
+		double secs = (Stats::now() - start_ns) / 1e9;
+		if (secs <= 0.0)
+			secs = 1e-9;
+		double traced_secs = recs.empty() ? 0.0 :
+			(recs.back().t_ns + recs.back().lat_ns) / 1e9;
+
+		report(total, traced, secs, traced_secs, loaded, n_threads);
+	}
+	catch (std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}